@@ -66,7 +66,7 @@ let package = Package(
             name: "llbuildCore",
             dependencies: ["llbuildBasic"],
             path: "lib/Core",
-            linkerSettings: [.linkedLibrary("sqlite3")]
+            linkerSettings: [.linkedLibrary("sqlite3"), .linkedLibrary("z")]
         ),
         .target(
             name: "llbuildBuildSystem",
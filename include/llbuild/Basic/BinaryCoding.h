@@ -16,10 +16,15 @@
 #include "llbuild/Basic/Compiler.h"
 #include "llbuild/Basic/LLVM.h"
 
+#include "llvm/ADT/ArrayRef.h"
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/Host.h"
 
+#include <cstring>
 #include <string>
+#include <type_traits>
 #include <vector>
 
 namespace llbuild {
@@ -37,6 +42,10 @@ struct BinaryCodingTraits {
 /// objects. It is endian-neutral, and should be paired with \see BinaryDecoder
 /// for decoding. The specific encoding is not intended to be stable.
 ///
+/// Fixed-width integers are encoded in little-endian order. Integers which are
+/// usually small (sizes, counts, IDs, etc.) can instead be encoded in a
+/// variable-length (unsigned LEB128) format via \see writeVarInt().
+///
 /// The utility supports coding of user-defined types via specialization of the
 /// BinaryCodeableTraits type.
 class BinaryEncoder {
@@ -50,6 +59,15 @@ private:
   // FIXME: Parameterize this size?
   llvm::SmallVector<uint8_t, 256> encdata;
 
+  template<typename T>
+  void writeFixed(T value) {
+    size_t offset = encdata.size();
+    encdata.resize(offset + sizeof(T));
+    llvm::support::endian::write<T, llvm::support::little,
+                                 llvm::support::unaligned>(
+        &encdata[offset], value);
+  }
+
 public:
   /// Construct a new binary encoder.
   BinaryEncoder() {}
@@ -65,21 +83,28 @@ public:
   }
 
   /// Encode a value to the stream.
-  void write(uint16_t value) {
-    write(uint8_t(value >> 0));
-    write(uint8_t(value >> 8));
-  }
+  void write(uint16_t value) { writeFixed(value); }
 
   /// Encode a value to the stream.
-  void write(uint32_t value) {
-    write(uint16_t(value >> 0));
-    write(uint16_t(value >> 16));
-  }
+  void write(uint32_t value) { writeFixed(value); }
 
   /// Encode a value to the stream.
-  void write(uint64_t value) {
-    write(uint32_t(value >> 0));
-    write(uint32_t(value >> 32));
+  void write(uint64_t value) { writeFixed(value); }
+
+  /// Encode a value to the stream, using a variable-length encoding.
+  ///
+  /// Values are encoded in 7-bit groups, least significant first, with the
+  /// high bit of each byte set if more bytes follow. Values less than 128 take
+  /// a single byte, and the largest values take 10 bytes.
+  void writeVarInt(uint64_t value) {
+    uint8_t bytes[10];
+    unsigned count = 0;
+    while (value >= 0x80) {
+      bytes[count++] = uint8_t(value) | 0x80;
+      value >>= 7;
+    }
+    bytes[count++] = uint8_t(value);
+    encdata.append(bytes, bytes + count);
   }
 
   /// Encode a value to the stream.
@@ -103,6 +128,22 @@ public:
     BinaryCodingTraits<T>::encode(value, *this);
   }
 
+  /// Encode a sequence of fixed-width values to the stream.
+  ///
+  /// The result is identical to writing each value in turn, but on
+  /// little-endian hosts it is a single copy.
+  template<typename T>
+  void writeArray(ArrayRef<T> values) {
+    static_assert(std::is_integral<T>::value, "unsupported element type");
+    if (llvm::sys::IsLittleEndianHost) {
+      auto bytes = reinterpret_cast<const uint8_t*>(values.data());
+      encdata.append(bytes, bytes + values.size() * sizeof(T));
+      return;
+    }
+    for (const auto& value: values)
+      writeFixed(value);
+  }
+
   /// Get the encoded binary data.
   std::vector<uint8_t> contents() {
     return std::vector<uint8_t>(encdata.begin(), encdata.end());
@@ -135,19 +176,14 @@ private:
   uint64_t pos = 0;
 
   uint8_t read8() { return data[pos++]; }
-  uint16_t read16() {
-    uint16_t result = read8();
-    result |= uint16_t(read8()) << 8;
-    return result;
-  }
-  uint32_t read32() {
-    uint32_t result = read16();
-    result |= uint32_t(read16()) << 16;
-    return result;
-  }
-  uint64_t read64() {
-    uint64_t result = read32();
-    result |= uint64_t(read32()) << 32;
+
+  template<typename T>
+  T readFixed() {
+    assert(pos + sizeof(T) <= data.size());
+    T result = llvm::support::endian::read<T, llvm::support::little,
+                                           llvm::support::unaligned>(
+        data.data() + pos);
+    pos += sizeof(T);
     return result;
   }
   
@@ -174,13 +210,29 @@ public:
   void read(uint8_t& value) { value = read8(); }
   
   /// Decode a value from the stream.
-  void read(uint16_t& value) { value = read16(); }
+  void read(uint16_t& value) { value = readFixed<uint16_t>(); }
 
   /// Decode a value from the stream.
-  void read(uint32_t& value) { value = read32(); }
+  void read(uint32_t& value) { value = readFixed<uint32_t>(); }
 
   /// Decode a value from the stream.
-  void read(uint64_t& value) { value = read64(); }
+  void read(uint64_t& value) { value = readFixed<uint64_t>(); }
+
+  /// Decode a value from the stream, using a variable-length encoding.
+  ///
+  /// \see BinaryEncoder::writeVarInt().
+  void readVarInt(uint64_t& value) {
+    uint64_t result = 0;
+    unsigned shift = 0;
+    uint8_t byte;
+    do {
+      assert(pos < data.size() && shift < 64 && "invalid variable-length int");
+      byte = read8();
+      result |= uint64_t(byte & 0x7F) << shift;
+      shift += 7;
+    } while (byte & 0x80);
+    value = result;
+  }
 
   /// Decode a value from the stream.
   void read(std::string& value) {
@@ -207,6 +259,23 @@ public:
     BinaryCodingTraits<T>::decode(value, *this);
   }
 
+  /// Decode a sequence of fixed-width values from the stream.
+  ///
+  /// \see BinaryEncoder::writeArray().
+  template<typename T>
+  void readArray(MutableArrayRef<T> values) {
+    static_assert(std::is_integral<T>::value, "unsupported element type");
+    if (llvm::sys::IsLittleEndianHost) {
+      size_t count = values.size() * sizeof(T);
+      assert(pos + count <= data.size());
+      memcpy(values.data(), data.data() + pos, count);
+      pos += count;
+      return;
+    }
+    for (auto& value: values)
+      value = readFixed<T>();
+  }
+
   /// Finish decoding and clean up.
   void finish() {
     assert(isEmpty());
@@ -14,6 +14,7 @@
 #define LLBUILD_BASIC_EXECUTIONQUEUE_H
 
 #include "llbuild/Basic/Compiler.h"
+#include "llbuild/Basic/Jobserver.h"
 #include "llbuild/Basic/LLVM.h"
 #include "llbuild/Basic/Subprocess.h"
 
@@ -55,6 +56,24 @@ namespace llbuild {
       virtual unsigned laneID() const = 0;
     };
 
+    /// A measure of the system load, for throttling the start of jobs (\see
+    /// ExecutionQueue::setMaximumLoad()).
+    enum class LoadSignal {
+      /// The one minute load average (as used by `make -l` and `ninja -l`).
+      LoadAverage = 0,
+
+      /// The Linux CPU pressure stall information (PSI) of the cgroup, as the
+      /// percentage of recent time in which runnable tasks were waiting for a
+      /// CPU. Unlike the load average, this accounts for the CPUs available to
+      /// the cgroup, and responds within seconds.
+      CPUPressure = 1,
+    };
+
+    /// Identifies a class of jobs whose concurrency is limited by the execution
+    /// queue (\see ExecutionQueue::addResourceClass()), or zero for jobs which
+    /// are only limited by the queue itself.
+    typedef uint32_t QueueJobResourceClass;
+
     /// Wrapper for individual pieces of work that are added to the execution
     /// queue.
     class QueueJob {
@@ -64,16 +83,40 @@ namespace llbuild {
       typedef std::function<void(QueueJobContext*)> work_fn_ty;
       work_fn_ty work;
 
+      /// The scheduling priority of the job, higher values are more urgent.
+      ///
+      /// This is only consulted by schedulers which order by priority (\see
+      /// SchedulerAlgorithm::CriticalPath and SchedulerAlgorithm::WorkStealing).
+      uint64_t priority = 0;
+
+      /// The resource class of the job, if any.
+      QueueJobResourceClass resourceClass = 0;
+
+      /// The estimated peak RSS of the job (in bytes), or zero if unknown.
+      ///
+      /// This is only consulted if the queue has a memory budget (\see
+      /// ExecutionQueue::setMemoryBudget()).
+      uint64_t estimatedPeakRSS = 0;
+
     public:
       /// Default constructor, for use as a sentinel.
       QueueJob() {}
 
       /// General constructor.
-      QueueJob(JobDescriptor* desc, work_fn_ty work)
-      : desc(desc), work(work) {}
+      QueueJob(JobDescriptor* desc, work_fn_ty work, uint64_t priority = 0,
+               QueueJobResourceClass resourceClass = 0,
+               uint64_t estimatedPeakRSS = 0)
+      : desc(desc), work(work), priority(priority),
+        resourceClass(resourceClass), estimatedPeakRSS(estimatedPeakRSS) {}
 
       JobDescriptor* getDescriptor() const { return desc; }
 
+      uint64_t getPriority() const { return priority; }
+
+      QueueJobResourceClass getResourceClass() const { return resourceClass; }
+
+      uint64_t getEstimatedPeakRSS() const { return estimatedPeakRSS; }
+
       void execute(QueueJobContext* context) { work(context); }
     };
 
@@ -102,6 +145,57 @@ namespace llbuild {
       /// Add a job to be executed.
       virtual void addJob(QueueJob job) = 0;
 
+      /// Add a class of jobs whose concurrency is limited (e.g., a Ninja pool).
+      ///
+      /// At most \p maxConcurrency jobs of the class are admitted to execute at
+      /// once; the others wait in a queue for the class (ordered by the queue's
+      /// scheduler algorithm) without occupying a lane.
+      ///
+      /// \param name The name of the class, for diagnostic purposes.
+      /// \returns The class, for use with \see QueueJob.
+      virtual QueueJobResourceClass addResourceClass(StringRef name,
+                                                     unsigned maxConcurrency) = 0;
+
+      /// Throttle the start of jobs while the system is loaded.
+      ///
+      /// While the sampled \p signal exceeds \p maximumLoad, jobs are only
+      /// started when no other job is executing. The signal is sampled
+      /// periodically, and throttling only ends once it drops back below 90% of
+      /// the maximum, so that lanes do not thrash around the limit.
+      ///
+      /// \returns False if the signal is not available on this system, in which
+      /// case jobs are not throttled.
+      virtual bool setMaximumLoad(LoadSignal signal, double maximumLoad) = 0;
+
+      /// Limit the memory used by concurrently executing jobs.
+      ///
+      /// A job is only started if the sum of the estimated peak RSS of the
+      /// executing jobs (\see QueueJob::getEstimatedPeakRSS()), including its
+      /// own, is within \p maximumBytes, or if no other job is executing (so
+      /// that jobs estimated to exceed the budget alone still run). Jobs with
+      /// no estimate are not limited.
+      ///
+      /// \param maximumBytes The budget, or zero for no limit.
+      virtual void setMemoryBudget(uint64_t maximumBytes) = 0;
+
+      /// Share the job slots of the queue with other processes, using the GNU
+      /// make jobserver protocol (\see Jobserver).
+      ///
+      /// If the MAKEFLAGS of the queue's environment describe the jobserver of
+      /// a parent make, the queue joins it. Otherwise, if \p serve is true,
+      /// the queue creates a jobserver with a slot per lane. Either way, each
+      /// lane holds a slot while executing a job, and the jobserver is exported
+      /// to subprocesses via MAKEFLAGS, so that nested make, ninja, or cargo
+      /// invocations share the same budget of slots.
+      ///
+      /// This must be called before adding any jobs.
+      ///
+      /// \param style The style of jobserver to create, if serving.
+      /// \param error_out [out] Error string if the return value is false.
+      /// \returns True if the queue is using a jobserver.
+      virtual bool enableJobserver(bool serve, JobserverStyle style,
+                                   std::string* error_out) = 0;
+
       /// Cancel all jobs and subprocesses of this queue.
       virtual void cancelAllJobs() = 0;
 
@@ -216,7 +310,16 @@ namespace llbuild {
       NamePriority = 0,
 
       /// First in, first out
-      FIFO = 1
+      FIFO = 1,
+
+      /// Longest remaining critical path first, as estimated by the job
+      /// priority, with ties broken by name.
+      CriticalPath = 2,
+
+      /// Per-lane ready queues (ordered as for \see CriticalPath), with idle
+      /// lanes stealing jobs from randomly chosen other lanes. This avoids
+      /// contention on a single ready queue when there are many lanes.
+      WorkStealing = 3
     };
 
     /// Create an execution queue that schedules jobs to individual lanes with a
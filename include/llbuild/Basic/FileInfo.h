@@ -108,32 +108,35 @@ struct FileInfo {
   static FileInfo getInfoForPath(const std::string& path, bool asLink = false);
 };
 
+// The fields of these types are usually far smaller than their width, so they
+// are encoded as variable-length integers.
+
 template<>
 struct BinaryCodingTraits<FileTimestamp> {
   static inline void encode(const FileTimestamp& value, BinaryEncoder& coder) {
-    coder.write(value.seconds);
-    coder.write(value.nanoseconds);
+    coder.writeVarInt(value.seconds);
+    coder.writeVarInt(value.nanoseconds);
   }
   static inline void decode(FileTimestamp& value, BinaryDecoder& coder) {
-    coder.read(value.seconds);
-    coder.read(value.nanoseconds);
+    coder.readVarInt(value.seconds);
+    coder.readVarInt(value.nanoseconds);
   }
 };
 
 template<>
 struct BinaryCodingTraits<FileInfo> {
   static inline void encode(const FileInfo& value, BinaryEncoder& coder) {
-    coder.write(value.device);
-    coder.write(value.inode);
-    coder.write(value.mode);
-    coder.write(value.size);
+    coder.writeVarInt(value.device);
+    coder.writeVarInt(value.inode);
+    coder.writeVarInt(value.mode);
+    coder.writeVarInt(value.size);
     coder.write(value.modTime);
   }
   static inline void decode(FileInfo& value, BinaryDecoder& coder) {
-    coder.read(value.device);
-    coder.read(value.inode);
-    coder.read(value.mode);
-    coder.read(value.size);
+    coder.readVarInt(value.device);
+    coder.readVarInt(value.inode);
+    coder.readVarInt(value.mode);
+    coder.readVarInt(value.size);
     coder.read(value.modTime);
   }
 };
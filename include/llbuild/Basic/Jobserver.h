@@ -0,0 +1,136 @@
+//===- Jobserver.h ----------------------------------------------*- C++ -*-===//
+//
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2019 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLBUILD_BASIC_JOBSERVER_H
+#define LLBUILD_BASIC_JOBSERVER_H
+
+#include "llbuild/Basic/LLVM.h"
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace llbuild {
+namespace basic {
+
+/// The ways in which a jobserver can be shared with child processes.
+enum class JobserverStyle {
+  /// An anonymous pipe, whose file descriptors are inherited by the child
+  /// processes (`--jobserver-auth=R,W`).
+  Pipe = 0,
+
+  /// A named pipe, which child processes open by its path
+  /// (`--jobserver-auth=fifo:PATH`, supported by GNU make 4.4 and later).
+  Fifo = 1,
+};
+
+/// A GNU make compatible jobserver, which shares a budget of job slots between
+/// cooperating processes (e.g., nested make, ninja, and cargo invocations).
+///
+/// Each slot is represented by a token byte in a pipe. Every participating
+/// process owns one implicit slot, and must read a token from the pipe for
+/// each additional job it runs concurrently, writing it back once the job
+/// completes.
+///
+/// This class is thread safe.
+class Jobserver {
+  /// The read and write file descriptors of the jobserver pipe (which are the
+  /// same for a fifo).
+  int fds[2] = { -1, -1 };
+
+  /// Whether this instance opened the file descriptors, and should close them.
+  bool ownsFDs = false;
+
+  /// A non-blocking descriptor for reading tokens from an inherited pipe, or
+  /// -1 (\see openNonBlockingReadFD()).
+  int nonBlockingReadFD = -1;
+
+  /// Whether the jobserver has been cancelled, \see cancel().
+  std::atomic<bool> isCancelled{false};
+
+  /// The style of the jobserver.
+  JobserverStyle style;
+
+  /// The path of the fifo (and its directory), if created by this instance.
+  std::string fifoPath;
+  std::string fifoDirectory;
+
+  /// The MAKEFLAGS to export to child processes.
+  std::string makeFlags;
+
+  /// Whether the implicit slot of this process is in use.
+  std::mutex implicitSlotMutex;
+  bool isImplicitSlotInUse = false;
+
+  Jobserver(JobserverStyle style) : style(style) {}
+
+  bool tryAcquireImplicitSlot();
+
+  void openNonBlockingReadFD();
+
+public:
+  /// The token of the implicit slot, \see acquire().
+  static const int ImplicitToken = -1;
+
+  ~Jobserver();
+
+  /// Join the jobserver described by the value of a MAKEFLAGS environment
+  /// variable (as exported by a parent make).
+  ///
+  /// \param error_out [out] Set if MAKEFLAGS describes a jobserver which can
+  /// not be used (e.g., because its file descriptors were not inherited).
+  /// \returns The jobserver, or null if there is no usable jobserver.
+  static std::unique_ptr<Jobserver> createClient(StringRef makeFlags,
+                                                 std::string* error_out);
+
+  /// Create a jobserver for sharing with child processes.
+  ///
+  /// \param numSlots The total number of slots, including the implicit slot of
+  /// this process.
+  /// \param error_out [out] Error string if the return value is null.
+  static std::unique_ptr<Jobserver> createServer(unsigned numSlots,
+                                                 JobserverStyle style,
+                                                 std::string* error_out);
+
+  /// Acquire a slot, waiting until one is available.
+  ///
+  /// \param token_out [out] The token for the slot, to pass to \see release().
+  /// \returns False if the jobserver has failed (e.g., its pipe was closed),
+  /// or has been cancelled.
+  bool acquire(int& token_out);
+
+  /// Make any pending and future calls to \see acquire() fail (once the
+  /// implicit slot is in use), e.g., because the build is being cancelled.
+  void cancel() { isCancelled = true; }
+
+  /// Release a slot acquired by \see acquire().
+  void release(int token);
+
+  /// Get the MAKEFLAGS value which describes the jobserver to child processes.
+  StringRef getMakeFlags() const { return makeFlags; }
+
+  /// Get the file descriptors which child processes must inherit.
+  ArrayRef<int> getInheritedFileDescriptors() const {
+    if (style != JobserverStyle::Pipe)
+      return {};
+    return fds;
+  }
+};
+
+}
+}
+
+#endif
@@ -35,6 +35,7 @@ namespace sys {
 
 bool chdir(const char *fileName);
 int close(int fileHandle);
+int fsync(int fileHandle);
 bool mkdir(const char *fileName);
 int pclose(FILE *stream);
 int pipe(int ptHandles[2]);
@@ -53,12 +54,44 @@ std::string makeTmpDir();
 // Return a string containing all valid path separators on the current platform
 std::string getPathSeparators();
 
+/// Flush the entries of a directory (e.g., a file renamed into it) to disk.
+///
+/// Returns: 0 on success, -1 on failure (check errno).
+int syncDirectory(const char *path);
+
+/// Take an exclusive advisory lock on an open file, without waiting for it.
+///
+/// The lock is held until it is released by \see unlockFile(), or the file
+/// is closed.
+///
+/// Returns: 0 on success, -1 on failure (check errno, which is EWOULDBLOCK if
+/// the lock is held by another open file).
+int tryLockFile(int fileHandle);
+
+/// Release a lock taken by \see tryLockFile().
+///
+/// Returns: 0 on success, -1 on failure (check errno).
+int unlockFile(int fileHandle);
+
 /// Sets the max open file limit to min(max(soft_limit, limit), hard_limit),
 /// where soft_limit and hard_limit are gathered from the system.
 ///
 /// Returns: 0 on success, -1 on failure (check errno).
 int raiseOpenFileLimit(llbuild_rlim_t limit = 2048);
 
+/// Get the one minute system load average.
+///
+/// Returns: True on success, or false if unsupported on this platform.
+bool getLoadAverage(double& loadAverage_out);
+
+/// Get the CPU pressure stall information (PSI) of the current cgroup (or, if
+/// unavailable, of the whole system), as the percentage of the last ten seconds
+/// in which runnable tasks were waiting for a CPU.
+///
+/// Returns: True on success, or false if unsupported (this requires Linux with
+/// PSI enabled).
+bool getCPUPressure(double& pressure_out);
+
 enum MATCH_RESULT { MATCH, NO_MATCH, MATCH_ERROR };
 // Test if a path or filename matches a wildcard pattern
 //
@@ -18,6 +18,7 @@
 #include "llbuild/Basic/LLVM.h"
 #include "llbuild/Basic/POSIXEnvironment.h"
 
+#include "llvm/ADT/ArrayRef.h"
 #include "llvm/ADT/Optional.h"
 
 #include <inttypes.h>
@@ -244,6 +245,10 @@ namespace llbuild {
       /// If true, exposes a control file descriptor that may be used to
       /// communicate with the build system.
       bool controlEnabled = true;
+
+      /// Additional file descriptors to be inherited by the process (e.g., a
+      /// jobserver pipe). This is ignored on Windows.
+      ArrayRef<int> inheritedFileDescriptors = {};
     };
 
     /// Execute the given command line.
@@ -190,6 +190,17 @@ public:
   virtual void getVerboseDescription(SmallVectorImpl<char> &result) const override = 0;
 
   virtual basic::CommandSignature getSignature() const;
+
+  /// Get the name of the pool which limits how many of its commands may
+  /// execute at once (in addition to the limit of the execution queue), or an
+  /// empty name if the command is not in a pool.
+  virtual StringRef getPool() const { return StringRef(); }
+
+  /// Get the maximum number of commands in the pool which may execute at once.
+  ///
+  /// Commands in the same pool should agree on its depth; otherwise, the depth
+  /// of the first of them to execute in a build is used.
+  virtual unsigned getPoolDepth() const { return 1; }
   
   /// @}
 
@@ -30,6 +30,11 @@ namespace basic {
   class ExecutionQueue;
   class FileSystem;
 }
+namespace core {
+  enum class BuildDBFormat;
+  struct BuildDBGarbageCollectionStats;
+  struct BuildEngineStatistics;
+}
 
 namespace buildsystem {
 
@@ -243,11 +248,37 @@ public:
   /// \returns True on success.
   bool attachDB(StringRef path, std::string* error_out);
 
+  /// Attach (or create) the database at the given path, using the given
+  /// format.
+  ///
+  /// \returns True on success.
+  bool attachDB(StringRef path, core::BuildDBFormat format,
+                std::string* error_out);
+
   /// Enable low-level engine tracing into the given output file.
   ///
   /// \returns True on success.
   bool enableTracing(StringRef path, std::string* error_out);
 
+  /// Configure the number of threads used to check the validity of prior
+  /// results while scanning the build graph.
+  ///
+  /// This is only safe when all of the commands in the build description (and
+  /// any custom tools) implement \see Command::isResultValid() in a
+  /// thread-safe manner; the built-in commands do.
+  void setScanConcurrency(unsigned numThreads);
+
+  /// Get the statistics on the operation of the underlying build engine.
+  core::BuildEngineStatistics getEngineStatistics();
+
+  /// Remove the results which are no longer needed from the attached database
+  /// (\see core::BuildEngine::collectDBGarbage()).
+  ///
+  /// \returns True on success.
+  bool collectDBGarbage(uint64_t minAge,
+                        core::BuildDBGarbageCollectionStats* stats_out,
+                        std::string* error_out);
+
   /// Build the named target.
   ///
   /// A build description *must* have been loaded before calling this method.
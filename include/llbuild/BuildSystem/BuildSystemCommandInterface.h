@@ -13,6 +13,8 @@
 #ifndef LLBUILD_BUILDSYSTEM_BUILDSYSTEMCOMMANDINTERFACE_H
 #define LLBUILD_BUILDSYSTEM_BUILDSYSTEMCOMMANDINTERFACE_H
 
+#include "llbuild/Basic/ExecutionQueue.h"
+
 #include <memory>
 
 namespace llbuild {
@@ -34,6 +36,7 @@ namespace buildsystem {
 class BuildKey;
 class BuildSystemDelegate;
 class BuildValue;
+class Command;
 class ShellCommandHandler;
 class ShellCommand;
 
@@ -82,6 +85,11 @@ public:
   /// Add a job to be executed.
   virtual void addJob(basic::QueueJob&&) = 0;
 
+  /// Get the execution queue resource class which limits the concurrency of
+  /// the pool of a command (\see Command::getPool()), or zero if it has none.
+  virtual basic::QueueJobResourceClass
+  getPoolResourceClass(const Command& command) = 0;
+
   /// @}
 
   /// @name BuildSystem Extensions API
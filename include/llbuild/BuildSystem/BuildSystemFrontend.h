@@ -17,6 +17,7 @@
 #include "llbuild/Basic/LLVM.h"
 #include "llbuild/BuildSystem/BuildSystem.h"
 #include "llbuild/BuildSystem/BuildNode.h"
+#include "llbuild/Core/BuildDB.h"
 #include "llbuild/Core/BuildEngine.h"
 
 #include "llvm/ADT/ArrayRef.h"
@@ -67,6 +68,12 @@ private:
 
   bool setupBuild();
 
+  /// Print the engine statistics, if requested by the invocation.
+  void reportStatistics();
+
+  /// Collect garbage in the database, if requested by the invocation.
+  void collectDBGarbage();
+
 public:
   BuildSystemFrontend(BuildSystemFrontendDelegate& delegate,
                       const BuildSystemInvocation& invocation,
@@ -350,12 +357,25 @@ public:
   /// Whether to show verbose output.
   bool showVerboseStatus = false;
 
+  /// Whether to print build engine statistics after each build.
+  bool showStats = false;
+
   /// Whether to use a serial build.
   bool useSerialBuild = false;
   
   /// The path of the database file to use, if any.
   std::string dbPath = "build.db";
 
+  /// The format of the database file.
+  core::BuildDBFormat dbFormat = core::BuildDBFormat::SQLite;
+
+  /// Whether to collect garbage in the database after each build.
+  bool collectDBGarbage = false;
+
+  /// The number of builds a result must have gone unused before it is
+  /// collected, \see collectDBGarbage.
+  uint64_t dbGarbageAge = 0;
+
   /// The path of a directory to change into before anything else, if any.
   std::string chdirPath = "";
 
@@ -370,6 +390,10 @@ public:
 
   uint32_t schedulerLanes = 0;
 
+  /// The number of threads to use for dependency scanning, or zero to scan on
+  /// the engine thread.
+  uint32_t scanThreads = 0;
+
   /// The base environment to use when executing subprocesses.
   ///
   /// The format is expected to match that of `::main()`, i.e. a null-terminated
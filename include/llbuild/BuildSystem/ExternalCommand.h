@@ -61,6 +61,10 @@ class ExternalCommand : public Command {
   /// Whether to treat the command as always being out-of-date.
   bool alwaysOutOfDate = false;
 
+  /// The pool of the command, and its depth, \see Command::getPool().
+  std::string pool;
+  unsigned poolDepth = 1;
+
   /// If not None, the command should be skipped with the provided BuildValue.
   llvm::Optional<BuildValue> skipValue;
 
@@ -101,6 +105,10 @@ protected:
 public:
   using Command::Command;
 
+  virtual StringRef getPool() const override { return pool; }
+
+  virtual unsigned getPoolDepth() const override { return poolDepth; }
+
   virtual void configureDescription(const ConfigureContext&,
                                     StringRef value) override;
   
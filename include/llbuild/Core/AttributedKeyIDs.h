@@ -15,46 +15,54 @@
 
 #include "llbuild/Core/KeyID.h"
 
+#include "llvm/ADT/SmallVector.h"
+
+#include <cassert>
 #include <cstdint>
 #include <utility>
-#include <vector>
 
 namespace llbuild {
 namespace core {
 
-/// A data structure representing a set of tuples (KeyID, flag) in a somewhat
-/// compact form.
-// FIXME: At some point, figure out the optimal representation for this
-// data structure, which is likely to be a lot of the resident memory size.
+/// A data structure representing a set of tuples (KeyID, flag) in a compact
+/// form.
+///
+/// Each tuple is packed into a single word, with the flag stored in the top
+/// bit of the key ID (which is never set for the pointer-derived IDs handed out
+/// by the engine), and the common case of a few dependencies is stored inline
+/// without any heap allocation.
 class AttributedKeyIDs {
-  // Dependencies to be kept track of.
-  std::vector<KeyID> keys;
+  /// The bit used to store the flag.
+  static constexpr uint64_t flagBit = uint64_t(1) << 63;
+
+  /// The packed tuples.
+  llvm::SmallVector<uint64_t, 4> items;
 
-  /// Flags associated with the keys.
-  std::vector<bool> flags;
+  static uint64_t pack(KeyID id, bool flag) {
+    assert((id.value() & flagBit) == 0 && "key ID collides with flag bit");
+    return id.value() | (flag ? flagBit : 0);
+  }
 
 public:
 
   /// Clear the contents of the set.
   void clear() {
-    keys.clear();
-    flags.clear();
+    items.clear();
   }
 
   /// Check whether the set is empty.
   bool empty() const {
-    return keys.empty();
+    return items.empty();
   }
 
   /// Return the size of the set.
   size_t size() const {
-    return keys.size();
+    return items.size();
   }
 
   /// Change the size of the set.
   void resize(size_t newSize) {
-    keys.resize(newSize);
-    flags.resize(newSize);
+    items.resize(newSize);
   }
 
   /// A return value for the subscript operator[].
@@ -64,25 +72,24 @@ public:
   };
 
   KeyIDAndFlag operator[](size_t n) const {
-    return {keys[n], flags[n]};
+    uint64_t item = items[n];
+    return {KeyID((const void*)(uintptr_t)(item & ~flagBit)),
+            (item & flagBit) != 0};
   }
 
   /// Store a new tuple under a known index.
   void set(size_t n, KeyID id, bool flag) {
-    keys[n] = id;
-    flags[n] = flag;
+    items[n] = pack(id, flag);
   }
 
   /// Add a given tuple at the end of the set.
   void push_back(KeyID id, bool flag) {
-      keys.push_back(id);
-      flags.push_back(flag);
+    items.push_back(pack(id, flag));
   }
 
   /// Append the contents of the given set into the current set.
   void append(const AttributedKeyIDs &rhs) {
-    keys.insert(keys.end(), rhs.keys.begin(), rhs.keys.end());
-    flags.insert(flags.end(), rhs.flags.begin(), rhs.flags.end());
+    items.append(rhs.items.begin(), rhs.items.end());
   }
 
 public:
@@ -108,7 +115,7 @@ public:
   };
 
   const_iterator begin() const { return {*this, 0}; };
-  const_iterator end() const { return {*this, keys.size()}; }
+  const_iterator end() const { return {*this, items.size()}; }
 
 };
 
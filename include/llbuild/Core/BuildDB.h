@@ -28,6 +28,15 @@ namespace core {
 struct Result;
 class Rule;
 
+/// Statistics on a garbage collection of a build database, \see
+/// BuildDB::collectGarbage().
+struct BuildDBGarbageCollectionStats {
+  /// The number of rule results which were removed.
+  uint64_t numResultsRemoved = 0;
+  /// The number of keys which were removed.
+  uint64_t numKeysRemoved = 0;
+};
+
 /// Delegate interface for use with the build database
 class BuildDBDelegate {
 public:
@@ -48,6 +57,13 @@ public:
   ///
   /// This method must be thread safe, and must not fail.
   virtual KeyType getKeyForID(const KeyID key) = 0;
+
+  /// Report an error which could not be returned to a caller (e.g., one
+  /// encountered while writing results in the background).
+  ///
+  /// This method must be thread safe. The default implementation ignores the
+  /// error.
+  virtual void error(const Twine& message);
 };
 
 
@@ -69,6 +85,9 @@ public:
 
   /// Set the current build iteration.
   ///
+  /// The engine sets the iteration when a build starts, before writing any
+  /// results for it.
+  ///
   /// \param error_out [out] Error string if return value is false.
   virtual bool setCurrentIteration(uint64_t value, std::string* error_out) = 0;
 
@@ -81,15 +100,56 @@ public:
   /// \returns True if the database had a stored result for the rule.
   //
   // FIXME: This might be more efficient if it returns Result.
-  //
-  // FIXME: Figure out if we want a more lazy approach where we make the
-  // database cache result objects and we query them only when needed. This may
-  // scale better to very large build graphs.
   inline bool lookupRuleResult(KeyID keyID, const Rule& rule, Result* result_out, std::string* error_out) {
     return lookupRuleResult(keyID, rule.key, result_out, error_out);
   }
   virtual bool lookupRuleResult(KeyID keyID, const KeyType& key, Result* result_out, std::string* error_out) = 0;
 
+  /// Look up the result for a rule, optionally deferring retrieval of its
+  /// value.
+  ///
+  /// The engine uses this to fetch only the information needed to scan a rule
+  /// (its signature, build timestamps, and dependencies), and later retrieves
+  /// the value via \see lookupRuleResultValue() only if it is actually
+  /// consumed. Databases which can fetch the value separately should override
+  /// both methods; the default implementation always loads the full result.
+  ///
+  /// \param valueLoaded_out [out] Whether the value of \arg result_out was
+  /// populated.
+  /// \returns True if the database had a stored result for the rule.
+  virtual bool lookupRuleResultWithoutValue(KeyID keyID, const KeyType& key,
+                                            Result* result_out,
+                                            bool* valueLoaded_out,
+                                            std::string* error_out) {
+    *valueLoaded_out = true;
+    return lookupRuleResult(keyID, key, result_out, error_out);
+  }
+
+  /// Look up the stored value for a rule.
+  ///
+  /// \param value_out [out] The value, if found.
+  /// \param error_out [out] Error string if an error occurred.
+  /// \returns True if the database had a stored result for the rule.
+  virtual bool lookupRuleResultValue(KeyID keyID, const KeyType& key,
+                                     ValueType* value_out,
+                                     std::string* error_out) {
+    Result result;
+    if (!lookupRuleResult(keyID, key, &result, error_out))
+      return false;
+    *value_out = std::move(result.value);
+    return true;
+  }
+
+  /// Load all of the stored results up front.
+  ///
+  /// This is an optimization for clients which expect to look up most of the
+  /// stored results (e.g., a null build), allowing the database to load them
+  /// in bulk instead of individually as they are looked up. The default
+  /// implementation does nothing.
+  ///
+  /// \param error_out [out] Error string if return value is false.
+  virtual bool preloadResults(std::string* error_out) { return true; }
+
   /// Update the stored result for a rule.
   ///
   /// The BuildEngine does not enforce that the dependencies for a Rule are
@@ -103,6 +163,39 @@ public:
   /// \param error_out [out] Error string if return value is false.
   virtual bool setRuleResult(KeyID keyID, const Rule& rule, const Result& result, std::string* error_out) = 0;
 
+  /// Record that a key was requested as the root of the current build.
+  ///
+  /// The engine calls this for each build, after \see setCurrentIteration().
+  /// The recorded roots determine which results are still reachable when
+  /// collecting garbage (\see collectGarbage()). The default implementation
+  /// does nothing.
+  ///
+  /// \param keyID The keyID for the requested key.
+  /// \param error_out [out] Error string if return value is false.
+  virtual bool setBuildRoot(KeyID keyID, const KeyType& key,
+                            std::string* error_out) {
+    return true;
+  }
+
+  /// Remove the results which are no longer needed.
+  ///
+  /// A result is removed if it was last built more than \p minAge iterations
+  /// ago, and it is not reachable (via the stored dependencies) from any build
+  /// root requested since then. Keys which are no longer referred to are
+  /// removed along with them, and the storage is compacted.
+  ///
+  /// This must not be called while a build is running. The default
+  /// implementation reports that garbage collection is unsupported.
+  ///
+  /// \param stats_out [out] Statistics on what was removed.
+  /// \param error_out [out] Error string if return value is false.
+  virtual bool collectGarbage(uint64_t minAge,
+                              BuildDBGarbageCollectionStats* stats_out,
+                              std::string* error_out) {
+    *error_out = "garbage collection is not supported by this database";
+    return false;
+  }
+
   /// Called by the build engine to indicate that a build has started.
   ///
   /// The engine guarantees that all mutation operations (e.g., \see
@@ -138,6 +231,21 @@ public:
   /// \note The number of keys and results added to the out parameters is always
   /// the same.
   virtual bool getKeysWithResult(std::vector<KeyType> &keys_out, std::vector<Result> &results_out, std::string* error_out) = 0;
+
+  /// Get the keys whose stored results depend on the given key.
+  ///
+  /// Databases which maintain an index of the dependencies answer this in time
+  /// proportional to the number of dependents. The default implementation
+  /// reports that the query is unsupported.
+  ///
+  /// \param keys_out [out] The dependent keys will be appended to this vector.
+  /// \param error_out [out] Error string if return value is false.
+  virtual bool getReverseDependencies(const KeyType& key,
+                                      std::vector<KeyType>& keys_out,
+                                      std::string* error_out) {
+    *error_out = "reverse dependencies are not supported by this database";
+    return false;
+  }
   
   /// Dump a debug view of the database contents
   virtual void dump(raw_ostream& os) { (void)os; }
@@ -149,11 +257,61 @@ public:
 /// client to allow batch changes to the stored build results; if the stored
 /// schema does not match the provided version the database will be cleared upon
 /// opening; to avoid this behavior, pass `false` for `recreateUnmatchedVersion`.
+///
+/// \param writeBehind If true, results set while a build is running are written
+/// asynchronously by a dedicated thread, and errors writing them are reported
+/// by a later call to \see BuildDB::setRuleResult().
+///
+/// \param compress If true, large values and dependency lists are compressed
+/// when written (when it is worthwhile). Compressed results are always read,
+/// regardless.
 std::unique_ptr<BuildDB> createSQLiteBuildDB(StringRef path,
+                                             uint32_t clientSchemaVersion,
+                                             bool recreateUnmatchedVersion,
+                                             std::string* error_out,
+                                             bool writeBehind = false,
+                                             bool compress = false);
+
+/// Create a BuildDB instance backed by a memory-mapped, append-only binary log.
+///
+/// \param clientSchemaVersion An uninterpreted version number for use by the
+/// client to allow batch changes to the stored build results; if the stored
+/// schema does not match the provided version the database will be cleared
+/// upon opening; to avoid this behavior, pass `false` for
+/// `recreateUnmatchedVersion`.
+std::unique_ptr<BuildDB> createBinaryBuildDB(StringRef path,
                                              uint32_t clientSchemaVersion,
                                              bool recreateUnmatchedVersion,
                                              std::string* error_out);
 
+/// The available build database formats.
+enum class BuildDBFormat {
+  /// A SQLite3 database (\see createSQLiteBuildDB()).
+  SQLite,
+
+  /// A binary log (\see createBinaryBuildDB()).
+  Binary,
+};
+
+/// Parse the name of a build database format (as used on the command line).
+///
+/// \returns True if the name was recognized.
+bool parseBuildDBFormat(StringRef name, BuildDBFormat* format_out);
+
+/// Create a BuildDB instance of the given format.
+///
+/// \param writeBehind If true, and supported by the format, results are written
+/// asynchronously (\see createSQLiteBuildDB()).
+///
+/// \param compress If true, and supported by the format, large results are
+/// compressed (\see createSQLiteBuildDB()).
+std::unique_ptr<BuildDB> createBuildDB(BuildDBFormat format, StringRef path,
+                                       uint32_t clientSchemaVersion,
+                                       bool recreateUnmatchedVersion,
+                                       std::string* error_out,
+                                       bool writeBehind = false,
+                                       bool compress = false);
+
 }
 }
 
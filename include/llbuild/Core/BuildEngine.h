@@ -15,6 +15,7 @@
 
 #include "llbuild/Basic/Compiler.h"
 #include "llbuild/Basic/Hashing.h"
+#include "llbuild/Basic/LLVM.h"
 
 #include "llbuild/Basic/Clock.h"
 
@@ -40,6 +41,7 @@ typedef std::vector<uint8_t> ValueType;
 
 class BuildDB;
 class BuildEngine;
+struct BuildDBGarbageCollectionStats;
 
 /// A monotonically increasing number identifying which iteration of a build
 /// an event occurred during.
@@ -77,6 +79,10 @@ struct Result {
   
   /// The timestamp of when the command finished computing
   basic::Clock::Timestamp end;
+
+  /// The peak resident set size (in bytes) of the processes run to compute
+  /// the result, or zero if unknown (e.g., if no process was run).
+  uint64_t peakRSS = 0;
 };
 
 /// A task object represents an abstract in-progress computation in the build
@@ -110,6 +116,12 @@ public:
   Task() {}
   virtual ~Task();
 
+  /// Storage reserved for the build engine's record of this task, which lets
+  /// the engine resolve the task without a (synchronized) table lookup.
+  ///
+  /// Clients must not access this.
+  void* engineTaskInfo = nullptr;
+
   /// Executed by the build engine when the task should be started.
   virtual void start(BuildEngine&) = 0;
 
@@ -137,9 +149,19 @@ public:
   /// The task is expected to call \see BuildEngine::taskIsComplete() when it is
   /// done with its computation.
   ///
-  /// It is an error for any client to request an additional input for a task
-  /// after the last requested input has been provided by the build engine.
+  /// While computing, the task may request additional inputs (\see
+  /// BuildEngine::taskNeedsInput()), from any thread. Those values are provided
+  /// via \see provideValue() as they become available, and it is an error for
+  /// the task to complete before all of them have been provided.
   virtual void inputsAvailable(BuildEngine&) = 0;
+
+  /// Invoked by the build engine when the build is cancelled while the task
+  /// has outstanding input requests made after \see inputsAvailable().
+  ///
+  /// Those inputs will never be provided, so a task which is waiting on them
+  /// should stop doing so and complete. This is invoked on the engine thread,
+  /// potentially concurrently with the task's own computation.
+  virtual void inputRequestsCancelled(BuildEngine&) {}
 };
 
 /// A rule represents an individual element of computation that can be performed
@@ -154,7 +176,9 @@ public:
 /// the computation.
 ///
 /// All callbacks for the Rule are always invoked synchronously on the primary
-/// BuildEngine thread.
+/// BuildEngine thread, with the exception of \see isResultValid and \see
+/// isResultValidAsync when the engine has been configured for parallel
+/// scanning (\see BuildEngine::setScanConcurrency()).
 //
 // FIXME: The intent of having a callback like Rule structure and a decoupled
 // (virtual) Task is that the Rule objects (of which there can be very many) can
@@ -188,6 +212,9 @@ public:
     SupplyPriorValue = 1
   };
 
+  /// The callback used to report the result of \see isResultValidAsync.
+  typedef std::function<void(bool isValid)> ValidationCompletionFn;
+
   /// The key computed by the rule.
   KeyType key;
 
@@ -204,11 +231,30 @@ public:
   /// state managed externally to the build engine. For example, a rule which
   /// computes something on the file system may use this to verify that the
   /// computed output has not changed since it was built.
+  ///
+  /// If the engine has been configured for parallel scanning, this callback
+  /// may be invoked concurrently (for different rules) from the engine's scan
+  /// worker threads, and must be thread-safe.
   std::function<bool(BuildEngine&, const Rule&,
                      const ValueType&)> isResultValid;
 
   /// Called to indicate a change in the rule status.
   std::function<void(BuildEngine&, StatusKind)> updateStatus;
+
+  /// Called to asynchronously check whether the previously computed value for
+  /// this rule is still valid.
+  ///
+  /// This is an alternative to \see isResultValid for rules whose validity
+  /// check is dominated by I/O. If provided, it is used instead of \see
+  /// isResultValid. The callback should initiate the check and return
+  /// promptly; the rule remains in the scanning state until the completion is
+  /// invoked, which may happen from any thread, and must happen exactly once.
+  ///
+  /// If the engine has been configured for parallel scanning, this callback
+  /// is invoked from the engine's scan worker threads, otherwise it is invoked
+  /// on the engine thread.
+  std::function<void(BuildEngine&, const Rule&, const ValueType&,
+                     ValidationCompletionFn)> isResultValidAsync;
 };
 
 /// Delegate interface for use with the build engine.
@@ -258,6 +304,50 @@ public:
 
 };
 
+/// Statistics on the operation of a build engine, accumulated over its
+/// lifetime (\see BuildEngine::getStatistics()).
+///
+/// All times are in microseconds.
+struct BuildEngineStatistics {
+  /// The number of rules which were scanned to determine if they needed to run.
+  uint64_t numRulesScanned = 0;
+  /// The number of rules which were found to be up-to-date.
+  uint64_t numRulesUpToDate = 0;
+  /// The number of tasks which were created.
+  uint64_t numTasksCreated = 0;
+  /// The number of input requests made by tasks.
+  uint64_t numInputRequests = 0;
+  /// The number of input requests which were paused waiting on a scan.
+  uint64_t numInputRequestsPaused = 0;
+  /// The number of rule result lookups made in the database.
+  uint64_t numDBLookups = 0;
+  /// The number of rule results written to the database.
+  uint64_t numDBWrites = 0;
+  /// The total time spent in database operations.
+  uint64_t dbTime = 0;
+  /// The number of rules looked up via \see BuildEngineDelegate::lookupRule().
+  uint64_t numRuleLookups = 0;
+  /// The total time spent in \see BuildEngineDelegate::lookupRule().
+  uint64_t ruleLookupTime = 0;
+  /// The peak number of rules known to the engine.
+  uint64_t peakRules = 0;
+  /// The maximum number of rules queued for scanning.
+  uint64_t maxRulesToScan = 0;
+  /// The maximum number of queued input requests.
+  uint64_t maxInputRequests = 0;
+  /// The maximum number of queued finished input requests.
+  uint64_t maxFinishedInputRequests = 0;
+  /// The maximum number of tasks queued as ready to run.
+  uint64_t maxReadyTasks = 0;
+  /// The maximum number of tasks running concurrently.
+  uint64_t maxOutstandingTasks = 0;
+  /// The maximum number of rule validations running concurrently.
+  uint64_t maxOutstandingValidations = 0;
+
+  /// Write the statistics as a JSON object.
+  void writeJSON(raw_ostream& os) const;
+};
+
 /// A build engine supports fast, incremental, persistent, and parallel
 /// execution of computational graphs.
 ///
@@ -339,18 +429,52 @@ public:
   /// it is an error to attach a database after adding rules or initiating any
   /// builds, or to attempt to attach multiple databases.
   ///
+  /// \param preloadResults Whether to eagerly load all of the stored results
+  /// (\see BuildDB::preloadResults()), which is profitable if most of them
+  /// will be needed by the first build.
   /// \param error_out [out] Error string if return value is false.
   /// \returns false if the build database could not be attached.
-  bool attachDB(std::unique_ptr<BuildDB> database, std::string* error_out);
+  bool attachDB(std::unique_ptr<BuildDB> database, std::string* error_out,
+                bool preloadResults = false);
+
+  /// Remove the results which are no longer needed from the attached database
+  /// (\see BuildDB::collectGarbage()).
+  ///
+  /// This method must not be called while a build is running.
+  ///
+  /// \param minAge The number of iterations a result must have gone unbuilt
+  /// (while unreachable from the requested keys) before it is removed.
+  /// \param stats_out [out] Statistics on what was removed.
+  /// \param error_out [out] Error string if return value is false.
+  bool collectDBGarbage(uint64_t minAge,
+                        BuildDBGarbageCollectionStats* stats_out,
+                        std::string* error_out);
 
   /// Enable tracing into the given output file.
   ///
   /// \returns True on success.
   bool enableTracing(const std::string& path, std::string* error_out);
 
+  /// Configure the number of worker threads used during dependency scanning.
+  ///
+  /// When \arg numThreads is greater than one, the \see Rule::isResultValid
+  /// (and \see Rule::isResultValidAsync) callbacks for independent rules being
+  /// scanned are dispatched to a pool of worker threads, instead of being
+  /// invoked serially on the engine thread. All rule state transitions still
+  /// happen on the engine thread.
+  ///
+  /// This method must not be called while a build is running.
+  void setScanConcurrency(unsigned numThreads);
+
   /// Dump the build state to a file in Graphviz DOT format.
   void dumpGraphToFile(const std::string &path);
 
+  /// Get the statistics on the engine's operation so far.
+  ///
+  /// It is legal to call this method from any thread, including while a build
+  /// is running, although the result is then only approximate.
+  BuildEngineStatistics getStatistics();
+
   /// @}
 
   /// @name Task Management APIs
@@ -376,6 +500,12 @@ public:
   /// NOTE: It is an unchecked error for a task to request the same input value
   /// multiple times.
   ///
+  /// This is normally called while the task is being started or provided with
+  /// its inputs, on the engine thread. Once the task has been told its inputs
+  /// are available, it may continue to request inputs from any thread (for
+  /// example, to handle dependencies which are discovered while computing and
+  /// whose values are required). See \see Task::inputsAvailable().
+  ///
   /// \param inputID An arbitrary value that may be provided by the client to
   /// use in efficiently associating this input. The range of this parameter is
   /// intentionally chosen to allow a pointer to be provided, but note that all
@@ -408,9 +538,8 @@ public:
   /// complete, these inputs will be recorded as being dependencies of the task
   /// so that it will be recomputed when any of the inputs change.
   ///
-  /// It is legal to call this method from any thread, but the caller is
-  /// responsible for ensuring that it is never called concurrently for the same
-  /// task.
+  /// It is legal to call this method from any thread, including concurrently
+  /// for the same task.
   void taskDiscoveredDependency(Task* task, const KeyType& key);
 
   /// Called by a task to indicate it has completed and to provide its value.
@@ -423,6 +552,36 @@ public:
   /// dependents to rebuild, even if the value itself is not different from the
   /// prior result.
   void taskIsComplete(Task* task, ValueType&& value, bool forceChange = false);
+
+  /// Get the scheduling priority of the given task.
+  ///
+  /// The priority is an estimate of the remaining critical path through the
+  /// task, in microseconds, computed from the durations recorded for the task
+  /// and its (transitive) requesters on prior builds. Tasks with no recorded
+  /// duration contribute a nominal unit, so that on a clean build the priority
+  /// degrades to the depth of the task in the requested graph.
+  ///
+  /// The priority is final once \see Task::inputsAvailable() has been invoked,
+  /// and is intended to be passed along to the execution queue when the task
+  /// enqueues its work (\see basic::SchedulerAlgorithm::CriticalPath).
+  uint64_t getTaskPriority(Task* task);
+
+  /// Called by a task to report the peak resident set size (in bytes) of a
+  /// process it ran, to be recorded in the result of its rule.
+  ///
+  /// It is legal to call this method from any thread, including concurrently
+  /// for the same task, but only before the task is complete. The largest
+  /// reported value is recorded; if none is reported, the value recorded by a
+  /// prior build is preserved.
+  void taskReportedPeakRSS(Task* task, uint64_t peakRSS);
+
+  /// Get the estimated peak resident set size (in bytes) of the work of the
+  /// given task, as recorded for its rule on a prior build, or zero if
+  /// unknown.
+  ///
+  /// This is intended to be passed along to the execution queue when the task
+  /// enqueues its work (\see basic::ExecutionQueue::setMemoryBudget()).
+  uint64_t getTaskEstimatedPeakRSS(Task* task);
   
   /// @}
 };
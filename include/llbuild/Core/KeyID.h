@@ -94,7 +94,9 @@ namespace llvm {
     static inline KeyID getEmptyKey() { return KeyID::novalue(); }
     static inline KeyID getTombstoneKey() { return KeyID::invalid(); }
     static unsigned getHashValue(const KeyID& Val) {
-      return (unsigned)(Val.value() * 37UL);
+      // Key IDs are typically pointers, so mix in the higher bits (as for
+      // DenseMapInfo<T*>) to avoid clustering on the always-zero low bits.
+      return (unsigned(Val.value()) >> 4) ^ (unsigned(Val.value()) >> 9);
     }
     static bool isEqual(const KeyID& LHS, const KeyID& RHS) {
       return LHS == RHS;
@@ -0,0 +1,263 @@
+//===-- Jobserver.cpp -----------------------------------------------------===//
+//
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2019 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+//
+//===----------------------------------------------------------------------===//
+
+#include "llbuild/Basic/Jobserver.h"
+
+#include "llbuild/Basic/PlatformUtility.h"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+
+#include <cerrno>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace llbuild;
+using namespace llbuild::basic;
+
+const int Jobserver::ImplicitToken;
+
+Jobserver::~Jobserver() {
+#if !defined(_WIN32)
+  if (nonBlockingReadFD != -1)
+    ::close(nonBlockingReadFD);
+  if (ownsFDs) {
+    ::close(fds[0]);
+    if (fds[1] != fds[0])
+      ::close(fds[1]);
+  }
+  if (!fifoPath.empty()) {
+    ::unlink(fifoPath.c_str());
+    ::rmdir(fifoDirectory.c_str());
+  }
+#endif
+}
+
+std::unique_ptr<Jobserver> Jobserver::createClient(StringRef makeFlags,
+                                                   std::string* error_out) {
+#if defined(_WIN32)
+  return nullptr;
+#else
+  // Find the (last) jobserver option. Older versions of make used
+  // `--jobserver-fds`.
+  StringRef auth;
+  SmallVector<StringRef, 8> flags;
+  makeFlags.split(flags, ' ', /*MaxSplit=*/-1, /*KeepEmpty=*/false);
+  for (auto flag: flags) {
+    if (flag.startswith("--jobserver-auth="))
+      auth = flag.substr(strlen("--jobserver-auth="));
+    else if (flag.startswith("--jobserver-fds="))
+      auth = flag.substr(strlen("--jobserver-fds="));
+  }
+  if (auth.empty())
+    return nullptr;
+
+  if (auth.startswith("fifo:")) {
+    std::string path = auth.substr(strlen("fifo:"));
+    int fd = ::open(path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+      *error_out = "unable to open jobserver fifo '" + path + "' (" +
+        sys::strerror(errno) + ")";
+      return nullptr;
+    }
+
+    std::unique_ptr<Jobserver> jobserver(new Jobserver(JobserverStyle::Fifo));
+    jobserver->fds[0] = jobserver->fds[1] = fd;
+    jobserver->ownsFDs = true;
+    jobserver->makeFlags = makeFlags;
+    return jobserver;
+  }
+
+  // Otherwise, the jobserver is an inherited pipe.
+  StringRef readFD, writeFD;
+  std::tie(readFD, writeFD) = auth.split(',');
+  std::unique_ptr<Jobserver> jobserver(new Jobserver(JobserverStyle::Pipe));
+  if (readFD.getAsInteger(10, jobserver->fds[0]) ||
+      writeFD.getAsInteger(10, jobserver->fds[1]) ||
+      jobserver->fds[0] < 0 || jobserver->fds[1] < 0) {
+    *error_out = ("invalid jobserver in MAKEFLAGS '" + auth + "'").str();
+    return nullptr;
+  }
+
+  // make only passes the pipe to commands it knows to be recursive (e.g.,
+  // those marked with '+'), so check that it was inherited.
+  if (::fcntl(jobserver->fds[0], F_GETFD) < 0 ||
+      ::fcntl(jobserver->fds[1], F_GETFD) < 0) {
+    *error_out = "jobserver file descriptors are not available (is the "
+      "command marked as recursive with '+'?)";
+    return nullptr;
+  }
+  jobserver->openNonBlockingReadFD();
+  jobserver->makeFlags = makeFlags;
+  return jobserver;
+#endif
+}
+
+std::unique_ptr<Jobserver> Jobserver::createServer(unsigned numSlots,
+                                                   JobserverStyle style,
+                                                   std::string* error_out) {
+#if defined(_WIN32)
+  *error_out = "jobserver is not supported on this platform";
+  return nullptr;
+#else
+  std::unique_ptr<Jobserver> jobserver(new Jobserver(style));
+  std::string auth;
+  if (style == JobserverStyle::Fifo) {
+    SmallString<256> directory;
+    if (auto ec = llvm::sys::fs::createUniqueDirectory("llbuild-jobserver",
+                                                       directory)) {
+      *error_out = "unable to create jobserver directory (" + ec.message() +
+        ")";
+      return nullptr;
+    }
+    SmallString<256> path(directory);
+    llvm::sys::path::append(path, "fifo");
+    jobserver->fifoDirectory = directory.str();
+    if (::mkfifo(path.c_str(), 0600) < 0) {
+      *error_out = "unable to create jobserver fifo (" +
+        sys::strerror(errno) + ")";
+      ::rmdir(directory.c_str());
+      return nullptr;
+    }
+    jobserver->fifoPath = path.str();
+
+    int fd = ::open(path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+      *error_out = "unable to open jobserver fifo (" +
+        sys::strerror(errno) + ")";
+      return nullptr;
+    }
+    jobserver->fds[0] = jobserver->fds[1] = fd;
+    auth = "fifo:" + jobserver->fifoPath;
+  } else {
+    // The pipe is deliberately not close-on-exec, so it is inherited.
+    if (sys::pipe(jobserver->fds) < 0) {
+      *error_out = "unable to create jobserver pipe (" +
+        sys::strerror(errno) + ")";
+      return nullptr;
+    }
+    auth = (Twine(jobserver->fds[0]) + "," + Twine(jobserver->fds[1])).str();
+    jobserver->openNonBlockingReadFD();
+  }
+  jobserver->ownsFDs = true;
+
+  // Fill the pipe with tokens for all but our own implicit slot.
+  std::vector<char> tokens(numSlots > 1 ? numSlots - 1 : 0, '+');
+  size_t numWritten = 0;
+  while (numWritten != tokens.size()) {
+    ssize_t result = ::write(jobserver->fds[1], tokens.data() + numWritten,
+                             tokens.size() - numWritten);
+    if (result < 0 && errno == EINTR)
+      continue;
+    if (result <= 0) {
+      *error_out = "unable to write jobserver tokens (" +
+        sys::strerror(errno) + ")";
+      return nullptr;
+    }
+    numWritten += result;
+  }
+
+  jobserver->makeFlags = (Twine(" -j") + Twine(numSlots) +
+                          " --jobserver-auth=" + auth).str();
+  return jobserver;
+#endif
+}
+
+void Jobserver::openNonBlockingReadFD() {
+  // The pipe is shared with other processes, so it must remain blocking for
+  // them, but a blocking read can wait forever if another process takes the
+  // token we polled for. On Linux, reopening the pipe gives us our own open
+  // file description, which can be made non-blocking. Elsewhere, we fall back
+  // to reading the shared descriptor.
+#if defined(__linux__)
+  std::string path = ("/proc/self/fd/" + Twine(fds[0])).str();
+  nonBlockingReadFD = ::open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+#endif
+}
+
+bool Jobserver::tryAcquireImplicitSlot() {
+  std::lock_guard<std::mutex> guard(implicitSlotMutex);
+  if (isImplicitSlotInUse)
+    return false;
+  isImplicitSlotInUse = true;
+  return true;
+}
+
+bool Jobserver::acquire(int& token_out) {
+  if (tryAcquireImplicitSlot()) {
+    token_out = ImplicitToken;
+    return true;
+  }
+
+#if defined(_WIN32)
+  return false;
+#else
+  int readFD = nonBlockingReadFD != -1 ? nonBlockingReadFD : fds[0];
+  while (true) {
+    if (isCancelled)
+      return false;
+
+    // Wait for a token, but periodically check whether the implicit slot has
+    // been released (or the jobserver cancelled) in the meantime.
+    struct pollfd pfd = { readFD, POLLIN, 0 };
+    int result = ::poll(&pfd, 1, /*timeout=*/100);
+    if (result < 0 && errno != EINTR)
+      return false;
+    if (result > 0) {
+      if (pfd.revents & (POLLERR | POLLNVAL))
+        return false;
+
+      // Another process may take the token first, in which case we get EAGAIN
+      // (unless the pipe could not be reopened non-blocking, in which case we
+      // wait for the next one).
+      char token;
+      ssize_t numRead = ::read(readFD, &token, 1);
+      if (numRead == 1) {
+        token_out = (unsigned char)token;
+        return true;
+      }
+      if (numRead == 0)
+        return false;
+      if (errno != EAGAIN && errno != EINTR)
+        return false;
+    }
+
+    if (tryAcquireImplicitSlot()) {
+      token_out = ImplicitToken;
+      return true;
+    }
+  }
+#endif
+}
+
+void Jobserver::release(int token) {
+  if (token == ImplicitToken) {
+    std::lock_guard<std::mutex> guard(implicitSlotMutex);
+    isImplicitSlotInUse = false;
+    return;
+  }
+
+#if !defined(_WIN32)
+  char byte = char(token);
+  while (::write(fds[1], &byte, 1) < 0 && errno == EINTR) {}
+#endif
+}
@@ -12,6 +12,7 @@
 
 #include "llbuild/Basic/ExecutionQueue.h"
 
+#include "llbuild/Basic/PlatformUtility.h"
 #include "llbuild/Basic/Tracing.h"
 
 #include "llvm/ADT/ArrayRef.h"
@@ -21,6 +22,7 @@
 #include "llvm/ADT/Twine.h"
 
 #include <atomic>
+#include <chrono>
 #include <future>
 #include <queue>
 #include <random>
@@ -44,6 +46,14 @@ struct QueueJobLess {
   }
 };
 
+struct QueueJobPriorityLess {
+  bool operator()(const QueueJob& lhs, const QueueJob& rhs) const {
+    if (lhs.getPriority() != rhs.getPriority())
+      return lhs.getPriority() < rhs.getPriority();
+    return QueueJobLess()(lhs, rhs);
+  }
+};
+
 namespace {
 
 struct LaneBasedExecutionQueueJobContext : public QueueJobContext {
@@ -66,6 +76,7 @@ public:
 
   virtual void addJob(QueueJob job) = 0;
   virtual QueueJob getNextJob() = 0;
+  virtual const QueueJob& peekNextJob() const = 0;
   virtual bool empty() const = 0;
   virtual uint64_t size() const = 0;
 
@@ -85,13 +96,85 @@ class LaneBasedExecutionQueue : public ExecutionQueue {
   /// A thread for each lane.
   std::vector<std::unique_ptr<std::thread>> lanes;
 
-  /// The ready queue of jobs to execute.
+  /// The ready queue of jobs to execute (unless work stealing).
   std::unique_ptr<Scheduler> readyJobs;
   std::mutex readyJobsMutex;
   std::condition_variable readyJobsCondition;
   bool cancelled { false };
   bool shutdown { false };
 
+  /// Whether jobs are scheduled by work stealing (\see
+  /// SchedulerAlgorithm::WorkStealing), instead of from the single ready queue.
+  bool workStealing;
+
+  /// The ready queue of a single lane, when work stealing.
+  struct LaneReadyJobs {
+    std::mutex mutex;
+    std::unique_ptr<Scheduler> jobs;
+  };
+
+  /// The ready queues of each lane, when work stealing.
+  std::vector<std::unique_ptr<LaneReadyJobs>> laneReadyJobs;
+
+  /// The total number of jobs in the lane ready queues.
+  std::atomic<uint64_t> numLaneReadyJobs{0};
+
+  /// The lane to which the next job is added.
+  std::atomic<unsigned> nextLane{0};
+
+  /// The number of lanes waiting for a job, and the condition they wait on.
+  /// The shutdown flag must also be set while holding the idleLanesMutex.
+  std::atomic<unsigned> numIdleLanes{0};
+  std::mutex idleLanesMutex;
+  std::condition_variable idleLanesCondition;
+
+  /// A class of jobs with limited concurrency, \see addResourceClass().
+  struct ResourceClass {
+    /// The name of the class.
+    std::string name;
+
+    /// The maximum number of jobs to admit at once.
+    unsigned maxConcurrency;
+
+    /// The number of admitted jobs, which are either ready or executing.
+    unsigned numAdmitted = 0;
+
+    /// The jobs waiting to be admitted.
+    std::unique_ptr<Scheduler> waitingJobs;
+  };
+
+  /// The resource classes, indexed by their QueueJobResourceClass (less one).
+  std::vector<std::unique_ptr<ResourceClass>> resourceClasses;
+  std::mutex resourceClassesMutex;
+
+  /// The algorithm used to order the jobs waiting on a resource class.
+  SchedulerAlgorithm waitingJobsAlgorithm;
+
+  /// Load based throttling, \see setMaximumLoad().
+  std::atomic<bool> isLoadLimited{false};
+  std::mutex loadMutex;
+  std::condition_variable loadCondition;
+  LoadSignal loadSignal = LoadSignal::LoadAverage;
+  double maximumLoad = 0.0;
+  bool isLoadThrottled = false;
+  std::chrono::steady_clock::time_point nextLoadSample;
+
+  /// The number of executing jobs admitted under the load limit.
+  unsigned numLoadAdmittedJobs = 0;
+
+  /// Memory based admission, \see setMemoryBudget().
+  std::atomic<uint64_t> memoryBudget{0};
+  std::mutex memoryMutex;
+  std::condition_variable memoryCondition;
+
+  /// The number of executing jobs admitted under the memory budget, and the
+  /// sum of their estimated peak RSS.
+  unsigned numMemoryAdmittedJobs = 0;
+  uint64_t admittedMemory = 0;
+
+  /// The jobserver sharing the job slots with other processes, if any.
+  std::unique_ptr<Jobserver> jobserver;
+
   ProcessGroup spawnedProcesses;
 
   /// Management of cancellation and SIGKILL escalation
@@ -132,12 +215,18 @@ class LaneBasedExecutionQueue : public ExecutionQueue {
     uint32_t jobCount = 0;
     uint64_t laneID = (((uint64_t)buildID & 0xFFFF) << 32) + (((uint64_t)laneNumber & 0xFFFF) << 16);
 
+    // The source of randomness for choosing lanes to steal from.
+    std::minstd_rand randomEngine(buildID + laneNumber);
+
     // Execute items from the queue until shutdown.
     while (true) {
       // Take a job from the ready queue.
       QueueJob job{};
       uint64_t readyJobsCount;
-      {
+      if (workStealing) {
+        if (!takeLaneJob(laneNumber, randomEngine, job, readyJobsCount))
+          return;
+      } else {
         std::unique_lock<std::mutex> lock(readyJobsMutex);
 
         // While the queue is empty, wait for an item.
@@ -160,6 +249,10 @@ class LaneBasedExecutionQueue : public ExecutionQueue {
       jobCount++;
       uint64_t jobID = laneID + jobCount;
       LaneBasedExecutionQueueJobContext context{ jobID, laneNumber, job };
+      bool memoryAdmitted = acquireMemoryAdmission(job.getEstimatedPeakRSS());
+      bool loadAdmitted = acquireLoadAdmission();
+      int jobserverToken;
+      bool hasJobserverToken = jobserver && jobserver->acquire(jobserverToken);
       {
         TracingExecutionQueueDepth(readyJobsCount);
 
@@ -171,7 +264,218 @@ class LaneBasedExecutionQueue : public ExecutionQueue {
         job.execute(reinterpret_cast<QueueJobContext*>(&context));
         getDelegate().queueJobFinished(job.getDescriptor());
       }
+      if (hasJobserverToken)
+        jobserver->release(jobserverToken);
+      if (loadAdmitted)
+        releaseLoadAdmission();
+      if (memoryAdmitted)
+        releaseMemoryAdmission(job.getEstimatedPeakRSS());
+
+      // Admit the next job waiting on the resource class, if any.
+      if (job.getResourceClass() != 0)
+        releaseResourceClass(job.getResourceClass());
+    }
+  }
+
+  /// Wait until a job may start under the load limit, if any.
+  ///
+  /// \returns True if the job was admitted under the limit, and must be
+  /// released by \see releaseLoadAdmission().
+  bool acquireLoadAdmission() {
+    if (!isLoadLimited)
+      return false;
+
+    std::unique_lock<std::mutex> lock(loadMutex);
+    while (true) {
+      sampleLoad();
+
+      // Always allow one job, so the build makes progress.
+      if (!isLoadThrottled || numLoadAdmittedJobs == 0)
+        break;
+
+      // Wait for a job to finish, or for the next sample.
+      loadCondition.wait_until(lock, nextLoadSample);
+    }
+    ++numLoadAdmittedJobs;
+    return true;
+  }
+
+  void releaseLoadAdmission() {
+    std::lock_guard<std::mutex> guard(loadMutex);
+    --numLoadAdmittedJobs;
+    loadCondition.notify_one();
+  }
+
+  /// Wait until a job with the given estimated peak RSS fits in the memory
+  /// budget, if any.
+  ///
+  /// \returns True if the job was admitted under the budget, and must be
+  /// released by \see releaseMemoryAdmission().
+  bool acquireMemoryAdmission(uint64_t estimatedPeakRSS) {
+    if (memoryBudget == 0 || estimatedPeakRSS == 0)
+      return false;
+
+    std::unique_lock<std::mutex> lock(memoryMutex);
+
+    // Always allow one job, so the build makes progress.
+    while (numMemoryAdmittedJobs != 0 && memoryBudget != 0 &&
+           admittedMemory + estimatedPeakRSS > memoryBudget) {
+      memoryCondition.wait(lock);
+    }
+    ++numMemoryAdmittedJobs;
+    admittedMemory += estimatedPeakRSS;
+    return true;
+  }
+
+  void releaseMemoryAdmission(uint64_t estimatedPeakRSS) {
+    std::lock_guard<std::mutex> guard(memoryMutex);
+    --numMemoryAdmittedJobs;
+    admittedMemory -= estimatedPeakRSS;
+
+    // The freed memory may admit several smaller jobs.
+    memoryCondition.notify_all();
+  }
+
+  /// Update whether the queue is throttled, if it is time for a new sample.
+  ///
+  /// The loadMutex must be held.
+  void sampleLoad() {
+    auto now = std::chrono::steady_clock::now();
+    if (now < nextLoadSample)
+      return;
+    nextLoadSample = now + std::chrono::seconds(1);
+
+    double load;
+    bool sampled = loadSignal == LoadSignal::CPUPressure
+      ? sys::getCPUPressure(load) : sys::getLoadAverage(load);
+    if (!sampled) {
+      isLoadThrottled = false;
+    } else if (isLoadThrottled) {
+      isLoadThrottled = load >= maximumLoad * 0.9;
+    } else {
+      isLoadThrottled = load > maximumLoad;
+    }
+  }
+
+  /// Add a job to the ready queue(s).
+  void addReadyJob(QueueJob job) {
+    uint64_t readyJobsCount;
+    if (workStealing) {
+      // Distribute the jobs over the lanes, idle lanes will steal them.
+      unsigned lane = nextLane++ % numLanes;
+      {
+        std::lock_guard<std::mutex> guard(laneReadyJobs[lane]->mutex);
+        laneReadyJobs[lane]->jobs->addJob(job);
+      }
+      readyJobsCount = ++numLaneReadyJobs;
+      if (numIdleLanes != 0) {
+        std::lock_guard<std::mutex> guard(idleLanesMutex);
+        idleLanesCondition.notify_one();
+      }
+    } else {
+      std::lock_guard<std::mutex> guard(readyJobsMutex);
+      readyJobs->addJob(job);
+      readyJobsCondition.notify_one();
+      readyJobsCount = readyJobs->size();
     }
+    TracingExecutionQueueDepth(readyJobsCount);
+  }
+
+  /// Release the admission of a finished job of a resource class, admitting
+  /// the next waiting job in its place.
+  void releaseResourceClass(QueueJobResourceClass id) {
+    QueueJob next;
+    {
+      std::lock_guard<std::mutex> guard(resourceClassesMutex);
+      ResourceClass& resourceClass = *resourceClasses[id - 1];
+      if (resourceClass.waitingJobs->empty()) {
+        --resourceClass.numAdmitted;
+        return;
+      }
+      next = resourceClass.waitingJobs->getNextJob();
+    }
+
+    // Shutdown waits for the ready queue to drain, and this lane checks it
+    // again before exiting, so the job is not lost.
+    addReadyJob(next);
+  }
+
+  /// Take a job from the lane ready queues, when work stealing, waiting for
+  /// one if necessary.
+  ///
+  /// The lane takes the most urgent job from either its own queue, or that of
+  /// a randomly chosen other lane, if it is more urgent (so urgent jobs are not
+  /// held up behind a busy lane). If its own queue is empty, it steals from the
+  /// first non-empty queue, starting from a random lane.
+  ///
+  /// \returns False if the queue is shutting down.
+  bool takeLaneJob(uint32_t laneNumber, std::minstd_rand& randomEngine,
+                   QueueJob& job_out, uint64_t& readyJobsCount_out) {
+    while (true) {
+      unsigned startLane = randomEngine() % numLanes;
+
+      // Check our own queue, against another lane's.
+      unsigned candidateLane = laneNumber;
+      if (numLanes > 1) {
+        unsigned otherLane = startLane != laneNumber ? startLane
+                                                     : (startLane + 1) % numLanes;
+        if (isMoreUrgent(otherLane, laneNumber))
+          candidateLane = otherLane;
+      }
+      if (popLaneJob(candidateLane, job_out) ||
+          (candidateLane != laneNumber && popLaneJob(laneNumber, job_out))) {
+        readyJobsCount_out = --numLaneReadyJobs;
+        return true;
+      }
+
+      // Otherwise, steal from the first lane with any jobs.
+      for (unsigned i = 0; i != numLanes; ++i) {
+        if (popLaneJob((startLane + i) % numLanes, job_out)) {
+          readyJobsCount_out = --numLaneReadyJobs;
+          return true;
+        }
+      }
+
+      // Wait for a job to be added. Jobs are counted before checking for idle
+      // lanes to notify (\see addJob()), and we check for jobs after counting
+      // ourselves idle, so one side always sees the other.
+      std::unique_lock<std::mutex> lock(idleLanesMutex);
+      ++numIdleLanes;
+      while (!shutdown && numLaneReadyJobs == 0) {
+        idleLanesCondition.wait(lock);
+      }
+      --numIdleLanes;
+      if (shutdown && numLaneReadyJobs == 0)
+        return false;
+    }
+  }
+
+  /// Check if the next job of lane \p lhs is more urgent than that of \p rhs.
+  bool isMoreUrgent(unsigned lhs, unsigned rhs) {
+    // Copy the next jobs, since the lanes are locked one at a time.
+    QueueJob lhsJob, rhsJob;
+    {
+      std::lock_guard<std::mutex> guard(laneReadyJobs[lhs]->mutex);
+      if (laneReadyJobs[lhs]->jobs->empty())
+        return false;
+      lhsJob = laneReadyJobs[lhs]->jobs->peekNextJob();
+    }
+    {
+      std::lock_guard<std::mutex> guard(laneReadyJobs[rhs]->mutex);
+      if (laneReadyJobs[rhs]->jobs->empty())
+        return true;
+      rhsJob = laneReadyJobs[rhs]->jobs->peekNextJob();
+    }
+    return QueueJobPriorityLess()(rhsJob, lhsJob);
+  }
+
+  /// Take the next job from a lane ready queue, if it has any.
+  bool popLaneJob(unsigned lane, QueueJob& job_out) {
+    std::lock_guard<std::mutex> guard(laneReadyJobs[lane]->mutex);
+    if (laneReadyJobs[lane]->jobs->empty())
+      return false;
+    job_out = laneReadyJobs[lane]->jobs->getNextJob();
+    return true;
   }
 
   void killAfterTimeout() {
@@ -198,8 +502,23 @@ public:
                           unsigned numLanes, SchedulerAlgorithm alg,
                           const char* const* environment)
   : ExecutionQueue(delegate), buildID(std::random_device()()), numLanes(numLanes),
-        readyJobs(Scheduler::make(alg)), environment(environment)
+        workStealing(alg == SchedulerAlgorithm::WorkStealing),
+        waitingJobsAlgorithm(workStealing ? SchedulerAlgorithm::CriticalPath
+                                          : alg),
+        environment(environment)
   {
+    // When work stealing, each lane has its own ready queue, ordered as for
+    // critical path scheduling (which is by name, for jobs without priority).
+    if (workStealing) {
+      for (unsigned i = 0; i != numLanes; ++i) {
+        laneReadyJobs.push_back(llvm::make_unique<LaneReadyJobs>());
+        laneReadyJobs.back()->jobs =
+          Scheduler::make(SchedulerAlgorithm::CriticalPath);
+      }
+    } else {
+      readyJobs = Scheduler::make(alg);
+    }
+
     // Configure the background task maximum. We currently support an
     // environmental override for experimentation pursposes, but otherwise limit
     // to a modest multiple of the core count, since we currently burn one thread
@@ -222,10 +541,16 @@ public:
     // Shut down the lanes.
     {
       std::unique_lock<std::mutex> lock(readyJobsMutex);
+      std::unique_lock<std::mutex> idleLock(idleLanesMutex);
       shutdown = true;
       readyJobsCondition.notify_all();
+      idleLanesCondition.notify_all();
     }
 
+    // Don't let any remaining jobs wait on other processes for job slots.
+    if (jobserver)
+      jobserver->cancel();
+
     for (unsigned i = 0; i != numLanes; ++i) {
       lanes[i]->join();
     }
@@ -244,14 +569,72 @@ public:
   }
 
   virtual void addJob(QueueJob job) override {
-    uint64_t readyJobsCount;
-    {
-      std::lock_guard<std::mutex> guard(readyJobsMutex);
-      readyJobs->addJob(job);
-      readyJobsCondition.notify_one();
-      readyJobsCount = readyJobs->size();
+    // If the job's resource class is at its limit, it waits to be admitted by
+    // a finishing job (\see releaseResourceClass()).
+    if (job.getResourceClass() != 0) {
+      std::lock_guard<std::mutex> guard(resourceClassesMutex);
+      ResourceClass& resourceClass = *resourceClasses[job.getResourceClass() - 1];
+      if (resourceClass.numAdmitted >= resourceClass.maxConcurrency) {
+        resourceClass.waitingJobs->addJob(job);
+        return;
+      }
+      ++resourceClass.numAdmitted;
     }
-    TracingExecutionQueueDepth(readyJobsCount);
+
+    addReadyJob(job);
+  }
+
+  virtual QueueJobResourceClass addResourceClass(
+      StringRef name, unsigned maxConcurrency) override {
+    assert(maxConcurrency != 0 && "invalid resource class concurrency");
+    std::lock_guard<std::mutex> guard(resourceClassesMutex);
+    resourceClasses.push_back(llvm::make_unique<ResourceClass>());
+    ResourceClass& resourceClass = *resourceClasses.back();
+    resourceClass.name = name;
+    resourceClass.maxConcurrency = maxConcurrency;
+    resourceClass.waitingJobs = Scheduler::make(waitingJobsAlgorithm);
+    return QueueJobResourceClass(resourceClasses.size());
+  }
+
+  virtual bool setMaximumLoad(LoadSignal signal, double maximum) override {
+    double load;
+    bool available = signal == LoadSignal::CPUPressure
+      ? sys::getCPUPressure(load) : sys::getLoadAverage(load);
+
+    std::lock_guard<std::mutex> guard(loadMutex);
+    loadSignal = signal;
+    maximumLoad = maximum;
+    isLoadThrottled = false;
+    nextLoadSample = std::chrono::steady_clock::time_point();
+    isLoadLimited = available && maximum > 0.0;
+    return available;
+  }
+
+  virtual void setMemoryBudget(uint64_t maximumBytes) override {
+    std::lock_guard<std::mutex> guard(memoryMutex);
+    memoryBudget = maximumBytes;
+    memoryCondition.notify_all();
+  }
+
+  virtual bool enableJobserver(bool serve, JobserverStyle style,
+                               std::string* error_out) override {
+    // Join the jobserver of a parent make, if any.
+    for (const char* const* p = environment; *p != nullptr; ++p) {
+      auto pair = StringRef(*p).split('=');
+      if (pair.first != "MAKEFLAGS")
+        continue;
+      jobserver = Jobserver::createClient(pair.second, error_out);
+      if (jobserver)
+        return true;
+      if (!error_out->empty())
+        return false;
+      break;
+    }
+
+    if (!serve)
+      return false;
+    jobserver = Jobserver::createServer(numLanes, style, error_out);
+    return jobserver != nullptr;
   }
 
   virtual void cancelAllJobs() override {
@@ -264,6 +647,11 @@ public:
       readyJobsCondition.notify_all();
     }
 
+    // Wake any lanes waiting for a job slot, since no more processes will be
+    // spawned.
+    if (jobserver)
+      jobserver->cancel();
+
     spawnedProcesses.signalAll(SIGINT);
     {
       std::lock_guard<std::mutex> guard(killAfterTimeoutThreadMutex);
@@ -311,6 +699,19 @@ public:
       posixEnv.setIfMissing(entry.first, entry.second);
     }
 
+    // Export the jobserver to subprocesses.
+    SmallVector<int, 4> inheritedFileDescriptors;
+    if (jobserver) {
+      posixEnv.setIfMissing("MAKEFLAGS", jobserver->getMakeFlags());
+      inheritedFileDescriptors.append(
+          attributes.inheritedFileDescriptors.begin(),
+          attributes.inheritedFileDescriptors.end());
+      inheritedFileDescriptors.append(
+          jobserver->getInheritedFileDescriptors().begin(),
+          jobserver->getInheritedFileDescriptors().end());
+      attributes.inheritedFileDescriptors = inheritedFileDescriptors;
+    }
+
     // Inherit the base environment, if desired.
     //
     // FIXME: This involves a lot of redundant allocation, currently. We could
@@ -387,6 +788,39 @@ public:
     return job;
   }
 
+  const QueueJob& peekNextJob() const override {
+    return jobs.top();
+  }
+
+  bool empty() const override {
+    return jobs.empty();
+  }
+
+  uint64_t size() const override {
+    return jobs.size();
+  }
+};
+
+class CriticalPathScheduler : public Scheduler {
+private:
+  std::priority_queue<QueueJob, std::vector<QueueJob>,
+                      QueueJobPriorityLess> jobs;
+
+public:
+  void addJob(QueueJob job) override {
+    jobs.push(job);
+  }
+
+  QueueJob getNextJob() override {
+    QueueJob job = jobs.top();
+    jobs.pop();
+    return job;
+  }
+
+  const QueueJob& peekNextJob() const override {
+    return jobs.top();
+  }
+
   bool empty() const override {
     return jobs.empty();
   }
@@ -411,6 +845,10 @@ public:
     return job;
   }
 
+  const QueueJob& peekNextJob() const override {
+    return jobs.front();
+  }
+
   bool empty() const override {
     return jobs.empty();
   }
@@ -426,6 +864,8 @@ std::unique_ptr<Scheduler> Scheduler::make(SchedulerAlgorithm alg) {
       return std::unique_ptr<Scheduler>(new PriorityQueueScheduler);
     case SchedulerAlgorithm::FIFO:
       return std::unique_ptr<Scheduler>(new FifoScheduler);
+    case SchedulerAlgorithm::CriticalPath:
+      return std::unique_ptr<Scheduler>(new CriticalPathScheduler);
     default:
       assert(0 && "unknown scheduler algorithm");
       return std::unique_ptr<Scheduler>(nullptr);
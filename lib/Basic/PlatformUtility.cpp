@@ -10,6 +10,7 @@
 #include "llbuild/Basic/PlatformUtility.h"
 #include "llbuild/Basic/Stat.h"
 #include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/Twine.h"
 #include "llvm/Support/ConvertUTF.h"
 #include "llvm/Support/Path.h"
 
@@ -20,13 +21,16 @@
 #include <io.h>
 #include <time.h>
 #else
+#include <fcntl.h>
 #include <fnmatch.h>
+#include <sys/file.h>
 #include <unistd.h>
 #if defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
 #include <dlfcn.h>
 #endif
 #endif
 #include <stdio.h>
+#include <stdlib.h>
 
 using namespace llbuild;
 using namespace llbuild::basic;
@@ -49,6 +53,14 @@ int sys::close(int fileHandle) {
 #endif
 }
 
+int sys::fsync(int fileHandle) {
+#if defined(_WIN32)
+  return ::_commit(fileHandle);
+#else
+  return ::fsync(fileHandle);
+#endif
+}
+
 #if defined(_WIN32)
 time_t filetimeToTime_t(FILETIME ft) {
   long long ltime = ft.dwLowDateTime | ((long long)ft.dwHighDateTime << 32);
@@ -240,6 +252,51 @@ int sys::raiseOpenFileLimit(llbuild_rlim_t limit) {
 #endif
 }
 
+bool sys::getLoadAverage(double& loadAverage_out) {
+#if defined(_WIN32)
+  return false;
+#else
+  return ::getloadavg(&loadAverage_out, 1) == 1;
+#endif
+}
+
+#if defined(__linux__)
+/// Read the "some avg10" value from a Linux PSI file.
+static bool readPressureAverage(const std::string& path, double& pressure_out) {
+  FILE* fp = ::fopen(path.c_str(), "r");
+  if (!fp)
+    return false;
+  bool found = ::fscanf(fp, "some avg10=%lf", &pressure_out) == 1;
+  ::fclose(fp);
+  return found;
+}
+#endif
+
+bool sys::getCPUPressure(double& pressure_out) {
+#if defined(__linux__)
+  // Find the cgroup (v2) of this process, from its "0::<path>" entry.
+  if (FILE* fp = ::fopen("/proc/self/cgroup", "r")) {
+    char line[4096];
+    while (::fgets(line, sizeof(line), fp)) {
+      llvm::StringRef entry = llvm::StringRef(line).rtrim("\n");
+      if (!entry.startswith("0::"))
+        continue;
+      std::string path = ("/sys/fs/cgroup" + entry.substr(3) +
+                          "/cpu.pressure").str();
+      if (readPressureAverage(path, pressure_out)) {
+        ::fclose(fp);
+        return true;
+      }
+    }
+    ::fclose(fp);
+  }
+
+  return readPressureAverage("/proc/pressure/cpu", pressure_out);
+#else
+  return false;
+#endif
+}
+
 sys::MATCH_RESULT sys::filenameMatch(const std::string& pattern,
                                      const std::string& filename) {
 #if defined(_WIN32)
@@ -340,6 +397,67 @@ std::string sys::getPathSeparators() {
 #endif
 }
 
+int sys::syncDirectory(const char *path) {
+#if defined(_WIN32)
+  // Directories cannot be opened for flushing, renames are made durable by the
+  // file system itself.
+  (void)path;
+  return 0;
+#else
+  int fd = ::open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+  int result = ::fsync(fd);
+  int savedErrno = errno;
+  ::close(fd);
+  errno = savedErrno;
+  return result;
+#endif
+}
+
+#if defined(_WIN32)
+// Windows locks are mandatory, so lock a byte far beyond the end of any file
+// to leave its contents accessible.
+static const DWORD lockOffsetHigh = 0x7FFFFFFF;
+#endif
+
+int sys::tryLockFile(int fileHandle) {
+#if defined(_WIN32)
+  OVERLAPPED overlapped = {};
+  overlapped.OffsetHigh = lockOffsetHigh;
+  if (!LockFileEx((HANDLE)_get_osfhandle(fileHandle),
+                  LOCKFILE_EXCLUSIVE_LOCK | LOCKFILE_FAIL_IMMEDIATELY, 0,
+                  /*nNumberOfBytesToLockLow=*/1,
+                  /*nNumberOfBytesToLockHigh=*/0, &overlapped)) {
+    errno = GetLastError() == ERROR_LOCK_VIOLATION ? EWOULDBLOCK : EIO;
+    return -1;
+  }
+  return 0;
+#else
+  int result;
+  do {
+    result = ::flock(fileHandle, LOCK_EX | LOCK_NB);
+  } while (result == -1 && errno == EINTR);
+  return result;
+#endif
+}
+
+int sys::unlockFile(int fileHandle) {
+#if defined(_WIN32)
+  OVERLAPPED overlapped = {};
+  overlapped.OffsetHigh = lockOffsetHigh;
+  if (!UnlockFileEx((HANDLE)_get_osfhandle(fileHandle), 0,
+                    /*nNumberOfBytesToUnlockLow=*/1,
+                    /*nNumberOfBytesToUnlockHigh=*/0, &overlapped)) {
+    errno = EIO;
+    return -1;
+  }
+  return 0;
+#else
+  return ::flock(fileHandle, LOCK_UN);
+#endif
+}
+
 sys::ModuleTraits<>::Handle sys::OpenLibrary(const char *path) {
 #if defined(_WIN32)
   int cchLength =
@@ -370,6 +370,12 @@ static void cleanUpExecutedProcess(ProcessDelegate& delegate,
                     uint64_t(usage.ru_utime.tv_usec));
   uint64_t stime = (uint64_t(usage.ru_stime.tv_sec) * 1000000 +
                     uint64_t(usage.ru_stime.tv_usec));
+#if defined(__APPLE__)
+  uint64_t maxrss = usage.ru_maxrss;
+#else
+  // Other platforms report the maximum RSS in kilobytes.
+  uint64_t maxrss = uint64_t(usage.ru_maxrss) * 1024;
+#endif
 
   // FIXME: We should report a statistic for how much output we read from the
   // subprocess (probably as a new point sample).
@@ -378,7 +384,7 @@ static void cleanUpExecutedProcess(ProcessDelegate& delegate,
   bool cancelled = WIFSIGNALED(exitCode) && (WTERMSIG(exitCode) == SIGINT || WTERMSIG(exitCode) == SIGKILL);
   ProcessStatus processStatus = cancelled ? ProcessStatus::Cancelled : (exitCode == 0) ? ProcessStatus::Succeeded : ProcessStatus::Failed;
   ProcessResult processResult(processStatus, exitCode, pid, utime, stime,
-                              usage.ru_maxrss);
+                              maxrss);
 #endif // else !defined(_WIN32)
   delegate.processFinished(ctx, handle, processResult);
   completionFn(processResult);
@@ -574,6 +580,15 @@ void llbuild::basic::spawnProcess(
     posix_spawn_file_actions_addclose(&fileActions, controlPipe[0]);
   }
 
+  // Inherit any additional file descriptors.
+  for (int fd: attr.inheritedFileDescriptors) {
+#ifdef __APPLE__
+    posix_spawn_file_actions_addinherit_np(&fileActions, fd);
+#else
+    posix_spawn_file_actions_adddup2(&fileActions, fd, fd);
+#endif
+  }
+
   // If we are capturing output, create a pipe and appropriate spawn actions.
   int outputPipe[2]{ -1, -1 };
   if (shouldCaptureOutput) {
@@ -165,13 +165,14 @@ public:
   /// The internal schema version.
   ///
   /// Version History:
+  /// * 10: Switch FileInfo to variable-length integer coding
   /// * 9: Added filters to Directory* BuildKeys
   /// * 8: Added DirectoryTreeStructureSignature to BuildValue
   /// * 7: Added StaleFileRemoval to BuildValue
   /// * 6: Added DirectoryContents to BuildKey
   /// * 5: Switch BuildValue to be BinaryCoding based
   /// * 4: Pre-history
-  static const uint32_t internalSchemaVersion = 9;
+  static const uint32_t internalSchemaVersion = 10;
 
 private:
   BuildSystem& buildSystem;
@@ -204,6 +205,11 @@ private:
   /// actually in progress.
   std::unique_ptr<ExecutionQueue> executionQueue;
 
+  /// The resource classes of the command pools used by the current build, in
+  /// the execution queue, \see getPoolResourceClass().
+  llvm::StringMap<QueueJobResourceClass> poolResourceClasses;
+  std::mutex poolResourceClassesMutex;
+
   /// Flag indicating if the build has been aborted.
   bool buildWasAborted = false;
 
@@ -216,6 +222,21 @@ private:
   /// @name BuildSystemCommandInterface Implementation
   /// @{
 
+  virtual QueueJobResourceClass getPoolResourceClass(const Command& command)
+      override {
+    if (command.getPool().empty())
+      return 0;
+
+    std::lock_guard<std::mutex> guard(poolResourceClassesMutex);
+    auto it = poolResourceClasses.find(command.getPool());
+    if (it != poolResourceClasses.end())
+      return it->second;
+    auto resourceClass = executionQueue->addResourceClass(
+        command.getPool(), command.getPoolDepth());
+    poolResourceClasses[command.getPool()] = resourceClass;
+    return resourceClass;
+  }
+
   virtual BuildEngine& getBuildEngine() override {
     return buildEngine;
   }
@@ -359,11 +380,14 @@ public:
     buildDescription = std::move(description);
   }
 
-  bool attachDB(StringRef filename, std::string* error_out) {
+  bool attachDB(StringRef filename, core::BuildDBFormat format,
+                std::string* error_out) {
     // FIXME: How do we pass the client schema version here, if we haven't
     // loaded the file yet.
     std::unique_ptr<core::BuildDB> db(
-                                      core::createSQLiteBuildDB(filename, getMergedSchemaVersion(), /* recreateUnmatchedVersion = */ true, error_out));
+        core::createBuildDB(format, filename, getMergedSchemaVersion(),
+                            /* recreateUnmatchedVersion = */ true, error_out,
+                            /* writeBehind = */ true, /* compress = */ true));
     if (!db)
       return false;
 
@@ -374,6 +398,20 @@ public:
     return buildEngine.enableTracing(filename, error_out);
   }
 
+  void setScanConcurrency(unsigned numThreads) {
+    buildEngine.setScanConcurrency(numThreads);
+  }
+
+  core::BuildEngineStatistics getEngineStatistics() {
+    return buildEngine.getStatistics();
+  }
+
+  bool collectDBGarbage(uint64_t minAge,
+                        core::BuildDBGarbageCollectionStats* stats_out,
+                        std::string* error_out) {
+    return buildEngine.collectDBGarbage(minAge, stats_out, error_out);
+  }
+
   /// Build the given key, and return the result and an indication of success.
   llvm::Optional<BuildValue> build(BuildKey key);
   
@@ -1451,7 +1489,9 @@ class CommandTask : public Task {
         bsci.taskIsComplete(this, std::move(result));
       });
     };
-    bsci.addJob({ &command, std::move(fn) });
+    bsci.addJob({ &command, std::move(fn), engine.getTaskPriority(this),
+                  bsci.getPoolResourceClass(command),
+                  engine.getTaskEstimatedPeakRSS(this) });
   }
 
 public:
@@ -1869,6 +1909,8 @@ llvm::Optional<BuildValue> BuildSystemImpl::build(BuildKey key) {
     }
 
     executionQueue = delegate.createExecutionQueue();
+    std::lock_guard<std::mutex> poolsGuard(poolResourceClassesMutex);
+    poolResourceClasses.clear();
   }
 
   // Build the target.
@@ -2181,7 +2223,7 @@ public:
           }
           if (completionFn.hasValue())
             completionFn.getValue()(result);
-        }});
+        }, bsci.getBuildEngine().getTaskPriority(task) });
         return;
       }
 
@@ -2799,7 +2841,7 @@ public:
       }
       if (completionFn.hasValue())
         completionFn.getValue()(result);
-    }});
+    }, bsci.getBuildEngine().getTaskPriority(task) });
   }
 };
 
@@ -3859,7 +3901,14 @@ void BuildSystem::loadDescription(
 
 bool BuildSystem::attachDB(StringRef path,
                                 std::string* error_out) {
-  return static_cast<BuildSystemImpl*>(impl)->attachDB(path, error_out);
+  return static_cast<BuildSystemImpl*>(impl)->attachDB(
+      path, core::BuildDBFormat::SQLite, error_out);
+}
+
+bool BuildSystem::attachDB(StringRef path, core::BuildDBFormat format,
+                           std::string* error_out) {
+  return static_cast<BuildSystemImpl*>(impl)->attachDB(path, format,
+                                                       error_out);
 }
 
 bool BuildSystem::enableTracing(StringRef path,
@@ -3871,6 +3920,21 @@ llvm::Optional<BuildValue> BuildSystem::build(BuildKey key) {
   return static_cast<BuildSystemImpl*>(impl)->build(key);
 }
 
+void BuildSystem::setScanConcurrency(unsigned numThreads) {
+  static_cast<BuildSystemImpl*>(impl)->setScanConcurrency(numThreads);
+}
+
+core::BuildEngineStatistics BuildSystem::getEngineStatistics() {
+  return static_cast<BuildSystemImpl*>(impl)->getEngineStatistics();
+}
+
+bool BuildSystem::collectDBGarbage(
+    uint64_t minAge, core::BuildDBGarbageCollectionStats* stats_out,
+    std::string* error_out) {
+  return static_cast<BuildSystemImpl*>(impl)->collectDBGarbage(
+      minAge, stats_out, error_out);
+}
+
 bool BuildSystem::build(StringRef name) {
   return static_cast<BuildSystemImpl*>(impl)->build(name);
 }
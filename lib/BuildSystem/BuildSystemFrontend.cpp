@@ -49,10 +49,16 @@ void BuildSystemInvocation::getUsage(int optionWidth, raw_ostream& os) {
     { "-C <PATH>, --chdir <PATH>", "change directory to PATH before building" },
     { "--no-db", "disable use of a build database" },
     { "--db <PATH>", "enable building against the database at PATH" },
+    { "--db-format <FORMAT>",
+      "use the 'sqlite' (default) or 'binary' database format" },
+    { "--db-gc <N>",
+      "after the build, remove database results unused for N builds" },
     { "-f <PATH>", "load the build task file at PATH" },
     { "--serial", "do not build in parallel" },
     { "--scheduler <SCHEDULER>", "set scheduler algorithm" },
     { "-j,--jobs <JOBS>", "set how many concurrent jobs (lanes) to run" },
+    { "--scan-threads <N>", "use N threads to check for out-of-date results" },
+    { "--stats", "print build engine statistics (as JSON) after the build" },
     { "-v, --verbose", "show verbose status information" },
     { "--trace <PATH>", "trace build engine operation to PATH" },
   };
@@ -101,6 +107,29 @@ void BuildSystemInvocation::parse(llvm::ArrayRef<std::string> args,
       }
       dbPath = args[0];
       args = args.slice(1);
+    } else if (option == "--db-format") {
+      if (args.empty()) {
+        error("missing argument to '" + option + "'");
+        break;
+      }
+      if (!core::parseBuildDBFormat(args[0], &dbFormat)) {
+        error("unknown database format '" + args[0] + "'");
+        break;
+      }
+      args = args.slice(1);
+    } else if (option == "--db-gc") {
+      if (args.empty()) {
+        error("missing argument to '" + option + "'");
+        break;
+      }
+      char *end;
+      dbGarbageAge = ::strtoull(args[0].c_str(), &end, 10);
+      if (*end != '\0') {
+        error("invalid argument '" + args[0] + "' to '" + option + "'");
+        break;
+      }
+      collectDBGarbage = true;
+      args = args.slice(1);
     } else if (option == "-C" || option == "--chdir") {
       if (args.empty()) {
         error("missing argument to '" + option + "'");
@@ -127,6 +156,10 @@ void BuildSystemInvocation::parse(llvm::ArrayRef<std::string> args,
         schedulerAlgorithm = SchedulerAlgorithm::NamePriority;
       } else if (algorithm == "fifo") {
         schedulerAlgorithm = SchedulerAlgorithm::FIFO;
+      } else if (algorithm == "criticalPath") {
+        schedulerAlgorithm = SchedulerAlgorithm::CriticalPath;
+      } else if (algorithm == "workStealing") {
+        schedulerAlgorithm = SchedulerAlgorithm::WorkStealing;
       } else {
         error("unknown scheduler algorithm '" + algorithm + "'");
         break;
@@ -149,6 +182,19 @@ void BuildSystemInvocation::parse(llvm::ArrayRef<std::string> args,
       if (*end != '\0') {
         error("invalid argument to '-j'");
       }
+    } else if (option == "--scan-threads") {
+      if (args.empty()) {
+        error("missing argument to '" + option + "'");
+        break;
+      }
+      char *end;
+      scanThreads = ::strtol(args[0].c_str(), &end, 10);
+      if (*end != '\0') {
+        error("invalid argument '" + args[0] + "' to '" + option + "'");
+      }
+      args = args.slice(1);
+    } else if (option == "--stats") {
+      showStats = true;
     } else if (option == "-v" || option == "--verbose") {
       showVerboseStatus = true;
     } else if (option == "--trace") {
@@ -710,6 +756,11 @@ bool BuildSystemFrontend::initialize() {
     }
   }
 
+  // Configure parallel scanning, if requested.
+  if (invocation.scanThreads > 1) {
+    buildSystem->setScanConcurrency(invocation.scanThreads);
+  }
+
   // Attach the database.
   if (!invocation.dbPath.empty()) {
     // If the database path is relative, always make it relative to the input
@@ -725,7 +776,7 @@ bool BuildSystemFrontend::initialize() {
     }
     
     std::string error;
-    if (!buildSystem->attachDB(dbPath, &error)) {
+    if (!buildSystem->attachDB(dbPath, invocation.dbFormat, &error)) {
       getDelegate().error(Twine("unable to attach DB: ") + error);
       return false;
     }
@@ -762,15 +813,37 @@ bool BuildSystemFrontend::setupBuild() {
   return true;
 }
 
+void BuildSystemFrontend::reportStatistics() {
+  if (!invocation.showStats)
+    return;
+
+  buildSystem->getEngineStatistics().writeJSON(llvm::outs());
+  llvm::outs().flush();
+}
+
+void BuildSystemFrontend::collectDBGarbage() {
+  if (!invocation.collectDBGarbage || invocation.dbPath.empty())
+    return;
+
+  std::string error;
+  core::BuildDBGarbageCollectionStats stats;
+  if (!buildSystem->collectDBGarbage(invocation.dbGarbageAge, &stats,
+                                     &error)) {
+    getDelegate().error(Twine("unable to collect DB garbage: ") + error);
+  }
+}
+
 bool BuildSystemFrontend::buildNode(StringRef nodeToBuild) {
   if (!setupBuild()) {
     return false;
   }
 
   auto buildValue = buildSystem->build(BuildKey::makeNode(nodeToBuild));
+  reportStatistics();
   if (!buildValue.hasValue()) {
     return false;
   }
+  collectDBGarbage();
 
   if (!buildValue.getValue().isExistingInput()) {
     if (buildValue.getValue().isMissingInput()) {
@@ -789,8 +862,11 @@ bool BuildSystemFrontend::build(StringRef targetToBuild) {
 
   // Build the target; if something unspecified failed about the build, return
   // an error.
-  if (!buildSystem->build(targetToBuild))
+  bool result = buildSystem->build(targetToBuild);
+  reportStatistics();
+  if (!result)
     return false;
+  collectDBGarbage();
 
   bool wasCancelled = false;
   auto impl = static_cast<BuildSystemFrontendDelegateImpl*>(delegate.impl);
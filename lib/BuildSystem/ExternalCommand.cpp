@@ -97,6 +97,16 @@ configureAttribute(const ConfigureContext& ctx, StringRef name,
     }
     alwaysOutOfDate = value == "true";
     return true;
+  } else if (name == "pool") {
+    pool = value;
+    return true;
+  } else if (name == "pool-depth") {
+    if (value.getAsInteger(10, poolDepth) || poolDepth == 0) {
+      ctx.error("invalid value: '" + value + "' for attribute '" +
+                name + "'");
+      return false;
+    }
+    return true;
   } else {
     ctx.error("unexpected attribute: '" + name + "'");
     return false;
@@ -382,9 +392,13 @@ void ExternalCommand::execute(BuildSystemCommandInterface& bsci,
     
   // Invoke the external command.
   bsci.getDelegate().commandStarted(this);
-  executeExternalCommand(bsci, task, context, {[this, &bsci, resultFn](ProcessResult result){
+  executeExternalCommand(bsci, task, context, {[this, &bsci, task, resultFn](ProcessResult result){
     bsci.getDelegate().commandFinished(this, result.status);
 
+    // Record the peak RSS of the command, for memory based admission.
+    if (result.maxrss != 0)
+      bsci.getBuildEngine().taskReportedPeakRSS(task, result.maxrss);
+
     // Process the result.
     switch (result.status) {
     case ProcessStatus::Failed:
@@ -356,7 +356,7 @@ void ShellCommand::executeExternalCommand(
             }
             if (completionFn.hasValue())
               completionFn.getValue()(result);
-          }});
+          }, bsci.getBuildEngine().getTaskPriority(task) });
       return;
     }
 
@@ -612,6 +612,8 @@ static void dbUsage(int exitCode) {
           "show this help message and exit");
   fprintf(stderr, "  %-*s %s\n", optionWidth, "--db <path>",
           "database path [default: 'build.db']");
+  fprintf(stderr, "  %-*s %s\n", optionWidth, "--db-format <format>",
+          "database format, 'sqlite' or 'binary' [default: 'sqlite']");
   fprintf(stderr, "\nActions:\n");
   fprintf(stderr, "  %-*s %s\n", optionWidth, "get <key>...",
           "get the build value of the specified key");
@@ -619,6 +621,10 @@ static void dbUsage(int exitCode) {
           "list build keys known by the database");
   fprintf(stderr, "  %-*s %s\n", optionWidth, "dump",
           "dump debug database contents");
+  fprintf(stderr, "  %-*s %s\n", optionWidth, "rdeps [--transitive] <key>...",
+          "list the keys whose results depend on the specified keys");
+  fprintf(stderr, "  %-*s %s\n", optionWidth, "gc [<age>]",
+          "remove results unused for <age> builds [default: 0]");
   ::exit(exitCode);
 }
 
@@ -643,6 +649,7 @@ public:
 
 static int executeDBCommand(std::vector<std::string> args) {
   std::string dbPath = "build.db";
+  BuildDBFormat dbFormat = BuildDBFormat::SQLite;
 
   // Parse options
   while (!args.empty() && args[0][0] == '-') {
@@ -662,6 +669,18 @@ static int executeDBCommand(std::vector<std::string> args) {
       }
       dbPath = args[0];
       args.erase(args.begin());
+    } else if (option == "--db-format") {
+      if (args.empty()) {
+        fprintf(stderr, "error: %s: missing db format\n\n",
+                getProgramName());
+        dbUsage(1);
+      }
+      if (!parseBuildDBFormat(args[0], &dbFormat)) {
+        fprintf(stderr, "error: %s: invalid db format: '%s'\n\n",
+                getProgramName(), args[0].c_str());
+        dbUsage(1);
+      }
+      args.erase(args.begin());
     } else {
       fprintf(stderr, "error: %s: invalid option: '%s'\n\n",
               getProgramName(), option.c_str());
@@ -677,7 +696,9 @@ static int executeDBCommand(std::vector<std::string> args) {
 
   // Load database
   std::string error;
-  std::unique_ptr<BuildDB> buildDB = createSQLiteBuildDB(dbPath, BuildSystem::getSchemaVersion(), /* recreateUnmatchedVersion = */ true, &error);
+  std::unique_ptr<BuildDB> buildDB = createBuildDB(
+      dbFormat, dbPath, BuildSystem::getSchemaVersion(),
+      /* recreateUnmatchedVersion = */ true, &error);
   if (!buildDB) {
     fprintf(stderr, "error: failed to load build db: %s\n\n", error.c_str());
     ::exit(1);
@@ -729,6 +750,66 @@ static int executeDBCommand(std::vector<std::string> args) {
     }
   } else if (action == "dump") {
     buildDB->dump(llvm::outs());
+  } else if (action == "rdeps") {
+    bool transitive = false;
+    if (!args.empty() && args[0] == "--transitive") {
+      transitive = true;
+      args.erase(args.begin());
+    }
+    if (args.empty()) {
+      fprintf(stderr, "error: %s: invalid number of arguments\n",
+              getProgramName());
+      dbUsage(1);
+    }
+
+    // Report each dependent once, searching through them if requested.
+    llvm::StringMap<bool> seen;
+    std::vector<KeyType> worklist(args.rbegin(), args.rend());
+    while (!worklist.empty()) {
+      KeyType key = worklist.back();
+      worklist.pop_back();
+
+      std::string error;
+      std::vector<KeyType> dependents;
+      if (!buildDB->getReverseDependencies(key, dependents, &error)) {
+        fprintf(stderr, "error: failed to get reverse dependencies: %s\n\n",
+                error.c_str());
+        ::exit(1);
+      }
+      for (auto& dependent: dependents) {
+        if (!seen.insert({ dependent, true }).second)
+          continue;
+        printf("%s\n", dependent.c_str());
+        if (transitive)
+          worklist.push_back(dependent);
+      }
+    }
+  } else if (action == "gc") {
+    uint64_t minAge = 0;
+    if (args.size() > 1) {
+      fprintf(stderr, "error: %s: invalid number of arguments\n",
+              getProgramName());
+      dbUsage(1);
+    }
+    if (!args.empty()) {
+      char *end;
+      minAge = ::strtoull(args[0].c_str(), &end, 10);
+      if (*end != '\0') {
+        fprintf(stderr, "error: %s: invalid age: '%s'\n\n",
+                getProgramName(), args[0].c_str());
+        dbUsage(1);
+      }
+    }
+
+    std::string error;
+    BuildDBGarbageCollectionStats stats;
+    if (!buildDB->collectGarbage(minAge, &stats, &error)) {
+      fprintf(stderr, "error: failed to collect garbage: %s\n\n",
+              error.c_str());
+      ::exit(1);
+    }
+    printf("removed %" PRIu64 " results and %" PRIu64 " keys\n",
+           stats.numResultsRemoved, stats.numKeysRemoved);
   } else {
     fprintf(stderr, "error: %s: invalid action: '%s'\n\n",
             getProgramName(), action.c_str());
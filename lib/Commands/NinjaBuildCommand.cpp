@@ -29,6 +29,7 @@
 
 #include "llbuild/Ninja/ManifestLoader.h"
 
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/SmallString.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/Path.h"
@@ -116,6 +117,8 @@ static void usage(int exitCode=1) {
           "do not persist build results");
   fprintf(stderr, "  %-*s %s\n", optionWidth, "--db <PATH>",
           "persist build results at PATH [default='build.db']");
+  fprintf(stderr, "  %-*s %s\n", optionWidth, "--db-format <FORMAT>",
+          "use the 'sqlite' or 'binary' database format [default='sqlite']");
   fprintf(stderr, "  %-*s %s\n", optionWidth, "-f <PATH>",
           "load the manifest at PATH [default='build.ninja']");
   fprintf(stderr, "  %-*s %s\n", optionWidth, "-k <N>",
@@ -126,10 +129,16 @@ static void usage(int exitCode=1) {
           "number of jobs to build in parallel [default=cpu dependent]");
   fprintf(stderr, "  %-*s %s\n", optionWidth, "--scheduler <SCHEDULER>",
           "set scheduler algorithm");
+  fprintf(stderr, "  %-*s %s\n", optionWidth, "--jobserver <MODE>",
+          "share jobs with make: 'client' (join a parent make's jobserver), "
+          "'pipe' or 'fifo' (also serve to subprocesses), or 'none' "
+          "[default='client']");
   fprintf(stderr, "  %-*s %s\n", optionWidth, "--no-regenerate",
           "disable manifest auto-regeneration");
   fprintf(stderr, "  %-*s %s\n", optionWidth, "--dump-graph <PATH>",
           "dump build graph to PATH in Graphviz DOT format");
+  fprintf(stderr, "  %-*s %s\n", optionWidth, "--stats",
+          "print build engine statistics (as JSON) after the build");
   fprintf(stderr, "  %-*s %s\n", optionWidth, "--profile <PATH>",
           "write a build profile trace event file to PATH");
   fprintf(stderr, "  %-*s %s\n", optionWidth, "--strict",
@@ -141,7 +150,12 @@ static void usage(int exitCode=1) {
   fprintf(stderr, "  %-*s %s\n", optionWidth, "-v, --verbose",
           "show full invocation for executed commands");
   fprintf(stderr, "  %-*s %s\n", optionWidth, "-l <N>",
-          "start jobs only when load average is below N [not implemented]");
+          "start jobs only when load average is below N");
+  fprintf(stderr, "  %-*s %s\n", optionWidth, "--max-cpu-pressure <N>",
+          "start jobs only when CPU pressure is below N% (Linux PSI)");
+  fprintf(stderr, "  %-*s %s\n", optionWidth, "--memory-budget <MB>",
+          "start jobs only while the peak memory they used on prior builds "
+          "sums to at most MB");
   fprintf(stderr, "  %-*s %s\n", optionWidth, "-d <TOOL>",
           "enable debugging tool TOOL. 'list' for available [not implemented]");
   ::exit(exitCode);
@@ -430,6 +444,27 @@ public:
   /// The limited queue we use to execute parallel jobs.
   std::unique_ptr<ExecutionQueue> jobQueue;
 
+  /// The job queue resource classes which enforce the depth of each pool
+  /// (other than the console pool, which is serialized on the console queue).
+  llvm::DenseMap<const ninja::Pool*, QueueJobResourceClass> poolResourceClasses;
+
+  /// Add the job queue resource classes for the pools of the manifest.
+  void addPoolResourceClasses() {
+    for (const auto& entry: manifest->getPools()) {
+      const ninja::Pool* pool = entry.getValue();
+      if (pool == manifest->getConsolePool() || pool->getDepth() == 0)
+        continue;
+      poolResourceClasses[pool] =
+        jobQueue->addResourceClass(pool->getName(), pool->getDepth());
+    }
+  }
+
+  /// Get the job queue resource class for a command, if its pool has a depth.
+  QueueJobResourceClass getResourceClass(const ninja::Command* command) const {
+    auto it = poolResourceClasses.find(command->getExecutionPool());
+    return it == poolResourceClasses.end() ? 0 : it->second;
+  }
+
   std::unique_ptr<std::thread> signalHandlerThread;
 
   /// The previous SIGINT handler.
@@ -1213,7 +1248,11 @@ buildCommand(BuildContext& context, ninja::Command* command) {
       }
       assert(!hasMissingInput);
 
-      auto addExecuteJob = [&](std::function<void(void)>&& jobFullyExecuted) {
+      uint64_t priority = engine.getTaskPriority(this);
+      QueueJobResourceClass resourceClass = context.getResourceClass(command);
+      uint64_t estimatedPeakRSS = engine.getTaskEstimatedPeakRSS(this);
+      auto addExecuteJob = [&, priority, resourceClass, estimatedPeakRSS](
+          std::function<void(void)>&& jobFullyExecuted) {
         // Otherwise, enqueue the job to run later.
         context.jobQueue->addJob({command, [&, done=std::move(jobFullyExecuted)] (QueueJobContext* qctx) {
           // Suppress static analyzer false positive on generalized lambda capture
@@ -1252,7 +1291,7 @@ buildCommand(BuildContext& context, ninja::Command* command) {
           }
           done();
 #endif
-        }});
+        }, priority, resourceClass, estimatedPeakRSS});
       };
 
       bool isConsolePool = command->getExecutionPool() == context.manifest->getConsolePool();
@@ -1330,6 +1369,11 @@ buildCommand(BuildContext& context, ninja::Command* command) {
 
       context.jobQueue->executeProcess(qctx, args, {}, {true, isConsolePool}, {
         [&](ProcessResult result) {
+          // Record the peak RSS of the command, for memory based admission on
+          // subsequent builds.
+          if (result.maxrss != 0)
+            context.engine.taskReportedPeakRSS(this, result.maxrss);
+
           // Actually run the command.
           if (result.status != ProcessStatus::Succeeded) {
             // If the command failed, complete the task with the failed result and
@@ -1734,12 +1778,14 @@ int commands::executeNinjaBuildCommand(std::vector<std::string> args) {
   std::string chdirPath = "";
   std::string customTool = "";
   std::string dbFilename = "build.db";
+  core::BuildDBFormat dbFormat = core::BuildDBFormat::SQLite;
   std::string dumpGraphPath, profileFilename, traceFilename;
   std::string manifestFilename = "build.ninja";
 
   // Create a context for the build.
   bool autoRegenerateManifest = true;
   bool quiet = false;
+  bool showStats = false;
   bool simulate = false;
   bool strict = false;
   bool verbose = false;
@@ -1747,6 +1793,11 @@ int commands::executeNinjaBuildCommand(std::vector<std::string> args) {
   SchedulerAlgorithm schedulerAlgorithm = SchedulerAlgorithm::NamePriority;
   unsigned numFailedCommandsToTolerate = 1;
   double maximumLoadAverage = 0.0;
+  double maximumCPUPressure = 0.0;
+  uint64_t memoryBudget = 0;
+  bool useJobserver = true;
+  bool serveJobserver = false;
+  JobserverStyle jobserverStyle = JobserverStyle::Pipe;
   std::vector<std::string> debugTools;
 
   if (basic::sys::raiseOpenFileLimit() != 0) {
@@ -1791,6 +1842,18 @@ int commands::executeNinjaBuildCommand(std::vector<std::string> args) {
       }
       dbFilename = args[0];
       args.erase(args.begin());
+    } else if (option == "--db-format") {
+      if (args.empty()) {
+        fprintf(stderr, "%s: error: missing argument to '%s'\n\n",
+                getProgramName(), option.c_str());
+        usage();
+      }
+      if (!core::parseBuildDBFormat(args[0], &dbFormat)) {
+        fprintf(stderr, "%s: error: unknown database format '%s'\n\n",
+                getProgramName(), args[0].c_str());
+        usage();
+      }
+      args.erase(args.begin());
     } else if (option == "--dump-graph") {
       if (args.empty()) {
         fprintf(stderr, "%s: error: missing argument to '%s'\n\n",
@@ -1799,6 +1862,8 @@ int commands::executeNinjaBuildCommand(std::vector<std::string> args) {
       }
       dumpGraphPath = args[0];
       args.erase(args.begin());
+    } else if (option == "--stats") {
+      showStats = true;
     } else if (option == "-f") {
       if (args.empty()) {
         fprintf(stderr, "%s: error: missing argument to '%s'\n\n",
@@ -1835,6 +1900,51 @@ int commands::executeNinjaBuildCommand(std::vector<std::string> args) {
           usage();
       }
       args.erase(args.begin());
+    } else if (option == "--jobserver") {
+      if (args.empty()) {
+        fprintf(stderr, "%s: error: missing argument to '%s'\n\n",
+                getProgramName(), option.c_str());
+        usage();
+      }
+      auto mode = args[0];
+      useJobserver = mode != "none";
+      serveJobserver = mode == "pipe" || mode == "fifo";
+      jobserverStyle = mode == "fifo" ? JobserverStyle::Fifo
+                                      : JobserverStyle::Pipe;
+      if (mode != "none" && mode != "client" && !serveJobserver) {
+        fprintf(stderr, "%s: error: invalid argument '%s' to '%s'\n\n",
+                getProgramName(), args[0].c_str(), option.c_str());
+        usage();
+      }
+      args.erase(args.begin());
+    } else if (option == "--max-cpu-pressure") {
+      if (args.empty()) {
+        fprintf(stderr, "%s: error: missing argument to '%s'\n\n",
+                getProgramName(), option.c_str());
+        usage();
+      }
+      char *end;
+      maximumCPUPressure = ::strtod(args[0].c_str(), &end);
+      if (*end != '\0') {
+          fprintf(stderr, "%s: error: invalid argument '%s' to '%s'\n\n",
+                  getProgramName(), args[0].c_str(), option.c_str());
+          usage();
+      }
+      args.erase(args.begin());
+    } else if (option == "--memory-budget") {
+      if (args.empty()) {
+        fprintf(stderr, "%s: error: missing argument to '%s'\n\n",
+                getProgramName(), option.c_str());
+        usage();
+      }
+      char *end;
+      memoryBudget = ::strtoull(args[0].c_str(), &end, 10) * 1024 * 1024;
+      if (*end != '\0' || memoryBudget == 0) {
+          fprintf(stderr, "%s: error: invalid argument '%s' to '%s'\n\n",
+                  getProgramName(), args[0].c_str(), option.c_str());
+          usage();
+      }
+      args.erase(args.begin());
     } else if (option == "-j" || option == "--jobs") {
       if (args.empty()) {
         fprintf(stderr, "%s: error: missing argument to '%s'\n\n",
@@ -1860,6 +1970,10 @@ int commands::executeNinjaBuildCommand(std::vector<std::string> args) {
         schedulerAlgorithm = SchedulerAlgorithm::NamePriority;
       } else if (algorithm == "fifo") {
         schedulerAlgorithm = SchedulerAlgorithm::FIFO;
+      } else if (algorithm == "criticalPath") {
+        schedulerAlgorithm = SchedulerAlgorithm::CriticalPath;
+      } else if (algorithm == "workStealing") {
+        schedulerAlgorithm = SchedulerAlgorithm::WorkStealing;
       } else {
         fprintf(stderr, "%s: error: unknown scheduler algorithm '%s'\n\n",
                 getProgramName(), args[0].c_str());
@@ -1919,9 +2033,10 @@ int commands::executeNinjaBuildCommand(std::vector<std::string> args) {
     }
   }
 
-  if (maximumLoadAverage > 0.0) {
-    fprintf(stderr, "%s: warning: maximum load average %.8g not implemented\n",
-            getProgramName(), maximumLoadAverage);
+  if (maximumLoadAverage > 0.0 && maximumCPUPressure > 0.0) {
+    fprintf(stderr, "%s: error: '-l' and '--max-cpu-pressure' cannot be used "
+            "together\n\n", getProgramName());
+    usage();
   }
 
   if (!debugTools.empty()) {
@@ -2008,6 +2123,36 @@ int commands::executeNinjaBuildCommand(std::vector<std::string> args) {
     context.jobQueue.reset(createLaneBasedExecutionQueue(
         context, numJobsInParallel, schedulerAlgorithm, nullptr));
 
+    // Share the jobs with make, if requested.
+    if (useJobserver) {
+      std::string error;
+      if (!context.jobQueue->enableJobserver(serveJobserver, jobserverStyle,
+                                             &error) &&
+          !error.empty() && iteration == 0) {
+        fprintf(stderr, "%s: warning: %s, ignoring jobserver\n",
+                getProgramName(), error.c_str());
+      }
+    }
+
+    // Throttle the start of jobs while the system is loaded, if requested.
+    if (maximumLoadAverage > 0.0 || maximumCPUPressure > 0.0) {
+      bool useCPUPressure = maximumCPUPressure > 0.0;
+      if (!context.jobQueue->setMaximumLoad(
+              useCPUPressure ? LoadSignal::CPUPressure : LoadSignal::LoadAverage,
+              useCPUPressure ? maximumCPUPressure : maximumLoadAverage) &&
+          iteration == 0) {
+        fprintf(stderr, "%s: warning: %s is unavailable, ignoring '%s'\n",
+                getProgramName(),
+                useCPUPressure ? "CPU pressure" : "load average",
+                useCPUPressure ? "--max-cpu-pressure" : "-l");
+      }
+    }
+
+    // Limit the memory of concurrent jobs, as estimated from the peak RSS
+    // recorded in the database on prior builds.
+    if (memoryBudget != 0)
+      context.jobQueue->setMemoryBudget(memoryBudget);
+
     // Load the manifest.
     BuildManifestActions actions(context);
     ninja::ManifestLoader loader(workingDirectory, manifestFilename, actions);
@@ -2019,6 +2164,9 @@ int commands::executeNinjaBuildCommand(std::vector<std::string> args) {
       return 1;
     }
 
+    // Enforce the pool depths.
+    context.addPoolResourceClasses();
+
     // Run the targets tool, if specified.
     if (!customTool.empty() && customTool == "targets") {
       if (args.size() != 1 || args[0] != "all") {
@@ -2060,11 +2208,13 @@ int commands::executeNinjaBuildCommand(std::vector<std::string> args) {
     if (!dbFilename.empty()) {
       std::string error;
       std::unique_ptr<core::BuildDB> db(
-        core::createSQLiteBuildDB(dbFilename,
-                                  BuildValue::currentSchemaVersion,
-                                  /* recreateUnmatchedVersion = */ true,
-                                  &error));
-      if (!db || !context.engine.attachDB(std::move(db), &error)) {
+        core::createBuildDB(dbFormat, dbFilename,
+                            BuildValue::currentSchemaVersion,
+                            /* recreateUnmatchedVersion = */ true,
+                            &error, /* writeBehind = */ true,
+                            /* compress = */ true));
+      if (!db || !context.engine.attachDB(std::move(db), &error,
+                                          /*preloadResults=*/true)) {
         context.emitError("unable to open build database: %s", error.c_str());
         return 1;
       }
@@ -2262,6 +2412,11 @@ int commands::executeNinjaBuildCommand(std::vector<std::string> args) {
       context.engine.dumpGraphToFile(dumpGraphPath);
     }
 
+    if (showStats) {
+      context.engine.getStatistics().writeJSON(llvm::outs());
+      llvm::outs().flush();
+    }
+
     // Close the build profile, if used.
     if (context.profileFP) {
       ::fclose(context.profileFP);
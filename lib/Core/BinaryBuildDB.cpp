@@ -0,0 +1,1036 @@
+//===-- BinaryBuildDB.cpp -------------------------------------------------===//
+//
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2014 - 2019 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+//
+//===----------------------------------------------------------------------===//
+
+#include "llbuild/Core/BuildDB.h"
+
+#include "llbuild/Basic/Defer.h"
+#include "llbuild/Basic/PlatformUtility.h"
+#include "llbuild/Core/BuildEngine.h"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/Support/DJB.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <cassert>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+
+using namespace llbuild;
+using namespace llbuild::core;
+
+// Binary BuildDB Implementation
+//
+// The database is a single append-only log of records, which is scanned (via a
+// memory mapping) when it is opened to build an in-memory index from key IDs
+// to the latest record for each.
+//
+// The file starts with a header:
+//
+//   magic (8 bytes), format version (u32), client schema version (u32)
+//
+// followed by a sequence of records, each aligned to 8 bytes:
+//
+//   kind (u32), payload size (u32), checksum (u32), reserved (u32), payload
+//
+// The payload depends on the kind of record:
+//
+// * Key: The key bytes. Keys are assigned sequential IDs (starting from 1) in
+//   the order their records appear.
+//
+// * Result: A fixed-width header (\see ResultHeader) followed by its heap: the
+//   encoded dependencies (u64 each, the key ID shifted left by one with the
+//   flag in the low bit), then the value bytes. A later result for the same
+//   key supersedes any earlier one.
+//
+// * Iteration: The current iteration (u64).
+//
+// All integers are little-endian. If the log ends with a truncated or corrupt
+// record (e.g., because of a crash while writing it), the file is truncated to
+// the last valid record when it is next opened (unless a build is running, see
+// below).
+//
+// Since superseded results are never reclaimed by appending, the log is
+// compacted (rewritten with only the latest records) once enough of it is
+// dead.
+//
+// Only one connection may modify the log at a time. A writer (a build, or
+// anything recovering the file when it is opened) holds an exclusive lock on a
+// sibling "-lock" file, which (unlike the log itself) is not replaced by
+// compaction. Other connections may still read while a build is running; they
+// ignore any incomplete tail of the log rather than truncating it.
+
+namespace {
+
+/// The kinds of records in the log.
+enum class RecordKind : uint32_t {
+  Key = 1,
+  Result = 2,
+  Iteration = 3,
+};
+
+/// The fixed-width portion of a result record.
+struct ResultHeader {
+  uint64_t keyID;
+  uint64_t signature;
+  uint64_t builtAt;
+  uint64_t computedAt;
+  uint64_t start;
+  uint64_t end;
+  uint64_t peakRSS;
+  uint32_t valueSize;
+  uint32_t numDependencies;
+
+  static constexpr size_t size = 64;
+
+  void write(char* data) const {
+    using namespace llvm::support::endian;
+    write64le(data + 0, keyID);
+    write64le(data + 8, signature);
+    write64le(data + 16, builtAt);
+    write64le(data + 24, computedAt);
+    write64le(data + 32, start);
+    write64le(data + 40, end);
+    write64le(data + 48, peakRSS);
+    write32le(data + 56, valueSize);
+    write32le(data + 60, numDependencies);
+  }
+
+  static ResultHeader read(const char* data) {
+    using namespace llvm::support::endian;
+    ResultHeader header;
+    header.keyID = read64le(data + 0);
+    header.signature = read64le(data + 8);
+    header.builtAt = read64le(data + 16);
+    header.computedAt = read64le(data + 24);
+    header.start = read64le(data + 32);
+    header.end = read64le(data + 40);
+    header.peakRSS = read64le(data + 48);
+    header.valueSize = read32le(data + 56);
+    header.numDependencies = read32le(data + 60);
+    return header;
+  }
+};
+
+static uint64_t doubleToBits(double value) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+static double bitsToDouble(uint64_t bits) {
+  double value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+class BinaryBuildDB : public BuildDB {
+  /// Version History:
+  /// * 2: Add the peak RSS of the command which produced the result.
+  /// * 1: Initial version.
+  static const uint32_t currentFormatVersion = 2;
+
+  static constexpr const char fileMagic[9] = "llbuilDB";
+  static constexpr size_t fileHeaderSize = 16;
+  static constexpr size_t recordHeaderSize = 16;
+
+  /// The size of the write buffer at which it is flushed to the file.
+  static constexpr size_t maxWriteBufferSize = 1 << 20;
+
+  /// The maximum amount of time written records may remain buffered while a
+  /// build is running.
+  const std::chrono::milliseconds maxWriteBufferDuration{1000};
+
+  /// The minimum size of the log before it is considered for compaction.
+  static constexpr uint64_t minCompactionSize = 1 << 20;
+
+  std::string path;
+  uint32_t clientSchemaVersion;
+  /// If this is `true`, the database will be re-created if the client/schema
+  /// version mismatches. If `false`, it will not be re-created but returns an
+  /// error instead.
+  bool recreateOnUnmatchedVersion;
+
+  /// The mutex to protect all access to the database.
+  std::mutex dbMutex;
+
+  /// The delegate pointer
+  BuildDBDelegate* delegate = nullptr;
+
+  /// The open file, or -1 if the database has not been opened.
+  int fd = -1;
+
+  /// The open lock file, or -1 if the lock is not held, \see acquireLock().
+  int lockFD = -1;
+
+  /// The mapping of the file, which is remapped whenever the file grows so
+  /// that it always covers the whole file.
+  std::unique_ptr<llvm::sys::fs::mapped_file_region> mapping;
+
+  /// The size of the file (not including the write buffer).
+  uint64_t fileSize = 0;
+
+  /// Records which have been appended, but not yet written to the file.
+  std::string writeBuffer;
+
+  /// The time at which the write buffer was last flushed.
+  std::chrono::steady_clock::time_point lastFlushTime;
+
+  /// The current iteration.
+  uint64_t iteration = 0;
+
+  /// The offset of the payload of each key record, indexed by key ID.
+  std::vector<uint64_t> keyOffsets;
+
+  /// The offset of the payload of the latest result record for each key (or
+  /// zero), indexed by key ID.
+  std::vector<uint64_t> resultOffsets;
+
+  /// The number of bytes in the log used by superseded records.
+  uint64_t deadBytes = 0;
+
+  /// Map of engine KeyIDs to database key IDs.
+  llvm::DenseMap<KeyID, uint64_t> dbKeyIDs;
+
+  /// Map of database key IDs to engine KeyIDs, for the first
+  /// `engineKeyIDs.size()` keys (\see resolveKeys()).
+  std::vector<KeyID> engineKeyIDs;
+
+  std::string getErrorMessage(const Twine& message) {
+    return ("error: accessing build database \"" + path + "\": " +
+            message).str();
+  }
+
+  /// Take the lock which excludes all other writers, until \see releaseLock().
+  ///
+  /// \param wouldBlock_out Set if the lock is held by another connection.
+  bool acquireLock(std::string *error_out, bool* wouldBlock_out = nullptr) {
+    assert(lockFD == -1 && "lock is already held");
+
+    int lockFile;
+    auto ec = llvm::sys::fs::openFileForReadWrite(
+        path + "-lock", lockFile, llvm::sys::fs::CD_OpenAlways,
+        llvm::sys::fs::OF_None);
+    if (ec) {
+      *error_out = getErrorMessage("unable to open lock file: " +
+                                   ec.message());
+      return false;
+    }
+    if (basic::sys::tryLockFile(lockFile) != 0) {
+      int err = errno;
+      basic::sys::close(lockFile);
+      if (wouldBlock_out)
+        *wouldBlock_out = err == EWOULDBLOCK;
+      if (err == EWOULDBLOCK) {
+        *error_out = getErrorMessage(
+            "database is locked Possibly there are two concurrent builds "
+            "running in the same filesystem location.");
+      } else {
+        *error_out = getErrorMessage("unable to lock database: " +
+                                     basic::sys::strerror(err));
+      }
+      return false;
+    }
+    lockFD = lockFile;
+    return true;
+  }
+
+  /// Release the lock taken by \see acquireLock(), if held.
+  void releaseLock() {
+    if (lockFD == -1)
+      return;
+    (void)basic::sys::unlockFile(lockFD);
+    basic::sys::close(lockFD);
+    lockFD = -1;
+  }
+
+  /// Make sure this connection holds the lock, so that it may modify the log.
+  ///
+  /// If the database was opened without the lock, it is reopened, since the
+  /// log may have been modified by another writer in the meantime.
+  bool ensureLocked(std::string *error_out) {
+    if (lockFD != -1)
+      return open(error_out);
+
+    if (!acquireLock(error_out))
+      return false;
+    close();
+    if (!open(error_out)) {
+      releaseLock();
+      return false;
+    }
+    return true;
+  }
+
+  static size_t alignedSize(size_t size) {
+    return (size + 7) & ~size_t(7);
+  }
+
+  static uint32_t computeChecksum(RecordKind kind, StringRef payload) {
+    char header[8];
+    llvm::support::endian::write32le(header, uint32_t(kind));
+    llvm::support::endian::write32le(header + 4, uint32_t(payload.size()));
+    return llvm::djbHash(payload, llvm::djbHash(StringRef(header, 8)));
+  }
+
+  /// Get the data at the given offset in the log.
+  ///
+  /// The result is only valid until the next modification of the database.
+  const char* getData(uint64_t offset, uint64_t size) {
+    if (offset >= fileSize) {
+      assert(offset - fileSize + size <= writeBuffer.size());
+      return writeBuffer.data() + (offset - fileSize);
+    }
+    assert(offset + size <= fileSize);
+    return mapping->const_data() + offset;
+  }
+
+  /// Map the whole file.
+  bool remap(std::string *error_out) {
+    mapping.reset();
+    std::error_code ec;
+    auto region = llvm::make_unique<llvm::sys::fs::mapped_file_region>(
+        fd, llvm::sys::fs::mapped_file_region::readonly, fileSize, 0, ec);
+    if (ec) {
+      *error_out = getErrorMessage("unable to map file: " + ec.message());
+      return false;
+    }
+    mapping = std::move(region);
+    return true;
+  }
+
+  /// Append a record to the log.
+  ///
+  /// \returns The offset of the record payload.
+  uint64_t appendRecord(RecordKind kind, StringRef payload) {
+    assert(writeBuffer.size() % 8 == 0);
+    char header[recordHeaderSize] = {};
+    llvm::support::endian::write32le(header, uint32_t(kind));
+    llvm::support::endian::write32le(header + 4, uint32_t(payload.size()));
+    llvm::support::endian::write32le(header + 8,
+                                     computeChecksum(kind, payload));
+    writeBuffer.append(header, recordHeaderSize);
+    uint64_t offset = fileSize + writeBuffer.size();
+    writeBuffer.append(payload.begin(), payload.end());
+    writeBuffer.resize(alignedSize(writeBuffer.size()), '\0');
+    return offset;
+  }
+
+  /// Write any buffered records to the file, and remap it to cover them.
+  ///
+  /// If the file cannot be remapped, the database is closed (to be reopened by
+  /// the next operation), since its records can no longer be read.
+  bool flush(std::string *error_out) {
+    if (writeBuffer.empty())
+      return true;
+
+    size_t pos = 0;
+    while (pos != writeBuffer.size()) {
+      unsigned count = unsigned(std::min(writeBuffer.size() - pos,
+                                         size_t(1) << 30));
+      int result = basic::sys::write(fd, &writeBuffer[pos], count);
+      if (result < 0) {
+        if (errno == EINTR)
+          continue;
+        *error_out = getErrorMessage(basic::sys::strerror(errno));
+        return false;
+      }
+      pos += result;
+    }
+    fileSize += writeBuffer.size();
+    writeBuffer.clear();
+    lastFlushTime = std::chrono::steady_clock::now();
+    if (!remap(error_out)) {
+      close();
+      return false;
+    }
+    return true;
+  }
+
+  /// Flush the written records to disk.
+  bool sync(std::string *error_out) {
+    if (basic::sys::fsync(fd) != 0) {
+      *error_out = getErrorMessage("unable to sync file: " +
+                                   basic::sys::strerror(errno));
+      return false;
+    }
+    return true;
+  }
+
+  /// Flush the write buffer, if it is large or old enough.
+  bool maybeFlush(std::string *error_out) {
+    if (writeBuffer.size() < maxWriteBufferSize &&
+        std::chrono::steady_clock::now() - lastFlushTime <
+        maxWriteBufferDuration)
+      return true;
+    return flush(error_out);
+  }
+
+  /// Reset the file to an empty database.
+  bool resetFile(std::string *error_out) {
+    if (auto ec = llvm::sys::fs::resize_file(fd, 0)) {
+      *error_out = getErrorMessage("unable to truncate file: " +
+                                   ec.message());
+      return false;
+    }
+    mapping.reset();
+    fileSize = 0;
+    writeBuffer.clear();
+
+    char header[fileHeaderSize];
+    memcpy(header, fileMagic, 8);
+    llvm::support::endian::write32le(header + 8, currentFormatVersion);
+    llvm::support::endian::write32le(header + 12, clientSchemaVersion);
+    writeBuffer.append(header, fileHeaderSize);
+    return flush(error_out);
+  }
+
+  bool open(std::string *error_out) {
+    // The db is opened lazily whenever an operation on it occurs. Thus if it is
+    // already open, we don't need to do any further work.
+    if (fd != -1) return true;
+
+    // Take the lock while the log is opened (and possibly recovered), unless
+    // another writer holds it, in which case the log is only read.
+    bool ownsLock = false;
+    std::string lockError;
+    if (lockFD == -1) {
+      bool wouldBlock = false;
+      ownsLock = acquireLock(&lockError, &wouldBlock);
+      if (!ownsLock && !wouldBlock) {
+        *error_out = lockError;
+        return false;
+      }
+    }
+    llbuild_defer {
+      if (ownsLock)
+        releaseLock();
+    };
+    bool readOnly = lockFD == -1;
+
+    auto ec = llvm::sys::fs::openFileForReadWrite(
+        path, fd, llvm::sys::fs::CD_OpenAlways, llvm::sys::fs::OF_Append);
+    if (ec) {
+      fd = -1;
+      *error_out = "unable to open database: " + ec.message();
+      return false;
+    }
+    llvm::sys::fs::file_status status;
+    if ((ec = llvm::sys::fs::status(fd, status))) {
+      *error_out = getErrorMessage(ec.message());
+      close();
+      return false;
+    }
+    fileSize = status.getSize();
+    lastFlushTime = std::chrono::steady_clock::now();
+
+    // Initialize an empty file.
+    if (fileSize == 0) {
+      if (readOnly) {
+        *error_out = lockError;
+        close();
+        return false;
+      }
+      if (!resetFile(error_out)) {
+        close();
+        return false;
+      }
+    } else if (!remap(error_out)) {
+      close();
+      return false;
+    }
+
+    // Check the header, and recreate the database if it doesn't match.
+    const char* data = mapping->const_data();
+    uint32_t version = 0, clientVersion = 0;
+    bool validMagic = fileSize >= fileHeaderSize &&
+      memcmp(data, fileMagic, 8) == 0;
+    if (validMagic) {
+      version = llvm::support::endian::read32le(data + 8);
+      clientVersion = llvm::support::endian::read32le(data + 12);
+    }
+    if (!validMagic || version != currentFormatVersion ||
+        clientVersion != clientSchemaVersion) {
+      if (!recreateOnUnmatchedVersion) {
+        // We don't re-create the database in this case and return an error
+        *error_out = ("Version mismatch. (database-schema: " +
+                      std::to_string(version) + " requested schema: " +
+                      std::to_string(currentFormatVersion) +
+                      ". database-client: " + std::to_string(clientVersion) +
+                      " requested client: " +
+                      std::to_string(clientSchemaVersion) + ")");
+        close();
+        return false;
+      }
+
+      if (readOnly) {
+        *error_out = lockError;
+        close();
+        return false;
+      }
+      if (!resetFile(error_out)) {
+        close();
+        return false;
+      }
+    }
+
+    // Scan the log to build the index.
+    if (!scan(error_out)) {
+      close();
+      return false;
+    }
+
+    return true;
+  }
+
+  /// Scan the records in the log, truncating any invalid tail if the lock is
+  /// held (otherwise, it may be a record which is still being written).
+  bool scan(std::string *error_out) {
+    iteration = 0;
+    keyOffsets.assign(1, 0);
+    resultOffsets.assign(1, 0);
+    deadBytes = 0;
+
+    const char* data = mapping->const_data();
+    uint64_t offset = fileHeaderSize;
+    while (offset != fileSize) {
+      // Validate the record.
+      if (fileSize - offset < recordHeaderSize)
+        break;
+      auto kind = RecordKind(llvm::support::endian::read32le(data + offset));
+      uint32_t size = llvm::support::endian::read32le(data + offset + 4);
+      uint32_t checksum = llvm::support::endian::read32le(data + offset + 8);
+      uint64_t payloadOffset = offset + recordHeaderSize;
+      if (fileSize - payloadOffset < alignedSize(size))
+        break;
+      StringRef payload(data + payloadOffset, size);
+      if (checksum != computeChecksum(kind, payload))
+        break;
+
+      // Apply the record.
+      bool valid = true;
+      switch (kind) {
+      case RecordKind::Key:
+        keyOffsets.push_back(payloadOffset);
+        resultOffsets.push_back(0);
+        break;
+      case RecordKind::Result: {
+        if (size < ResultHeader::size) {
+          valid = false;
+          break;
+        }
+        auto header = ResultHeader::read(payload.data());
+        if (header.keyID == 0 || header.keyID >= keyOffsets.size() ||
+            ResultHeader::size + header.numDependencies * 8ULL +
+            header.valueSize != size) {
+          valid = false;
+          break;
+        }
+        // Every dependency must refer to a key recorded before the result.
+        for (uint32_t i = 0; i != header.numDependencies; ++i) {
+          uint64_t raw = llvm::support::endian::read64le(
+              payload.data() + ResultHeader::size + i * 8);
+          if ((raw >> 1) == 0 || (raw >> 1) >= keyOffsets.size()) {
+            valid = false;
+            break;
+          }
+        }
+        if (!valid)
+          break;
+        if (auto previous = resultOffsets[header.keyID])
+          deadBytes += getRecordSize(previous);
+        resultOffsets[header.keyID] = payloadOffset;
+        break;
+      }
+      case RecordKind::Iteration:
+        if (size != 8) {
+          valid = false;
+          break;
+        }
+        if (iteration != 0)
+          deadBytes += recordHeaderSize + 8;
+        iteration = llvm::support::endian::read64le(payload.data());
+        break;
+      default:
+        valid = false;
+        break;
+      }
+      if (!valid)
+        break;
+
+      offset = payloadOffset + alignedSize(size);
+    }
+
+    // If the log ends with an invalid record, truncate it.
+    if (offset != fileSize && lockFD == -1) {
+      fileSize = offset;
+    } else if (offset != fileSize) {
+      if (auto ec = llvm::sys::fs::resize_file(fd, offset)) {
+        *error_out = getErrorMessage("unable to truncate file: " +
+                                     ec.message());
+        return false;
+      }
+      fileSize = offset;
+      if (!remap(error_out))
+        return false;
+    }
+
+    return true;
+  }
+
+  /// Get the total size of the record with the payload at the given offset.
+  uint64_t getRecordSize(uint64_t payloadOffset) {
+    uint32_t size = llvm::support::endian::read32le(
+        getData(payloadOffset - recordHeaderSize + 4, 4));
+    return recordHeaderSize + alignedSize(size);
+  }
+
+  void close() {
+    if (fd == -1) return;
+
+    mapping.reset();
+    basic::sys::close(fd);
+    fd = -1;
+    fileSize = 0;
+    writeBuffer.clear();
+    keyOffsets.clear();
+    resultOffsets.clear();
+    dbKeyIDs.clear();
+    engineKeyIDs.clear();
+  }
+
+  /// Map any keys in the database which have not yet been mapped to engine
+  /// KeyIDs.
+  void resolveKeys() {
+    assert(delegate != nullptr);
+    if (engineKeyIDs.empty())
+      engineKeyIDs.push_back(KeyID::novalue());
+    for (uint64_t id = engineKeyIDs.size(); id != keyOffsets.size(); ++id) {
+      auto key = getKeyForID(id);
+      auto keyID = delegate->getKeyID(KeyType(key.data(), key.size()));
+      engineKeyIDs.push_back(keyID);
+      dbKeyIDs[keyID] = id;
+    }
+  }
+
+  /// Get the key for a database key ID.
+  ///
+  /// The result is only valid until the next modification of the database.
+  StringRef getKeyForID(uint64_t id) {
+    uint64_t offset = keyOffsets[id];
+    uint32_t size = llvm::support::endian::read32le(
+        getData(offset - recordHeaderSize + 4, 4));
+    return StringRef(getData(offset, size), size);
+  }
+
+  /// Get the database key ID for an engine KeyID, adding the key if necessary.
+  uint64_t getOrAddKeyID(KeyID keyID) {
+    auto it = dbKeyIDs.find(keyID);
+    if (it != dbKeyIDs.end())
+      return it->second;
+
+    auto key = delegate->getKeyForID(keyID);
+    keyOffsets.push_back(appendRecord(RecordKind::Key, key));
+    resultOffsets.push_back(0);
+    uint64_t id = keyOffsets.size() - 1;
+    assert(engineKeyIDs.size() == id);
+    engineKeyIDs.push_back(keyID);
+    dbKeyIDs[keyID] = id;
+    return id;
+  }
+
+  /// Find the offset of the result record for an engine KeyID, if any.
+  uint64_t findResult(KeyID keyID) {
+    resolveKeys();
+    auto it = dbKeyIDs.find(keyID);
+    if (it == dbKeyIDs.end())
+      return 0;
+    return resultOffsets[it->second];
+  }
+
+  /// Read the result record at the given offset.
+  void readResult(uint64_t offset, Result* result_out, bool includeValue) {
+    auto header = ResultHeader::read(getData(offset, ResultHeader::size));
+    result_out->signature = basic::CommandSignature(header.signature);
+    result_out->builtAt = header.builtAt;
+    result_out->computedAt = header.computedAt;
+    result_out->start = bitsToDouble(header.start);
+    result_out->end = bitsToDouble(header.end);
+    result_out->peakRSS = header.peakRSS;
+
+    const char* dependencies = getData(offset + ResultHeader::size,
+                                       header.numDependencies * 8ULL);
+    result_out->dependencies.resize(header.numDependencies);
+    for (uint32_t i = 0; i != header.numDependencies; ++i) {
+      uint64_t raw = llvm::support::endian::read64le(dependencies + i * 8);
+      result_out->dependencies.set(i, engineKeyIDs[raw >> 1], raw & 1);
+    }
+
+    if (includeValue)
+      readValue(offset, &result_out->value);
+  }
+
+  /// Read the value of the result record at the given offset.
+  void readValue(uint64_t offset, ValueType* value_out) {
+    auto header = ResultHeader::read(getData(offset, ResultHeader::size));
+    uint64_t valueOffset = (offset + ResultHeader::size +
+                            header.numDependencies * 8ULL);
+    const char* value = getData(valueOffset, header.valueSize);
+    value_out->assign(value, value + header.valueSize);
+  }
+
+  /// Rewrite the log with only its live records, if enough of it is dead.
+  bool maybeCompact(std::string *error_out) {
+    uint64_t size = fileSize + writeBuffer.size();
+    if (size < minCompactionSize || deadBytes * 2 < size)
+      return true;
+
+    // Write the new log to a temporary file, which then replaces the current
+    // one. Keys are written in order, so that they retain their IDs.
+    std::string compactPath = path + ".compact";
+    int compactFD;
+    auto ec = llvm::sys::fs::openFileForWrite(compactPath, compactFD);
+    if (ec) {
+      *error_out = getErrorMessage("unable to compact: " + ec.message());
+      return false;
+    }
+    llvm::raw_fd_ostream os(compactFD, /*shouldClose=*/true);
+
+    auto writeRecord = [&](RecordKind kind, StringRef payload) {
+      char header[recordHeaderSize] = {};
+      llvm::support::endian::write32le(header, uint32_t(kind));
+      llvm::support::endian::write32le(header + 4, uint32_t(payload.size()));
+      llvm::support::endian::write32le(header + 8,
+                                       computeChecksum(kind, payload));
+      os.write(header, recordHeaderSize);
+      os << payload;
+      os.write_zeros(alignedSize(payload.size()) - payload.size());
+    };
+
+    char header[fileHeaderSize];
+    memcpy(header, fileMagic, 8);
+    llvm::support::endian::write32le(header + 8, currentFormatVersion);
+    llvm::support::endian::write32le(header + 12, clientSchemaVersion);
+    os.write(header, fileHeaderSize);
+    for (uint64_t id = 1; id != keyOffsets.size(); ++id)
+      writeRecord(RecordKind::Key, getKeyForID(id));
+    char iterationData[8];
+    llvm::support::endian::write64le(iterationData, iteration);
+    writeRecord(RecordKind::Iteration, StringRef(iterationData, 8));
+    for (uint64_t id = 1; id != resultOffsets.size(); ++id) {
+      if (uint64_t offset = resultOffsets[id]) {
+        uint32_t size = llvm::support::endian::read32le(
+            getData(offset - recordHeaderSize + 4, 4));
+        writeRecord(RecordKind::Result,
+                    StringRef(getData(offset, size), size));
+      }
+    }
+    // Make sure the new log is on disk before it replaces the current one.
+    os.flush();
+    bool synced = !os.has_error() && basic::sys::fsync(compactFD) == 0;
+    os.close();
+    if (os.has_error() || !synced) {
+      os.clear_error();
+      llvm::sys::fs::remove(compactPath);
+      *error_out = getErrorMessage("unable to write compacted database");
+      return false;
+    }
+
+    // Replace the log, and reopen it.
+    if ((ec = llvm::sys::fs::rename(compactPath, path))) {
+      llvm::sys::fs::remove(compactPath);
+      *error_out = getErrorMessage("unable to compact: " + ec.message());
+      return false;
+    }
+    std::string directory = llvm::sys::path::parent_path(path);
+    if (directory.empty())
+      directory = ".";
+    bool directorySynced = basic::sys::syncDirectory(directory.c_str()) == 0;
+    int syncErrno = errno;
+    auto keyIDs = std::move(engineKeyIDs);
+    close();
+    if (!open(error_out))
+      return false;
+
+    // Restore the key mappings, which are unchanged.
+    engineKeyIDs = std::move(keyIDs);
+    for (uint64_t id = 1; id < engineKeyIDs.size(); ++id)
+      dbKeyIDs[engineKeyIDs[id]] = id;
+
+    if (!directorySynced) {
+      *error_out = getErrorMessage("unable to sync directory: " +
+                                   basic::sys::strerror(syncErrno));
+      return false;
+    }
+    return true;
+  }
+
+public:
+  BinaryBuildDB(StringRef path, uint32_t clientSchemaVersion,
+                bool recreateOnUnmatchedVersion)
+    : path(path), clientSchemaVersion(clientSchemaVersion),
+      recreateOnUnmatchedVersion(recreateOnUnmatchedVersion) { }
+
+  virtual ~BinaryBuildDB() {
+    std::lock_guard<std::mutex> guard(dbMutex);
+    if (fd != -1) {
+      std::string error;
+      (void)flush(&error);
+    }
+    close();
+    releaseLock();
+  }
+
+  /// @name BuildDB API
+  /// @{
+
+  virtual void attachDelegate(BuildDBDelegate* delegate) override {
+    std::lock_guard<std::mutex> guard(dbMutex);
+    this->delegate = delegate;
+    dbKeyIDs.clear();
+    engineKeyIDs.clear();
+  }
+
+  virtual Epoch getCurrentEpoch(bool* success_out,
+                                std::string *error_out) override {
+    std::lock_guard<std::mutex> guard(dbMutex);
+
+    if (!open(error_out)) {
+      *success_out = false;
+      return 0;
+    }
+
+    *success_out = true;
+    return iteration;
+  }
+
+  virtual bool setCurrentIteration(uint64_t value,
+                                   std::string *error_out) override {
+    std::lock_guard<std::mutex> guard(dbMutex);
+
+    if (!ensureLocked(error_out))
+      return false;
+
+    char data[8];
+    llvm::support::endian::write64le(data, value);
+    appendRecord(RecordKind::Iteration, StringRef(data, 8));
+    if (iteration != 0)
+      deadBytes += recordHeaderSize + 8;
+    iteration = value;
+    return maybeFlush(error_out);
+  }
+
+  virtual bool lookupRuleResult(KeyID keyID, const KeyType& key,
+                                Result* result_out,
+                                std::string *error_out) override {
+    assert(delegate != nullptr);
+    std::lock_guard<std::mutex> guard(dbMutex);
+    assert(result_out->builtAt == 0);
+
+    if (!open(error_out))
+      return false;
+
+    uint64_t offset = findResult(keyID);
+    if (!offset)
+      return false;
+    readResult(offset, result_out, /*includeValue=*/true);
+    return true;
+  }
+
+  virtual bool lookupRuleResultWithoutValue(KeyID keyID, const KeyType& key,
+                                            Result* result_out,
+                                            bool* valueLoaded_out,
+                                            std::string *error_out) override {
+    assert(delegate != nullptr);
+    std::lock_guard<std::mutex> guard(dbMutex);
+    assert(result_out->builtAt == 0);
+    *valueLoaded_out = false;
+
+    if (!open(error_out))
+      return false;
+
+    uint64_t offset = findResult(keyID);
+    if (!offset)
+      return false;
+    readResult(offset, result_out, /*includeValue=*/false);
+    return true;
+  }
+
+  virtual bool lookupRuleResultValue(KeyID keyID, const KeyType& key,
+                                     ValueType* value_out,
+                                     std::string *error_out) override {
+    assert(delegate != nullptr);
+    std::lock_guard<std::mutex> guard(dbMutex);
+
+    if (!open(error_out))
+      return false;
+
+    uint64_t offset = findResult(keyID);
+    if (!offset)
+      return false;
+    readValue(offset, value_out);
+    return true;
+  }
+
+  virtual bool setRuleResult(KeyID keyID,
+                             const Rule& rule,
+                             const Result& ruleResult,
+                             std::string *error_out) override {
+    assert(delegate != nullptr);
+    std::lock_guard<std::mutex> guard(dbMutex);
+
+    if (!ensureLocked(error_out))
+      return false;
+
+    // Map the keys, adding any new ones.
+    resolveKeys();
+    uint64_t id = getOrAddKeyID(keyID);
+    std::vector<uint64_t> dependencyIDs;
+    dependencyIDs.reserve(ruleResult.dependencies.size());
+    for (auto keyIDAndFlag: ruleResult.dependencies) {
+      dependencyIDs.push_back((getOrAddKeyID(keyIDAndFlag.keyID) << 1) +
+                              keyIDAndFlag.flag);
+    }
+
+    // Encode the result.
+    ResultHeader header;
+    header.keyID = id;
+    header.signature = ruleResult.signature.value;
+    header.builtAt = ruleResult.builtAt;
+    header.computedAt = ruleResult.computedAt;
+    header.start = doubleToBits(ruleResult.start);
+    header.end = doubleToBits(ruleResult.end);
+    header.peakRSS = ruleResult.peakRSS;
+    header.valueSize = ruleResult.value.size();
+    header.numDependencies = dependencyIDs.size();
+    std::string payload(ResultHeader::size + dependencyIDs.size() * 8 +
+                        ruleResult.value.size(), '\0');
+    header.write(&payload[0]);
+    for (size_t i = 0; i != dependencyIDs.size(); ++i) {
+      llvm::support::endian::write64le(
+          &payload[ResultHeader::size + i * 8], dependencyIDs[i]);
+    }
+    if (!ruleResult.value.empty()) {
+      memcpy(&payload[ResultHeader::size + dependencyIDs.size() * 8],
+             ruleResult.value.data(), ruleResult.value.size());
+    }
+
+    // Append it, superseding any previous result.
+    if (auto previous = resultOffsets[id])
+      deadBytes += getRecordSize(previous);
+    resultOffsets[id] = appendRecord(RecordKind::Result, payload);
+
+    return maybeFlush(error_out);
+  }
+
+  virtual bool buildStarted(std::string *error_out) override {
+    std::lock_guard<std::mutex> guard(dbMutex);
+
+    return ensureLocked(error_out);
+  }
+
+  virtual void buildComplete() override {
+    std::lock_guard<std::mutex> guard(dbMutex);
+
+    // Let other builds start once the results are written.
+    llbuild_defer { releaseLock(); };
+
+    if (fd == -1) return;
+
+    // Write the results to disk, and compact the log if it has accumulated
+    // enough superseded records. Any results which could not be written will
+    // be rebuilt.
+    std::string error;
+    if (!flush(&error) || !sync(&error) || !maybeCompact(&error)) {
+      if (delegate)
+        delegate->error("unable to write build results (" + error + ")");
+    }
+  }
+
+  virtual bool getKeys(std::vector<KeyType>& keys_out,
+                       std::string* error_out) override {
+    std::lock_guard<std::mutex> guard(dbMutex);
+
+    if (!open(error_out))
+      return false;
+
+    for (uint64_t id = 1; id != keyOffsets.size(); ++id) {
+      auto key = getKeyForID(id);
+      keys_out.push_back(KeyType(key.data(), key.size()));
+    }
+    return true;
+  }
+
+  bool getKeysWithResult(std::vector<KeyType> &keys_out,
+                         std::vector<Result> &results_out,
+                         std::string* error_out) override {
+    assert(delegate != nullptr);
+    std::lock_guard<std::mutex> guard(dbMutex);
+
+    if (!open(error_out))
+      return false;
+
+    resolveKeys();
+    for (uint64_t id = 1; id != resultOffsets.size(); ++id) {
+      if (uint64_t offset = resultOffsets[id]) {
+        auto key = getKeyForID(id);
+        keys_out.push_back(KeyType(key.data(), key.size()));
+        Result result;
+        readResult(offset, &result, /*includeValue=*/true);
+        results_out.push_back(std::move(result));
+      }
+    }
+    return true;
+  }
+
+  virtual void dump(raw_ostream& os) override {
+    std::lock_guard<std::mutex> guard(dbMutex);
+
+    std::string error;
+    if (!open(&error)) {
+      os << "error: " << error << "\n";
+      return;
+    }
+
+    os << "keys:\n";
+    for (uint64_t id = 1; id != keyOffsets.size(); ++id)
+      os << id << " -- " << getKeyForID(id) << "\n";
+
+    os << "\nresults:\n";
+    for (uint64_t id = 1; id != resultOffsets.size(); ++id) {
+      if (uint64_t offset = resultOffsets[id]) {
+        auto header = ResultHeader::read(getData(offset, ResultHeader::size));
+        os << id << " -- " << header.builtAt << ", " << header.computedAt
+           << ", " << bitsToDouble(header.end) - bitsToDouble(header.start)
+           << "s\n";
+      }
+    }
+  }
+
+  /// @}
+};
+
+constexpr const char BinaryBuildDB::fileMagic[9];
+
+}
+
+std::unique_ptr<BuildDB> core::createBinaryBuildDB(
+    StringRef path, uint32_t clientSchemaVersion,
+    bool recreateUnmatchedVersion, std::string *error_out) {
+  return llvm::make_unique<BinaryBuildDB>(path, clientSchemaVersion,
+                                          recreateUnmatchedVersion);
+}
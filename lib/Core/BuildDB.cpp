@@ -12,9 +12,44 @@
 
 #include "llbuild/Core/BuildDB.h"
 
+#include "llvm/Support/ErrorHandling.h"
+
 using namespace llbuild;
 using namespace llbuild::core;
 
 BuildDBDelegate::~BuildDBDelegate() { }
 
+void BuildDBDelegate::error(const Twine& message) { }
+
 BuildDB::~BuildDB() { }
+
+bool core::parseBuildDBFormat(StringRef name, BuildDBFormat* format_out) {
+  if (name == "sqlite") {
+    *format_out = BuildDBFormat::SQLite;
+    return true;
+  }
+  if (name == "binary") {
+    *format_out = BuildDBFormat::Binary;
+    return true;
+  }
+  return false;
+}
+
+std::unique_ptr<BuildDB> core::createBuildDB(BuildDBFormat format,
+                                             StringRef path,
+                                             uint32_t clientSchemaVersion,
+                                             bool recreateUnmatchedVersion,
+                                             std::string* error_out,
+                                             bool writeBehind,
+                                             bool compress) {
+  switch (format) {
+  case BuildDBFormat::SQLite:
+    return createSQLiteBuildDB(path, clientSchemaVersion,
+                               recreateUnmatchedVersion, error_out,
+                               writeBehind, compress);
+  case BuildDBFormat::Binary:
+    return createBinaryBuildDB(path, clientSchemaVersion,
+                               recreateUnmatchedVersion, error_out);
+  }
+  llvm_unreachable("unknown build database format");
+}
@@ -17,16 +17,21 @@
 #include "llbuild/Core/BuildDB.h"
 #include "llbuild/Core/KeyID.h"
 
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/ADT/StringMap.h"
+#include "llvm/Support/raw_ostream.h"
 
 #include "BuildEngineTrace.h"
 
 #include <atomic>
 #include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <cstdio>
 #include <condition_variable>
+#include <deque>
 #include <iostream>
 #include <memory>
 #include <mutex>
@@ -35,6 +40,12 @@
 #include <unordered_set>
 #include <vector>
 
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 using namespace llbuild;
 using namespace llbuild::core;
 
@@ -48,14 +59,145 @@ bool BuildEngineDelegate::shouldResolveCycle(const std::vector<Rule*>& items,
   return false;
 }
 
+void BuildEngineStatistics::writeJSON(raw_ostream& os) const {
+  os << "{\n"
+     << "  \"rules_scanned\": " << numRulesScanned << ",\n"
+     << "  \"rules_up_to_date\": " << numRulesUpToDate << ",\n"
+     << "  \"tasks_created\": " << numTasksCreated << ",\n"
+     << "  \"input_requests\": " << numInputRequests << ",\n"
+     << "  \"input_requests_paused\": " << numInputRequestsPaused << ",\n"
+     << "  \"db_lookups\": " << numDBLookups << ",\n"
+     << "  \"db_writes\": " << numDBWrites << ",\n"
+     << "  \"db_time_us\": " << dbTime << ",\n"
+     << "  \"rule_lookups\": " << numRuleLookups << ",\n"
+     << "  \"rule_lookup_time_us\": " << ruleLookupTime << ",\n"
+     << "  \"peak_rules\": " << peakRules << ",\n"
+     << "  \"max_rules_to_scan\": " << maxRulesToScan << ",\n"
+     << "  \"max_input_requests\": " << maxInputRequests << ",\n"
+     << "  \"max_finished_input_requests\": " << maxFinishedInputRequests
+     << ",\n"
+     << "  \"max_ready_tasks\": " << maxReadyTasks << ",\n"
+     << "  \"max_outstanding_tasks\": " << maxOutstandingTasks << ",\n"
+     << "  \"max_outstanding_validations\": " << maxOutstandingValidations
+     << "\n"
+     << "}\n";
+}
+
 #pragma mark - BuildEngine implementation
 
 namespace {
 
+/// An event used to wake the engine thread when work is delivered to it from
+/// other threads.
+///
+/// Producers bump a sequence number when they deliver work; the engine samples
+/// the sequence number *before* checking its queues, and then only sleeps if
+/// it is unchanged. Signalling is free (no system call, no lock) unless the
+/// engine is actually asleep. On Linux this waits on the sequence number
+/// directly with a futex, elsewhere it falls back to a condition variable.
+class EngineWakeupEvent {
+  std::atomic<uint32_t> sequence{0};
+  std::atomic<uint32_t> numWaiters{0};
+#if !defined(__linux__)
+  std::mutex mutex;
+  std::condition_variable condition;
+#endif
+
+public:
+  /// Get the token to pass to \see wait(), which must be retrieved before
+  /// checking for available work.
+  uint32_t prepareWait() const {
+    return sequence.load();
+  }
+
+  /// Wait until the event has been signalled since \arg token was retrieved.
+  void wait(uint32_t token) {
+#if defined(__linux__)
+    ++numWaiters;
+    while (sequence.load() == token) {
+      syscall(SYS_futex, &sequence, FUTEX_WAIT_PRIVATE, token,
+              nullptr, nullptr, 0);
+    }
+    --numWaiters;
+#else
+    std::unique_lock<std::mutex> lock(mutex);
+    ++numWaiters;
+    condition.wait(lock, [&] { return sequence.load() != token; });
+    --numWaiters;
+#endif
+  }
+
+  /// Signal the event, waking the waiter (if any).
+  void signal() {
+    ++sequence;
+    if (numWaiters.load() == 0)
+      return;
+#if defined(__linux__)
+    syscall(SYS_futex, &sequence, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+#else
+    { std::lock_guard<std::mutex> guard(mutex); }
+    condition.notify_one();
+#endif
+  }
+};
+
+/// Accumulates the time spent in a scope into a statistic, in nanoseconds.
+class StatisticTimer {
+  std::atomic<uint64_t>& statistic;
+  std::chrono::steady_clock::time_point start;
+
+public:
+  StatisticTimer(std::atomic<uint64_t>& statistic)
+      : statistic(statistic), start(std::chrono::steady_clock::now()) {}
+
+  ~StatisticTimer() {
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    statistic.fetch_add(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(),
+        std::memory_order_relaxed);
+  }
+};
+
 class BuildEngineImpl : public BuildDBDelegate {
   struct RuleInfo;
   struct TaskInfo;
 
+  /// The engine statistics, \see BuildEngine::getStatistics().
+  ///
+  /// These are only written by the engine thread (with the exception of the
+  /// timers), but may be read from any thread, so the counters do not need
+  /// atomic read-modify-write operations.
+  struct Statistics {
+    std::atomic<uint64_t> numRulesScanned{0};
+    std::atomic<uint64_t> numRulesUpToDate{0};
+    std::atomic<uint64_t> numTasksCreated{0};
+    std::atomic<uint64_t> numInputRequests{0};
+    std::atomic<uint64_t> numInputRequestsPaused{0};
+    std::atomic<uint64_t> numDBLookups{0};
+    std::atomic<uint64_t> numDBWrites{0};
+    std::atomic<uint64_t> dbTimeNS{0};
+    std::atomic<uint64_t> numRuleLookups{0};
+    std::atomic<uint64_t> ruleLookupTimeNS{0};
+    std::atomic<uint64_t> peakRules{0};
+    std::atomic<uint64_t> maxRulesToScan{0};
+    std::atomic<uint64_t> maxInputRequests{0};
+    std::atomic<uint64_t> maxFinishedInputRequests{0};
+    std::atomic<uint64_t> maxReadyTasks{0};
+    std::atomic<uint64_t> maxOutstandingTasks{0};
+    std::atomic<uint64_t> maxOutstandingValidations{0};
+
+    /// Increment a statistic (which only has a single writer).
+    static void increment(std::atomic<uint64_t>& statistic) {
+      statistic.store(statistic.load(std::memory_order_relaxed) + 1,
+                      std::memory_order_relaxed);
+    }
+
+    static void updateMax(std::atomic<uint64_t>& statistic, uint64_t value) {
+      if (value > statistic.load(std::memory_order_relaxed))
+        statistic.store(value, std::memory_order_relaxed);
+    }
+  } stats;
+
   /// Reserved input ID. May be generated by application, but never vended
   /// to the application if the engine generates it itself).
   static constexpr uintptr_t kMustFollowInputID = ~(uintptr_t)0;
@@ -124,6 +266,9 @@ class BuildEngineImpl : public BuildDBDelegate {
     /// The vector of deferred scan requests, for rules which are waiting on
     /// this one to be scanned.
     std::vector<RuleScanRequest> deferredScanRequests;
+    /// The inputs this rule's scan has been deferred on, \see
+    /// addWaitingOnEdge().
+    std::vector<RuleInfo*> waitingOn;
   };
 
   /// Wrapper for information specific to a single rule.
@@ -156,7 +301,7 @@ class BuildEngineImpl : public BuildDBDelegate {
       Complete
     };
 
-    RuleInfo(KeyID keyID, Rule&& rule) : keyID(keyID), rule(rule) {}
+    RuleInfo(KeyID keyID, Rule&& rule) : keyID(keyID), rule(std::move(rule)) {}
 
     /// The ID for the rule key.
     KeyID keyID;
@@ -174,6 +319,11 @@ class BuildEngineImpl : public BuildDBDelegate {
     /// The current state of the rule.
     StateKind state = StateKind::Incomplete;
     bool wasForced = false;
+    /// Whether the stored result has been loaded from the database.
+    bool isResultLoaded = false;
+    /// Whether the value of the stored result has been loaded from the
+    /// database, which is deferred until it is consumed.
+    bool isValueLoaded = false;
 
   public:
     bool isScanning() const {
@@ -260,20 +410,81 @@ class BuildEngineImpl : public BuildDBDelegate {
     }
   };
 
-  // The map of registered rules.
-  //
-  // NOTE: We currently rely on the unordered_map behavior that ensures that
-  // references to elements are not invalidated by insertion. We will need to
-  // move to an alternate allocation strategy if we switch to DenseMap style
-  // table. This is probably a good idea in any case, because we would benefit
-  // from pool allocating RuleInfo instances.
-  std::unordered_map<KeyID, RuleInfo> ruleInfos;
+  /// Storage for the registered rules.
+  ///
+  /// Rules are allocated densely in fixed size blocks, so that references to
+  /// them are never invalidated by insertion, and are located through an
+  /// open-addressed table mapping each KeyID to the rule's index.
+  class RuleInfoTable {
+    /// The log2 of the number of rules allocated per block.
+    static constexpr unsigned blockShift = 12;
+    static constexpr uint32_t blockSize = 1 << blockShift;
+
+    /// The allocated blocks of rules.
+    std::vector<RuleInfo*> blocks;
+
+    /// The number of rules in the table.
+    uint32_t numRuleInfos = 0;
+
+    /// The map of key IDs to rule indices.
+    llvm::DenseMap<KeyID, uint32_t> indices;
+
+  public:
+    RuleInfoTable() {}
+    RuleInfoTable(const RuleInfoTable&) = delete;
+    ~RuleInfoTable() {
+      for (uint32_t i = 0; i != numRuleInfos; ++i)
+        (*this)[i].~RuleInfo();
+      for (auto* block: blocks)
+        ::operator delete(block);
+    }
+
+    bool empty() const { return numRuleInfos == 0; }
+    uint32_t size() const { return numRuleInfos; }
+
+    RuleInfo& operator[](uint32_t index) {
+      assert(index < numRuleInfos);
+      return blocks[index >> blockShift][index & (blockSize - 1)];
+    }
+    const RuleInfo& operator[](uint32_t index) const {
+      assert(index < numRuleInfos);
+      return blocks[index >> blockShift][index & (blockSize - 1)];
+    }
+
+    /// Find the rule for the given key, if present.
+    RuleInfo* find(KeyID keyID) {
+      auto it = indices.find(keyID);
+      if (it == indices.end())
+        return nullptr;
+      return &(*this)[it->second];
+    }
+
+    /// Insert a new rule for the given key.
+    ///
+    /// \returns The rule for the key, and whether it was newly inserted.
+    std::pair<RuleInfo*, bool> insert(KeyID keyID, Rule&& rule) {
+      auto result = indices.insert({ keyID, numRuleInfos });
+      if (!result.second)
+        return { &(*this)[result.first->second], false };
+
+      // Allocate a new block, if necessary.
+      if ((numRuleInfos & (blockSize - 1)) == 0) {
+        blocks.push_back(static_cast<RuleInfo*>(
+                             ::operator new(sizeof(RuleInfo) * blockSize)));
+      }
+      auto* ruleInfo = &blocks.back()[numRuleInfos & (blockSize - 1)];
+      new (ruleInfo) RuleInfo(keyID, std::move(rule));
+      ++numRuleInfos;
+      return { ruleInfo, true };
+    }
+  };
+
+  /// The registered rules.
+  RuleInfoTable ruleInfos;
 
   /// Information tracked for executing tasks.
-  //
-  // FIXME: Keeping this in a side table is very inefficient, we always have to
-  // look it up. It might make much more sense to require the Task to have a
-  // private field available for our use to store this.
+  ///
+  /// The task info for a task is found via \see Task::engineTaskInfo.
   struct TaskInfo {
     TaskInfo(Task* task) : task(task) {}
 
@@ -290,13 +501,32 @@ class BuildEngineImpl : public BuildDBDelegate {
     //
     // FIXME: As above, this structure has redundancy in it.
     std::vector<RuleScanRequest> deferredScanRequests;
+    /// The inputs this task has waited on, \see addWaitingOnEdge().
+    std::vector<RuleInfo*> waitingOn;
     /// The rule that this task is computing.
     RuleInfo* forRuleInfo = nullptr;
     /// The number of outstanding inputs that this task is waiting on to be
     /// provided.
     unsigned waitCount = 0;
     /// The list of discovered dependencies found during execution of the task.
+    ///
+    /// Access to this must be protected via \see dynamicRequestsMutex.
     AttributedKeyIDs discoveredDependencies;
+    /// The number of outstanding inputs requested after the task started
+    /// computing, which have been taken by the engine but not yet provided.
+    unsigned dynamicWaitCount = 0;
+    /// The next task in the finished task queue.
+    TaskInfo* nextFinished = nullptr;
+    /// The duration of the rule on its last run, in microseconds (or a
+    /// nominal unit, if unknown).
+    uint64_t duration = 1;
+    /// The estimated remaining critical path through this task, i.e. its own
+    /// duration plus that of the most expensive chain of requesters.
+    uint64_t priority = 1;
+    /// The largest peak RSS reported by the task, or zero if none.
+    ///
+    /// Access to this must be protected via \see dynamicRequestsMutex.
+    uint64_t peakRSS = 0;
 
 #ifndef NDEBUG
     void dump() const {
@@ -315,7 +545,9 @@ class BuildEngineImpl : public BuildDBDelegate {
 
   /// The tracked information for executing tasks.
   ///
-  /// Access to this must be protected via \see taskInfosMutex.
+  /// Access to this must be protected via \see taskInfosMutex. Individual
+  /// entries are found via \see Task::engineTaskInfo, which does not require
+  /// the lock.
   std::unordered_map<Task*, TaskInfo> taskInfos;
 
   /// The mutex that protects the task info map.
@@ -327,18 +559,167 @@ class BuildEngineImpl : public BuildDBDelegate {
   /// The number of tasks which have been readied but not yet finished.
   unsigned numOutstandingUnfinishedTasks = 0;
 
-  /// The queue of tasks which are complete, accesses to this member variable
-  /// must be protected via \see finishedTaskInfosMutex.
-  std::vector<TaskInfo*> finishedTaskInfos;
+  /// An input request made by a task after it started computing.
+  struct DynamicInputRequest {
+    /// The task making the request.
+    TaskInfo* taskInfo;
+    /// The task provided input ID.
+    uintptr_t inputID;
+    /// The key which was requested.
+    KeyID keyID;
+  };
+
+  /// The queue of input requests made by computing tasks, from any thread.
+  std::vector<DynamicInputRequest> dynamicInputRequests;
+
+  /// The mutex that protects \see dynamicInputRequests and the discovered
+  /// dependencies and peak RSS of computing tasks.
+  std::mutex dynamicRequestsMutex;
+
+  /// The number of computing tasks with a non-zero \see
+  /// TaskInfo::dynamicWaitCount.
+  ///
+  /// Such tasks are presumed to be unable to complete until their inputs are
+  /// provided, which is used to detect cycles through them.
+  unsigned numTasksAwaitingDynamicInputs = 0;
+
+  /// The queue of tasks which are complete.
+  ///
+  /// This is a lock-free stack (linked via \see TaskInfo::nextFinished) which
+  /// is pushed to from any thread, and which the engine thread drains in its
+  /// entirety into \see takenFinishedTaskInfos. Since the consumer only ever
+  /// takes the whole stack, this is not subject to the ABA problem.
+  std::atomic<TaskInfo*> finishedTaskInfos{nullptr};
+
+  /// The finished tasks which have been taken by the engine thread, but not yet
+  /// processed.
+  TaskInfo* takenFinishedTaskInfos = nullptr;
+
+  /// The event used to wake the engine when work is added to the finished
+  /// queues (\see finishedTaskInfos and \see finishedValidations), or to
+  /// \see dynamicInputRequests.
+  EngineWakeupEvent finishedWorkEvent;
+
+  /// Add a task to the finished queue, from any thread.
+  void enqueueFinishedTaskInfo(TaskInfo* taskInfo) {
+    TaskInfo* head = finishedTaskInfos.load(std::memory_order_relaxed);
+    do {
+      taskInfo->nextFinished = head;
+    } while (!finishedTaskInfos.compare_exchange_weak(
+                 head, taskInfo, std::memory_order_release,
+                 std::memory_order_relaxed));
+    finishedWorkEvent.signal();
+  }
+
+  /// Take the next task from the finished queue, if any.
+  TaskInfo* dequeueFinishedTaskInfo() {
+    if (!takenFinishedTaskInfos) {
+      takenFinishedTaskInfos = finishedTaskInfos.exchange(
+          nullptr, std::memory_order_acquire);
+      if (!takenFinishedTaskInfos)
+        return nullptr;
+    }
+    TaskInfo* taskInfo = takenFinishedTaskInfos;
+    takenFinishedTaskInfos = taskInfo->nextFinished;
+    taskInfo->nextFinished = nullptr;
+    return taskInfo;
+  }
+
+  /// Check if there is any finished work available to the engine.
+  bool hasFinishedWork() {
+    if (takenFinishedTaskInfos ||
+        finishedTaskInfos.load(std::memory_order_acquire))
+      return true;
+    {
+      std::lock_guard<std::mutex> guard(dynamicRequestsMutex);
+      if (!dynamicInputRequests.empty())
+        return true;
+    }
+    std::lock_guard<std::mutex> guard(finishedValidationsMutex);
+    return !finishedValidations.empty();
+  }
+
+  /// Move any dynamic input requests into the regular input request queue.
+  ///
+  /// \returns True if any requests were taken.
+  bool takeDynamicInputRequests() {
+    std::vector<DynamicInputRequest> requests;
+    {
+      std::lock_guard<std::mutex> guard(dynamicRequestsMutex);
+      if (dynamicInputRequests.empty())
+        return false;
+      requests.swap(dynamicInputRequests);
+    }
+
+    for (const auto& request: requests) {
+      TaskInfo* taskInfo = request.taskInfo;
+      assert(taskInfo->forRuleInfo->isInProgressComputing());
+      if (taskInfo->dynamicWaitCount++ == 0)
+        ++numTasksAwaitingDynamicInputs;
+      Statistics::increment(stats.numInputRequests);
+      inputRequests.push_back({ taskInfo, request.inputID,
+                                &getRuleInfoForKey(request.keyID), false,
+                                false });
+    }
+    return true;
+  }
+
+  /// @name Parallel Scanning
+  ///
+  /// When parallel scanning is enabled, the (potentially expensive)
+  /// \see Rule::isResultValid checks are dispatched to a pool of scan worker
+  /// threads. Rules which provide \see Rule::isResultValidAsync are validated
+  /// the same way, regardless of whether parallel scanning is enabled, except
+  /// that they report their own completion. A rule awaiting validation stays in
+  /// the \see RuleInfo::StateKind::IsScanning state with a pending scan record,
+  /// so that requests which depend on it are deferred exactly as they would be
+  /// while its inputs are scanned. The results are then consumed on the engine
+  /// thread, which remains the only thread to transition rule states.
+  ///
+  /// @{
+
+  /// The result of a deferred rule validation.
+  struct RuleValidationResult {
+    /// The rule which was validated.
+    RuleInfo* ruleInfo;
+    /// Whether the prior result of the rule is still valid.
+    bool isValid;
+  };
+
+  /// The scan worker threads, if parallel scanning is enabled.
+  std::vector<std::unique_ptr<std::thread>> scanWorkers;
+
+  /// The number of scan worker threads.
+  unsigned numScanWorkers = 0;
+
+  /// The queue of rules waiting to be validated by a scan worker, accesses to
+  /// this member variable must be protected via \see scanWorkMutex.
+  std::deque<RuleInfo*> scanWorkQueue;
 
-  /// The mutex that protects finished task infos.
-  std::mutex finishedTaskInfosMutex;
+  /// Whether the scan workers should shut down.
+  bool scanWorkersShutdown = false;
 
-  /// This variable is used to signal when additional work is added to the
-  /// FinishedTaskInfos queue, which the engine may need to wait on.
-  std::condition_variable finishedTaskInfosCondition;
+  /// The mutex that protects the scan work queue.
+  std::mutex scanWorkMutex;
 
+  /// This variable is used to signal the scan workers when work is available.
+  std::condition_variable scanWorkCondition;
 
+  /// The rules which need to be validated, but have not yet been dispatched.
+  std::vector<RuleInfo*> ruleInfosToValidate;
+
+  /// The number of rule validations which have been dispatched but not yet
+  /// processed by the engine.
+  unsigned numOutstandingValidations = 0;
+
+  /// The queue of completed validations, accesses to this member variable must
+  /// be protected via \see finishedValidationsMutex.
+  std::vector<RuleValidationResult> finishedValidations;
+
+  /// The mutex that protects the completed validations.
+  std::mutex finishedValidationsMutex;
+
+  /// @}
 
 private:
   /// @name RuleScanRecord Allocation
@@ -396,6 +777,7 @@ private:
     if (freeRuleScanRecords.size() < maximumFreeRuleScanRecords) {
       scanRecord->pausedInputRequests.clear();
       scanRecord->deferredScanRequests.clear();
+      scanRecord->waitingOn.clear();
       freeRuleScanRecords.push_back(scanRecord);
     }
   }
@@ -422,6 +804,10 @@ private:
     // Otherwise, start scanning the rule.
     if (trace)
       trace->checkingRuleNeedsToRun(&ruleInfo.rule);
+    Statistics::increment(stats.numRulesScanned);
+
+    // Make sure we have the information from the prior build.
+    loadRuleResult(ruleInfo);
 
     // Report the status change.
     if (ruleInfo.rule.updateStatus)
@@ -445,17 +831,36 @@ private:
     }
 
     // If the rule indicates its computed value is out of date, it needs to run.
-    //
-    // FIXME: We should probably try and move this so that it can be done by
-    // clients in the background, either by us backgrounding it, or by using a
-    // completion model as we do for inputs.
-    if (ruleInfo.rule.isResultValid &&
-        !ruleInfo.rule.isResultValid(buildEngine, ruleInfo.rule,
-                                     ruleInfo.result.value)) {
-      if (trace)
-        trace->ruleNeedsToRunBecauseInvalidValue(&ruleInfo.rule);
-      ruleInfo.state = RuleInfo::StateKind::NeedsToRun;
-      return true;
+    if (ruleInfo.rule.isResultValid || ruleInfo.rule.isResultValidAsync) {
+      // The check requires the prior value, which must be loaded here as the
+      // engine thread is the only one which may access the database on behalf
+      // of a rule.
+      loadRuleValue(ruleInfo);
+
+      // If we are scanning in parallel, or the rule validates asynchronously,
+      // defer the check and leave the rule in the scanning state until the
+      // result comes back.
+      if (!scanWorkers.empty() || ruleInfo.rule.isResultValidAsync) {
+        ruleInfo.state = RuleInfo::StateKind::IsScanning;
+        ruleInfo.setPendingScanRecord(newRuleScanRecord());
+        if (!scanWorkers.empty()) {
+          ruleInfosToValidate.push_back(&ruleInfo);
+        } else {
+          ++numOutstandingValidations;
+          Statistics::updateMax(stats.maxOutstandingValidations,
+                                numOutstandingValidations);
+          startAsyncRuleValidation(&ruleInfo);
+        }
+        return false;
+      }
+
+      if (!ruleInfo.rule.isResultValid(buildEngine, ruleInfo.rule,
+                                       ruleInfo.result.value)) {
+        if (trace)
+          trace->ruleNeedsToRunBecauseInvalidValue(&ruleInfo.rule);
+        ruleInfo.state = RuleInfo::StateKind::NeedsToRun;
+        return true;
+      }
     }
 
     // If the rule has no dependencies, then it is ready to run.
@@ -481,11 +886,165 @@ private:
     return false;
   }
 
+  /// Process the result of a deferred rule validation.
+  ///
+  /// This completes the portion of \see scanRule() which was deferred while
+  /// the rule was being validated.
+  void processRuleValidationResult(const RuleValidationResult& validation) {
+    auto& ruleInfo = *validation.ruleInfo;
+
+    // The rule may have been cancelled while it was being validated.
+    if (!ruleInfo.isScanning())
+      return;
+
+    if (!validation.isValid) {
+      if (trace)
+        trace->ruleNeedsToRunBecauseInvalidValue(&ruleInfo.rule);
+      finishScanRequest(ruleInfo, RuleInfo::StateKind::NeedsToRun);
+      return;
+    }
+
+    // If the rule has no dependencies, then it is ready to run.
+    if (ruleInfo.result.dependencies.empty()) {
+      if (trace)
+        trace->ruleDoesNotNeedToRun(&ruleInfo.rule);
+      finishScanRequest(ruleInfo, RuleInfo::StateKind::DoesNotNeedToRun);
+      return;
+    }
+
+    // Otherwise, continue with the recursive scan of the inputs.
+    if (trace)
+      trace->ruleScheduledForScanning(&ruleInfo.rule);
+    ruleInfosToScan.push_back({ &ruleInfo, /*InputIndex=*/0, nullptr, false });
+  }
+
+  /// Start an asynchronous validation of the given rule.
+  ///
+  /// The result is delivered to \see finishedValidations when the rule invokes
+  /// the completion, which may happen on any thread.
+  void startAsyncRuleValidation(RuleInfo* ruleInfo) {
+    ruleInfo->rule.isResultValidAsync(
+        buildEngine, ruleInfo->rule, ruleInfo->result.value,
+        [this, ruleInfo](bool isValid) {
+          {
+            std::lock_guard<std::mutex> guard(finishedValidationsMutex);
+            finishedValidations.push_back({ ruleInfo, isValid });
+          }
+          finishedWorkEvent.signal();
+        });
+  }
+
+  /// Dispatch all of the pending rule validations to the scan workers.
+  void dispatchRuleValidations() {
+    numOutstandingValidations += ruleInfosToValidate.size();
+    {
+      std::lock_guard<std::mutex> guard(scanWorkMutex);
+      scanWorkQueue.insert(scanWorkQueue.end(), ruleInfosToValidate.begin(),
+                           ruleInfosToValidate.end());
+    }
+    ruleInfosToValidate.clear();
+    scanWorkCondition.notify_all();
+  }
+
+  /// The body of a scan worker thread.
+  void executeScanWorker() {
+    std::vector<RuleInfo*> batch;
+    std::vector<RuleValidationResult> results;
+    while (true) {
+      // Take a batch of work from the queue.
+      //
+      // We take several items at once to amortize the synchronization cost, but
+      // not so many that the other workers are left idle.
+      {
+        std::unique_lock<std::mutex> lock(scanWorkMutex);
+        while (!scanWorkersShutdown && scanWorkQueue.empty()) {
+          scanWorkCondition.wait(lock);
+        }
+        if (scanWorkersShutdown)
+          return;
+
+        size_t batchSize = std::min<size_t>(
+            64, 1 + scanWorkQueue.size() / numScanWorkers);
+        batch.assign(scanWorkQueue.begin(), scanWorkQueue.begin() + batchSize);
+        scanWorkQueue.erase(scanWorkQueue.begin(),
+                            scanWorkQueue.begin() + batchSize);
+      }
+
+      // Validate each of the rules.
+      //
+      // NOTE: The engine thread will not touch the rule or its result while
+      // the rule is scanning, so it is safe to access them here.
+      results.clear();
+      for (auto* ruleInfo: batch) {
+        // Asynchronous validations report their own results.
+        if (ruleInfo->rule.isResultValidAsync) {
+          startAsyncRuleValidation(ruleInfo);
+          continue;
+        }
+
+        bool isValid = ruleInfo->rule.isResultValid(
+            buildEngine, ruleInfo->rule, ruleInfo->result.value);
+        results.push_back({ ruleInfo, isValid });
+      }
+
+      // Report the results to the engine.
+      if (results.empty())
+        continue;
+      {
+        std::lock_guard<std::mutex> guard(finishedValidationsMutex);
+        finishedValidations.insert(finishedValidations.end(),
+                                   results.begin(), results.end());
+      }
+      finishedWorkEvent.signal();
+    }
+  }
+
+  /// Stop and join all of the scan worker threads.
+  void shutdownScanWorkers() {
+    {
+      std::lock_guard<std::mutex> guard(scanWorkMutex);
+      scanWorkersShutdown = true;
+    }
+    scanWorkCondition.notify_all();
+    for (auto& worker: scanWorkers) {
+      worker->join();
+    }
+    scanWorkers.clear();
+    numScanWorkers = 0;
+    scanWorkersShutdown = false;
+  }
+
+  /// Compute the historical duration of a rule, for use in prioritization.
+  static uint64_t getRuleDuration(const RuleInfo& ruleInfo) {
+    const Result& result = ruleInfo.result;
+    if (result.builtAt == 0 || !(result.end > result.start))
+      return 1;
+    return std::max(uint64_t(1),
+                    uint64_t((result.end - result.start) * 1000000.0));
+  }
+
+  /// Raise the priority of a task on behalf of a requester.
+  ///
+  /// FIXME: This does not propagate the increase to inputs the task has already
+  /// requested, so the priority is only a lower bound on the critical path
+  /// when a task is shared by multiple requesters.
+  void raiseTaskPriority(TaskInfo* taskInfo, const TaskInfo* requester) {
+    // Once the task has been told to run, its priority has been handed off.
+    if (!requester || !taskInfo->forRuleInfo->isInProgressWaiting())
+      return;
+    uint64_t priority = requester->priority + taskInfo->duration;
+    if (priority > taskInfo->priority)
+      taskInfo->priority = priority;
+  }
+
   /// Request the construction of the key specified by the given rule.
   ///
+  /// \param requester The task requesting the rule, if any, used to propagate
+  /// scheduling priority.
+  ///
   /// \returns True if the rule is already available, otherwise the rule will be
   /// enqueued for processing.
-  bool demandRule(RuleInfo& ruleInfo) {
+  bool demandRule(RuleInfo& ruleInfo, TaskInfo* requester = nullptr) {
     // The rule must have already been scanned.
     assert(ruleInfo.isScanned(this));
 
@@ -502,6 +1061,8 @@ private:
     if (ruleInfo.state == RuleInfo::StateKind::DoesNotNeedToRun) {
       ruleInfo.setComplete(this);
 
+      Statistics::increment(stats.numRulesUpToDate);
+
       // Report the status change.
       if (ruleInfo.rule.updateStatus)
         ruleInfo.rule.updateStatus(buildEngine, Rule::StatusKind::IsUpToDate);
@@ -512,14 +1073,22 @@ private:
     // Otherwise, we actually need to initiate the processing of this rule.
     assert(ruleInfo.state == RuleInfo::StateKind::NeedsToRun);
 
+    // Load the prior value, which is needed both to provide it to the task and
+    // to detect an unchanged result when the task completes (potentially on
+    // another thread).
+    loadRuleValue(ruleInfo);
+
     // Create the task for this rule.
     Task* task = ruleInfo.rule.action(buildEngine);
+    Statistics::increment(stats.numTasksCreated);
     assert(task && "rule action returned null task");
 
     // Find the task info for this task.
     auto taskInfo = getTaskInfo(task);
     assert(taskInfo && "rule action returned an unregistered task");
     taskInfo->forRuleInfo = &ruleInfo;
+    taskInfo->duration = getRuleDuration(ruleInfo);
+    taskInfo->priority = taskInfo->duration;
 
     if (trace)
       trace->createdTaskForRule(taskInfo->task.get(), &ruleInfo.rule);
@@ -528,6 +1097,10 @@ private:
     ruleInfo.state = RuleInfo::StateKind::InProgressWaiting;
     ruleInfo.setPendingTaskInfo(taskInfo);
 
+    // Inherit the requester's priority before starting, so it is passed along
+    // to any inputs the task requests.
+    raiseTaskPriority(taskInfo, requester);
+
     // Reset the Rule Dependencies, which we just append to during processing,
     // but we reset the others to ensure no one ever inadvertently uses them
     // during an invalid state.
@@ -594,6 +1167,7 @@ private:
                                              &inputRuleInfo.rule);
         inputRuleInfo.getPendingScanRecord()
           ->deferredScanRequests.push_back(request);
+        ruleInfo.getPendingScanRecord()->waitingOn.push_back(&inputRuleInfo);
         return;
       }
 
@@ -615,6 +1189,7 @@ private:
         assert(inputRuleInfo.isInProgress());
         inputRuleInfo.getPendingTaskInfo()->
             deferredScanRequests.push_back(request);
+        ruleInfo.getPendingScanRecord()->waitingOn.push_back(&inputRuleInfo);
         return;
       }
 
@@ -706,6 +1281,7 @@ private:
       //
       // FIXME: We don't want to process all of these requests, this amounts to
       // doing all of the dependency scanning up-front.
+      Statistics::updateMax(stats.maxRulesToScan, ruleInfosToScan.size());
       while (!ruleInfosToScan.empty()) {
         TracingEngineQueueItemEvent i(EngineQueueItemKind::RuleToScan, buildKey.c_str());
         
@@ -717,7 +1293,12 @@ private:
         processRuleScanRequest(request);
       }
 
+      // Take any inputs requested by computing tasks.
+      if (takeDynamicInputRequests())
+        didWork = true;
+
       // Process all of the pending input requests.
+      Statistics::updateMax(stats.maxInputRequests, inputRequests.size());
       while (!inputRequests.empty()) {
         TracingEngineQueueItemEvent i(EngineQueueItemKind::InputRequest, buildKey.c_str());
         
@@ -746,11 +1327,14 @@ private:
               &request.inputRuleInfo->rule);
           request.inputRuleInfo->getPendingScanRecord()
             ->pausedInputRequests.push_back(request);
+          Statistics::increment(stats.numInputRequestsPaused);
+          if (request.taskInfo)
+            request.taskInfo->waitingOn.push_back(request.inputRuleInfo);
           continue;
         }
 
         // Request the input rule be computed.
-        bool isAvailable = demandRule(*request.inputRuleInfo);
+        bool isAvailable = demandRule(*request.inputRuleInfo, request.taskInfo);
 
         // If this is a dummy input request, we are done.
         if (!request.taskInfo)
@@ -768,12 +1352,39 @@ private:
           if (trace)
             trace->addedRulePendingTask(&request.inputRuleInfo->rule,
                                         request.taskInfo->task.get());
-          request.inputRuleInfo->getPendingTaskInfo()->requestedBy.push_back(
-            request);
+          TaskInfo* inputTaskInfo = request.inputRuleInfo->getPendingTaskInfo();
+          raiseTaskPriority(inputTaskInfo, request.taskInfo);
+          inputTaskInfo->requestedBy.push_back(request);
+          request.taskInfo->waitingOn.push_back(request.inputRuleInfo);
+        }
+      }
+
+      // Dispatch any rules waiting to be validated.
+      if (!ruleInfosToValidate.empty()) {
+        didWork = true;
+        dispatchRuleValidations();
+      }
+
+      // Process all of the completed rule validations.
+      while (numOutstandingValidations != 0) {
+        std::vector<RuleValidationResult> validations;
+        {
+          std::lock_guard<std::mutex> guard(finishedValidationsMutex);
+          validations.swap(finishedValidations);
+        }
+        if (validations.empty())
+          break;
+
+        didWork = true;
+        numOutstandingValidations -= validations.size();
+        for (const auto& validation: validations) {
+          processRuleValidationResult(validation);
         }
       }
 
       // Process all of the finished inputs.
+      Statistics::updateMax(stats.maxFinishedInputRequests,
+                            finishedInputRequests.size());
       while (!finishedInputRequests.empty()) {
         TracingEngineQueueItemEvent i(EngineQueueItemKind::FinishedInputRequest, buildKey.c_str());
         
@@ -812,7 +1423,16 @@ private:
         } else {
           TracingEngineTaskCallback i(EngineTaskCallbackKind::ProvideValue, request.inputRuleInfo->keyID);
           request.taskInfo->task->provideValue(
-              buildEngine, request.inputID, request.inputRuleInfo->result.value);
+              buildEngine, request.inputID,
+              loadRuleValue(*request.inputRuleInfo));
+        }
+
+        // If the task is already computing, this was a dynamic request.
+        if (request.taskInfo->forRuleInfo->isInProgressComputing()) {
+          assert(request.taskInfo->dynamicWaitCount != 0);
+          if (--request.taskInfo->dynamicWaitCount == 0)
+            --numTasksAwaitingDynamicInputs;
+          continue;
         }
 
         // Decrement the wait count, and move to finish queue if necessary.
@@ -820,6 +1440,7 @@ private:
       }
 
       // Process all of the ready to run tasks.
+      Statistics::updateMax(stats.maxReadyTasks, readyTaskInfos.size());
       while (!readyTaskInfos.empty()) {
         TracingEngineQueueItemEvent i(EngineQueueItemKind::ReadyTask, buildKey.c_str());
         
@@ -848,6 +1469,8 @@ private:
 
         // Increment our count of outstanding tasks.
         ++numOutstandingUnfinishedTasks;
+        Statistics::updateMax(stats.maxOutstandingTasks,
+                              numOutstandingUnfinishedTasks);
       }
 
       // Process all of the finished tasks.
@@ -855,14 +1478,7 @@ private:
         TracingEngineQueueItemEvent i(EngineQueueItemKind::FinishedTask, buildKey.c_str());
         
         // Try to take a task from the finished queue.
-        TaskInfo* taskInfo = nullptr;
-        {
-          std::lock_guard<std::mutex> guard(finishedTaskInfosMutex);
-          if (!finishedTaskInfos.empty()) {
-            taskInfo = finishedTaskInfos.back();
-            finishedTaskInfos.pop_back();
-          }
-        }
+        TaskInfo* taskInfo = dequeueFinishedTaskInfo();
         if (!taskInfo)
           break;
 
@@ -871,6 +1487,20 @@ private:
         RuleInfo* ruleInfo = taskInfo->forRuleInfo;
         assert(taskInfo == ruleInfo->getPendingTaskInfo());
 
+        // Validate that the task is not still waiting on inputs it requested
+        // while computing. Any such request made before the task completed is
+        // visible to us now, so take them first.
+        takeDynamicInputRequests();
+        if (taskInfo->dynamicWaitCount != 0) {
+          delegate.error("task \"" + ruleInfo->rule.key +
+                         "\" completed with outstanding input requests");
+          --numOutstandingUnfinishedTasks;
+          --numTasksAwaitingDynamicInputs;
+          taskInfo->dynamicWaitCount = 0;
+          cancelRemainingTasks();
+          return false;
+        }
+
         // The task was changed if was computed in the current iteration.
         if (trace) {
           bool wasChanged = ruleInfo->result.computedAt == currentEpoch;
@@ -896,13 +1526,17 @@ private:
         // indicate an underspecified build (e.g., a generated header).
         ruleInfo->result.dependencies.append(taskInfo->discoveredDependencies);
 
+        // Record the peak RSS of the task, if it reported one. Otherwise, keep
+        // the prior estimate (e.g., if the task found its outputs up-to-date).
+        if (taskInfo->peakRSS != 0)
+          ruleInfo->result.peakRSS = taskInfo->peakRSS;
+
         // Push back dummy input requests for any discovered dependencies, which
         // must be at least built in order to be brought up-to-date.
         //
-        // FIXME: The need to do this makes it questionable that we use this
-        // approach for discovered dependencies instead of just providing
-        // support for taskNeedsInput() even after the task has started
-        // computing and from parallel contexts.
+        // Tasks which need the values of the dependencies they discover should
+        // instead request them via taskNeedsInput(), which is supported while
+        // computing.
         for (auto keyIDAndFlag: taskInfo->discoveredDependencies) {
           inputRequests.push_back({ nullptr, 0, &getRuleInfoForKey(keyIDAndFlag.keyID), keyIDAndFlag.flag, false });
         }
@@ -910,8 +1544,13 @@ private:
         // Update the database record, if attached.
         if (db) {
           std::string error;
-          bool result = db->setRuleResult(
-              ruleInfo->keyID, ruleInfo->rule, ruleInfo->result, &error);
+          bool result;
+          {
+            StatisticTimer timer(stats.dbTimeNS);
+            Statistics::increment(stats.numDBWrites);
+            result = db->setRuleResult(
+                ruleInfo->keyID, ruleInfo->rule, ruleInfo->result, &error);
+          }
           if (!result) {
             delegate.error(error);
 
@@ -950,6 +1589,7 @@ private:
           std::lock_guard<std::mutex> guard(taskInfosMutex);
           auto it = taskInfos.find(taskInfo->task.get());
           assert(it != taskInfos.end());
+          taskInfo->task->engineTaskInfo = nullptr;
           taskInfos.erase(it);
         }
       }
@@ -960,17 +1600,23 @@ private:
       // NOTE: Cancellation also implements this process, if you modify this
       // code please also validate that \see cancelRemainingTasks() is still
       // correct.
-      if (!didWork && numOutstandingUnfinishedTasks != 0) {
+      //
+      // Tasks which are waiting on inputs they requested while computing can
+      // only make progress once other work is done, so if they are all that
+      // remains we have found a cycle.
+      if (!didWork && (numOutstandingUnfinishedTasks !=
+                         numTasksAwaitingDynamicInputs ||
+                       numOutstandingValidations != 0)) {
         TracingEngineQueueItemEvent i(EngineQueueItemKind::Waiting, buildKey.c_str());
         
-        // Wait for our condition variable.
-        std::unique_lock<std::mutex> lock(finishedTaskInfosMutex);
-
-        // Ensure we still don't have enqueued operations under the protection
-        // of the mutex, if one has been added then we may have already missed
-        // the condition notification and cannot safely wait.
-        if (finishedTaskInfos.empty()) {
-          finishedTaskInfosCondition.wait(lock);
+        // Wait for the wakeup event.
+        //
+        // We must ensure we still don't have enqueued operations after
+        // preparing to wait, if one has been added then we may have already
+        // missed the signal and cannot safely wait.
+        uint32_t token = finishedWorkEvent.prepareWait();
+        if (!hasFinishedWork()) {
+          finishedWorkEvent.wait(token);
         }
 
         didWork = true;
@@ -1006,7 +1652,7 @@ private:
   bool resolveCycle(const KeyType& buildKey) {
     // Take all available locks, to ensure we dump a consistent state.
     std::lock_guard<std::mutex> guard1(taskInfosMutex);
-    std::lock_guard<std::mutex> guard2(finishedTaskInfosMutex);
+    std::lock_guard<std::mutex> guard2(finishedValidationsMutex);
 
     std::vector<Rule*> cycleList = findCycle(buildKey);
     assert(!cycleList.empty());
@@ -1018,126 +1664,80 @@ private:
     return false;
   }
 
+  /// Get the inputs a pending rule may be waiting on.
+  ///
+  /// These lists are recorded as the requests are made and are never pruned,
+  /// so an input which is no longer pending must be ignored (it has since been
+  /// provided, which can only make it pending again by being requested anew).
+  const std::vector<RuleInfo*>* getWaitingOn(const RuleInfo& ruleInfo) {
+    if (ruleInfo.isScanning())
+      return &ruleInfo.getPendingScanRecord()->waitingOn;
+    if (ruleInfo.isInProgress())
+      return &ruleInfo.getPendingTaskInfo()->waitingOn;
+    return nullptr;
+  }
+
   std::vector<Rule*> findCycle(const KeyType& buildKey) {
     TracingEngineQueueItemEvent i(EngineQueueItemKind::FindingCycle, buildKey.c_str());
 
-    // Gather all of the successor relationships.
-    std::unordered_map<Rule*, std::vector<Rule*>> successorGraph;
-    std::vector<const RuleScanRecord *> activeRuleScanRecords;
-    for (const auto& it: taskInfos) {
-      const TaskInfo& taskInfo = it.second;
-      assert(taskInfo.forRuleInfo);
-      std::vector<Rule*> successors;
-      for (const auto& request: taskInfo.requestedBy) {
-        assert(request.taskInfo->forRuleInfo);
-        successors.push_back(&request.taskInfo->forRuleInfo->rule);
-      }
-      for (const auto& request: taskInfo.deferredScanRequests) {
-        // Add the sucessor for the deferred relationship itself.
-        successors.push_back(&request.ruleInfo->rule);
-      }
-      successorGraph.insert({ &taskInfo.forRuleInfo->rule, successors });
-    }
-
-    // Add the pending scan records for every rule.
-    //
-    // NOTE: There is a very subtle condition around this versus adding the ones
-    // accessible via the tasks, see https://bugs.swift.org/browse/SR-1948.
-    // Unfortunately, we do not have a test case for this!
-    for (const auto& it: ruleInfos) {
-      const RuleInfo& ruleInfo = it.second;
-      if (ruleInfo.isScanning()) {
-        const auto* scanRecord = ruleInfo.getPendingScanRecord();
-        activeRuleScanRecords.push_back(scanRecord);
-      }
-    }
-
-    // Gather dependencies from all of the active scan records.
-    std::unordered_set<const RuleScanRecord*> visitedRuleScanRecords;
-    while (!activeRuleScanRecords.empty()) {
-      const auto* record = activeRuleScanRecords.back();
-      activeRuleScanRecords.pop_back();
-
-      // Mark the record and ignore it if not scanned.
-      if (!visitedRuleScanRecords.insert(record).second)
-        continue;
-
-      // For each paused request, add the dependency.
-      for (const auto& request: record->pausedInputRequests) {
-        if (request.taskInfo) {
-          successorGraph[&request.inputRuleInfo->rule].push_back(
-                                                                 &request.taskInfo->forRuleInfo->rule);
-        }
-      }
-
-      // Process the deferred scan requests.
-      for (const auto& request: record->deferredScanRequests) {
-        // Add the sucessor for the deferred relationship itself.
-        successorGraph[&request.inputRuleInfo->rule].push_back(
-                                                               &request.ruleInfo->rule);
-
-        // Add the active rule scan record which needs to be traversed.
-        assert(request.ruleInfo->isScanning() || request.ruleInfo->wasForced);
-        if (request.ruleInfo->isScanning()) {
-          activeRuleScanRecords.push_back(
-            request.ruleInfo->getPendingScanRecord());
-        }
-      }
-    }
-
-    // Invert the graph, so we can search from the root.
-    std::unordered_map<Rule*, std::vector<Rule*>> predecessorGraph;
-    for (auto& entry: successorGraph) {
-      Rule* node = entry.first;
-      for (auto& succ: entry.second) {
-        predecessorGraph[succ].push_back(node);
-      }
-    }
-
-    // Normalize predecessor order, to ensure a deterministic result (at least,
-    // if the graph reaches the same cycle).
-    for (auto& entry: predecessorGraph) {
-      std::sort(entry.second.begin(), entry.second.end(), [](Rule* a, Rule* b) {
-        return a->key < b->key;
-      });
-    }
-
-    // Find the cycle by searching from the entry node.
+    // Find the cycle by searching from the entry node through the inputs each
+    // rule is waiting on. This only visits the pending frontier reachable from
+    // the entry node, rather than the whole graph.
     struct WorkItem {
-      WorkItem(Rule * node) { this->node = node; }
+      WorkItem(RuleInfo* node) { this->node = node; }
 
-      Rule* node;
+      RuleInfo* node;
+      std::vector<RuleInfo*> predecessors;
       unsigned predecessorIndex = 0;
     };
     std::vector<Rule*> cycleList;
-    std::unordered_set<Rule*> cycleItems;
-    std::vector<WorkItem> stack{
-      WorkItem{ &getRuleInfoForKey(buildKey).rule } };
+    llvm::DenseSet<RuleInfo*> cycleItems;
+    llvm::DenseSet<RuleInfo*> visitedItems;
+    std::vector<WorkItem> stack{ WorkItem{ &getRuleInfoForKey(buildKey) } };
     while (!stack.empty()) {
       // Take the top item.
       auto& entry = stack.back();
-      const auto& predecessors = predecessorGraph[entry.node];
 
       // If the index is 0, we just started visiting the node.
       if (entry.predecessorIndex == 0) {
         // Push the node on the stack.
-        cycleList.push_back(entry.node);
+        cycleList.push_back(&entry.node->rule);
         auto it = cycleItems.insert(entry.node);
 
         // If the node is already in the stack, we found a cycle.
         if (!it.second)
           break;
+
+        // Gather the pending inputs, in a deterministic order (at least, if
+        // the graph reaches the same cycle).
+        if (const auto* waitingOn = getWaitingOn(*entry.node)) {
+          for (auto* input: *waitingOn) {
+            if (input->isScanning() || input->isInProgress())
+              entry.predecessors.push_back(input);
+          }
+          std::sort(entry.predecessors.begin(), entry.predecessors.end(),
+                    [](RuleInfo* a, RuleInfo* b) {
+                      return a->rule.key < b->rule.key;
+                    });
+        }
       }
 
       // Visit the next predecessor, if possible.
-      if (entry.predecessorIndex != predecessors.size()) {
-        auto* child = predecessors[entry.predecessorIndex];
+      //
+      // A node which has already been completely visited cannot lead to a
+      // cycle through the current stack, so it need not be visited again.
+      while (entry.predecessorIndex != entry.predecessors.size() &&
+             visitedItems.count(entry.predecessors[entry.predecessorIndex]))
+        entry.predecessorIndex += 1;
+      if (entry.predecessorIndex != entry.predecessors.size()) {
+        auto* child = entry.predecessors[entry.predecessorIndex];
         entry.predecessorIndex += 1;
         stack.emplace_back(WorkItem{ child });
         continue;
       }
 
       // Otherwise, we are done visiting this node.
+      visitedItems.insert(entry.node);
       cycleItems.erase(entry.node);
       cycleList.pop_back();
       stack.pop_back();
@@ -1211,7 +1811,18 @@ private:
         finishedInputRequests.insert(finishedInputRequests.end(), *it);
 
         // remove this request from the task info
+        TaskInfo* waitingTaskInfo = it->taskInfo;
         taskInfo->requestedBy.erase(it);
+
+        // the requesting task is no longer waiting on this rule, unless it has
+        // other requests for it
+        auto& waitingOn = waitingTaskInfo->waitingOn;
+        waitingOn.erase(std::remove(waitingOn.begin(), waitingOn.end(),
+                                    &ruleInfo), waitingOn.end());
+        for (const auto& request: taskInfo->requestedBy) {
+          if (request.taskInfo == waitingTaskInfo)
+            waitingOn.push_back(&ruleInfo);
+        }
         return true;
       }
     }
@@ -1243,6 +1854,43 @@ private:
     return requests.end();
   }
 
+  /// Inform any tasks waiting on inputs requested while computing that those
+  /// inputs will never be provided.
+  ///
+  /// \returns True if any tasks were informed.
+  bool cancelDynamicInputRequests() {
+    std::vector<DynamicInputRequest> requests;
+    {
+      std::lock_guard<std::mutex> guard(dynamicRequestsMutex);
+      requests.swap(dynamicInputRequests);
+    }
+    if (requests.empty() && numTasksAwaitingDynamicInputs == 0)
+      return false;
+
+    std::vector<TaskInfo*> waitingTaskInfos;
+    for (const auto& request: requests) {
+      if (request.taskInfo->dynamicWaitCount++ == 0)
+        waitingTaskInfos.push_back(request.taskInfo);
+    }
+    if (numTasksAwaitingDynamicInputs != 0) {
+      std::lock_guard<std::mutex> guard(taskInfosMutex);
+      for (auto& it: taskInfos) {
+        TaskInfo* taskInfo = &it.second;
+        if (taskInfo->dynamicWaitCount != 0 &&
+            std::find(waitingTaskInfos.begin(), waitingTaskInfos.end(),
+                      taskInfo) == waitingTaskInfos.end())
+          waitingTaskInfos.push_back(taskInfo);
+      }
+    }
+    numTasksAwaitingDynamicInputs = 0;
+
+    for (auto* taskInfo: waitingTaskInfos) {
+      taskInfo->dynamicWaitCount = 0;
+      taskInfo->task->inputRequestsCancelled(buildEngine);
+    }
+    return !waitingTaskInfos.empty();
+  }
+
   // Cancel all of the remaining tasks.
   void cancelRemainingTasks() {
     // We need to wait for any currently running tasks to be reported as
@@ -1254,17 +1902,37 @@ private:
     // we expect clients to implement cancellation in conjection with causing
     // long-running tasks to also cancel and fail, so preserving those results
     // is not valuable.
-    while (numOutstandingUnfinishedTasks != 0) {
-        std::unique_lock<std::mutex> lock(finishedTaskInfosMutex);
-        if (finishedTaskInfos.empty()) {
-          finishedTaskInfosCondition.wait(lock);
-        } else {
-          assert(finishedTaskInfos.size() <= numOutstandingUnfinishedTasks);
-          numOutstandingUnfinishedTasks -= finishedTaskInfos.size();
-          finishedTaskInfos.clear();
+    while (numOutstandingUnfinishedTasks != 0 ||
+           numOutstandingValidations != 0) {
+        uint32_t token = finishedWorkEvent.prepareWait();
+        bool drainedAny = cancelDynamicInputRequests();
+        while (dequeueFinishedTaskInfo()) {
+          assert(numOutstandingUnfinishedTasks != 0);
+          --numOutstandingUnfinishedTasks;
+          drainedAny = true;
+        }
+        {
+          std::lock_guard<std::mutex> guard(finishedValidationsMutex);
+          if (!finishedValidations.empty()) {
+            assert(finishedValidations.size() <= numOutstandingValidations);
+            numOutstandingValidations -= finishedValidations.size();
+            finishedValidations.clear();
+            drainedAny = true;
+          }
         }
+        if (!drainedAny)
+          finishedWorkEvent.wait(token);
     }
 
+    // Drop any validations which were never dispatched, the rules will be
+    // cancelled below along with all other scanning rules.
+    ruleInfosToValidate.clear();
+
+    // Drop any queued requests on behalf of the tasks, which are deleted below.
+    inputRequests.clear();
+    finishedInputRequests.clear();
+    readyTaskInfos.clear();
+
     std::lock_guard<std::mutex> guard(taskInfosMutex);
 
     for (auto& it: taskInfos) {
@@ -1291,14 +1959,16 @@ private:
     // FIXME: This is currently an O(n) operation that could be relatively
     // expensive on larger projects.  We should be able to do something more
     // targeted. rdar://problem/39386591
-    for (auto& it: ruleInfos) {
+    for (uint32_t i = 0, e = ruleInfos.size(); i != e; ++i) {
       // Cancel outstanding activity on rules
-      if (it.second.isScanning()) {
-        it.second.setCancelled();
+      if (ruleInfos[i].isScanning()) {
+        ruleInfos[i].setCancelled();
       }
     }
 
     // Delete all of the tasks.
+    for (auto& it: taskInfos)
+      it.second.task->engineTaskInfo = nullptr;
     taskInfos.clear();
   }
 
@@ -1308,6 +1978,9 @@ public:
     : buildEngine(buildEngine), delegate(delegate) {}
 
   ~BuildEngineImpl() {
+    // Stop the scan workers, if running.
+    shutdownScanWorkers();
+
     // If tracing is enabled, close it.
     if (trace) {
       std::string error;
@@ -1342,33 +2015,40 @@ public:
       (const char*)(uintptr_t)key).getKey();
   }
 
+  virtual void error(const Twine& message) override {
+    delegate.error(message);
+  }
+
   RuleInfo& getRuleInfoForKey(const KeyType& key) {
     auto keyID = getKeyID(key);
     
     // Check if we have already found the rule.
-    auto it = ruleInfos.find(keyID);
-    if (it != ruleInfos.end())
-      return it->second;
+    if (auto* ruleInfo = ruleInfos.find(keyID))
+      return *ruleInfo;
 
     // Otherwise, request it from the delegate and add it.
-    return addRule(keyID, delegate.lookupRule(key));
+    return addRule(keyID, lookupRule(key));
   }
 
   RuleInfo& getRuleInfoForKey(KeyID keyID) {
     // Check if we have already found the rule.
-    auto it = ruleInfos.find(keyID);
-    if (it != ruleInfos.end())
-      return it->second;
+    if (auto* ruleInfo = ruleInfos.find(keyID))
+      return *ruleInfo;
 
     // Otherwise, we need to resolve the full key so we can request it from the
     // delegate.
-    return addRule(keyID, delegate.lookupRule(getKeyForID(keyID)));
+    return addRule(keyID, lookupRule(getKeyForID(keyID)));
+  }
+
+  /// Look up a rule from the delegate.
+  Rule lookupRule(const KeyType& key) {
+    StatisticTimer timer(stats.ruleLookupTimeNS);
+    Statistics::increment(stats.numRuleLookups);
+    return delegate.lookupRule(key);
   }
 
   TaskInfo* getTaskInfo(Task* task) {
-    std::lock_guard<std::mutex> guard(taskInfosMutex);
-    auto it = taskInfos.find(task);
-    return it == taskInfos.end() ? nullptr : &it->second;
+    return static_cast<TaskInfo*>(task->engineTaskInfo);
   }
   
   /// @name Rule Definition
@@ -1379,34 +2059,76 @@ public:
   }
   
   RuleInfo& addRule(KeyID keyID, Rule&& rule) {
-    auto result = ruleInfos.emplace(keyID, RuleInfo(keyID, std::move(rule)));
+    auto result = ruleInfos.insert(keyID, std::move(rule));
+    Statistics::updateMax(stats.peakRules, ruleInfos.size());
     if (!result.second) {
       delegate.error("attempt to register duplicate rule \"" + rule.key + "\"\n");
 
       // Set cancelled, but return something 'valid' for use until it is
       // processed.
       buildCancelled = true;
-      return result.first->second;
+      return *result.first;
     }
 
-    // If we have a database attached, retrieve any stored result.
-    //
-    // FIXME: Investigate retrieving this result lazily. If the DB is
-    // particularly efficient, it may be best to retrieve this only when we need
-    // it and never duplicate it.
-    RuleInfo& ruleInfo = result.first->second;
-    if (db) {
-      std::string error;
-      db->lookupRuleResult(ruleInfo.keyID, ruleInfo.rule, &ruleInfo.result, &error);
-      if (!error.empty()) {
-        // FIXME: Investigate changing the database error handling model to
-        // allow builds to proceed without the database.
-        delegate.error(error);
-        buildCancelled = true;
-      }
+    // Any stored result is retrieved lazily, when the rule is scanned.
+    return *result.first;
+  }
+
+  /// Load the stored result for a rule from the database, if necessary.
+  ///
+  /// This loads everything needed to scan the rule, but the value is deferred
+  /// until it is consumed (\see loadRuleValue()).
+  void loadRuleResult(RuleInfo& ruleInfo) {
+    if (ruleInfo.isResultLoaded)
+      return;
+    ruleInfo.isResultLoaded = true;
+
+    // If there is no database, there is nothing to load.
+    if (!db) {
+      ruleInfo.isValueLoaded = true;
+      return;
+    }
+
+    std::string error;
+    bool valueLoaded = false;
+    StatisticTimer timer(stats.dbTimeNS);
+    Statistics::increment(stats.numDBLookups);
+    if (!db->lookupRuleResultWithoutValue(ruleInfo.keyID, ruleInfo.rule.key,
+                                          &ruleInfo.result, &valueLoaded,
+                                          &error)) {
+      // If there was no stored result, there is no value to load.
+      valueLoaded = true;
+    }
+    ruleInfo.isValueLoaded = valueLoaded;
+    if (!error.empty()) {
+      // FIXME: Investigate changing the database error handling model to
+      // allow builds to proceed without the database.
+      delegate.error(error);
+      buildCancelled = true;
     }
+  }
 
-    return ruleInfo;
+  /// Load the value of the stored result for a rule, if necessary.
+  ///
+  /// \returns The current value for the rule.
+  const ValueType& loadRuleValue(RuleInfo& ruleInfo) {
+    assert(ruleInfo.isResultLoaded);
+    if (ruleInfo.isValueLoaded)
+      return ruleInfo.result.value;
+    ruleInfo.isValueLoaded = true;
+
+    std::string error;
+    {
+      StatisticTimer timer(stats.dbTimeNS);
+      Statistics::increment(stats.numDBLookups);
+      db->lookupRuleResultValue(ruleInfo.keyID, ruleInfo.rule.key,
+                                &ruleInfo.result.value, &error);
+    }
+    if (!error.empty()) {
+      delegate.error(error);
+      buildCancelled = true;
+    }
+    return ruleInfo.result.value;
   }
 
   /// @}
@@ -1426,6 +2148,7 @@ public:
     };
 
     if (db) {
+      StatisticTimer timer(stats.dbTimeNS);
       std::string error;
       bool result = db->buildStarted(&error);
       if (!result) {
@@ -1445,6 +2168,23 @@ public:
     // and \see RuleInfo::isComplete().
     ++currentEpoch;
 
+    // Record the new iteration in the build database, if attached. This must
+    // happen before any results are written, since the database may commit
+    // them while the build is running: if the build is interrupted, the next
+    // one must not reuse the iteration those results were built at.
+    if (db) {
+      StatisticTimer timer(stats.dbTimeNS);
+      std::string error;
+      bool result = db->setCurrentIteration(currentEpoch, &error) &&
+        db->setBuildRoot(getKeyID(key), key, &error);
+      if (!result) {
+        delegate.error(error);
+        db->buildComplete();
+        static ValueType emptyValue{};
+        return emptyValue;
+      }
+    }
+
     if (trace)
       trace->buildStarted();
 
@@ -1452,17 +2192,9 @@ public:
     buildCancelled = false;
     bool success = executeTasks(key);
     
-    // Update the build database, if attached.
-    //
-    // FIXME: Is it correct to do this here, or earlier?
+    // Complete the build in the database, if attached.
     if (db) {
-      std::string error;
-      bool result = db->setCurrentIteration(currentEpoch, &error);
-      if (!result) {
-        delegate.error(error);
-        static ValueType emptyValue{};
-        return emptyValue;
-      }
+      StatisticTimer timer(stats.dbTimeNS);
       db->buildComplete();
     }
 
@@ -1487,7 +2219,7 @@ public:
     // The task queue should be empty and the rule complete.
     auto& ruleInfo = getRuleInfoForKey(key);
     assert(taskInfos.empty() && ruleInfo.isComplete(this));
-    return ruleInfo.result.value;
+    return loadRuleValue(ruleInfo);
   }
 
   void cancelBuild() {
@@ -1499,7 +2231,8 @@ public:
     buildCancelled = true;
   }
   
-  bool attachDB(std::unique_ptr<BuildDB> database, std::string* error_out) {
+  bool attachDB(std::unique_ptr<BuildDB> database, std::string* error_out,
+                bool preloadResults) {
     assert(!db && "invalid attachDB() call");
     assert(currentEpoch == 0 && "invalid attachDB() call");
     assert(ruleInfos.empty() && "invalid attachDB() call");
@@ -1509,7 +2242,35 @@ public:
     // Load our initial state from the database.
     bool success;
     currentEpoch = db->getCurrentEpoch(&success, error_out);
-    return success;
+    if (!success)
+      return false;
+
+    if (preloadResults) {
+      StatisticTimer timer(stats.dbTimeNS);
+      return db->preloadResults(error_out);
+    }
+    return true;
+  }
+
+  bool collectDBGarbage(uint64_t minAge,
+                        BuildDBGarbageCollectionStats* stats_out,
+                        std::string* error_out) {
+    assert(!buildRunning && "invalid collectDBGarbage() call");
+    if (!db) {
+      *error_out = "no database attached";
+      return false;
+    }
+
+    // Load any values which were deferred, since their results may be about to
+    // be removed from the database.
+    for (uint32_t i = 0, e = ruleInfos.size(); i != e; ++i) {
+      auto& ruleInfo = ruleInfos[i];
+      if (ruleInfo.isResultLoaded && !ruleInfo.isValueLoaded)
+        loadRuleValue(ruleInfo);
+    }
+
+    StatisticTimer timer(stats.dbTimeNS);
+    return db->collectGarbage(minAge, stats_out, error_out);
   }
 
   bool enableTracing(const std::string& filename, std::string* error_out) {
@@ -1522,6 +2283,47 @@ public:
     return true;
   }
 
+  void setScanConcurrency(unsigned numThreads) {
+    assert(!buildRunning && "invalid setScanConcurrency() call");
+
+    // Replace any existing workers.
+    shutdownScanWorkers();
+    if (numThreads <= 1)
+      return;
+
+    numScanWorkers = numThreads;
+    for (unsigned i = 0; i != numThreads; ++i) {
+      scanWorkers.push_back(llvm::make_unique<std::thread>(
+                                &BuildEngineImpl::executeScanWorker, this));
+    }
+  }
+
+  /// Get a snapshot of the engine's statistics, \see BuildEngineStatistics.
+  BuildEngineStatistics getStatistics() {
+    BuildEngineStatistics result;
+    auto get = [](const std::atomic<uint64_t>& statistic) {
+      return statistic.load(std::memory_order_relaxed);
+    };
+    result.numRulesScanned = get(stats.numRulesScanned);
+    result.numRulesUpToDate = get(stats.numRulesUpToDate);
+    result.numTasksCreated = get(stats.numTasksCreated);
+    result.numInputRequests = get(stats.numInputRequests);
+    result.numInputRequestsPaused = get(stats.numInputRequestsPaused);
+    result.numDBLookups = get(stats.numDBLookups);
+    result.numDBWrites = get(stats.numDBWrites);
+    result.dbTime = get(stats.dbTimeNS) / 1000;
+    result.numRuleLookups = get(stats.numRuleLookups);
+    result.ruleLookupTime = get(stats.ruleLookupTimeNS) / 1000;
+    result.peakRules = get(stats.peakRules);
+    result.maxRulesToScan = get(stats.maxRulesToScan);
+    result.maxInputRequests = get(stats.maxInputRequests);
+    result.maxFinishedInputRequests = get(stats.maxFinishedInputRequests);
+    result.maxReadyTasks = get(stats.maxReadyTasks);
+    result.maxOutstandingTasks = get(stats.maxOutstandingTasks);
+    result.maxOutstandingValidations = get(stats.maxOutstandingValidations);
+    return result;
+  }
+
   /// Dump the build state to a file in Graphviz DOT format.
   void dumpGraphToFile(const std::string& path) {
     FILE* fp = ::fopen(path.c_str(), "w");
@@ -1539,8 +2341,10 @@ public:
 
     // Create a canonical node ordering.
     std::vector<const RuleInfo*> orderedRuleInfos;
-    for (const auto& entry: ruleInfos)
-      orderedRuleInfos.push_back(&entry.second);
+    for (uint32_t i = 0, e = ruleInfos.size(); i != e; ++i) {
+      loadRuleResult(ruleInfos[i]);
+      orderedRuleInfos.push_back(&ruleInfos[i]);
+    }
     std::sort(orderedRuleInfos.begin(), orderedRuleInfos.end(),
               [] (const RuleInfo* a, const RuleInfo* b) {
         return a->rule.key < b->rule.key;
@@ -1565,6 +2369,19 @@ public:
   void addTaskInputRequest(Task* task, const KeyType& key, uintptr_t inputID, bool orderOnly) {
     auto taskInfo = getTaskInfo(task);
 
+    // If the task is already computing, it is requesting an input it
+    // discovered, potentially from another thread. Hand the request off to
+    // the engine thread.
+    if (taskInfo->forRuleInfo->isInProgressComputing() && !orderOnly) {
+      auto keyID = getKeyID(key);
+      {
+        std::lock_guard<std::mutex> guard(dynamicRequestsMutex);
+        dynamicInputRequests.push_back({ taskInfo, inputID, keyID });
+      }
+      finishedWorkEvent.signal();
+      return;
+    }
+
     // Validate that the task is in a valid state to request inputs.
     if (!taskInfo->forRuleInfo->isInProgressWaiting()) {
       // FIXME: Error handling.
@@ -1576,6 +2393,8 @@ public:
     
     inputRequests.push_back({ taskInfo, inputID, ruleInfo, orderOnly });
     taskInfo->waitCount++;
+    Statistics::increment(stats.numInputRequests);
+    Statistics::updateMax(stats.maxInputRequests, inputRequests.size());
   }
 
   /// @}
@@ -1588,7 +2407,7 @@ public:
       std::lock_guard<std::mutex> guard(taskInfosMutex);
       auto result = taskInfos.emplace(task, TaskInfo(task));
       assert(result.second && "task already registered");
-      (void)result;
+      task->engineTaskInfo = &result.first->second;
     }
     return task;
   }
@@ -1622,9 +2441,26 @@ public:
     }
 
     auto dependencyID = getKeyID(key);
+    std::lock_guard<std::mutex> guard(dynamicRequestsMutex);
     taskInfo->discoveredDependencies.push_back(dependencyID, false);
   }
 
+  uint64_t getTaskPriority(Task* task) {
+    return getTaskInfo(task)->priority;
+  }
+
+  void taskReportedPeakRSS(Task* task, uint64_t peakRSS) {
+    auto taskInfo = getTaskInfo(task);
+    assert(taskInfo && "cannot report peak RSS for an unknown task");
+
+    std::lock_guard<std::mutex> guard(dynamicRequestsMutex);
+    taskInfo->peakRSS = std::max(taskInfo->peakRSS, peakRSS);
+  }
+
+  uint64_t getTaskEstimatedPeakRSS(Task* task) {
+    return getTaskInfo(task)->forRuleInfo->result.peakRSS;
+  }
+
   void taskIsComplete(Task* task, ValueType&& value, bool forceChange) {
     // FIXME: We should flag the task to ensure this is only called once, and
     // that no other API calls are made once complete.
@@ -1654,14 +2490,8 @@ public:
         ruleInfo->result.computedAt = currentEpoch;
     }
 
-    // Enqueue the finished task.
-    {
-      std::lock_guard<std::mutex> guard(finishedTaskInfosMutex);
-      finishedTaskInfos.push_back(taskInfo);
-    }
-
-    // Notify the engine to wake up, if necessary.
-    finishedTaskInfosCondition.notify_one();
+    // Enqueue the finished task, waking the engine if necessary.
+    enqueueFinishedTaskInfo(taskInfo);
   }
 
   /// @}
@@ -1707,12 +2537,29 @@ void BuildEngine::cancelBuild() {
   return static_cast<BuildEngineImpl*>(impl)->cancelBuild();
 }
 
+void BuildEngine::setScanConcurrency(unsigned numThreads) {
+  static_cast<BuildEngineImpl*>(impl)->setScanConcurrency(numThreads);
+}
+
 void BuildEngine::dumpGraphToFile(const std::string& path) {
   static_cast<BuildEngineImpl*>(impl)->dumpGraphToFile(path);
 }
 
-bool BuildEngine::attachDB(std::unique_ptr<BuildDB> database, std::string* error_out) {
-  return static_cast<BuildEngineImpl*>(impl)->attachDB(std::move(database), error_out);
+BuildEngineStatistics BuildEngine::getStatistics() {
+  return static_cast<BuildEngineImpl*>(impl)->getStatistics();
+}
+
+bool BuildEngine::attachDB(std::unique_ptr<BuildDB> database, std::string* error_out,
+                           bool preloadResults) {
+  return static_cast<BuildEngineImpl*>(impl)->attachDB(std::move(database), error_out,
+                                                       preloadResults);
+}
+
+bool BuildEngine::collectDBGarbage(uint64_t minAge,
+                                   BuildDBGarbageCollectionStats* stats_out,
+                                   std::string* error_out) {
+  return static_cast<BuildEngineImpl*>(impl)->collectDBGarbage(
+      minAge, stats_out, error_out);
 }
 
 bool BuildEngine::enableTracing(const std::string& path,
@@ -1742,3 +2589,15 @@ void BuildEngine::taskIsComplete(Task* task, ValueType&& value,
   static_cast<BuildEngineImpl*>(impl)->taskIsComplete(task, std::move(value),
                                                       forceChange);
 }
+
+uint64_t BuildEngine::getTaskPriority(Task* task) {
+  return static_cast<BuildEngineImpl*>(impl)->getTaskPriority(task);
+}
+
+void BuildEngine::taskReportedPeakRSS(Task* task, uint64_t peakRSS) {
+  static_cast<BuildEngineImpl*>(impl)->taskReportedPeakRSS(task, peakRSS);
+}
+
+uint64_t BuildEngine::getTaskEstimatedPeakRSS(Task* task) {
+  return static_cast<BuildEngineImpl*>(impl)->getTaskEstimatedPeakRSS(task);
+}
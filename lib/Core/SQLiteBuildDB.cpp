@@ -13,19 +13,31 @@
 #include "llbuild/Core/BuildDB.h"
 
 #include "llbuild/Basic/BinaryCoding.h"
+#include "llbuild/Basic/Defer.h"
 #include "llbuild/Basic/PlatformUtility.h"
 #include "llbuild/Core/BuildEngine.h"
 
+#include "llvm/ADT/ArrayRef.h"
 #include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/FileSystem.h"
 #include "llvm/Support/raw_ostream.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cerrno>
+#include <chrono>
+#include <condition_variable>
 #include <cstring>
 #include <mutex>
+#include <thread>
 
 #include <sqlite3.h>
+#include <zlib.h>
 
 using namespace llbuild;
 using namespace llbuild::core;
@@ -42,18 +54,77 @@ struct DBKeyID {
   explicit DBKeyID(uint64_t value) : value(value) { ; }
 };
 
-// Provide DenseMapInfo for DBKeyID.
-template<> struct ::llvm::DenseMapInfo<DBKeyID> {
-  static inline DBKeyID getEmptyKey() { return DBKeyID(~0ULL); }
-  static inline DBKeyID getTombstoneKey() { return DBKeyID(~0ULL - 1ULL); }
-  static unsigned getHashValue(const DBKeyID& Val) {
-    return (unsigned)(Val.value * 37ULL);
-  }
-  static bool isEqual(const DBKeyID& LHS, const DBKeyID& RHS) {
-    return LHS.value == RHS.value;
-  }
+/// Flags describing how the blobs of a rule result are stored.
+enum RuleResultFlags : int {
+  /// The value blob is compressed (\see compressBlob()).
+  CompressedValue = 1 << 0,
+
+  /// The dependencies blob is compressed (\see compressBlob()).
+  CompressedDependencies = 1 << 1,
 };
 
+/// The maximum number of bytes in the encoding of a dependency (a 64-bit
+/// variable-length integer).
+static const unsigned maxVarIntSize = 10;
+
+/// The size below which blobs are always stored uncompressed.
+static const size_t minCompressedBlobSize = 256;
+
+/// The maximum ratio of uncompressed to compressed size zlib can achieve, used
+/// to reject the sizes of corrupt blobs before allocating for them.
+static const size_t maxCompressionRatio = 1032;
+
+/// Compress a blob, if it is large enough to be worth doing so.
+///
+/// The compressed form is the uncompressed size (as a 32-bit little-endian
+/// integer) followed by the zlib encoded data.
+///
+/// \returns True if the blob was compressed into \p compressed_out.
+static bool compressBlob(const void* data, size_t size,
+                         std::vector<uint8_t>& compressed_out) {
+  if (size < minCompressedBlobSize || size > UINT32_MAX)
+    return false;
+
+  // Favor speed, most of these blobs are highly repetitive path lists which
+  // compress well regardless.
+  uLongf compressedSize = compressBound(size);
+  compressed_out.resize(4 + compressedSize);
+  if (::compress2(compressed_out.data() + 4, &compressedSize,
+                  (const Bytef*)data, size, Z_BEST_SPEED) != Z_OK)
+    return false;
+
+  // Only use the compressed form if it is a worthwhile reduction.
+  if (4 + compressedSize >= size - size / 8)
+    return false;
+  llvm::support::endian::write32le(compressed_out.data(), uint32_t(size));
+  compressed_out.resize(4 + compressedSize);
+  return true;
+}
+
+/// Read a blob column, decompressing it if necessary.
+///
+/// \returns False if the blob could not be decompressed.
+static bool readBlobColumn(sqlite3_stmt* stmt, int column, bool compressed,
+                           std::vector<uint8_t>& data_out) {
+  auto bytes = (const uint8_t*)sqlite3_column_blob(stmt, column);
+  size_t numBytes = sqlite3_column_bytes(stmt, column);
+  if (!compressed) {
+    data_out.assign(bytes, bytes + numBytes);
+    return true;
+  }
+
+  if (numBytes < 4)
+    return false;
+  uLongf size = llvm::support::endian::read32le(bytes);
+  if (size > (numBytes - 4) * maxCompressionRatio)
+    return false;
+  data_out.resize(size);
+  if (::uncompress(data_out.data(), &size, bytes + 4, numBytes - 4) != Z_OK ||
+      size != data_out.size())
+    return false;
+  return true;
+}
+
 // Helper macro checking and returning error messages for failed SQLite calls
 #define checkSQLiteResultOKReturnFalse(result) \
 if (result != SQLITE_OK) { \
@@ -66,6 +137,12 @@ namespace {
 
 class SQLiteBuildDB : public BuildDB {
   /// Version History:
+  /// * 18: Record whether the reverse dependency index is maintained.
+  /// * 17: Add the peak RSS of the command which produced the result.
+  /// * 16: Encode dependencies as variable-length integers.
+  /// * 15: Add the reverse dependency index.
+  /// * 14: Add build roots, for garbage collection.
+  /// * 13: Add result flags, for compressed values and dependencies.
   /// * 12: Tagging dependencies with order-only flag.
   /// * 11: Add result timestamps
   /// * 10: Add result signature
@@ -75,7 +152,7 @@ class SQLiteBuildDB : public BuildDB {
   /// * 6: Added `ordinal` field for dependencies.
   /// * 5: Switched to using `WITHOUT ROWID` for dependencies.
   /// * 4: Pre-history
-  static const int currentSchemaVersion = 12;
+  static const int currentSchemaVersion = 18;
 
   std::string path;
   uint32_t clientSchemaVersion;
@@ -85,22 +162,134 @@ class SQLiteBuildDB : public BuildDB {
 
   sqlite3 *db = nullptr;
 
-  /// The mutex to protect all access to the database and statements.
+  /// The mutex to protect all access to the main connection to the database,
+  /// and its statements.
   std::mutex dbMutex;
 
+  /// A connection to the database, and the statements used to look up results
+  /// on it.
+  struct LookupConnection {
+    sqlite3 *db = nullptr;
+    sqlite3_stmt* findRuleResultStmt = nullptr;
+    sqlite3_stmt* fastFindRuleResultStmt = nullptr;
+    sqlite3_stmt* findRuleResultWithoutValueStmt = nullptr;
+    sqlite3_stmt* fastFindRuleResultWithoutValueStmt = nullptr;
+    sqlite3_stmt* findRuleResultValueStmt = nullptr;
+    sqlite3_stmt* findKeyNameForKeyIDStmt = nullptr;
+  };
+
+  /// The lookup statements on the main connection, which are protected by the
+  /// dbMutex like the rest of it.
+  LookupConnection mainLookup;
+
+  /// Whether the main connection is open (and the schema is known to be
+  /// current), which is required before any reader connections are opened.
+  std::atomic<bool> isOpen{false};
+
+  /// The maximum number of reader connections, \see acquireReader().
+  static constexpr unsigned maxReaders = 16;
+
+  /// The mutex to protect the pool of reader connections.
+  std::mutex readerPoolMutex;
+
+  /// The reader connections which are not currently in use.
+  std::vector<std::unique_ptr<LookupConnection>> idleReaders;
+
+  /// The number of open reader connections, including those in use.
+  unsigned numReaders = 0;
+
+  /// The mutex to protect the key ID caches and the preloaded results, which
+  /// are shared by all connections. No other mutex may be acquired while
+  /// holding it.
+  std::mutex keyCacheMutex;
+
+  /// The maximum number of results written in a single build transaction
+  /// before it is committed.
+  static constexpr unsigned maxResultsPerTransaction = 1000;
+
+  /// The maximum amount of time results may remain uncommitted while a build
+  /// is running.
+  const std::chrono::milliseconds maxTransactionDuration{1000};
+
+  /// Whether results are written asynchronously while a build is running,
+  /// \see setRuleResult().
+  bool writeBehind;
+
+  /// Whether large values and dependency lists are compressed when written,
+  /// \see compressBlob().
+  bool compress;
+
+  /// Whether a build transaction is currently open, \see buildStarted().
+  bool inBuildTransaction = false;
+
+  /// The open lock file, while the build lock is held, or -1,
+  /// \see acquireBuildLock().
+  int buildLockFD = -1;
+
+  /// Whether the reverse dependency index has been built, and so must be kept
+  /// up to date as results are written, \see buildReverseDependencyIndex().
+  ///
+  /// This is recorded in the database, \see loadReverseDependencyIndexState().
+  bool isReverseDependencyIndexBuilt = false;
+
+  /// The number of results written in the current build transaction.
+  unsigned numUncommittedResults = 0;
+
+  /// The time at which the current build transaction was started.
+  std::chrono::steady_clock::time_point transactionStartTime;
+
+  /// The thread which writes results in write-behind mode, and periodically
+  /// commits the build transaction so that completed results are not lost if
+  /// the build is interrupted.
+  std::thread writerThread;
+
+  /// The mutex to protect the writer thread state. If both are needed, this
+  /// must be acquired after the dbMutex.
+  std::mutex writerMutex;
+
+  /// Condition used to wake the writer thread.
+  std::condition_variable writerCondition;
+
+  /// Whether results are currently being handed off to the writer thread.
+  bool isWritingBehind = false;
+
+  /// The results waiting to be written by the writer thread.
+  llvm::DenseMap<KeyID, Result> pendingResults;
+
+  /// Whether the writer thread should exit.
+  bool writerThreadShouldExit = false;
+
+  /// The first error encountered by the writer thread, reported by the next
+  /// write or by \see buildComplete().
+  std::string writerError;
+
+  /// The keys whose results have been written in the current build transaction
+  /// but not yet committed, or are about to be. These can only be looked up on
+  /// the main connection, since reader connections only see committed results.
+  llvm::DenseSet<KeyID> uncommittedKeyIDs;
+
   /// The delegate pointer
   BuildDBDelegate* delegate = nullptr;
 
   std::string getCurrentErrorMessage() {
-    int err_code = sqlite3_errcode(db);
-    const char* err_message = sqlite3_errmsg(db);
-    const char* filename = sqlite3_db_filename(db, "main");
+    return getCurrentErrorMessage(db);
+  }
+
+  static std::string getCurrentErrorMessage(sqlite3* connection) {
+    int err_code = sqlite3_errcode(connection);
+    const char* err_message = sqlite3_errmsg(connection);
+    const char* filename = sqlite3_db_filename(connection, "main");
+    return getErrorMessage(filename, err_message,
+                           err_code == SQLITE_BUSY || err_code == SQLITE_LOCKED);
+  }
 
+  static std::string getErrorMessage(StringRef filename, StringRef message,
+                                     bool isLocked) {
     std::string out;
     llvm::raw_string_ostream outStream(out);
-    outStream << "error: accessing build database \"" << filename << "\": " << err_message;
+    outStream << "error: accessing build database \"" << filename << "\": " << message;
 
-    if (err_code == SQLITE_BUSY || err_code == SQLITE_LOCKED) {
+    if (isLocked) {
       outStream << " Possibly there are two concurrent builds running in the same filesystem location.";
     }
 
@@ -108,6 +297,57 @@ class SQLiteBuildDB : public BuildDB {
     return out;
   }
 
+  /// Take the lock which excludes all other builds (and other writers, such
+  /// as garbage collection) from the database, until \see releaseBuildLock().
+  ///
+  /// SQLite's own write lock cannot be used for this, since it is released
+  /// whenever a batch of results is committed while the build is running. The
+  /// lock is taken on a separate file, since closing another descriptor for the
+  /// database file itself would drop SQLite's locks on it.
+  ///
+  /// This method is not thread-safe. The caller must protect access via the
+  /// dbMutex.
+  bool acquireBuildLock(std::string *error_out) {
+    assert(buildLockFD == -1 && "build lock is already held");
+
+    int fd;
+    auto ec = llvm::sys::fs::openFileForReadWrite(
+        path + "-lock", fd, llvm::sys::fs::CD_OpenAlways,
+        llvm::sys::fs::OF_None);
+    if (ec) {
+      *error_out = getErrorMessage(path, "unable to open lock file: " +
+                                   ec.message(), /*isLocked=*/false);
+      return false;
+    }
+    if (basic::sys::tryLockFile(fd) != 0) {
+      int err = errno;
+      basic::sys::close(fd);
+      if (err == EWOULDBLOCK) {
+        *error_out = getErrorMessage(path, "database is locked",
+                                     /*isLocked=*/true);
+      } else {
+        *error_out = getErrorMessage(path, "unable to lock database: " +
+                                     basic::sys::strerror(err),
+                                     /*isLocked=*/false);
+      }
+      return false;
+    }
+    buildLockFD = fd;
+    return true;
+  }
+
+  /// Release the lock taken by \see acquireBuildLock(), if held.
+  ///
+  /// This method is not thread-safe. The caller must protect access via the
+  /// dbMutex.
+  void releaseBuildLock() {
+    if (buildLockFD == -1)
+      return;
+    (void)basic::sys::unlockFile(buildLockFD);
+    basic::sys::close(buildLockFD);
+    buildLockFD = -1;
+  }
+
   bool open(std::string *error_out) {
     // The db is opened lazily whenever an operation on it occurs. Thus if it is
     // already open, we don't need to do any further work.
@@ -118,7 +358,7 @@ class SQLiteBuildDB : public BuildDB {
     // We attempt to set multi-threading mode, but can settle for serialized if
     // the library can't be reinitialized (there are only two modes).
     static int sqliteConfigureResult = []() -> int {
-      // We access a single connection from multiple threads.
+      // We access each connection from multiple threads (one at a time).
       return sqlite3_config(SQLITE_CONFIG_MULTITHREAD);
     }();
     if (sqliteConfigureResult != SQLITE_OK) {
@@ -171,7 +411,14 @@ class SQLiteBuildDB : public BuildDB {
       // Close the database before we try to recreate it.
       sqlite3_close(db);
       db = nullptr;
-      
+
+      // Any cached key mappings refer to the old database.
+      {
+        std::lock_guard<std::mutex> guard(keyCacheMutex);
+        engineKeyIDs.clear();
+        dbKeyIDs.clear();
+      }
+
       if (!recreateOnUnmatchedVersion) {
         // We don't re-create the database in this case and return an error
         *error_out = std::string("Version mismatch. (database-schema: ") + std::to_string(version) + std::string(" requested schema: ") + std::to_string(currentSchemaVersion) + std::string(". database-client: ") + std::to_string(clientVersion) + std::string(" requested client: ") + std::to_string(clientSchemaVersion) + std::string(")");
@@ -179,6 +426,11 @@ class SQLiteBuildDB : public BuildDB {
       }
 
       // Always recreate the database from scratch when the schema changes.
+      //
+      // Any write-ahead log left behind by an interrupted process must go
+      // along with it, it cannot be applied to the new database.
+      (void)basic::sys::unlink((path + "-wal").c_str());
+      (void)basic::sys::unlink((path + "-shm").c_str());
       result = basic::sys::unlink(path.c_str());
       if (result == -1) {
         if (errno != ENOENT) {
@@ -207,12 +459,13 @@ class SQLiteBuildDB : public BuildDB {
                "id INTEGER PRIMARY KEY, "
                "version INTEGER, "
                "client_version INTEGER, "
-               "iteration INTEGER);"),
+               "iteration INTEGER, "
+               "reverse_dependencies_indexed INTEGER);"),
           nullptr, nullptr, &cError);
       }
       if (result == SQLITE_OK) {
         char* query = sqlite3_mprintf(
-          "INSERT INTO info VALUES (0, %d, %d, 0);",
+          "INSERT INTO info VALUES (0, %d, %d, 0, 0);",
           currentSchemaVersion, clientSchemaVersion);
         result = sqlite3_exec(db, query, nullptr, nullptr, &cError);
         sqlite3_free(query);
@@ -235,9 +488,30 @@ class SQLiteBuildDB : public BuildDB {
                "start REAL, "
                "end REAL, "
                "dependencies BLOB, "
+               "flags INTEGER, "
+               "peak_rss INTEGER, "
+               "FOREIGN KEY(key_id) REFERENCES key_names(id));"),
+          nullptr, nullptr, &cError);
+      }
+      if (result == SQLITE_OK) {
+        result = sqlite3_exec(
+          db, ("CREATE TABLE build_roots ("
+               "key_id INTEGER PRIMARY KEY, "
+               "requested_at INTEGER, "
                "FOREIGN KEY(key_id) REFERENCES key_names(id));"),
           nullptr, nullptr, &cError);
       }
+      if (result == SQLITE_OK) {
+        result = sqlite3_exec(
+          db, ("CREATE TABLE reverse_dependencies ("
+               "dependent_id INTEGER, "
+               "key_id INTEGER, "
+               "PRIMARY KEY(dependent_id, key_id), "
+               "FOREIGN KEY(dependent_id) REFERENCES key_names(id), "
+               "FOREIGN KEY(key_id) REFERENCES key_names(id)) "
+               "WITHOUT ROWID;"),
+          nullptr, nullptr, &cError);
+      }
 
       // Create the indices on the rule tables.
       if (result == SQLITE_OK) {
@@ -247,6 +521,14 @@ class SQLiteBuildDB : public BuildDB {
             db, "CREATE UNIQUE INDEX rule_results_idx ON rule_results (key_id);",
             nullptr, nullptr, &cError);
       }
+      if (result == SQLITE_OK) {
+        // Create an index to be used for efficiently looking up the rules which
+        // depend on a key.
+        result = sqlite3_exec(
+            db, ("CREATE INDEX reverse_dependencies_idx "
+                 "ON reverse_dependencies (key_id, dependent_id);"),
+            nullptr, nullptr, &cError);
+      }
 
       // Sync changes to disk.
       if (result == SQLITE_OK) {
@@ -263,17 +545,21 @@ class SQLiteBuildDB : public BuildDB {
       }
     }
 
+    // Use write-ahead logging, so that readers are not blocked by a running
+    // build and results can be committed incrementally while it runs. In this
+    // mode the NORMAL synchronization level is still safe against a crash of
+    // the process, only a power loss can roll back the most recent commits.
+    result = sqlite3_exec(
+      db, "PRAGMA journal_mode = WAL; PRAGMA synchronous = NORMAL;",
+      nullptr, nullptr, nullptr);
+    checkSQLiteResultOKReturnFalse(result);
+
     // Initialize prepared statements.
     result = sqlite3_prepare_v2(
       db, findKeyIDForKeyStmtSQL,
       -1, &findKeyIDForKeyStmt, nullptr);
     checkSQLiteResultOKReturnFalse(result);
 
-    result = sqlite3_prepare_v2(
-      db, findKeyNameForKeyIDStmtSQL,
-      -1, &findKeyNameForKeyIDStmt, nullptr);
-    checkSQLiteResultOKReturnFalse(result);
-
     result = sqlite3_prepare_v2(
       db, insertIntoKeysStmtSQL,
       -1, &insertIntoKeysStmt, nullptr);
@@ -290,35 +576,84 @@ class SQLiteBuildDB : public BuildDB {
     checkSQLiteResultOKReturnFalse(result);
 
     result = sqlite3_prepare_v2(
-      db, findRuleResultStmtSQL,
-      -1, &findRuleResultStmt, nullptr);
+      db, getKeysWithResultStmtSQL,
+      -1, &getKeysWithResultStmt, nullptr);
     checkSQLiteResultOKReturnFalse(result);
 
     result = sqlite3_prepare_v2(
-      db, fastFindRuleResultStmtSQL,
-      -1, &fastFindRuleResultStmt, nullptr);
+      db, deleteReverseDependenciesStmtSQL,
+      -1, &deleteReverseDependenciesStmt, nullptr);
     checkSQLiteResultOKReturnFalse(result);
-    
+
     result = sqlite3_prepare_v2(
-      db, getKeysWithResultStmtSQL,
-      -1, &getKeysWithResultStmt, nullptr);
+      db, insertReverseDependencyStmtSQL,
+      -1, &insertReverseDependencyStmt, nullptr);
     checkSQLiteResultOKReturnFalse(result);
 
+    mainLookup.db = db;
+    if (!prepareLookupStatements(mainLookup, error_out))
+      return false;
+
+    if (!loadReverseDependencyIndexState(error_out))
+      return false;
+
+    isOpen = true;
+    return true;
+  }
+
+  /// Prepare the statements used to look up results on a connection.
+  static bool prepareLookupStatements(LookupConnection& connection,
+                                      std::string *error_out) {
+    const struct {
+      const char* sql;
+      sqlite3_stmt** stmt;
+    } statements[] = {
+      { findRuleResultStmtSQL, &connection.findRuleResultStmt },
+      { fastFindRuleResultStmtSQL, &connection.fastFindRuleResultStmt },
+      { findRuleResultWithoutValueStmtSQL,
+        &connection.findRuleResultWithoutValueStmt },
+      { fastFindRuleResultWithoutValueStmtSQL,
+        &connection.fastFindRuleResultWithoutValueStmt },
+      { findRuleResultValueStmtSQL, &connection.findRuleResultValueStmt },
+      { findKeyNameForKeyIDStmtSQL, &connection.findKeyNameForKeyIDStmt },
+    };
+    for (const auto& statement: statements) {
+      int result = sqlite3_prepare_v2(connection.db, statement.sql, -1,
+                                      statement.stmt, nullptr);
+      if (result != SQLITE_OK) {
+        *error_out = getCurrentErrorMessage(connection.db);
+        return false;
+      }
+    }
     return true;
   }
 
+  /// Destroy the statements used to look up results on a connection.
+  static void finalizeLookupStatements(LookupConnection& connection) {
+    for (auto stmt: { &connection.findRuleResultStmt,
+                      &connection.fastFindRuleResultStmt,
+                      &connection.findRuleResultWithoutValueStmt,
+                      &connection.fastFindRuleResultWithoutValueStmt,
+                      &connection.findRuleResultValueStmt,
+                      &connection.findKeyNameForKeyIDStmt }) {
+      sqlite3_finalize(*stmt);
+      *stmt = nullptr;
+    }
+  }
+
   void close() {
     if (!db) return;
 
+    // Close the reader connections first, they are only valid while the main
+    // connection is open.
+    isOpen = false;
+    closeReaders();
+
     // Destroy prepared statements.
+    finalizeLookupStatements(mainLookup);
+    mainLookup.db = nullptr;
     sqlite3_finalize(findKeyIDForKeyStmt);
     findKeyIDForKeyStmt = nullptr;
-    sqlite3_finalize(findKeyNameForKeyIDStmt);
-    findKeyNameForKeyIDStmt = nullptr;
-    sqlite3_finalize(findRuleResultStmt);
-    findRuleResultStmt = nullptr;
-    sqlite3_finalize(fastFindRuleResultStmt);
-    fastFindRuleResultStmt = nullptr;
     sqlite3_finalize(deleteFromKeysStmt);
     deleteFromKeysStmt = nullptr;
     sqlite3_finalize(insertIntoKeysStmt);
@@ -327,6 +662,21 @@ class SQLiteBuildDB : public BuildDB {
     insertIntoRuleResultsStmt = nullptr;
     sqlite3_finalize(getKeysWithResultStmt);
     getKeysWithResultStmt = nullptr;
+    sqlite3_finalize(deleteReverseDependenciesStmt);
+    deleteReverseDependenciesStmt = nullptr;
+    sqlite3_finalize(insertReverseDependencyStmt);
+    insertReverseDependencyStmt = nullptr;
+    for (auto& stmt: insertKeysStmts) {
+      sqlite3_finalize(stmt);
+      stmt = nullptr;
+    }
+    isKeyTableLoaded = false;
+    isReverseDependencyIndexBuilt = false;
+    keyTableDataVersion = -1;
+    {
+      std::lock_guard<std::mutex> guard(writerMutex);
+      uncommittedKeyIDs.clear();
+    }
 
     int result = sqlite3_close(db);
     (void)result; // use the variable if we're building without asserts
@@ -334,14 +684,96 @@ class SQLiteBuildDB : public BuildDB {
     db = nullptr;
   }
 
+  /// Get a reader connection to look up the result for a key, if possible.
+  ///
+  /// Reader connections allow lookups to proceed concurrently with each other,
+  /// and with the writes of a running build. However, they only see committed
+  /// results, so cannot be used for keys whose results are being written by
+  /// the current build. If this returns null, the lookup must be done on the
+  /// main connection instead.
+  std::unique_ptr<LookupConnection> acquireReader(KeyID keyID) {
+    if (!isOpen)
+      return nullptr;
+
+    {
+      std::lock_guard<std::mutex> guard(writerMutex);
+      if (pendingResults.count(keyID) || uncommittedKeyIDs.count(keyID))
+        return nullptr;
+    }
+
+    {
+      std::lock_guard<std::mutex> guard(readerPoolMutex);
+      if (!idleReaders.empty()) {
+        auto reader = std::move(idleReaders.back());
+        idleReaders.pop_back();
+        return reader;
+      }
+      if (numReaders == maxReaders)
+        return nullptr;
+      ++numReaders;
+    }
+
+    // Open a new reader, outside of the lock. If this fails for any reason, we
+    // just fall back to the main connection.
+    auto reader = llvm::make_unique<LookupConnection>();
+    std::string error;
+    int result = sqlite3_open_v2(path.c_str(), &reader->db,
+                                 SQLITE_OPEN_READONLY, nullptr);
+    if (result == SQLITE_OK) {
+      sqlite3_busy_timeout(reader->db, 5000);
+      if (prepareLookupStatements(*reader, &error))
+        return reader;
+      finalizeLookupStatements(*reader);
+    }
+    sqlite3_close(reader->db);
+    std::lock_guard<std::mutex> guard(readerPoolMutex);
+    --numReaders;
+    return nullptr;
+  }
+
+  /// Return a reader connection to the pool, \see acquireReader().
+  void releaseReader(std::unique_ptr<LookupConnection> reader) {
+    // Reset the statements, so that the reader does not hold its read
+    // transaction open (which would prevent the log from being checkpointed).
+    for (auto stmt: { reader->findRuleResultStmt,
+                      reader->fastFindRuleResultStmt,
+                      reader->findRuleResultWithoutValueStmt,
+                      reader->fastFindRuleResultWithoutValueStmt,
+                      reader->findRuleResultValueStmt,
+                      reader->findKeyNameForKeyIDStmt })
+      sqlite3_reset(stmt);
+
+    std::lock_guard<std::mutex> guard(readerPoolMutex);
+    idleReaders.push_back(std::move(reader));
+  }
+
+  /// Close all of the reader connections, none of which may be in use.
+  void closeReaders() {
+    std::lock_guard<std::mutex> guard(readerPoolMutex);
+    assert(idleReaders.size() == numReaders && "reader connection in use");
+    for (auto& reader: idleReaders) {
+      finalizeLookupStatements(*reader);
+      sqlite3_close(reader->db);
+    }
+    idleReaders.clear();
+    numReaders = 0;
+  }
+
 public:
-  SQLiteBuildDB(StringRef path, uint32_t clientSchemaVersion, bool recreateOnUnmatchedVersion)
-    : path(path), clientSchemaVersion(clientSchemaVersion), recreateOnUnmatchedVersion(recreateOnUnmatchedVersion) { }
+  SQLiteBuildDB(StringRef path, uint32_t clientSchemaVersion,
+                bool recreateOnUnmatchedVersion, bool writeBehind,
+                bool compress)
+    : path(path), clientSchemaVersion(clientSchemaVersion),
+      recreateOnUnmatchedVersion(recreateOnUnmatchedVersion),
+      writeBehind(writeBehind), compress(compress) { }
 
   virtual ~SQLiteBuildDB() {
+    stopWriterThread();
+
     std::lock_guard<std::mutex> guard(dbMutex);
     if (db)
       close();
+    releaseBuildLock();
   }
 
   /// @name BuildDB API
@@ -425,219 +857,580 @@ public:
   // equivalent to the mapping we would have to do for the DBKeyID, but defers
   // the creation of new IDs until we actually need them in setRuleResult().
   static constexpr const char *findRuleResultStmtSQL = (
-      "SELECT rule_results.key_id, value, built_at, computed_at, start, end, dependencies, signature FROM rule_results "
+      "SELECT rule_results.key_id, value, built_at, computed_at, start, end, dependencies, signature, flags, peak_rss FROM rule_results "
       "INNER JOIN key_names ON key_names.id = rule_results.key_id WHERE key == ?;");
-  sqlite3_stmt* findRuleResultStmt = nullptr;
 
   // Fast path find result for rules we already know they ID for
   static constexpr const char *fastFindRuleResultStmtSQL = (
-      "SELECT key_id, value, built_at, computed_at, start, end, dependencies, signature FROM rule_results "
+      "SELECT key_id, value, built_at, computed_at, start, end, dependencies, signature, flags, peak_rss FROM rule_results "
+      "WHERE key_id == ?;");
+
+  // Variants of the above which omit the value (while preserving the column
+  // layout), used when the client defers loading it.
+  static constexpr const char *findRuleResultWithoutValueStmtSQL = (
+      "SELECT rule_results.key_id, NULL, built_at, computed_at, start, end, dependencies, signature, flags, peak_rss FROM rule_results "
+      "INNER JOIN key_names ON key_names.id = rule_results.key_id WHERE key == ?;");
+  static constexpr const char *fastFindRuleResultWithoutValueStmtSQL = (
+      "SELECT key_id, NULL, built_at, computed_at, start, end, dependencies, signature, flags, peak_rss FROM rule_results "
       "WHERE key_id == ?;");
-  sqlite3_stmt* fastFindRuleResultStmt = nullptr;
+
+  // Find only the value of a result, for rules we already know the ID for.
+  static constexpr const char *findRuleResultValueStmtSQL = (
+      "SELECT value, flags FROM rule_results WHERE key_id == ?;");
   
   static constexpr const char *getKeysWithResultStmtSQL = (
-      "SELECT rule_results.key_id, key_names.key, rule_results.value, rule_results.built_at, rule_results.computed_at, rule_results.start, rule_results.end, rule_results.dependencies, rule_results.signature FROM rule_results "
+      "SELECT rule_results.key_id, key_names.key, rule_results.value, rule_results.built_at, rule_results.computed_at, rule_results.start, rule_results.end, rule_results.dependencies, rule_results.signature, rule_results.flags, rule_results.peak_rss FROM rule_results "
       "JOIN key_names WHERE rule_results.key_id == key_names.id;");
   sqlite3_stmt* getKeysWithResultStmt = nullptr;
 
   virtual bool lookupRuleResult(KeyID keyID, const KeyType& key,
                                 Result* result_out,
                                 std::string *error_out) override {
+    return lookupRuleResultImpl(keyID, key, result_out, /*includeValue=*/true,
+                                error_out);
+  }
+
+  virtual bool lookupRuleResultWithoutValue(KeyID keyID, const KeyType& key,
+                                            Result* result_out,
+                                            bool* valueLoaded_out,
+                                            std::string *error_out) override {
+    *valueLoaded_out = false;
+    return lookupRuleResultImpl(keyID, key, result_out, /*includeValue=*/false,
+                                error_out, valueLoaded_out);
+  }
+
+  bool lookupRuleResultImpl(KeyID keyID, const KeyType& key,
+                            Result* result_out, bool includeValue,
+                            std::string *error_out,
+                            bool* valueLoaded_out = nullptr) {
     assert(delegate != nullptr);
-    std::lock_guard<std::mutex> guard(dbMutex);
     assert(result_out->builtAt == 0);
 
+    // Use the preloaded result, if available (each is only used once).
+    {
+      std::lock_guard<std::mutex> guard(keyCacheMutex);
+      auto preloaded = preloadedResults.find(keyID);
+      if (preloaded != preloadedResults.end()) {
+        *result_out = std::move(preloaded->second);
+        preloadedResults.erase(preloaded);
+        if (valueLoaded_out)
+          *valueLoaded_out = true;
+        return true;
+      }
+    }
+
+    // Use a reader connection if possible, so that concurrent lookups do not
+    // serialize on the main connection.
+    if (auto reader = acquireReader(keyID)) {
+      bool found = lookupRuleResultOn(*reader, keyID, key, result_out,
+                                      includeValue, error_out);
+      releaseReader(std::move(reader));
+      return found;
+    }
+
+    std::lock_guard<std::mutex> guard(dbMutex);
+
     if (!open(error_out)) {
       return false;
     }
 
-    // Fetch the basic rule information.
-    int result;
-    int numDependencyBytes = 0;
-    const void* dependencyBytes = nullptr;
-    DBKeyID dbKeyID;
+    if (!flushPendingResult(keyID, error_out)) {
+      return false;
+    }
 
-    // Check if we already have the key mapping
-    auto it = dbKeyIDs.find(keyID);
-    if (it != dbKeyIDs.end()) {
-      // DBKeyID is known, perform the fast path that avoids table joining
+    return lookupRuleResultOn(mainLookup, keyID, key, result_out, includeValue,
+                              error_out);
+  }
 
-      result = sqlite3_reset(fastFindRuleResultStmt);
-      checkSQLiteResultOKReturnFalse(result);
-      result = sqlite3_clear_bindings(fastFindRuleResultStmt);
-      checkSQLiteResultOKReturnFalse(result);
-      result = sqlite3_bind_int64(fastFindRuleResultStmt, /*index=*/1,
-                                  it->second.value);
-      checkSQLiteResultOKReturnFalse(result);
+  /// Look up the result for a rule on the given connection.
+  ///
+  /// This method is not thread-safe. The caller must have exclusive use of the
+  /// connection (via the dbMutex, for the main connection).
+  bool lookupRuleResultOn(LookupConnection& connection, KeyID keyID,
+                          const KeyType& key, Result* result_out,
+                          bool includeValue, std::string *error_out) {
+#define checkSQLiteResultOKReturnFalseOn(result) \
+if (result != SQLITE_OK) { \
+  *error_out = getCurrentErrorMessage(connection.db); \
+  return false; \
+}
 
-      // If the rule wasn't found, we are done.
-      result = sqlite3_step(fastFindRuleResultStmt);
-      if (result == SQLITE_DONE)
-        return false;
-      if (result != SQLITE_ROW) {
-        *error_out = getCurrentErrorMessage();
+    // Check if we already have the key mapping. While the key table is
+    // loaded, a key without an ID has no result.
+    DBKeyID knownDBKeyID;
+    {
+      std::lock_guard<std::mutex> guard(keyCacheMutex);
+      auto it = dbKeyIDs.find(keyID);
+      if (it != dbKeyIDs.end()) {
+        knownDBKeyID = it->second;
+      } else if (isKeyTableLoaded) {
         return false;
       }
+    }
 
-      // Otherwise, read the result contents from the row.
-      assert(sqlite3_column_count(fastFindRuleResultStmt) == 8);
-      dbKeyID = DBKeyID(sqlite3_column_int64(fastFindRuleResultStmt, 0));
-      int numValueBytes = sqlite3_column_bytes(fastFindRuleResultStmt, 1);
-      result_out->value.resize(numValueBytes);
-      memcpy(result_out->value.data(),
-             sqlite3_column_blob(fastFindRuleResultStmt, 1),
-             numValueBytes);
-      result_out->builtAt = sqlite3_column_int64(fastFindRuleResultStmt, 2);
-      result_out->computedAt = sqlite3_column_int64(fastFindRuleResultStmt, 3);
-      result_out->start = sqlite3_column_double(fastFindRuleResultStmt, 4);
-      result_out->end = sqlite3_column_double(fastFindRuleResultStmt, 5);
-
-      // Extract the dependencies binary blob.
-      numDependencyBytes = sqlite3_column_bytes(fastFindRuleResultStmt, 6);
-      dependencyBytes = sqlite3_column_blob(fastFindRuleResultStmt, 6);
-
-      // Extract the signature
-      result_out->signature =
-        basic::CommandSignature(sqlite3_column_int64(fastFindRuleResultStmt, 7));
+    // Fetch the basic rule information.
+    int result;
+    sqlite3_stmt* stmt;
+    if (knownDBKeyID.value != 0) {
+      // DBKeyID is known, perform the fast path that avoids table joining
+      stmt = includeValue ? connection.fastFindRuleResultStmt
+                          : connection.fastFindRuleResultWithoutValueStmt;
+
+      result = sqlite3_reset(stmt);
+      checkSQLiteResultOKReturnFalseOn(result);
+      result = sqlite3_clear_bindings(stmt);
+      checkSQLiteResultOKReturnFalseOn(result);
+      result = sqlite3_bind_int64(stmt, /*index=*/1, knownDBKeyID.value);
+      checkSQLiteResultOKReturnFalseOn(result);
     } else {
       // KeyID is not known, perform the 'normal' search using the key value
-
-      result = sqlite3_reset(findRuleResultStmt);
-      checkSQLiteResultOKReturnFalse(result);
-      result = sqlite3_clear_bindings(findRuleResultStmt);
-      checkSQLiteResultOKReturnFalse(result);
-      result = sqlite3_bind_text(findRuleResultStmt, /*index=*/1,
+      stmt = includeValue ? connection.findRuleResultStmt
+                          : connection.findRuleResultWithoutValueStmt;
+
+      result = sqlite3_reset(stmt);
+      checkSQLiteResultOKReturnFalseOn(result);
+      result = sqlite3_clear_bindings(stmt);
+      checkSQLiteResultOKReturnFalseOn(result);
+      result = sqlite3_bind_text(stmt, /*index=*/1,
                                  key.data(), key.size(),
                                  SQLITE_STATIC);
-      checkSQLiteResultOKReturnFalse(result);
-
-      // If the rule wasn't found, we are done.
-      result = sqlite3_step(findRuleResultStmt);
-      if (result == SQLITE_DONE)
-        return false;
-      if (result != SQLITE_ROW) {
-        *error_out = getCurrentErrorMessage();
-        return false;
-      }
+      checkSQLiteResultOKReturnFalseOn(result);
+    }
 
-      // Otherwise, read the result contents from the row.
-      assert(sqlite3_column_count(findRuleResultStmt) == 8);
-      dbKeyID = DBKeyID(sqlite3_column_int64(findRuleResultStmt, 0));
-      int numValueBytes = sqlite3_column_bytes(findRuleResultStmt, 1);
-      result_out->value.resize(numValueBytes);
-      memcpy(result_out->value.data(),
-             sqlite3_column_blob(findRuleResultStmt, 1),
-             numValueBytes);
-      result_out->builtAt = sqlite3_column_int64(findRuleResultStmt, 2);
-      result_out->computedAt = sqlite3_column_int64(findRuleResultStmt, 3);
-      result_out->start = sqlite3_column_double(findRuleResultStmt, 4);
-      result_out->end = sqlite3_column_double(findRuleResultStmt, 5);
+    // If the rule wasn't found, we are done.
+    result = sqlite3_step(stmt);
+    if (result == SQLITE_DONE)
+      return false;
+    if (result != SQLITE_ROW) {
+      *error_out = getCurrentErrorMessage(connection.db);
+      return false;
+    }
 
-      // Cache the engine key mapping
-      engineKeyIDs[dbKeyID] = keyID;
-      dbKeyIDs[keyID] = dbKeyID;
+    // Otherwise, read the result contents from the row.
+    assert(sqlite3_column_count(stmt) == 10);
+    DBKeyID dbKeyID(sqlite3_column_int64(stmt, 0));
+    if (includeValue &&
+        !readValueColumn(dbKeyID, stmt, 1, 8, &result_out->value,
+                         error_out)) {
+      return false;
+    }
+    result_out->builtAt = sqlite3_column_int64(stmt, 2);
+    result_out->computedAt = sqlite3_column_int64(stmt, 3);
+    result_out->start = sqlite3_column_double(stmt, 4);
+    result_out->end = sqlite3_column_double(stmt, 5);
+    result_out->peakRSS = sqlite3_column_int64(stmt, 9);
+
+    // Cache the engine key mapping
+    if (knownDBKeyID.value == 0)
+      cacheKeyIDMapping(dbKeyID, keyID);
+
+    // Extract the signature
+    result_out->signature =
+      basic::CommandSignature(sqlite3_column_int64(stmt, 7));
+
+    return decodeDependencies(connection, dbKeyID, stmt, 6, 8, result_out,
+                              error_out);
+  }
 
-      // Extract the dependencies binary blob.
-      numDependencyBytes = sqlite3_column_bytes(findRuleResultStmt, 6);
-      dependencyBytes = sqlite3_column_blob(findRuleResultStmt, 6);
+  /// Look up the value of the result for a rule on the given connection.
+  ///
+  /// This method is not thread-safe. The caller must have exclusive use of the
+  /// connection (via the dbMutex, for the main connection).
+  bool lookupRuleResultValueOn(LookupConnection& connection, DBKeyID dbKeyID,
+                               ValueType* value_out, std::string *error_out) {
+    auto stmt = connection.findRuleResultValueStmt;
+    int result;
+    result = sqlite3_reset(stmt);
+    checkSQLiteResultOKReturnFalseOn(result);
+    result = sqlite3_clear_bindings(stmt);
+    checkSQLiteResultOKReturnFalseOn(result);
+    result = sqlite3_bind_int64(stmt, /*index=*/1, dbKeyID.value);
+    checkSQLiteResultOKReturnFalseOn(result);
 
-      // Extract the signature
-      result_out->signature =
-        basic::CommandSignature(sqlite3_column_int64(findRuleResultStmt, 7));
+    result = sqlite3_step(stmt);
+    if (result == SQLITE_DONE)
+      return false;
+    if (result != SQLITE_ROW) {
+      *error_out = getCurrentErrorMessage(connection.db);
+      return false;
     }
 
+    return readValueColumn(dbKeyID, stmt, 0, 1, value_out, error_out);
+#undef checkSQLiteResultOKReturnFalseOn
+  }
+
+  /// Get the error message for a malformed result.
+  static std::string getMalformedResultMessage(DBKeyID dbKeyID) {
+    return (llvm::Twine("unexpected contents for database result: ") +
+            llvm::Twine((int)dbKeyID.value)).str();
+  }
 
-    int numDependencies = numDependencyBytes / sizeof(uint64_t);
-    if (numDependencyBytes != numDependencies * sizeof(uint64_t)) {
-      *error_out = (llvm::Twine("unexpected contents for database result: ") +
-                    llvm::Twine((int)dbKeyID.value)).str();
+  /// Read the value of a result from the given column of a row, using the
+  /// flags in \p flagsColumn.
+  bool readValueColumn(DBKeyID dbKeyID, sqlite3_stmt* stmt, int column,
+                       int flagsColumn, ValueType* value_out,
+                       std::string *error_out) {
+    bool compressed = sqlite3_column_int(stmt, flagsColumn) & CompressedValue;
+    if (!readBlobColumn(stmt, column, compressed, *value_out)) {
+      *error_out = getMalformedResultMessage(dbKeyID);
       return false;
     }
-    result_out->dependencies.resize(numDependencies);
-    basic::BinaryDecoder decoder(
-        StringRef((const char*)dependencyBytes, numDependencyBytes));
-    for (auto i = 0; i != numDependencies; ++i) {
-      uint64_t raw;
-      decoder.read(raw);
-      bool flag = raw & 1;
-      DBKeyID dbKeyID(raw >> 1);
-
-      // Map the database key ID into an engine key ID (note that we already
-      // hold the dbMutex at this point as required by getKeyIDforID())
-      KeyID keyID = getKeyIDForID(dbKeyID, error_out);
-      if (!error_out->empty()) {
+    return true;
+  }
+
+  /// Read the encoded dependencies of a result from the given column of a row,
+  /// using the flags in \p flagsColumn.
+  ///
+  /// \param storage Storage for the bytes, if they must be decompressed.
+  /// \param bytes_out [out] The encoded dependencies, valid until the row or
+  /// \p storage changes.
+  bool readDependencyBytes(DBKeyID dbKeyID, sqlite3_stmt* stmt, int column,
+                           int flagsColumn, std::vector<uint8_t>& storage,
+                           StringRef* bytes_out, std::string *error_out) {
+    StringRef dependencyBytes(
+        (const char*)sqlite3_column_blob(stmt, column),
+        sqlite3_column_bytes(stmt, column));
+    if (sqlite3_column_int(stmt, flagsColumn) & CompressedDependencies) {
+      if (!readBlobColumn(stmt, column, /*compressed=*/true, storage)) {
+        *error_out = getMalformedResultMessage(dbKeyID);
         return false;
       }
-      result_out->dependencies.set(i, keyID, flag);
+      dependencyBytes = StringRef((const char*)storage.data(), storage.size());
     }
 
+    // Each dependency is a variable-length integer, so the last byte must
+    // terminate one, and none may be longer than a 64-bit value needs. This
+    // guarantees they can be decoded without reading past the end.
+    unsigned varIntSize = 0;
+    for (char c: dependencyBytes) {
+      varIntSize = (uint8_t(c) & 0x80) ? varIntSize + 1 : 0;
+      if (varIntSize >= maxVarIntSize)
+        break;
+    }
+    if (varIntSize != 0) {
+      *error_out = getMalformedResultMessage(dbKeyID);
+      return false;
+    }
+    *bytes_out = dependencyBytes;
     return true;
   }
 
-  static constexpr const char *insertIntoRuleResultsStmtSQL =
-    "INSERT OR REPLACE INTO rule_results VALUES (?, ?, ?, ?, ?, ?, ?, ?);";
-  sqlite3_stmt* insertIntoRuleResultsStmt = nullptr;
+  /// Get the number of dependencies in an encoded dependency list.
+  static size_t getNumEncodedDependencies(StringRef bytes) {
+    // Count the final bytes of each variable-length integer.
+    return std::count_if(bytes.begin(), bytes.end(),
+                         [](char c) { return (uint8_t(c) & 0x80) == 0; });
+  }
 
-  static constexpr const char *findKeyIDForKeyStmtSQL = (
-      "SELECT id FROM key_names "
-      "WHERE key == ? LIMIT 1;");
-  sqlite3_stmt* findKeyIDForKeyStmt = nullptr;
+  /// Decode the dependencies of a result from the given column of a row (on
+  /// the given connection), using the flags in \p flagsColumn.
+  ///
+  /// This method is not thread-safe. The caller must have exclusive use of the
+  /// connection (via the dbMutex, for the main connection).
+  bool decodeDependencies(LookupConnection& connection, DBKeyID dbKeyID,
+                          sqlite3_stmt* stmt, int column, int flagsColumn,
+                          Result* result_out, std::string *error_out) {
+    std::vector<uint8_t> decompressed;
+    StringRef dependencyBytes;
+    if (!readDependencyBytes(dbKeyID, stmt, column, flagsColumn, decompressed,
+                             &dependencyBytes, error_out)) {
+      return false;
+    }
 
-  static constexpr const char *findKeyNameForKeyIDStmtSQL = (
-      "SELECT key FROM key_names "
-      "WHERE id == ? LIMIT 1;");
-  sqlite3_stmt* findKeyNameForKeyIDStmt = nullptr;
+    size_t numDependencies = getNumEncodedDependencies(dependencyBytes);
+    result_out->dependencies.resize(numDependencies);
+    basic::BinaryDecoder decoder(dependencyBytes);
+
+    // Map the database key IDs into engine key IDs, using the cache for as
+    // many as possible while holding its lock once.
+    llvm::SmallVector<std::pair<size_t, DBKeyID>, 8> uncachedDependencies;
+    {
+      std::lock_guard<std::mutex> guard(keyCacheMutex);
+      for (size_t i = 0; i != numDependencies; ++i) {
+        uint64_t raw;
+        decoder.readVarInt(raw);
+        bool flag = raw & 1;
+        DBKeyID dbKeyID(raw >> 1);
 
-  static constexpr const char *insertIntoKeysStmtSQL =
-  "INSERT OR IGNORE INTO key_names(key) VALUES (?);";
-  sqlite3_stmt* insertIntoKeysStmt = nullptr;
+        KeyID keyID = KeyID::novalue();
+        if (dbKeyID.value < engineKeyIDs.size())
+          keyID = engineKeyIDs[dbKeyID.value];
+        if (keyID == KeyID::novalue())
+          uncachedDependencies.push_back({ i, dbKeyID });
+        result_out->dependencies.set(i, keyID, flag);
+      }
+    }
+    for (const auto& entry: uncachedDependencies) {
+      KeyID keyID = getKeyIDForID(connection, entry.second, error_out);
+      if (!error_out->empty()) {
+        return false;
+      }
+      result_out->dependencies.set(
+          entry.first, keyID, result_out->dependencies[entry.first].flag);
+    }
 
-  virtual bool setRuleResult(KeyID keyID,
-                             const Rule& rule,
-                             const Result& ruleResult,
-                             std::string *error_out) override {
+    return true;
+  }
+
+  virtual bool preloadResults(std::string *error_out) override {
     assert(delegate != nullptr);
     std::lock_guard<std::mutex> guard(dbMutex);
-    int result;
 
     if (!open(error_out)) {
       return false;
     }
 
-    auto dbKeyID = getKeyID(keyID, error_out);
-    if (!error_out->empty()) {
+    // Load the key mappings first, so that dependencies can be mapped without
+    // further queries.
+    if (!loadKeyTable(error_out)) {
       return false;
     }
 
-    // Create the encoded dependency list.
-    //
-    // FIXME: We could save some reallocation by having a templated SmallVector
-    // size here.
-    basic::BinaryEncoder encoder{};
-    for (auto keyIDAndFlag: ruleResult.dependencies) {
-      // Map the enging keyID to a database key ID
-      //
-      // FIXME: This is naively mapping all keys with no caching at this point,
-      // thus likely to perform poorly.  Should refactor this into a bulk
-      // query or a DB layer cache.
-      auto dbKeyID = getKeyID(keyIDAndFlag.keyID, error_out);
+    // Load every result in a single scan.
+    int result;
+    sqlite3_stmt* stmt;
+    result = sqlite3_prepare_v2(
+      db, ("SELECT key_id, value, built_at, computed_at, start, end, "
+           "dependencies, signature, flags, peak_rss FROM rule_results;"),
+      -1, &stmt, nullptr);
+    checkSQLiteResultOKReturnFalse(result);
+
+    llvm::DenseMap<KeyID, Result> results;
+    while ((result = sqlite3_step(stmt)) == SQLITE_ROW) {
+      assert(sqlite3_column_count(stmt) == 10);
+      auto dbKeyID = DBKeyID(sqlite3_column_int64(stmt, 0));
+      KeyID keyID = getKeyIDForID(mainLookup, dbKeyID, error_out);
       if (!error_out->empty()) {
+        sqlite3_finalize(stmt);
         return false;
       }
-      encoder.write((dbKeyID.value << 1) + keyIDAndFlag.flag);
-    }
 
-    // Insert the actual rule result.
-    result = sqlite3_reset(insertIntoRuleResultsStmt);
-    checkSQLiteResultOKReturnFalse(result);
-    result = sqlite3_clear_bindings(insertIntoRuleResultsStmt);
-    checkSQLiteResultOKReturnFalse(result);
-    result = sqlite3_bind_int64(insertIntoRuleResultsStmt, /*index=*/1,
+      Result& entry = results[keyID];
+      if (!readValueColumn(dbKeyID, stmt, 1, 8, &entry.value, error_out)) {
+        sqlite3_finalize(stmt);
+        return false;
+      }
+      entry.builtAt = sqlite3_column_int64(stmt, 2);
+      entry.computedAt = sqlite3_column_int64(stmt, 3);
+      entry.start = sqlite3_column_double(stmt, 4);
+      entry.end = sqlite3_column_double(stmt, 5);
+      entry.peakRSS = sqlite3_column_int64(stmt, 9);
+      entry.signature = basic::CommandSignature(sqlite3_column_int64(stmt, 7));
+      if (!decodeDependencies(mainLookup, dbKeyID, stmt, 6, 8, &entry,
+                              error_out)) {
+        sqlite3_finalize(stmt);
+        return false;
+      }
+    }
+    sqlite3_finalize(stmt);
+    if (result != SQLITE_DONE) {
+      *error_out = getCurrentErrorMessage();
+      return false;
+    }
+
+    std::lock_guard<std::mutex> cacheGuard(keyCacheMutex);
+    for (auto& entry: results)
+      preloadedResults[entry.first] = std::move(entry.second);
+    return true;
+  }
+
+  virtual bool lookupRuleResultValue(KeyID keyID, const KeyType& key,
+                                     ValueType* value_out,
+                                     std::string *error_out) override {
+    assert(delegate != nullptr);
+
+    // If we know the key mapping (as we will if the rest of the result was
+    // just looked up), fetch only the value.
+    DBKeyID dbKeyID;
+    {
+      std::lock_guard<std::mutex> guard(keyCacheMutex);
+      auto it = dbKeyIDs.find(keyID);
+      if (it != dbKeyIDs.end())
+        dbKeyID = it->second;
+    }
+    if (dbKeyID.value != 0) {
+      if (auto reader = acquireReader(keyID)) {
+        bool found = lookupRuleResultValueOn(*reader, dbKeyID, value_out,
+                                             error_out);
+        releaseReader(std::move(reader));
+        return found;
+      }
+
+      std::lock_guard<std::mutex> guard(dbMutex);
+
+      if (!open(error_out)) {
+        return false;
+      }
+
+      if (!flushPendingResult(keyID, error_out)) {
+        return false;
+      }
+
+      return lookupRuleResultValueOn(mainLookup, dbKeyID, value_out,
+                                     error_out);
+    }
+
+    // Otherwise, perform a full lookup.
+    Result result;
+    if (!lookupRuleResult(keyID, key, &result, error_out))
+      return false;
+    *value_out = std::move(result.value);
+    return true;
+  }
+
+  static constexpr const char *insertIntoRuleResultsStmtSQL =
+    "INSERT OR REPLACE INTO rule_results VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?);";
+  sqlite3_stmt* insertIntoRuleResultsStmt = nullptr;
+
+  static constexpr const char *findKeyIDForKeyStmtSQL = (
+      "SELECT id FROM key_names "
+      "WHERE key == ? LIMIT 1;");
+  sqlite3_stmt* findKeyIDForKeyStmt = nullptr;
+
+  static constexpr const char *findKeyNameForKeyIDStmtSQL = (
+      "SELECT key FROM key_names "
+      "WHERE id == ? LIMIT 1;");
+
+  static constexpr const char *insertIntoKeysStmtSQL =
+  "INSERT OR IGNORE INTO key_names(key) VALUES (?);";
+  sqlite3_stmt* insertIntoKeysStmt = nullptr;
+
+  static constexpr const char *deleteReverseDependenciesStmtSQL = (
+      "DELETE FROM reverse_dependencies WHERE dependent_id == ?;");
+  sqlite3_stmt* deleteReverseDependenciesStmt = nullptr;
+
+  static constexpr const char *insertReverseDependencyStmtSQL = (
+      "INSERT OR IGNORE INTO reverse_dependencies VALUES (?, ?);");
+  sqlite3_stmt* insertReverseDependencyStmt = nullptr;
+
+  /// The maximum number of keys inserted by a single statement, \see
+  /// insertKeys().
+  static constexpr unsigned maxKeysPerInsert = 64;
+
+  /// The multi-row key insertion statements, indexed by number of rows (these
+  /// are prepared lazily).
+  sqlite3_stmt* insertKeysStmts[maxKeysPerInsert + 1] = {};
+
+  virtual bool setRuleResult(KeyID keyID,
+                             const Rule& rule,
+                             const Result& ruleResult,
+                             std::string *error_out) override {
+    assert(delegate != nullptr);
+
+    // Any preloaded result is now stale.
+    {
+      std::lock_guard<std::mutex> guard(keyCacheMutex);
+      preloadedResults.erase(keyID);
+    }
+
+    {
+      std::lock_guard<std::mutex> guard(writerMutex);
+      if (!writerError.empty()) {
+        *error_out = writerError;
+        writerError.clear();
+        return false;
+      }
+
+      // In write-behind mode, hand a snapshot of the result off to the writer
+      // thread. If there is already a pending result for the rule, it is
+      // simply superseded.
+      if (isWritingBehind) {
+        bool wasEmpty = pendingResults.empty();
+        pendingResults[keyID] = ruleResult;
+        if (wasEmpty)
+          writerCondition.notify_one();
+        return true;
+      }
+    }
+
+    std::lock_guard<std::mutex> guard(dbMutex);
+
+    if (!open(error_out)) {
+      return false;
+    }
+
+    return writeRuleResult(keyID, ruleResult, error_out) &&
+      commitBuildTransactionIfFull(error_out);
+  }
+
+  /// Write a rule result to the database.
+  ///
+  /// This method is not thread-safe. The caller must protect access via the
+  /// dbMutex.
+  bool writeRuleResult(KeyID keyID, const Result& ruleResult,
+                       std::string *error_out) {
+    int result;
+
+    // Until the build transaction is committed, the result can only be looked
+    // up on the main connection.
+    if (inBuildTransaction) {
+      std::lock_guard<std::mutex> guard(writerMutex);
+      uncommittedKeyIDs.insert(keyID);
+    }
+
+    // Insert any new keys in bulk, if possible.
+    if (isKeyTableLoaded) {
+      llvm::SmallVector<KeyID, 16> keyIDs;
+      keyIDs.push_back(keyID);
+      for (auto keyIDAndFlag: ruleResult.dependencies)
+        keyIDs.push_back(keyIDAndFlag.keyID);
+      if (!insertKeys(keyIDs, error_out))
+        return false;
+    }
+
+    auto dbKeyID = getKeyID(keyID, error_out);
+    if (!error_out->empty()) {
+      return false;
+    }
+
+    // Create the encoded dependency list.
+    //
+    // FIXME: We could save some reallocation by having a templated SmallVector
+    // size here.
+    basic::BinaryEncoder encoder{};
+    llvm::SmallVector<DBKeyID, 16> dependencyIDs;
+    for (auto keyIDAndFlag: ruleResult.dependencies) {
+      // Map the engine keyID to a database key ID.
+      auto dbKeyID = getKeyID(keyIDAndFlag.keyID, error_out);
+      if (!error_out->empty()) {
+        return false;
+      }
+      encoder.writeVarInt((dbKeyID.value << 1) + keyIDAndFlag.flag);
+      dependencyIDs.push_back(dbKeyID);
+    }
+
+    // Compress the value and dependencies, if worthwhile.
+    int flags = 0;
+    StringRef valueBytes((const char*)ruleResult.value.data(),
+                         ruleResult.value.size());
+    std::vector<uint8_t> compressedValue;
+    if (compress &&
+        compressBlob(valueBytes.data(), valueBytes.size(), compressedValue)) {
+      flags |= CompressedValue;
+      valueBytes = StringRef((const char*)compressedValue.data(),
+                             compressedValue.size());
+    }
+    StringRef dependencyBytes((const char*)encoder.data(), encoder.size());
+    std::vector<uint8_t> compressedDependencies;
+    if (compress &&
+        compressBlob(dependencyBytes.data(), dependencyBytes.size(),
+                     compressedDependencies)) {
+      flags |= CompressedDependencies;
+      dependencyBytes = StringRef((const char*)compressedDependencies.data(),
+                                  compressedDependencies.size());
+    }
+
+    // Insert the actual rule result.
+    result = sqlite3_reset(insertIntoRuleResultsStmt);
+    checkSQLiteResultOKReturnFalse(result);
+    result = sqlite3_clear_bindings(insertIntoRuleResultsStmt);
+    checkSQLiteResultOKReturnFalse(result);
+    result = sqlite3_bind_int64(insertIntoRuleResultsStmt, /*index=*/1,
                                dbKeyID.value);
     checkSQLiteResultOKReturnFalse(result);
     result = sqlite3_bind_blob(insertIntoRuleResultsStmt, /*index=*/2,
-                               ruleResult.value.data(),
-                               ruleResult.value.size(),
+                               valueBytes.data(),
+                               valueBytes.size(),
                                SQLITE_STATIC);
     checkSQLiteResultOKReturnFalse(result);
     result = sqlite3_bind_int64(insertIntoRuleResultsStmt, /*index=*/3,
@@ -656,50 +1449,399 @@ public:
                                 ruleResult.end);
     checkSQLiteResultOKReturnFalse(result);
     result = sqlite3_bind_blob(insertIntoRuleResultsStmt, /*index=*/8,
-                               encoder.data(),
-                               encoder.size(),
+                               dependencyBytes.data(),
+                               dependencyBytes.size(),
                                SQLITE_STATIC);
     checkSQLiteResultOKReturnFalse(result);
+    result = sqlite3_bind_int(insertIntoRuleResultsStmt, /*index=*/9, flags);
+    checkSQLiteResultOKReturnFalse(result);
+    result = sqlite3_bind_int64(insertIntoRuleResultsStmt, /*index=*/10,
+                                ruleResult.peakRSS);
+    checkSQLiteResultOKReturnFalse(result);
     result = sqlite3_step(insertIntoRuleResultsStmt);
     if (result != SQLITE_DONE) {
       *error_out = getCurrentErrorMessage();
       return false;
     }
 
+    // Replace the reverse dependency edges of the rule, if they are indexed.
+    if (isReverseDependencyIndexBuilt &&
+        !updateReverseDependencies(dbKeyID, dependencyIDs, error_out))
+      return false;
+
+    if (inBuildTransaction)
+      ++numUncommittedResults;
     return true;
   }
 
-  virtual bool buildStarted(std::string *error_out) override {
+  /// Replace the reverse dependency edges of a rule.
+  ///
+  /// This method is not thread-safe. The caller must protect access via the
+  /// dbMutex.
+  bool updateReverseDependencies(DBKeyID dbKeyID,
+                                 ArrayRef<DBKeyID> dependencyIDs,
+                                 std::string *error_out) {
+    int result;
+    result = sqlite3_reset(deleteReverseDependenciesStmt);
+    checkSQLiteResultOKReturnFalse(result);
+    result = sqlite3_bind_int64(deleteReverseDependenciesStmt, /*index=*/1,
+                                dbKeyID.value);
+    checkSQLiteResultOKReturnFalse(result);
+    result = sqlite3_step(deleteReverseDependenciesStmt);
+    if (result != SQLITE_DONE) {
+      *error_out = getCurrentErrorMessage();
+      return false;
+    }
+
+    for (auto dependencyID: dependencyIDs) {
+      result = sqlite3_reset(insertReverseDependencyStmt);
+      checkSQLiteResultOKReturnFalse(result);
+      result = sqlite3_bind_int64(insertReverseDependencyStmt, /*index=*/1,
+                                  dbKeyID.value);
+      checkSQLiteResultOKReturnFalse(result);
+      result = sqlite3_bind_int64(insertReverseDependencyStmt, /*index=*/2,
+                                  dependencyID.value);
+      checkSQLiteResultOKReturnFalse(result);
+      result = sqlite3_step(insertReverseDependencyStmt);
+      if (result != SQLITE_DONE) {
+        *error_out = getCurrentErrorMessage();
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /// Read whether the reverse dependency index is maintained.
+  ///
+  /// This method is not thread-safe. The caller must protect access via the
+  /// dbMutex.
+  bool loadReverseDependencyIndexState(std::string *error_out) {
+    sqlite3_stmt* stmt;
+    int result = sqlite3_prepare_v2(
+      db, "SELECT reverse_dependencies_indexed FROM info LIMIT 1;",
+      -1, &stmt, nullptr);
+    checkSQLiteResultOKReturnFalse(result);
+    result = sqlite3_step(stmt);
+    if (result != SQLITE_ROW) {
+      *error_out = getCurrentErrorMessage();
+      sqlite3_finalize(stmt);
+      return false;
+    }
+    isReverseDependencyIndexBuilt = sqlite3_column_int(stmt, 0) != 0;
+    sqlite3_finalize(stmt);
+    return true;
+  }
+
+  /// Build the reverse dependency index from the stored results.
+  ///
+  /// Most builds never query the index, so it is only built on the first
+  /// query. That is recorded in the database, and from then on every write of
+  /// a result keeps the index up to date, so later queries only need to read
+  /// it. Until then the table is empty.
+  ///
+  /// This method is not thread-safe. The caller must protect access via the
+  /// dbMutex.
+  bool buildReverseDependencyIndex(std::string *error_out) {
+    // Replace the index in a single transaction, unless a build has one open.
+    int result;
+    bool ownsBuildLock = false;
+    if (!inBuildTransaction) {
+      if (!acquireBuildLock(error_out))
+        return false;
+      ownsBuildLock = true;
+    }
+    llbuild_defer {
+      if (ownsBuildLock)
+        releaseBuildLock();
+    };
+    if (!inBuildTransaction) {
+      result = sqlite3_exec(db, "BEGIN IMMEDIATE;", nullptr, nullptr, nullptr);
+      checkSQLiteResultOKReturnFalse(result);
+
+      // Another client may have built the index since it was last checked.
+      if (!loadReverseDependencyIndexState(error_out)) {
+        sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+        return false;
+      }
+      if (isReverseDependencyIndexBuilt) {
+        sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+        return true;
+      }
+    }
+    bool rebuilt = rebuildReverseDependencies(error_out);
+    if (rebuilt) {
+      result = sqlite3_exec(
+        db, "UPDATE info SET reverse_dependencies_indexed = 1;",
+        nullptr, nullptr, nullptr);
+      if (result != SQLITE_OK) {
+        *error_out = getCurrentErrorMessage();
+        rebuilt = false;
+      }
+    }
+    if (!rebuilt) {
+      if (!inBuildTransaction)
+        sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+      return false;
+    }
+    if (!inBuildTransaction) {
+      result = sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr);
+      if (result != SQLITE_OK) {
+        *error_out = getCurrentErrorMessage();
+        sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+        return false;
+      }
+    }
+
+    isReverseDependencyIndexBuilt = true;
+    return true;
+  }
+
+  /// Replace the contents of the reverse dependency index with the edges of
+  /// the stored results.
+  ///
+  /// This method is not thread-safe. The caller must protect access via the
+  /// dbMutex.
+  bool rebuildReverseDependencies(std::string *error_out) {
+    int result = sqlite3_exec(db, "DELETE FROM reverse_dependencies;",
+                              nullptr, nullptr, nullptr);
+    checkSQLiteResultOKReturnFalse(result);
+
+    sqlite3_stmt* stmt;
+    result = sqlite3_prepare_v2(
+      db, "SELECT key_id, dependencies, flags FROM rule_results;",
+      -1, &stmt, nullptr);
+    checkSQLiteResultOKReturnFalse(result);
+    std::vector<uint8_t> decompressed;
+    llvm::SmallVector<DBKeyID, 16> dependencyIDs;
+    while ((result = sqlite3_step(stmt)) == SQLITE_ROW) {
+      DBKeyID dbKeyID(sqlite3_column_int64(stmt, 0));
+      StringRef dependencyBytes;
+      if (!readDependencyBytes(dbKeyID, stmt, 1, 2, decompressed,
+                               &dependencyBytes, error_out)) {
+        sqlite3_finalize(stmt);
+        return false;
+      }
+      dependencyIDs.clear();
+      basic::BinaryDecoder decoder(dependencyBytes);
+      while (!decoder.isEmpty()) {
+        uint64_t raw;
+        decoder.readVarInt(raw);
+        dependencyIDs.push_back(DBKeyID(raw >> 1));
+      }
+      if (!updateReverseDependencies(dbKeyID, dependencyIDs, error_out)) {
+        sqlite3_finalize(stmt);
+        return false;
+      }
+    }
+    sqlite3_finalize(stmt);
+    if (result != SQLITE_DONE) {
+      *error_out = getCurrentErrorMessage();
+      return false;
+    }
+    return true;
+  }
+
+  virtual bool setBuildRoot(KeyID keyID, const KeyType& key,
+                            std::string *error_out) override {
+    assert(delegate != nullptr);
     std::lock_guard<std::mutex> guard(dbMutex);
 
-    if (!open(error_out))
+    if (!open(error_out)) {
       return false;
+    }
 
-    // Execute the entire build inside a single transaction.
-    //
-    // FIXME: We should revist this, as we probably wouldn't want a crash in the
-    // build system to totally lose all build results.
-    int result = sqlite3_exec(db, "BEGIN EXCLUSIVE;", nullptr, nullptr, nullptr);
+    auto dbKeyID = getKeyID(keyID, error_out);
+    if (!error_out->empty()) {
+      return false;
+    }
 
-    if (result != SQLITE_OK) {
+    // Record the root as requested at the current iteration.
+    sqlite3_stmt* stmt;
+    int result;
+    result = sqlite3_prepare_v2(
+      db, ("INSERT OR REPLACE INTO build_roots "
+           "SELECT ?, iteration FROM info WHERE id == 0;"),
+      -1, &stmt, nullptr);
+    checkSQLiteResultOKReturnFalse(result);
+    result = sqlite3_bind_int64(stmt, /*index=*/1, dbKeyID.value);
+    checkSQLiteResultOKReturnFalse(result);
+
+    result = sqlite3_step(stmt);
+    if (result != SQLITE_DONE) {
       *error_out = getCurrentErrorMessage();
+      sqlite3_finalize(stmt);
       return false;
     }
 
+    sqlite3_finalize(stmt);
+    return true;
+  }
+
+  virtual bool buildStarted(std::string *error_out) override {
+    {
+      std::lock_guard<std::mutex> guard(dbMutex);
+
+      // Exclude any other build for the whole of this one.
+      if (!acquireBuildLock(error_out))
+        return false;
+
+      if (!open(error_out)) {
+        releaseBuildLock();
+        return false;
+      }
+
+      // Execute the build inside a write transaction, which is committed in
+      // bounded batches (by count in setRuleResult(), and by time from the
+      // writer thread) so that an interrupted build only loses the most
+      // recent results. Readers still see a consistent snapshot meanwhile.
+      int result = sqlite3_exec(db, "BEGIN IMMEDIATE;",
+                                nullptr, nullptr, nullptr);
+      if (result != SQLITE_OK) {
+        *error_out = getCurrentErrorMessage();
+        releaseBuildLock();
+        return false;
+      }
+
+      // Another client may have built the reverse dependency index since the
+      // database was opened, which must then be maintained by this build.
+      if (!loadReverseDependencyIndexState(error_out)) {
+        sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+        releaseBuildLock();
+        return false;
+      }
+
+      inBuildTransaction = true;
+      numUncommittedResults = 0;
+      transactionStartTime = std::chrono::steady_clock::now();
+
+      // Load all of the key mappings up front (unless they are already
+      // loaded and the database has not changed since), since the build will
+      // likely need most of them. This is done once we hold the write lock, so
+      // that any key missing from the table afterwards is known to be new.
+      if (delegate) {
+        int64_t dataVersion;
+        if (!getDataVersion(&dataVersion, error_out) ||
+            (dataVersion != keyTableDataVersion &&
+             !loadKeyTable(error_out))) {
+          sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+          inBuildTransaction = false;
+          releaseBuildLock();
+          return false;
+        }
+        isKeyTableLoaded = true;
+      }
+    }
+
+    {
+      std::lock_guard<std::mutex> guard(writerMutex);
+      isWritingBehind = writeBehind;
+      writerError.clear();
+    }
+
+    writerThread = std::thread(&SQLiteBuildDB::runWriterThread, this);
     return true;
   }
 
   virtual void buildComplete() override {
+    // Wait for any pending results to be written.
+    stopWriterThread();
+
+    // Report any results the writer thread failed to write, which will be
+    // rebuilt by the next build.
+    {
+      std::lock_guard<std::mutex> guard(writerMutex);
+      if (!writerError.empty()) {
+        if (delegate)
+          delegate->error("unable to write build results (" + writerError +
+                          ")");
+        writerError.clear();
+      }
+      pendingResults.clear();
+    }
+
     std::lock_guard<std::mutex> guard(dbMutex);
 
     // Sync changes to disk.
-    int result = sqlite3_exec(db, "END;", nullptr, nullptr, nullptr);
-    assert(result == SQLITE_OK);
-    (void)result;
+    if (inBuildTransaction) {
+      int result = sqlite3_exec(db, "END;", nullptr, nullptr, nullptr);
+      assert(result == SQLITE_OK);
+      (void)result;
+      inBuildTransaction = false;
+    }
+    {
+      std::lock_guard<std::mutex> guard(writerMutex);
+      uncommittedKeyIDs.clear();
+    }
 
     // We close the connection whenever a build completes so that we release
     // any locks that we may have on the file.
     close();
+    releaseBuildLock();
+  }
+
+  virtual bool collectGarbage(uint64_t minAge,
+                              BuildDBGarbageCollectionStats* stats_out,
+                              std::string *error_out) override {
+    std::lock_guard<std::mutex> guard(dbMutex);
+    assert(!inBuildTransaction && "invalid collectGarbage() call");
+
+    // Results must not be removed while a build is running.
+    if (!acquireBuildLock(error_out))
+      return false;
+    llbuild_defer {
+      releaseBuildLock();
+    };
+
+    if (!open(error_out))
+      return false;
+
+    if (!writePendingResults(error_out))
+      return false;
+
+    int result = sqlite3_exec(db, "BEGIN IMMEDIATE;", nullptr, nullptr,
+                              nullptr);
+    checkSQLiteResultOKReturnFalse(result);
+    *stats_out = BuildDBGarbageCollectionStats();
+    if (!removeGarbage(minAge, stats_out, error_out)) {
+      sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+      close();
+      return false;
+    }
+    result = sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr);
+    if (result != SQLITE_OK) {
+      // Don't leave the transaction open, or the next build can't begin one.
+      *error_out = getCurrentErrorMessage();
+      sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+      close();
+      return false;
+    }
+
+    // The removed key IDs may be reused, so drop the cached mappings.
+    {
+      std::lock_guard<std::mutex> guard(keyCacheMutex);
+      engineKeyIDs.clear();
+      dbKeyIDs.clear();
+    }
+
+    // Compact the database, which requires that no statements are active, so
+    // do so on a fresh connection.
+    close();
+    if (!open(error_out))
+      return false;
+    if (stats_out->numResultsRemoved || stats_out->numKeysRemoved) {
+      result = sqlite3_exec(
+        db, "VACUUM; PRAGMA wal_checkpoint(TRUNCATE);",
+        nullptr, nullptr, nullptr);
+      if (result != SQLITE_OK) {
+        *error_out = getCurrentErrorMessage();
+        close();
+        return false;
+      }
+    }
+
+    // Release any locks, as when a build completes.
+    close();
+    return true;
   }
 
   virtual bool getKeys(std::vector<KeyType>& keys_out, std::string* error_out) override {
@@ -708,6 +1850,9 @@ public:
     if (!open(error_out))
       return false;
 
+    if (!writePendingResults(error_out))
+      return false;
+
     // Search for the key in the database
     int result;
     sqlite3_stmt* stmt;
@@ -736,6 +1881,9 @@ public:
     
     if (!open(error_out))
       return false;
+
+    if (!writePendingResults(error_out))
+      return false;
     
     auto stmt = getKeysWithResultStmt;
     
@@ -743,60 +1891,82 @@ public:
     checkSQLiteResultOKReturnFalse(result);
     
     while (sqlite3_step(stmt) == SQLITE_ROW) {
-      assert(sqlite3_column_count(stmt) == 9);
+      assert(sqlite3_column_count(stmt) == 11);
       
       auto dbKeyID = DBKeyID(sqlite3_column_int64(stmt, 0));
       auto key = KeyType((const char *)sqlite3_column_text(stmt, 1), sqlite3_column_bytes(stmt, 1));
       
       auto engineKeyID = delegate->getKeyID(key);
-      engineKeyIDs[dbKeyID] = engineKeyID;
-      dbKeyIDs[engineKeyID] = dbKeyID;
+      cacheKeyIDMapping(dbKeyID, engineKeyID);
       
       Result result;
-      int numValueBytes = sqlite3_column_bytes(stmt, 2);
-      result.value.resize(numValueBytes);
-      memcpy(result.value.data(),
-             sqlite3_column_blob(stmt, 2),
-             numValueBytes);
+      if (!readValueColumn(dbKeyID, stmt, 2, 9, &result.value, error_out)) {
+        return false;
+      }
       result.builtAt = sqlite3_column_int64(stmt, 3);
       result.computedAt = sqlite3_column_int64(stmt, 4);
       result.start = sqlite3_column_double(stmt, 5);
       result.end = sqlite3_column_double(stmt, 6);
-      auto numDependencyBytes = sqlite3_column_bytes(stmt, 7);
-      auto dependencyBytes = sqlite3_column_blob(stmt, 7);
+      result.peakRSS = sqlite3_column_int64(stmt, 10);
       
       // map dependencies
-      int numDependencies = numDependencyBytes / sizeof(uint64_t);
-      if (numDependencyBytes != numDependencies * sizeof(uint64_t)) {
-        *error_out = (llvm::Twine("unexpected contents for database result: ") +
-                      llvm::Twine((int)dbKeyID.value)).str();
+      if (!decodeDependencies(mainLookup, dbKeyID, stmt, 7, 9, &result,
+                              error_out)) {
         return false;
       }
+      
+      result.signature = basic::CommandSignature(sqlite3_column_int64(stmt, 8));
+      
+      keys_out.push_back(key);
+      results_out.push_back(result);
+    }
+    
+    return true;
+  }
+
+  virtual bool getReverseDependencies(const KeyType& key,
+                                      std::vector<KeyType>& keys_out,
+                                      std::string* error_out) override {
+    std::lock_guard<std::mutex> guard(dbMutex);
+
+    if (!open(error_out))
+      return false;
+
+    if (!writePendingResults(error_out))
+      return false;
+
+    if (!isReverseDependencyIndexBuilt &&
+        !buildReverseDependencyIndex(error_out))
+      return false;
+
+    int result;
+    sqlite3_stmt* stmt;
+    result = sqlite3_prepare_v2(
+      db, ("SELECT key_names.key FROM reverse_dependencies "
+           "JOIN key_names ON key_names.id == reverse_dependencies.dependent_id "
+           "WHERE reverse_dependencies.key_id == "
+           "(SELECT id FROM key_names WHERE key == ?);"),
+      -1, &stmt, nullptr);
+    checkSQLiteResultOKReturnFalse(result);
+    result = sqlite3_bind_text(stmt, /*index=*/1, key.data(), key.size(),
+                               SQLITE_STATIC);
+    checkSQLiteResultOKReturnFalse(result);
+
+    while ((result = sqlite3_step(stmt)) == SQLITE_ROW) {
+      assert(sqlite3_column_count(stmt) == 1);
+
+      auto size = sqlite3_column_bytes(stmt, 0);
+      auto text = (const char*) sqlite3_column_text(stmt, 0);
 
-      result.dependencies.resize(numDependencies);
-      basic::BinaryDecoder decoder(
-                                   StringRef((const char*)dependencyBytes, numDependencyBytes));
-      for (auto i = 0; i != numDependencies; ++i) {
-        uint64_t raw;
-        decoder.read(raw);
-        bool flag = raw & 1;
-        DBKeyID dbKeyID(raw >> 1);
-        
-        // Map the database key ID into an engine key ID (note that we already
-        // hold the dbMutex at this point as required by getKeyIDforID())
-        KeyID keyID = getKeyIDForID(dbKeyID, error_out);
-        if (!error_out->empty()) {
-          return false;
-        }
-        result.dependencies.set(i, keyID, flag);
-      }
-      
-      result.signature = basic::CommandSignature(sqlite3_column_int64(stmt, 8));
-      
-      keys_out.push_back(key);
-      results_out.push_back(result);
+      keys_out.push_back(KeyType(text, size));
     }
-    
+
+    sqlite3_finalize(stmt);
+    if (result != SQLITE_DONE) {
+      *error_out = getCurrentErrorMessage();
+      return false;
+    }
+
     return true;
   }
 
@@ -804,7 +1974,7 @@ public:
     std::lock_guard<std::mutex> guard(dbMutex);
 
     std::string error;
-    if (!open(&error)) {
+    if (!open(&error) || !writePendingResults(&error)) {
       os << "error: " << getCurrentErrorMessage() << "\n";
       return;
     }
@@ -857,29 +2027,539 @@ public:
 
   
 private:
-  /// Local cache of database DBKeyID (values) to engine KeyIDs
-  llvm::DenseMap<DBKeyID, KeyID> engineKeyIDs;
+  /// Remove the results which are no longer needed, and the keys which are no
+  /// longer referred to, \see collectGarbage().
+  ///
+  /// This method is not thread-safe. The caller must protect access via the
+  /// dbMutex, and hold a write transaction.
+  bool removeGarbage(uint64_t minAge, BuildDBGarbageCollectionStats* stats_out,
+                     std::string *error_out) {
+    int result;
+    sqlite3_stmt* stmt;
+
+    // Results last built before this iteration are old enough to be removed.
+    result = sqlite3_prepare_v2(db, "SELECT iteration FROM info LIMIT 1",
+                                -1, &stmt, nullptr);
+    checkSQLiteResultOKReturnFalse(result);
+    result = sqlite3_step(stmt);
+    if (result != SQLITE_ROW) {
+      *error_out = getCurrentErrorMessage();
+      sqlite3_finalize(stmt);
+      return false;
+    }
+    uint64_t iteration = sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
+    uint64_t minIteration = iteration > minAge ? iteration - minAge : 0;
+
+    // Forget the roots which have not been requested recently.
+    result = sqlite3_prepare_v2(
+      db, "DELETE FROM build_roots WHERE requested_at < ?;",
+      -1, &stmt, nullptr);
+    checkSQLiteResultOKReturnFalse(result);
+    result = sqlite3_bind_int64(stmt, /*index=*/1, minIteration);
+    checkSQLiteResultOKReturnFalse(result);
+    result = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if (result != SQLITE_DONE) {
+      *error_out = getCurrentErrorMessage();
+      return false;
+    }
+
+    // Mark the remaining roots, and the keys they transitively depend on, as
+    // reachable. The key IDs are densely allocated, so the state for each is
+    // indexed by its ID.
+    std::vector<bool> isReachable;
+    std::vector<uint64_t> worklist;
+    auto markReachable = [&](uint64_t id) {
+      if (id >= isReachable.size())
+        isReachable.resize(id + 1);
+      if (!isReachable[id]) {
+        isReachable[id] = true;
+        worklist.push_back(id);
+      }
+    };
+    result = sqlite3_prepare_v2(db, "SELECT key_id FROM build_roots;",
+                                -1, &stmt, nullptr);
+    checkSQLiteResultOKReturnFalse(result);
+    while ((result = sqlite3_step(stmt)) == SQLITE_ROW)
+      markReachable(sqlite3_column_int64(stmt, 0));
+    sqlite3_finalize(stmt);
+    if (result != SQLITE_DONE) {
+      *error_out = getCurrentErrorMessage();
+      return false;
+    }
+
+    // Load the dependencies of every result.
+    std::vector<std::vector<uint64_t>> dependencies;
+    std::vector<bool> hasResult, isRecent;
+    result = sqlite3_prepare_v2(
+      db, "SELECT key_id, built_at, dependencies, flags FROM rule_results;",
+      -1, &stmt, nullptr);
+    checkSQLiteResultOKReturnFalse(result);
+    std::vector<uint8_t> decompressed;
+    while ((result = sqlite3_step(stmt)) == SQLITE_ROW) {
+      assert(sqlite3_column_count(stmt) == 4);
+      auto dbKeyID = DBKeyID(sqlite3_column_int64(stmt, 0));
+      if (dbKeyID.value >= hasResult.size()) {
+        dependencies.resize(dbKeyID.value + 1);
+        hasResult.resize(dbKeyID.value + 1);
+        isRecent.resize(dbKeyID.value + 1);
+      }
+      hasResult[dbKeyID.value] = true;
+      isRecent[dbKeyID.value] =
+        uint64_t(sqlite3_column_int64(stmt, 1)) >= minIteration;
+
+      StringRef dependencyBytes;
+      if (!readDependencyBytes(dbKeyID, stmt, 2, 3, decompressed,
+                               &dependencyBytes, error_out)) {
+        sqlite3_finalize(stmt);
+        return false;
+      }
+      auto& ids = dependencies[dbKeyID.value];
+      basic::BinaryDecoder decoder(dependencyBytes);
+      while (!decoder.isEmpty()) {
+        uint64_t raw;
+        decoder.readVarInt(raw);
+        ids.push_back(raw >> 1);
+      }
+    }
+    sqlite3_finalize(stmt);
+    if (result != SQLITE_DONE) {
+      *error_out = getCurrentErrorMessage();
+      return false;
+    }
+
+    while (!worklist.empty()) {
+      uint64_t id = worklist.back();
+      worklist.pop_back();
+      if (id < dependencies.size()) {
+        for (auto dependency: dependencies[id])
+          markReachable(dependency);
+      }
+    }
+
+    // Remove the results which are neither reachable nor recent, and mark the
+    // keys used by the rest as live.
+    std::vector<bool> isLive = isReachable;
+    result = sqlite3_prepare_v2(
+      db, "DELETE FROM rule_results WHERE key_id == ?;", -1, &stmt, nullptr);
+    checkSQLiteResultOKReturnFalse(result);
+    for (uint64_t id = 0; id != hasResult.size(); ++id) {
+      if (!hasResult[id])
+        continue;
+      if (isRecent[id] || (id < isReachable.size() && isReachable[id])) {
+        if (id >= isLive.size())
+          isLive.resize(id + 1);
+        isLive[id] = true;
+        for (auto dependency: dependencies[id]) {
+          if (dependency >= isLive.size())
+            isLive.resize(dependency + 1);
+          isLive[dependency] = true;
+        }
+        continue;
+      }
+
+      // Any preloaded result is also gone.
+      {
+        std::lock_guard<std::mutex> guard(keyCacheMutex);
+        if (id < engineKeyIDs.size() && engineKeyIDs[id] != KeyID::novalue())
+          preloadedResults.erase(engineKeyIDs[id]);
+      }
+
+      result = sqlite3_reset(stmt);
+      if (result == SQLITE_OK)
+        result = sqlite3_bind_int64(stmt, /*index=*/1, id);
+      if (result == SQLITE_OK && sqlite3_step(stmt) != SQLITE_DONE)
+        result = SQLITE_ERROR;
+      if (result != SQLITE_OK ||
+          (isReverseDependencyIndexBuilt &&
+           !updateReverseDependencies(DBKeyID(id), {}, error_out))) {
+        if (result != SQLITE_OK)
+          *error_out = getCurrentErrorMessage();
+        sqlite3_finalize(stmt);
+        return false;
+      }
+      ++stats_out->numResultsRemoved;
+    }
+    sqlite3_finalize(stmt);
+
+    // Remove the keys which are no longer referred to.
+    std::vector<uint64_t> deadKeyIDs;
+    result = sqlite3_prepare_v2(db, "SELECT id FROM key_names;",
+                                -1, &stmt, nullptr);
+    checkSQLiteResultOKReturnFalse(result);
+    while ((result = sqlite3_step(stmt)) == SQLITE_ROW) {
+      uint64_t id = sqlite3_column_int64(stmt, 0);
+      if (id >= isLive.size() || !isLive[id])
+        deadKeyIDs.push_back(id);
+    }
+    sqlite3_finalize(stmt);
+    if (result != SQLITE_DONE) {
+      *error_out = getCurrentErrorMessage();
+      return false;
+    }
+    result = sqlite3_prepare_v2(
+      db, "DELETE FROM key_names WHERE id == ?;", -1, &stmt, nullptr);
+    checkSQLiteResultOKReturnFalse(result);
+    for (auto id: deadKeyIDs) {
+      result = sqlite3_reset(stmt);
+      if (result == SQLITE_OK)
+        result = sqlite3_bind_int64(stmt, /*index=*/1, id);
+      if (result == SQLITE_OK && sqlite3_step(stmt) != SQLITE_DONE)
+        result = SQLITE_ERROR;
+      if (result != SQLITE_OK) {
+        *error_out = getCurrentErrorMessage();
+        sqlite3_finalize(stmt);
+        return false;
+      }
+    }
+    sqlite3_finalize(stmt);
+    stats_out->numKeysRemoved = deadKeyIDs.size();
+
+    return true;
+  }
+
+  /// Commit the current build transaction, and start a new one.
+  ///
+  /// This method is not thread-safe. The caller must protect access via the
+  /// dbMutex.
+  bool commitBuildTransaction(std::string *error_out) {
+    assert(inBuildTransaction);
+
+    int result = sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr);
+    if (result != SQLITE_OK) {
+      *error_out = getCurrentErrorMessage();
+      return false;
+    }
+    {
+      std::lock_guard<std::mutex> guard(writerMutex);
+      uncommittedKeyIDs.clear();
+    }
+
+    // The write lock is briefly released here, but the build lock keeps any
+    // other build (or writer) from taking it meanwhile.
+    result = sqlite3_exec(db, "BEGIN IMMEDIATE;", nullptr, nullptr, nullptr);
+    if (result != SQLITE_OK) {
+      inBuildTransaction = false;
+      *error_out = getCurrentErrorMessage();
+      return false;
+    }
+
+    numUncommittedResults = 0;
+    transactionStartTime = std::chrono::steady_clock::now();
+    return true;
+  }
+
+  /// Commit the batch of results written in the build transaction, once it is
+  /// large enough.
+  ///
+  /// This method is not thread-safe. The caller must protect access via the
+  /// dbMutex.
+  bool commitBuildTransactionIfFull(std::string *error_out) {
+    if (inBuildTransaction &&
+        numUncommittedResults >= maxResultsPerTransaction) {
+      return commitBuildTransaction(error_out);
+    }
+    return true;
+  }
+
+  /// Write all of the results pending in write-behind mode.
+  ///
+  /// This method is not thread-safe. The caller must protect access via the
+  /// dbMutex.
+  bool writePendingResults(std::string *error_out) {
+    llvm::DenseMap<KeyID, Result> results;
+    {
+      // The results must be marked as uncommitted as they are taken, so that
+      // they are never looked up on a reader connection in the meantime.
+      std::lock_guard<std::mutex> guard(writerMutex);
+      if (pendingResults.empty())
+        return true;
+      results.swap(pendingResults);
+      if (inBuildTransaction) {
+        for (const auto& entry: results)
+          uncommittedKeyIDs.insert(entry.first);
+      }
+    }
+
+    // Insert the new keys for the whole batch at once.
+    if (isKeyTableLoaded) {
+      std::vector<KeyID> keyIDs;
+      for (const auto& entry: results) {
+        keyIDs.push_back(entry.first);
+        for (auto keyIDAndFlag: entry.second.dependencies)
+          keyIDs.push_back(keyIDAndFlag.keyID);
+      }
+      if (!insertKeys(keyIDs, error_out)) {
+        restorePendingResults(results.begin(), results.end());
+        return false;
+      }
+    }
+
+    for (auto it = results.begin(), ie = results.end(); it != ie; ++it) {
+      if (!writeRuleResult(it->first, it->second, error_out)) {
+        restorePendingResults(it, ie);
+        return false;
+      }
+    }
+    return commitBuildTransactionIfFull(error_out);
+  }
+
+  /// Return results which could not be written to the pending results, unless
+  /// they have since been superseded.
+  void restorePendingResults(llvm::DenseMap<KeyID, Result>::iterator begin,
+                             llvm::DenseMap<KeyID, Result>::iterator end) {
+    std::lock_guard<std::mutex> guard(writerMutex);
+    for (auto it = begin; it != end; ++it)
+      pendingResults.insert(std::make_pair(it->first, std::move(it->second)));
+  }
+
+  /// Write the pending results if there is one for the given key, so that it
+  /// can be looked up.
+  ///
+  /// This method is not thread-safe. The caller must protect access via the
+  /// dbMutex.
+  bool flushPendingResult(KeyID keyID, std::string *error_out) {
+    {
+      std::lock_guard<std::mutex> guard(writerMutex);
+      if (pendingResults.count(keyID) == 0)
+        return true;
+    }
+    return writePendingResults(error_out);
+  }
+
+  /// Write pending results and periodically commit the build transaction,
+  /// while a build is running.
+  void runWriterThread() {
+    while (true) {
+      bool shouldExit;
+      {
+        // After an error, only retry periodically.
+        std::unique_lock<std::mutex> lock(writerMutex);
+        if ((pendingResults.empty() || !writerError.empty()) &&
+            !writerThreadShouldExit)
+          writerCondition.wait_for(lock, maxTransactionDuration);
+        shouldExit = writerThreadShouldExit;
+      }
+
+      // Pending results are only taken from the queue while holding the
+      // dbMutex, so lookups never miss a result which is being written.
+      std::lock_guard<std::mutex> guard(dbMutex);
+      std::string error;
+      bool success = writePendingResults(&error);
+      if (success && inBuildTransaction && numUncommittedResults != 0 &&
+          (std::chrono::steady_clock::now() - transactionStartTime >=
+           maxTransactionDuration)) {
+        success = commitBuildTransaction(&error);
+      }
+      if (!success) {
+        std::lock_guard<std::mutex> guard(writerMutex);
+        if (writerError.empty())
+          writerError = error;
+      }
+
+      if (shouldExit)
+        return;
+    }
+  }
+
+  /// Stop the writer thread (once all pending results are written), if
+  /// running.
+  void stopWriterThread() {
+    {
+      std::lock_guard<std::mutex> guard(writerMutex);
+      if (!writerThread.joinable())
+        return;
+      writerThreadShouldExit = true;
+      isWritingBehind = false;
+    }
+    writerCondition.notify_all();
+    writerThread.join();
+    writerThreadShouldExit = false;
+  }
+
+  /// Local cache of database DBKeyID (values) to engine KeyIDs, indexed by
+  /// the DBKeyID (which are densely allocated by the database).
+  ///
+  /// This is protected by the keyCacheMutex.
+  std::vector<KeyID> engineKeyIDs;
 
   /// Local cache of database engine KeyIDs to DBKeyIDs
+  ///
+  /// This is protected by the keyCacheMutex.
   llvm::DenseMap<KeyID, DBKeyID> dbKeyIDs;
 
+  /// Whether the caches above hold every key in the database, and will
+  /// continue to (since the build holds the write lock), \see buildStarted().
+  std::atomic<bool> isKeyTableLoaded{false};
+
+  /// The data version at which the key table was last loaded, or -1.
+  int64_t keyTableDataVersion = -1;
+
+  /// The results loaded by \see preloadResults(), which have yet to be
+  /// looked up.
+  ///
+  /// Like the engine's own state, these assume the database is only modified
+  /// through this instance (which invalidates them) while it is attached.
+  ///
+  /// This is protected by the keyCacheMutex.
+  llvm::DenseMap<KeyID, Result> preloadedResults;
+
+  /// Cache the mapping between a DBKeyID and an engine KeyID.
+  void cacheKeyIDMapping(DBKeyID dbKeyID, KeyID keyID) {
+    std::lock_guard<std::mutex> guard(keyCacheMutex);
+    if (dbKeyID.value >= engineKeyIDs.size())
+      engineKeyIDs.resize(dbKeyID.value + 1, KeyID::novalue());
+    engineKeyIDs[dbKeyID.value] = keyID;
+    dbKeyIDs[keyID] = dbKeyID;
+  }
+
+  /// Load the mappings for all the keys in the database.
+  ///
+  /// This method is not thread-safe. The caller must protect access via the
+  /// dbMutex.
+  bool loadKeyTable(std::string *error_out) {
+    int result;
+    sqlite3_stmt* stmt;
+    result = sqlite3_prepare_v2(db, "SELECT id, key FROM key_names;",
+                                -1, &stmt, nullptr);
+    checkSQLiteResultOKReturnFalse(result);
+
+    while ((result = sqlite3_step(stmt)) == SQLITE_ROW) {
+      assert(sqlite3_column_count(stmt) == 2);
+      auto dbKeyID = DBKeyID(sqlite3_column_int64(stmt, 0));
+      auto size = sqlite3_column_bytes(stmt, 1);
+      auto text = (const char*) sqlite3_column_text(stmt, 1);
+      cacheKeyIDMapping(dbKeyID, delegate->getKeyID(KeyType(text, size)));
+    }
+    sqlite3_finalize(stmt);
+    if (result != SQLITE_DONE) {
+      *error_out = getCurrentErrorMessage();
+      return false;
+    }
+
+    return getDataVersion(&keyTableDataVersion, error_out);
+  }
+
+  /// Get the data version of the database, which changes whenever another
+  /// connection commits changes to it.
+  ///
+  /// This method is not thread-safe. The caller must protect access via the
+  /// dbMutex.
+  bool getDataVersion(int64_t* version_out, std::string *error_out) {
+    int result;
+    sqlite3_stmt* stmt;
+    result = sqlite3_prepare_v2(db, "PRAGMA data_version;",
+                                -1, &stmt, nullptr);
+    checkSQLiteResultOKReturnFalse(result);
+    result = sqlite3_step(stmt);
+    if (result != SQLITE_ROW) {
+      *error_out = getCurrentErrorMessage();
+      sqlite3_finalize(stmt);
+      return false;
+    }
+    *version_out = sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
+    return true;
+  }
+
+  /// Insert any of the given keys which are not yet in the database, using
+  /// multi-row statements.
+  ///
+  /// This requires the key table to have been loaded (and the write lock to
+  /// still be held), so that any key not in the cache is known to be new.
+  ///
+  /// This method is not thread-safe. The caller must protect access via the
+  /// dbMutex.
+  bool insertKeys(ArrayRef<KeyID> keyIDs, std::string *error_out) {
+    assert(isKeyTableLoaded);
+
+    // Collect the new keys, marking them as seen in the cache (with a
+    // placeholder ID, which lookups treat as unknown).
+    std::vector<KeyID> newKeyIDs;
+    {
+      std::lock_guard<std::mutex> guard(keyCacheMutex);
+      for (auto keyID: keyIDs) {
+        if (dbKeyIDs.insert({ keyID, DBKeyID() }).second)
+          newKeyIDs.push_back(keyID);
+      }
+    }
+
+    for (size_t i = 0, e = newKeyIDs.size(); i != e;) {
+      unsigned count = std::min(size_t(maxKeysPerInsert), e - i);
+      if (!insertKeysBatch(ArrayRef<KeyID>(newKeyIDs).slice(i, count),
+                           error_out)) {
+        // Drop the remaining placeholder mappings.
+        std::lock_guard<std::mutex> guard(keyCacheMutex);
+        for (; i != e; ++i)
+          dbKeyIDs.erase(newKeyIDs[i]);
+        return false;
+      }
+      i += count;
+    }
+    return true;
+  }
+
+  /// Insert a batch of new keys using a single statement.
+  bool insertKeysBatch(ArrayRef<KeyID> keyIDs, std::string *error_out) {
+    assert(!keyIDs.empty() && keyIDs.size() <= maxKeysPerInsert);
+    int result;
+
+    auto& stmt = insertKeysStmts[keyIDs.size()];
+    if (!stmt) {
+      std::string sql = "INSERT INTO key_names(key) VALUES (?)";
+      for (size_t i = 1; i != keyIDs.size(); ++i)
+        sql += ",(?)";
+      sql += ";";
+      result = sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr);
+      checkSQLiteResultOKReturnFalse(result);
+    }
+
+    result = sqlite3_reset(stmt);
+    checkSQLiteResultOKReturnFalse(result);
+    result = sqlite3_clear_bindings(stmt);
+    checkSQLiteResultOKReturnFalse(result);
+
+    for (size_t i = 0; i != keyIDs.size(); ++i) {
+      auto key = delegate->getKeyForID(keyIDs[i]);
+      result = sqlite3_bind_text(stmt, /*index=*/i + 1,
+                                 key.data(), key.size(), SQLITE_TRANSIENT);
+      checkSQLiteResultOKReturnFalse(result);
+    }
+    result = sqlite3_step(stmt);
+    if (result != SQLITE_DONE) {
+      *error_out = getCurrentErrorMessage();
+      return false;
+    }
+
+    // The rows of a single insert into a rowid table (without AUTOINCREMENT)
+    // are each assigned one more than the largest existing ID, so the IDs of
+    // the batch are consecutive, ending at the last inserted ID.
+    uint64_t firstID = sqlite3_last_insert_rowid(db) - (keyIDs.size() - 1);
+    for (size_t i = 0; i != keyIDs.size(); ++i)
+      cacheKeyIDMapping(DBKeyID(firstID + i), keyIDs[i]);
+    return true;
+  }
+
   /// Lookup or create a DBKeyID for a given engine KeyID
   ///
   /// This method is not thread-safe. The caller must protect access via the
   /// dbMutex.
   DBKeyID getKeyID(KeyID keyID, std::string *error_out) {
     // Try to fetch the DBKeyID from the cache
-    auto it = dbKeyIDs.find(keyID);
-    if (it != dbKeyIDs.end()) {
-      return it->second;
+    {
+      std::lock_guard<std::mutex> guard(keyCacheMutex);
+      auto it = dbKeyIDs.find(keyID);
+      if (it != dbKeyIDs.end()) {
+        return it->second;
+      }
     }
 
     auto dbKeyID = getKeyIDFromDB(keyID, error_out);
 
     if (dbKeyID.value != 0) {
       // Cache the ID mappings
-      engineKeyIDs[dbKeyID] = keyID;
-      dbKeyIDs[keyID] = dbKeyID;
+      cacheKeyIDMapping(dbKeyID, keyID);
     }
 
     return dbKeyID;
@@ -935,48 +2615,53 @@ if (result != SQLITE_OK) { \
 #undef checkSQLiteResultOKReturnDBKeyID
   }
 
-  /// Maps a DBKeyID into an engine KeyID
+  /// Maps a DBKeyID into an engine KeyID, looking it up on the given
+  /// connection if necessary.
   ///
-  /// This method is not thread-safe. The caller must protect access via the
-  /// dbMutex.
-  KeyID getKeyIDForID(DBKeyID dbKeyID, std::string *error_out) {
+  /// This method is not thread-safe. The caller must have exclusive use of the
+  /// connection (via the dbMutex, for the main connection).
+  KeyID getKeyIDForID(LookupConnection& connection, DBKeyID dbKeyID,
+                      std::string *error_out) {
 #define checkSQLiteResultOKReturnKeyID(result) \
 if (result != SQLITE_OK) { \
-  *error_out = getCurrentErrorMessage(); \
+  *error_out = getCurrentErrorMessage(connection.db); \
   return KeyID(); \
 }
 
     // Search local db <-> engine mapping cache
-    auto it = engineKeyIDs.find(dbKeyID);
-    if (it != engineKeyIDs.end())
-      return it->second;
+    {
+      std::lock_guard<std::mutex> guard(keyCacheMutex);
+      if (dbKeyID.value < engineKeyIDs.size() &&
+          engineKeyIDs[dbKeyID.value] != KeyID::novalue())
+        return engineKeyIDs[dbKeyID.value];
+    }
 
     // Search for the key in the database
+    auto stmt = connection.findKeyNameForKeyIDStmt;
     int result;
-    result = sqlite3_reset(findKeyNameForKeyIDStmt);
+    result = sqlite3_reset(stmt);
     checkSQLiteResultOKReturnKeyID(result);
-    result = sqlite3_clear_bindings(findKeyNameForKeyIDStmt);
+    result = sqlite3_clear_bindings(stmt);
     checkSQLiteResultOKReturnKeyID(result);
-    result = sqlite3_bind_int64(findKeyNameForKeyIDStmt, /*index=*/1, dbKeyID.value);
+    result = sqlite3_bind_int64(stmt, /*index=*/1, dbKeyID.value);
     checkSQLiteResultOKReturnKeyID(result);
 
-    result = sqlite3_step(findKeyNameForKeyIDStmt);
+    result = sqlite3_step(stmt);
     if (result != SQLITE_ROW) {
-      *error_out = getCurrentErrorMessage();
+      *error_out = getCurrentErrorMessage(connection.db);
       return KeyID();
     }
-    assert(sqlite3_column_count(findKeyNameForKeyIDStmt) == 1);
+    assert(sqlite3_column_count(stmt) == 1);
 
     // Found a key
-    auto size = sqlite3_column_bytes(findKeyNameForKeyIDStmt, 0);
-    auto text = (const char*) sqlite3_column_text(findKeyNameForKeyIDStmt, 0);
+    auto size = sqlite3_column_bytes(stmt, 0);
+    auto text = (const char*) sqlite3_column_text(stmt, 0);
 
     // Map the key to an engine ID
     auto engineKeyID = delegate->getKeyID(KeyType(text, size));
 
     // Cache the mapping locally
-    engineKeyIDs[dbKeyID] = engineKeyID;
-    dbKeyIDs[engineKeyID] = dbKeyID;
+    cacheKeyIDMapping(dbKeyID, engineKeyID);
 
     return engineKeyID;
 #undef checkSQLiteResultOKReturnKeyID
@@ -988,8 +2673,12 @@ if (result != SQLITE_OK) { \
 std::unique_ptr<BuildDB> core::createSQLiteBuildDB(StringRef path,
                                                    uint32_t clientSchemaVersion,
                                                    bool recreateUnmatchedVersion,
-                                                   std::string *error_out) {
-  return llvm::make_unique<SQLiteBuildDB>(path, clientSchemaVersion, recreateUnmatchedVersion);
+                                                   std::string *error_out,
+                                                   bool writeBehind,
+                                                   bool compress) {
+  return llvm::make_unique<SQLiteBuildDB>(path, clientSchemaVersion,
+                                          recreateUnmatchedVersion,
+                                          writeBehind, compress);
 }
 
 #undef checkSQLiteResultOKReturnFalse
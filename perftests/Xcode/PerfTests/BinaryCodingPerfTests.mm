@@ -63,4 +63,68 @@ using namespace llbuild::basic;
     }];
 }
 
+/// Check encoding 128K small uint64_ts as fixed-width values, 100 times.
+- (void)testEncoding_SmallUInt64_Fixed {
+    [self measureBlock:^{
+        for (int j = 0; j != 100; ++j) {
+            BinaryEncoder coder;
+            for (auto i = 0; i != (1 << 20) / 8; ++i) {
+                coder.write(uint64_t(i & 0xFFF));
+            }
+            auto result = coder.contents();
+            XCTAssertEqual(result.size(), (size_t) 1 << 20);
+        }
+    }];
+}
+
+/// Check encoding 128K small uint64_ts as variable-length values, 100 times.
+- (void)testEncoding_SmallUInt64_VarInt {
+    [self measureBlock:^{
+        for (int j = 0; j != 100; ++j) {
+            BinaryEncoder coder;
+            for (auto i = 0; i != (1 << 20) / 8; ++i) {
+                coder.writeVarInt(uint64_t(i & 0xFFF));
+            }
+            auto result = coder.contents();
+            XCTAssertTrue(result.size() < (size_t) 1 << 19);
+        }
+    }];
+}
+
+/// Check decoding 128K small variable-length uint64_ts, 1000 times.
+- (void)testDecoding_SmallUInt64_VarInt {
+    // Write the data.
+    BinaryEncoder coder;
+    for (auto i = 0; i != (1 << 20) / 8; ++i) {
+        coder.writeVarInt(uint64_t(i & 0xFFF));
+    }
+    auto data = coder.contents();
+
+    [self measureBlock:^{
+        for (int j = 0; j != 1000; ++j) {
+            BinaryDecoder decoder(data);
+            for (auto i = 0; i != (1 << 20) / 8; ++i) {
+                uint64_t value;
+                decoder.readVarInt(value);
+                if (value != uint64_t(i & 0xFFF)) abort();
+            }
+            decoder.finish();
+        }
+    }];
+}
+
+/// Check encoding 100MB of uint64_ts as arrays.
+- (void)testEncoding_UInt64Array_100MB {
+    std::vector<uint64_t> values((1 << 20) / 8, 0xAABBCCDDAABBCCDDULL);
+    [self measureBlock:^{
+        // We do 100 iterations to sum to 100 MBs.
+        for (int j = 0; j != 100; ++j) {
+            BinaryEncoder coder;
+            coder.writeArray(llvm::ArrayRef<uint64_t>(values));
+            auto result = coder.contents();
+            XCTAssertEqual(result.size(), (size_t) 1 << 20);
+        }
+    }];
+}
+
 @end
@@ -165,7 +165,13 @@ typedef enum LLBUILD_ENUM_ATTRIBUTES {
   llb_scheduler_algorithm_command_name_priority LLBUILD_SWIFT_NAME(commandNamePriority) = 0,
 
   /// First in, first out
-  llb_scheduler_algorithm_fifo = 1
+  llb_scheduler_algorithm_fifo = 1,
+
+  /// Longest historical critical path first
+  llb_scheduler_algorithm_critical_path LLBUILD_SWIFT_NAME(criticalPath) = 2,
+
+  /// Per-lane queues with randomized work stealing
+  llb_scheduler_algorithm_work_stealing LLBUILD_SWIFT_NAME(workStealing) = 3
 } llb_scheduler_algorithm_t LLBUILD_SWIFT_NAME(SchedulerAlgorithm);
 
 /// Invocation parameters for a build system.
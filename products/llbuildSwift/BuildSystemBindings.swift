@@ -177,6 +177,10 @@ extension SchedulerAlgorithm {
             self = .commandNamePriority
         case "fifo":
             self = .fifo
+        case "criticalPath":
+            self = .criticalPath
+        case "workStealing":
+            self = .workStealing
         default:
             return nil
         }
@@ -1,4 +1,5 @@
 import struct
+import zlib
 
 from sqlalchemy import *
 from sqlalchemy.orm import relation, relationship
@@ -30,6 +31,16 @@ class RuleResult(Base):
 
     key = relation(KeyName)
     dependencies_bytes = Column("dependencies", Binary, nullable=True)
+    flags = Column(Integer, nullable=True)
+
+    # Flags indicating compressed blobs (see SQLiteBuildDB.cpp).
+    COMPRESSED_VALUE = 1 << 0
+    COMPRESSED_DEPENDENCIES = 1 << 1
+
+    @staticmethod
+    def _decompress(data):
+        # Compressed blobs are prefixed with their (32-bit) uncompressed size.
+        return zlib.decompress(bytes(data)[4:])
 
     def __repr__(self):
         return "%s%r" % (
@@ -38,6 +49,8 @@ class RuleResult(Base):
 
     @property
     def value(self):
+        if (self.flags or 0) & self.COMPRESSED_VALUE:
+            return BuildValue(self._decompress(self.value_bytes))
         return BuildValue(self.value_bytes)
 
     @property
@@ -45,12 +58,31 @@ class RuleResult(Base):
         if self.dependencies_bytes is None:
             return []
         else :
-            num_dependencies = len(self.dependencies_bytes) / 8
-            return struct.unpack("<" + str(num_dependencies) + "Q",
-                                 self.dependencies_bytes)
+            data = self.dependencies_bytes
+            if (self.flags or 0) & self.COMPRESSED_DEPENDENCIES:
+                data = self._decompress(data)
+            dependencies = []
+            data = str(data)
+            while data:
+                value, data = read_varint(data)
+                dependencies.append(value)
+            return dependencies
     
 ###
 
+def read_varint(bytes):
+    """Decode a variable-length (LEB128) integer, as written by
+    llbuild::basic::BinaryEncoder::writeVarInt(), returning it and the
+    remaining bytes."""
+    result = shift = 0
+    for i, c in enumerate(bytes):
+        byte = ord(c)
+        result |= (byte & 0x7F) << shift
+        shift += 7
+        if not byte & 0x80:
+            return result, bytes[i+1:]
+    raise ValueError("truncated variable-length integer")
+
 class BuildValue(object):
     # FIXME: This is a manually Python translation of the C++
     # llbuild::buildsystem::BuildValue type, which is unfortunate, but it isn't
@@ -90,8 +122,8 @@ class BuildValue(object):
             self.outputs = []
             for i in range(numOutputs):
                 # Read the file information.
-                self.outputs.append(FileInfo(bytes[:48]))
-                bytes = bytes[48:]
+                fileInfo, bytes = FileInfo.decode(bytes)
+                self.outputs.append(fileInfo)
         else:
             self.outputs = None
 
@@ -137,10 +169,21 @@ class BuildValue(object):
         return output
 
 class FileInfo(object):
-    def __init__(self, bytes):
-        (self.device, self.inode, self.mode, self.size,
-         modTimeSec, modTimeNano) = struct.unpack("<QQQQQQ", bytes)
-        self.modTime =  (modTimeSec, modTimeNano)
+    def __init__(self, device, inode, mode, size, modTime):
+        self.device = device
+        self.inode = inode
+        self.mode = mode
+        self.size = size
+        self.modTime = modTime
+
+    @staticmethod
+    def decode(bytes):
+        """Decode a FileInfo, returning it and the remaining bytes."""
+        fields = []
+        for i in range(6):
+            value, bytes = read_varint(bytes)
+            fields.append(value)
+        return FileInfo(*(fields[:4] + [tuple(fields[4:])])), bytes
 
     def __repr__(self):
         return "FileInfo(device=%r, inode=%#0x, mode=%r, size=%r, mtime=(%r, %r))" % (
@@ -105,6 +105,65 @@ TEST(BinaryCodingTests, bytes) {
   EXPECT_EQ(s2, StringRef("world"));
 }
 
+TEST(BinaryCodingTests, fixedWidthLayout) {
+  // Fixed-width integers are always encoded little-endian.
+  EXPECT_EQ(encode(uint32_t(0x01020304)),
+            std::vector<uint8_t>({ 0x04, 0x03, 0x02, 0x01 }));
+  EXPECT_EQ(encode(uint64_t(0x0102030405060708ULL)),
+            std::vector<uint8_t>({ 0x08, 0x07, 0x06, 0x05,
+                                   0x04, 0x03, 0x02, 0x01 }));
+}
+
+TEST(BinaryCodingTests, varInt) {
+  auto encodeVarInt = [](uint64_t value) {
+    BinaryEncoder encoder;
+    encoder.writeVarInt(value);
+    return encoder.contents();
+  };
+
+  // Check the raw encoding.
+  EXPECT_EQ(encodeVarInt(0), std::vector<uint8_t>({ 0x00 }));
+  EXPECT_EQ(encodeVarInt(127), std::vector<uint8_t>({ 0x7F }));
+  EXPECT_EQ(encodeVarInt(128), std::vector<uint8_t>({ 0x80, 0x01 }));
+  EXPECT_EQ(encodeVarInt(624485), std::vector<uint8_t>({ 0xE5, 0x8E, 0x26 }));
+  EXPECT_EQ(encodeVarInt(~uint64_t(0)).size(), 10U);
+
+  // Check the roundtrip.
+  BinaryEncoder encoder;
+  std::vector<uint64_t> values = {
+    0, 1, 127, 128, 300, 0xFFFF, 0xFFFFFFFFULL, 0x123456789ABCDEFULL,
+    ~uint64_t(0) };
+  for (auto value: values)
+    encoder.writeVarInt(value);
+  auto data = encoder.contents();
+  BinaryDecoder decoder(data);
+  for (auto value: values) {
+    uint64_t decoded;
+    decoder.readVarInt(decoded);
+    EXPECT_EQ(decoded, value);
+  }
+  decoder.finish();
+}
+
+TEST(BinaryCodingTests, array) {
+  std::vector<uint32_t> values = { 0x01020304, 0xAABBCCDD, 0 };
+  BinaryEncoder encoder;
+  encoder.writeArray(ArrayRef<uint32_t>(values));
+  auto data = encoder.contents();
+
+  // Arrays are encoded the same as the individual elements.
+  BinaryEncoder elementEncoder;
+  for (auto value: values)
+    elementEncoder.write(value);
+  EXPECT_EQ(data, elementEncoder.contents());
+
+  std::vector<uint32_t> decoded(values.size());
+  BinaryDecoder decoder(data);
+  decoder.readArray(MutableArrayRef<uint32_t>(decoded));
+  decoder.finish();
+  EXPECT_EQ(decoded, values);
+}
+
 TEST(BinaryCodingTests, customType) {
   // Check the coding of basic types.
   checkRoundtrip(CustomType{ 0xABCD, 0x1234 });
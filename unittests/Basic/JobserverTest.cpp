@@ -0,0 +1,146 @@
+//===- unittests/Basic/JobserverTest.cpp ----------------------------------===//
+//
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2019 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+//
+//===----------------------------------------------------------------------===//
+
+#include "llbuild/Basic/Jobserver.h"
+
+#include "gtest/gtest.h"
+
+#include <chrono>
+#include <thread>
+
+using namespace llbuild;
+using namespace llbuild::basic;
+
+namespace {
+
+#if !defined(_WIN32)
+
+/// Check that a jobserver with the given number of slots hands out exactly
+/// that many slots (the implicit one first).
+static void checkSlots(Jobserver& jobserver, unsigned numSlots) {
+  std::vector<int> tokens;
+  for (unsigned i = 0; i != numSlots; ++i) {
+    int token;
+    ASSERT_TRUE(jobserver.acquire(token));
+    tokens.push_back(token);
+  }
+  EXPECT_EQ(Jobserver::ImplicitToken, tokens[0]);
+  for (unsigned i = 1; i != numSlots; ++i) {
+    EXPECT_EQ('+', tokens[i]);
+  }
+
+  // Releasing a slot makes it available again.
+  jobserver.release(tokens.back());
+  int token;
+  ASSERT_TRUE(jobserver.acquire(token));
+  EXPECT_EQ(tokens.back(), token);
+
+  for (auto token: tokens)
+    jobserver.release(token);
+}
+
+TEST(JobserverTest, pipeServer) {
+  std::string error;
+  auto server = Jobserver::createServer(3, JobserverStyle::Pipe, &error);
+  ASSERT_TRUE(server) << error;
+  EXPECT_TRUE(server->getMakeFlags().startswith(" -j3 --jobserver-auth="));
+  EXPECT_EQ(2U, server->getInheritedFileDescriptors().size());
+  checkSlots(*server, 3);
+
+  // A client shares the slots, but has its own implicit slot.
+  auto client = Jobserver::createClient(server->getMakeFlags(), &error);
+  ASSERT_TRUE(client) << error;
+  EXPECT_EQ(server->getMakeFlags(), client->getMakeFlags());
+  int serverToken, clientTokens[3];
+  ASSERT_TRUE(server->acquire(serverToken));
+  for (auto& token: clientTokens)
+    ASSERT_TRUE(client->acquire(token));
+  EXPECT_EQ(Jobserver::ImplicitToken, serverToken);
+  EXPECT_EQ(Jobserver::ImplicitToken, clientTokens[0]);
+  for (auto token: clientTokens)
+    client->release(token);
+  server->release(serverToken);
+}
+
+TEST(JobserverTest, fifoServer) {
+  std::string error;
+  auto server = Jobserver::createServer(4, JobserverStyle::Fifo, &error);
+  ASSERT_TRUE(server) << error;
+  EXPECT_TRUE(server->getMakeFlags().startswith(
+                  " -j4 --jobserver-auth=fifo:"));
+  EXPECT_TRUE(server->getInheritedFileDescriptors().empty());
+  checkSlots(*server, 4);
+
+  auto client = Jobserver::createClient(server->getMakeFlags(), &error);
+  ASSERT_TRUE(client) << error;
+  checkSlots(*client, 4);
+}
+
+TEST(JobserverTest, cancel) {
+  for (auto style: { JobserverStyle::Pipe, JobserverStyle::Fifo }) {
+    std::string error;
+    auto server = Jobserver::createServer(2, style, &error);
+    ASSERT_TRUE(server) << error;
+    auto client = Jobserver::createClient(server->getMakeFlags(), &error);
+    ASSERT_TRUE(client) << error;
+
+    // Take every slot, so that the next acquisition has to wait.
+    int serverToken, clientTokens[2];
+    ASSERT_TRUE(server->acquire(serverToken));
+    for (auto& token: clientTokens)
+      ASSERT_TRUE(client->acquire(token));
+
+    // Check that cancelling the jobserver wakes the waiting acquisition.
+    bool acquired = true;
+    std::thread waiter([&]() {
+        int token;
+        acquired = client->acquire(token);
+      });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    client->cancel();
+    waiter.join();
+    EXPECT_FALSE(acquired);
+
+    // Once cancelled, no further slots are handed out from the pipe.
+    client->release(clientTokens[1]);
+    int token;
+    EXPECT_FALSE(client->acquire(token));
+
+    // The implicit slot remains usable.
+    client->release(clientTokens[0]);
+    ASSERT_TRUE(client->acquire(token));
+    EXPECT_EQ(Jobserver::ImplicitToken, token);
+    client->release(token);
+    server->release(serverToken);
+  }
+}
+
+TEST(JobserverTest, clientMakeFlags) {
+  // There is no jobserver without the option.
+  std::string error;
+  EXPECT_FALSE(Jobserver::createClient("", &error));
+  EXPECT_FALSE(Jobserver::createClient("kw -j4", &error));
+  EXPECT_TRUE(error.empty());
+
+  // The file descriptors must have been inherited.
+  EXPECT_FALSE(Jobserver::createClient(" -j4 --jobserver-auth=1000,1001",
+                                       &error));
+  EXPECT_FALSE(error.empty());
+
+  error.clear();
+  EXPECT_FALSE(Jobserver::createClient(" --jobserver-fds=x,y", &error));
+  EXPECT_FALSE(error.empty());
+}
+
+#endif
+
+}
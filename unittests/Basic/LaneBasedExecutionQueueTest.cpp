@@ -22,10 +22,12 @@
 #include "gtest/gtest.h"
 
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <ctime>
 #include <future>
 #include <mutex>
+#include <thread>
 
 using namespace llbuild;
 using namespace llbuild::basic;
@@ -175,4 +177,158 @@ namespace {
     EXPECT_EQ(executions, 2);
   }
 
+  static void checkPriorityScheduling(SchedulerAlgorithm alg) {
+    DummyDelegate delegate;
+    auto queue = std::unique_ptr<ExecutionQueue>(
+        createLaneBasedExecutionQueue(delegate, 1, alg,
+                                      /*environment=*/nullptr));
+
+    // Block the only lane until all of the jobs have been queued.
+    std::promise<void> allQueued;
+    std::shared_future<void> allQueuedFuture(allQueued.get_future());
+    DummyCommand blockingCommand;
+    queue->addJob(QueueJob(&blockingCommand, [allQueuedFuture](QueueJobContext*) {
+      allQueuedFuture.wait();
+    }));
+
+    std::mutex orderMutex;
+    std::vector<uint64_t> order;
+    DummyCommand dummyCommand;
+    for (uint64_t priority: { 5, 100, 1, 20 }) {
+      queue->addJob(QueueJob(&dummyCommand, [&, priority](QueueJobContext*) {
+        std::lock_guard<std::mutex> lock(orderMutex);
+        order.push_back(priority);
+      }, priority));
+    }
+    allQueued.set_value();
+
+    // Destroying the queue waits for all of the jobs to complete.
+    queue.reset();
+
+    EXPECT_EQ(std::vector<uint64_t>({ 100, 20, 5, 1 }), order);
+  }
+
+  TEST(LaneBasedExecutionQueueTest, criticalPathScheduling) {
+    checkPriorityScheduling(SchedulerAlgorithm::CriticalPath);
+  }
+
+  TEST(LaneBasedExecutionQueueTest, workStealingPriorityScheduling) {
+    checkPriorityScheduling(SchedulerAlgorithm::WorkStealing);
+  }
+
+  TEST(LaneBasedExecutionQueueTest, resourceClasses) {
+    DummyDelegate delegate;
+    auto queue = std::unique_ptr<ExecutionQueue>(
+        createLaneBasedExecutionQueue(delegate, 4,
+                                      SchedulerAlgorithm::NamePriority,
+                                      /*environment=*/nullptr));
+    auto resourceClass = queue->addResourceClass("pool", 2);
+
+    // Jobs of the resource class should never exceed its concurrency, even
+    // with lanes to spare.
+    std::atomic<unsigned> numRunning{0};
+    std::atomic<unsigned> maxRunning{0};
+    std::atomic<unsigned> executions{0};
+    DummyCommand dummyCommand;
+    for (unsigned i = 0; i != 20; ++i) {
+      queue->addJob(QueueJob(&dummyCommand, [&](QueueJobContext*) {
+        unsigned running = ++numRunning;
+        unsigned max = maxRunning;
+        while (running > max && !maxRunning.compare_exchange_weak(max, running))
+          ;
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        --numRunning;
+        ++executions;
+      }, /*priority=*/0, resourceClass));
+    }
+
+    // Destroying the queue waits for all of the jobs to complete.
+    queue.reset();
+
+    EXPECT_EQ(20U, executions);
+    EXPECT_LE(maxRunning, 2U);
+  }
+
+  TEST(LaneBasedExecutionQueueTest, memoryBudget) {
+    DummyDelegate delegate;
+    auto queue = std::unique_ptr<ExecutionQueue>(
+        createLaneBasedExecutionQueue(delegate, 4,
+                                      SchedulerAlgorithm::NamePriority,
+                                      /*environment=*/nullptr));
+    queue->setMemoryBudget(100);
+
+    // The estimated memory of the executing jobs should never exceed the
+    // budget, except for a job which exceeds it alone (which runs by itself).
+    std::mutex mutex;
+    uint64_t runningMemory = 0, maxRunningMemory = 0;
+    unsigned numRunning = 0, maxRunningWithLargeJob = 0;
+    std::atomic<unsigned> executions{0};
+    DummyCommand dummyCommand;
+    auto addJob = [&](uint64_t estimatedPeakRSS) {
+      queue->addJob(QueueJob(&dummyCommand, [&, estimatedPeakRSS](QueueJobContext*) {
+        {
+          std::lock_guard<std::mutex> guard(mutex);
+          runningMemory += estimatedPeakRSS;
+          ++numRunning;
+          if (estimatedPeakRSS <= 100)
+            maxRunningMemory = std::max(maxRunningMemory, runningMemory);
+          if (estimatedPeakRSS > 100 || runningMemory > 100)
+            maxRunningWithLargeJob = std::max(maxRunningWithLargeJob,
+                                              numRunning);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        {
+          std::lock_guard<std::mutex> guard(mutex);
+          runningMemory -= estimatedPeakRSS;
+          --numRunning;
+        }
+        ++executions;
+      }, /*priority=*/0, /*resourceClass=*/0, estimatedPeakRSS));
+    };
+    for (unsigned i = 0; i != 20; ++i) {
+      addJob(40);
+      if (i == 10)
+        addJob(150);
+    }
+
+    // Destroying the queue waits for all of the jobs to complete.
+    queue.reset();
+
+    EXPECT_EQ(21U, executions);
+    EXPECT_LE(maxRunningMemory, 100U);
+    EXPECT_EQ(1U, maxRunningWithLargeJob);
+  }
+
+  TEST(LaneBasedExecutionQueueTest, workStealingScheduling) {
+    DummyDelegate delegate;
+    auto queue = std::unique_ptr<ExecutionQueue>(
+        createLaneBasedExecutionQueue(delegate, 4,
+                                      SchedulerAlgorithm::WorkStealing,
+                                      /*environment=*/nullptr));
+
+    // Block one lane (with a timeout, in case the jobs are never run), so the
+    // jobs queued to it must be stolen by the others.
+    std::promise<void> allExecuted;
+    std::shared_future<void> allExecutedFuture(allExecuted.get_future());
+    DummyCommand blockingCommand;
+    queue->addJob(QueueJob(&blockingCommand,
+                           [allExecutedFuture](QueueJobContext*) {
+      allExecutedFuture.wait_for(std::chrono::seconds(10));
+    }));
+
+    const unsigned numJobs = 1000;
+    std::atomic<unsigned> executions{0};
+    DummyCommand dummyCommand;
+    for (unsigned i = 0; i != numJobs; ++i) {
+      queue->addJob(QueueJob(&dummyCommand, [&](QueueJobContext*) {
+        if (++executions == numJobs)
+          allExecuted.set_value();
+      }));
+    }
+
+    EXPECT_EQ(std::future_status::ready,
+              allExecutedFuture.wait_for(std::chrono::seconds(10)));
+    queue.reset();
+  }
+
 }
@@ -1166,3 +1166,64 @@ TEST(BuildSystemTaskTests, directoryContentsWithSkippedCommand) {
   ASSERT_TRUE(result.hasValue());
   ASSERT_FALSE(result.getValue().isSkippedCommand());
 }
+
+/// Check that a command pool limits how many of its commands execute at once.
+TEST(BuildSystemTaskTests, commandPool) {
+  TmpDir tempDir(__func__);
+
+  SmallString<256> manifest{ tempDir.str() };
+  sys::path::append(manifest, "manifest.llbuild");
+  SmallString<256> log{ tempDir.str() };
+  sys::path::append(log, "log");
+
+  {
+    std::error_code ec;
+    llvm::raw_fd_ostream os(manifest, ec, llvm::sys::fs::F_Text);
+    assert(!ec);
+
+    os <<
+    "client:\n"
+    "  name: mock\n"
+    "\n"
+    "commands:\n"
+    "  \"<all>\":\n"
+    "    tool: phony\n"
+    "    inputs: [\"<P1>\", \"<P2>\", \"<P3>\"]\n"
+    "    outputs: [\"<all>\"]\n";
+    for (int i = 1; i <= 3; ++i) {
+      os << "  P" << i << ":\n"
+         << "    tool: shell\n"
+         << "    outputs: [\"<P" << i << ">\"]\n"
+         << "    pool: serial\n"
+         << "    pool-depth: 1\n"
+         << "    args: echo start >> \"" << log << "\"; sleep 0.1; "
+         << "echo end >> \"" << log << "\"\n";
+    }
+  }
+
+  class ConcurrentDelegate: public MockBuildSystemDelegate {
+    MockExecutionQueueDelegate executionQueueDelegate;
+
+  public:
+    virtual std::unique_ptr<ExecutionQueue> createExecutionQueue() override {
+      return std::unique_ptr<ExecutionQueue>(
+          createLaneBasedExecutionQueue(executionQueueDelegate, /*numLanes=*/4,
+                                        SchedulerAlgorithm::NamePriority,
+                                        /*environment=*/nullptr));
+    }
+  };
+
+  ConcurrentDelegate delegate;
+  BuildSystem system(delegate, createLocalFileSystem());
+  bool loadingResult = system.loadDescription(manifest);
+  ASSERT_TRUE(loadingResult);
+
+  auto result = system.build(BuildKey::makeNode("<all>"));
+  ASSERT_TRUE(result.hasValue());
+
+  // The commands must not have overlapped, despite the spare lanes.
+  auto contents = llvm::MemoryBuffer::getFile(log);
+  ASSERT_TRUE(bool(contents));
+  EXPECT_EQ("start\nend\nstart\nend\nstart\nend\n",
+            contents.get()->getBuffer());
+}
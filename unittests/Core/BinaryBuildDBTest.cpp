@@ -0,0 +1,410 @@
+//===- unittests/Core/BinaryBuildDBTest.cpp -------------------------------===//
+//
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2014 - 2019 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+//
+//===----------------------------------------------------------------------===//
+
+#include "llbuild/Core/BuildDB.h"
+
+#include "llbuild/Basic/PlatformUtility.h"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/DJB.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "gtest/gtest.h"
+
+using namespace llbuild;
+using namespace llbuild::core;
+
+namespace {
+class SimpleBuildDBDelegate : public BuildDBDelegate {
+  llvm::StringMap<bool> keyTable;
+
+public:
+  virtual const KeyID getKeyID(const KeyType& key) override {
+    auto it = keyTable.insert(std::make_pair(key, false)).first;
+    return KeyID(it->getKey().data());
+  }
+
+  virtual KeyType getKeyForID(const KeyID key) override {
+    return llvm::StringMapEntry<bool>::GetStringMapEntryFromKeyData(
+      (const char*)(uintptr_t)key).getKey();
+  }
+};
+
+uint64_t getFileSize(StringRef path) {
+  uint64_t size = 0;
+  auto ec = llvm::sys::fs::file_size(path, size);
+  EXPECT_EQ(bool(ec), false);
+  return size;
+}
+}
+
+TEST(BinaryBuildDBTest, LookupWithoutValue) {
+  // Create a temporary file.
+  llvm::SmallString<256> dbPath;
+  auto ec = llvm::sys::fs::createTemporaryFile("build", "db", dbPath);
+  EXPECT_EQ(bool(ec), false);
+
+  SimpleBuildDBDelegate delegate;
+  std::string error;
+  std::unique_ptr<BuildDB> buildDB = createBinaryBuildDB(dbPath, 1, /* recreateUnmatchedVersion = */ true, &error);
+  EXPECT_TRUE(buildDB != nullptr);
+  buildDB->attachDelegate(&delegate);
+
+  // Store a result.
+  Rule rule{"output"};
+  KeyID keyID = delegate.getKeyID(rule.key);
+  Result result;
+  result.value = {1, 2, 3};
+  result.signature = basic::CommandSignature(42);
+  result.builtAt = 1;
+  result.computedAt = 1;
+  result.start = 1.5;
+  result.end = 2.5;
+  result.peakRSS = 64 * 1024 * 1024;
+  result.dependencies.push_back(delegate.getKeyID("input"), false);
+  result.dependencies.push_back(delegate.getKeyID("directory"), true);
+  EXPECT_TRUE(buildDB->buildStarted(&error));
+  EXPECT_TRUE(buildDB->setCurrentIteration(1, &error));
+  EXPECT_TRUE(buildDB->setRuleResult(keyID, rule, result, &error));
+  buildDB->buildComplete();
+  EXPECT_EQ(error, "");
+
+  // Reopen the database, and check the result can be retrieved without its
+  // value, then with it.
+  buildDB = createBinaryBuildDB(dbPath, 1, /* recreateUnmatchedVersion = */ true, &error);
+  buildDB->attachDelegate(&delegate);
+  bool success = false;
+  EXPECT_EQ(1U, buildDB->getCurrentEpoch(&success, &error));
+  EXPECT_TRUE(success);
+  Result metadata;
+  bool valueLoaded = true;
+  EXPECT_TRUE(buildDB->lookupRuleResultWithoutValue(
+                  keyID, rule.key, &metadata, &valueLoaded, &error));
+  EXPECT_EQ(error, "");
+  EXPECT_FALSE(valueLoaded);
+  EXPECT_TRUE(metadata.value.empty());
+  EXPECT_EQ(result.signature, metadata.signature);
+  EXPECT_EQ(1U, metadata.builtAt);
+  EXPECT_EQ(1U, metadata.computedAt);
+  EXPECT_EQ(1.5, metadata.start);
+  EXPECT_EQ(2.5, metadata.end);
+  EXPECT_EQ(result.peakRSS, metadata.peakRSS);
+  EXPECT_EQ(2U, metadata.dependencies.size());
+  EXPECT_EQ(delegate.getKeyID("input"), metadata.dependencies[0].keyID);
+  EXPECT_FALSE(metadata.dependencies[0].flag);
+  EXPECT_EQ(delegate.getKeyID("directory"), metadata.dependencies[1].keyID);
+  EXPECT_TRUE(metadata.dependencies[1].flag);
+
+  ValueType value;
+  EXPECT_TRUE(buildDB->lookupRuleResultValue(keyID, rule.key, &value, &error));
+  EXPECT_EQ(error, "");
+  EXPECT_EQ(result.value, value);
+
+  // Check that the value can also be retrieved directly.
+  buildDB = createBinaryBuildDB(dbPath, 1, /* recreateUnmatchedVersion = */ true, &error);
+  buildDB->attachDelegate(&delegate);
+  value.clear();
+  EXPECT_TRUE(buildDB->lookupRuleResultValue(keyID, rule.key, &value, &error));
+  EXPECT_EQ(result.value, value);
+  EXPECT_FALSE(buildDB->lookupRuleResultValue(
+                   delegate.getKeyID("missing"), "missing", &value, &error));
+  EXPECT_EQ(error, "");
+
+  // Check the keys known to the database.
+  std::vector<KeyType> keys;
+  EXPECT_TRUE(buildDB->getKeys(keys, &error));
+  EXPECT_EQ((std::vector<KeyType>{"output", "input", "directory"}), keys);
+
+  buildDB = nullptr;
+  ec = llvm::sys::fs::remove(dbPath.str());
+  EXPECT_EQ(bool(ec), false);
+  (void)llvm::sys::fs::remove(dbPath.str() + "-lock");
+}
+
+TEST(BinaryBuildDBTest, VersionMismatch) {
+  // Create a temporary file.
+  llvm::SmallString<256> dbPath;
+  auto ec = llvm::sys::fs::createTemporaryFile("build", "db", dbPath);
+  EXPECT_EQ(bool(ec), false);
+
+  SimpleBuildDBDelegate delegate;
+  std::string error;
+  std::unique_ptr<BuildDB> buildDB = createBinaryBuildDB(dbPath, 1, /* recreateUnmatchedVersion = */ true, &error);
+  buildDB->attachDelegate(&delegate);
+  Rule rule{"output"};
+  Result result;
+  result.builtAt = 1;
+  EXPECT_TRUE(buildDB->buildStarted(&error));
+  EXPECT_TRUE(buildDB->setRuleResult(delegate.getKeyID(rule.key), rule,
+                                     result, &error));
+  buildDB->buildComplete();
+  buildDB = nullptr;
+
+  // Check that a different client version is an error, if requested.
+  buildDB = createBinaryBuildDB(dbPath, 2, /* recreateUnmatchedVersion = */ false, &error);
+  bool success = true;
+  buildDB->getCurrentEpoch(&success, &error);
+  EXPECT_FALSE(success);
+  EXPECT_EQ("Version mismatch. (database-schema: 2 requested schema: 2. "
+            "database-client: 1 requested client: 2)", error);
+
+  // Otherwise, check the database is recreated.
+  error.clear();
+  buildDB = createBinaryBuildDB(dbPath, 2, /* recreateUnmatchedVersion = */ true, &error);
+  buildDB->attachDelegate(&delegate);
+  Result lookup;
+  EXPECT_FALSE(buildDB->lookupRuleResult(delegate.getKeyID(rule.key), rule.key,
+                                         &lookup, &error));
+  EXPECT_EQ(error, "");
+
+  buildDB = nullptr;
+  ec = llvm::sys::fs::remove(dbPath.str());
+  EXPECT_EQ(bool(ec), false);
+  (void)llvm::sys::fs::remove(dbPath.str() + "-lock");
+}
+
+TEST(BinaryBuildDBTest, CrashRecovery) {
+  // Create a temporary file.
+  llvm::SmallString<256> dbPath;
+  auto ec = llvm::sys::fs::createTemporaryFile("build", "db", dbPath);
+  EXPECT_EQ(bool(ec), false);
+
+  SimpleBuildDBDelegate delegate;
+  std::string error;
+  std::unique_ptr<BuildDB> buildDB = createBinaryBuildDB(dbPath, 1, /* recreateUnmatchedVersion = */ true, &error);
+  buildDB->attachDelegate(&delegate);
+  EXPECT_TRUE(buildDB->buildStarted(&error));
+  for (int i = 0; i != 10; ++i) {
+    Rule rule{"output-" + std::to_string(i)};
+    Result result;
+    result.value = {uint8_t(i)};
+    result.builtAt = 1;
+    EXPECT_TRUE(buildDB->setRuleResult(delegate.getKeyID(rule.key), rule,
+                                       result, &error));
+  }
+  buildDB->buildComplete();
+  buildDB = nullptr;
+  uint64_t validSize = getFileSize(dbPath);
+
+  // Simulate a crash while a record was being written, by appending a partial
+  // record.
+  {
+    std::error_code ec;
+    llvm::raw_fd_ostream os(dbPath, ec, llvm::sys::fs::F_Append);
+    EXPECT_EQ(bool(ec), false);
+    os << StringRef("\x02\x00\x00\x00\x40\x00\x00\x00garbage", 15);
+  }
+  uint64_t partialSize = getFileSize(dbPath);
+  EXPECT_NE(validSize, partialSize);
+
+  // Check that while another writer holds the lock, the partial record is
+  // ignored but not truncated (since it may still be being written).
+  {
+    int lockFD;
+    ec = llvm::sys::fs::openFileForReadWrite(dbPath + "-lock", lockFD,
+                                             llvm::sys::fs::CD_OpenAlways,
+                                             llvm::sys::fs::OF_None);
+    EXPECT_EQ(bool(ec), false);
+    EXPECT_EQ(0, basic::sys::tryLockFile(lockFD));
+    buildDB = createBinaryBuildDB(dbPath, 1, /* recreateUnmatchedVersion = */ true, &error);
+    buildDB->attachDelegate(&delegate);
+    std::vector<KeyType> keys;
+    std::vector<Result> results;
+    EXPECT_TRUE(buildDB->getKeysWithResult(keys, results, &error));
+    EXPECT_EQ(error, "");
+    EXPECT_EQ(10U, results.size());
+    EXPECT_EQ(partialSize, getFileSize(dbPath));
+    buildDB = nullptr;
+    basic::sys::unlockFile(lockFD);
+    basic::sys::close(lockFD);
+  }
+
+  // Check the partial record is dropped, and the prior results are intact.
+  buildDB = createBinaryBuildDB(dbPath, 1, /* recreateUnmatchedVersion = */ true, &error);
+  buildDB->attachDelegate(&delegate);
+  std::vector<KeyType> keys;
+  std::vector<Result> results;
+  EXPECT_TRUE(buildDB->getKeysWithResult(keys, results, &error));
+  EXPECT_EQ(error, "");
+  EXPECT_EQ(10U, results.size());
+  EXPECT_EQ(validSize, getFileSize(dbPath));
+
+  // Check that the database can still be written.
+  Rule rule{"output-10"};
+  Result result;
+  result.value = {10};
+  result.builtAt = 2;
+  EXPECT_TRUE(buildDB->buildStarted(&error));
+  EXPECT_TRUE(buildDB->setRuleResult(delegate.getKeyID(rule.key), rule,
+                                     result, &error));
+  buildDB->buildComplete();
+  buildDB = nullptr;
+
+  // Simulate a crash which lost the end of the file, by truncating part of the
+  // last record.
+  uint64_t size = getFileSize(dbPath);
+  {
+    int fd;
+    ec = llvm::sys::fs::openFileForReadWrite(dbPath, fd,
+                                             llvm::sys::fs::CD_OpenExisting,
+                                             llvm::sys::fs::OF_None);
+    EXPECT_EQ(bool(ec), false);
+    ec = llvm::sys::fs::resize_file(fd, size - 8);
+    EXPECT_EQ(bool(ec), false);
+    ::close(fd);
+  }
+
+  buildDB = createBinaryBuildDB(dbPath, 1, /* recreateUnmatchedVersion = */ true, &error);
+  buildDB->attachDelegate(&delegate);
+  keys.clear();
+  results.clear();
+  EXPECT_TRUE(buildDB->getKeysWithResult(keys, results, &error));
+  EXPECT_EQ(error, "");
+  EXPECT_EQ(10U, results.size());
+  ValueType value;
+  EXPECT_TRUE(buildDB->lookupRuleResultValue(
+                  delegate.getKeyID("output-9"), "output-9", &value, &error));
+  EXPECT_EQ(ValueType{9}, value);
+  EXPECT_FALSE(buildDB->lookupRuleResultValue(
+                   delegate.getKeyID("output-10"), "output-10", &value,
+                   &error));
+
+  buildDB = nullptr;
+  ec = llvm::sys::fs::remove(dbPath.str());
+  EXPECT_EQ(bool(ec), false);
+  (void)llvm::sys::fs::remove(dbPath.str() + "-lock");
+}
+
+TEST(BinaryBuildDBTest, InvalidDependency) {
+  // Create a temporary file.
+  llvm::SmallString<256> dbPath;
+  auto ec = llvm::sys::fs::createTemporaryFile("build", "db", dbPath);
+  EXPECT_EQ(bool(ec), false);
+
+  SimpleBuildDBDelegate delegate;
+  std::string error;
+  std::unique_ptr<BuildDB> buildDB = createBinaryBuildDB(dbPath, 1, /* recreateUnmatchedVersion = */ true, &error);
+  buildDB->attachDelegate(&delegate);
+  EXPECT_TRUE(buildDB->buildStarted(&error));
+  Rule rule{"output"};
+  Result result;
+  result.value = {1};
+  result.builtAt = 1;
+  EXPECT_TRUE(buildDB->setRuleResult(delegate.getKeyID(rule.key), rule,
+                                     result, &error));
+  buildDB->buildComplete();
+  buildDB = nullptr;
+  uint64_t validSize = getFileSize(dbPath);
+
+  // Append a well-formed result record for the key, whose dependency refers to
+  // a key which was never recorded.
+  {
+    using namespace llvm::support::endian;
+    char record[16 + 72] = {};
+    char* payload = record + 16;
+    write64le(payload, 1);
+    write32le(payload + 60, 1);
+    write64le(payload + 64, 1000 << 1);
+    write32le(record, 2);
+    write32le(record + 4, 72);
+    write32le(record + 8, llvm::djbHash(StringRef(payload, 72),
+                                        llvm::djbHash(StringRef(record, 8))));
+    std::error_code ec;
+    llvm::raw_fd_ostream os(dbPath, ec, llvm::sys::fs::F_Append);
+    EXPECT_EQ(bool(ec), false);
+    os.write(record, sizeof(record));
+  }
+
+  // Check the record is dropped as corrupt, and the prior result is intact.
+  buildDB = createBinaryBuildDB(dbPath, 1, /* recreateUnmatchedVersion = */ true, &error);
+  buildDB->attachDelegate(&delegate);
+  ValueType value;
+  EXPECT_TRUE(buildDB->lookupRuleResultValue(
+                  delegate.getKeyID("output"), "output", &value, &error));
+  EXPECT_EQ(ValueType{1}, value);
+  EXPECT_EQ(error, "");
+  EXPECT_EQ(validSize, getFileSize(dbPath));
+
+  buildDB = nullptr;
+  ec = llvm::sys::fs::remove(dbPath.str());
+  EXPECT_EQ(bool(ec), false);
+  (void)llvm::sys::fs::remove(dbPath.str() + "-lock");
+}
+
+TEST(BinaryBuildDBTest, Compaction) {
+  // Create a temporary file.
+  llvm::SmallString<256> dbPath;
+  auto ec = llvm::sys::fs::createTemporaryFile("build", "db", dbPath);
+  EXPECT_EQ(bool(ec), false);
+
+  SimpleBuildDBDelegate delegate;
+  std::string error;
+  std::unique_ptr<BuildDB> buildDB = createBinaryBuildDB(dbPath, 1, /* recreateUnmatchedVersion = */ true, &error);
+  buildDB->attachDelegate(&delegate);
+
+  // Run several builds which rebuild every result, so most of the log is
+  // superseded.
+  const int numResults = 100;
+  for (uint64_t iteration = 1; iteration <= 4; ++iteration) {
+    EXPECT_TRUE(buildDB->buildStarted(&error));
+    EXPECT_TRUE(buildDB->setCurrentIteration(iteration, &error));
+    for (int i = 0; i != numResults; ++i) {
+      Rule rule{"output-" + std::to_string(i)};
+      Result result;
+      result.value = ValueType(10000, uint8_t(iteration));
+      result.builtAt = iteration;
+      result.computedAt = iteration;
+      result.dependencies.push_back(
+          delegate.getKeyID("input-" + std::to_string(i)), false);
+      EXPECT_TRUE(buildDB->setRuleResult(delegate.getKeyID(rule.key), rule,
+                                         result, &error));
+    }
+    buildDB->buildComplete();
+    EXPECT_EQ(error, "");
+  }
+
+  // Check the log was compacted (otherwise it would hold four builds worth of
+  // results).
+  EXPECT_GT(uint64_t(3 * numResults * 10000), getFileSize(dbPath));
+
+  // Check the latest results survived, both in the open database and after
+  // reopening it.
+  for (int reopen = 0; reopen != 2; ++reopen) {
+    if (reopen) {
+      buildDB = createBinaryBuildDB(dbPath, 1, /* recreateUnmatchedVersion = */ true, &error);
+      buildDB->attachDelegate(&delegate);
+    }
+    bool success = false;
+    EXPECT_EQ(4U, buildDB->getCurrentEpoch(&success, &error));
+    EXPECT_TRUE(success);
+    for (int i = 0; i != numResults; ++i) {
+      std::string key = "output-" + std::to_string(i);
+      Result result;
+      EXPECT_TRUE(buildDB->lookupRuleResult(delegate.getKeyID(key), key,
+                                            &result, &error));
+      EXPECT_EQ(4U, result.builtAt);
+      EXPECT_EQ(ValueType(10000, 4), result.value);
+      EXPECT_EQ(1U, result.dependencies.size());
+      EXPECT_EQ(delegate.getKeyID("input-" + std::to_string(i)),
+                result.dependencies[0].keyID);
+    }
+    EXPECT_EQ(error, "");
+  }
+
+  buildDB = nullptr;
+  ec = llvm::sys::fs::remove(dbPath.str());
+  EXPECT_EQ(bool(ec), false);
+  (void)llvm::sys::fs::remove(dbPath.str() + "-lock");
+}
@@ -0,0 +1,213 @@
+//===- unittests/Core/BuildDBTest.cpp -------------------------------------===//
+//
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2014 - 2019 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+//
+//===----------------------------------------------------------------------===//
+
+#include "llbuild/Core/BuildDB.h"
+
+#include "llbuild/Basic/PlatformUtility.h"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/FileSystem.h"
+
+#include "gtest/gtest.h"
+
+#include <functional>
+#include <sstream>
+
+#include <sqlite3.h>
+
+using namespace llbuild;
+using namespace llbuild::core;
+
+namespace {
+/// A database backend, for the tests which apply to all of them.
+struct Backend {
+  const char* name;
+
+  /// Create a database at the given path.
+  std::function<std::unique_ptr<BuildDB>(StringRef path,
+                                         std::string* error_out)> create;
+
+  /// Lock the database at the given path, as an unrelated process would, and
+  /// return a function which releases the lock.
+  std::function<std::function<void()>(StringRef path)> lockExternally;
+};
+
+std::vector<Backend> getBackends() {
+  return {
+    { "sqlite",
+      [](StringRef path, std::string* error_out) {
+        return createSQLiteBuildDB(path, 1,
+                                   /* recreateUnmatchedVersion = */ true,
+                                   error_out);
+      },
+      [](StringRef path) -> std::function<void()> {
+        sqlite3 *db = nullptr;
+        sqlite3_open(path.str().c_str(), &db);
+        sqlite3_exec(db, "PRAGMA locking_mode = EXCLUSIVE; BEGIN EXCLUSIVE;",
+                     nullptr, nullptr, nullptr);
+        return [db]() {
+          sqlite3_exec(db, "END;", nullptr, nullptr, nullptr);
+          sqlite3_close(db);
+        };
+      } },
+    { "binary",
+      [](StringRef path, std::string* error_out) {
+        return createBinaryBuildDB(path, 1,
+                                   /* recreateUnmatchedVersion = */ true,
+                                   error_out);
+      },
+      [](StringRef path) -> std::function<void()> {
+        int fd;
+        auto ec = llvm::sys::fs::openFileForReadWrite(
+            path + "-lock", fd, llvm::sys::fs::CD_OpenAlways,
+            llvm::sys::fs::OF_None);
+        EXPECT_EQ(bool(ec), false);
+        EXPECT_EQ(0, basic::sys::tryLockFile(fd));
+        return [fd]() {
+          basic::sys::unlockFile(fd);
+          basic::sys::close(fd);
+        };
+      } },
+  };
+}
+
+std::string getLockedError(const char* path) {
+  std::stringstream out;
+  out << "error: accessing build database \"" << path << "\": database is locked Possibly there are two concurrent builds running in the same filesystem location.";
+  return out.str();
+}
+}
+
+TEST(BuildDBTest, ErrorHandling) {
+  for (const auto& backend: getBackends()) {
+    SCOPED_TRACE(backend.name);
+
+    // Create a temporary file.
+    llvm::SmallString<256> dbPath;
+    auto ec = llvm::sys::fs::createTemporaryFile("build", "db", dbPath);
+    EXPECT_EQ(bool(ec), false);
+    const char* path = dbPath.c_str();
+    fprintf(stderr, "using db: %s\n", path);
+
+    std::string error;
+    std::unique_ptr<BuildDB> buildDB = backend.create(dbPath, &error);
+    EXPECT_TRUE(buildDB != nullptr);
+    EXPECT_EQ(error, "");
+
+    auto unlock = backend.lockExternally(dbPath);
+
+    buildDB = backend.create(dbPath, &error);
+    EXPECT_FALSE(buildDB == nullptr);
+
+    // The database is opened lazily, thus run an operation that will cause it
+    // to be opened and verify that it fails as expected.
+    bool result = true;
+    buildDB->getCurrentEpoch(&result, &error);
+    EXPECT_FALSE(result);
+    EXPECT_EQ(error, getLockedError(path));
+
+    // Clean up database connections before unlinking
+    unlock();
+    buildDB = nullptr;
+
+    ec = llvm::sys::fs::remove(dbPath.str());
+    EXPECT_EQ(bool(ec), false);
+    (void)llvm::sys::fs::remove(dbPath.str() + "-lock");
+  }
+}
+
+TEST(BuildDBTest, LockedWhileBuilding) {
+  for (const auto& backend: getBackends()) {
+    SCOPED_TRACE(backend.name);
+
+    // Create a temporary file.
+    llvm::SmallString<256> dbPath;
+    auto ec = llvm::sys::fs::createTemporaryFile("build", "db", dbPath);
+    EXPECT_EQ(bool(ec), false);
+    const char* path = dbPath.c_str();
+    fprintf(stderr, "using db: %s\n", path);
+
+    std::string error;
+    std::unique_ptr<BuildDB> buildDB = backend.create(dbPath, &error);
+    EXPECT_TRUE(buildDB != nullptr);
+    EXPECT_EQ(error, "");
+
+    std::unique_ptr<BuildDB> secondBuildDB = backend.create(dbPath, &error);
+    EXPECT_TRUE(buildDB != nullptr);
+    EXPECT_EQ(error, "");
+
+    bool result = buildDB->buildStarted(&error);
+    EXPECT_TRUE(result);
+    EXPECT_EQ(error, "");
+
+    // Tests that we cannot start a second build with an existing connection
+    result = secondBuildDB->buildStarted(&error);
+    EXPECT_FALSE(result);
+    EXPECT_EQ(error, getLockedError(path));
+
+    // Tests that other connections can still read while a build is running
+    std::unique_ptr<BuildDB> otherBuildDB = backend.create(dbPath, &error);
+    EXPECT_FALSE(otherBuildDB == nullptr);
+
+    // The database is opened lazily, thus run an operation that will cause it
+    // to be opened and verify that it succeeds.
+    bool success = false;
+    error.clear();
+    otherBuildDB->getCurrentEpoch(&success, &error);
+    EXPECT_TRUE(success);
+    EXPECT_EQ(error, "");
+
+    // Tests that a second build can start once the first is complete.
+    buildDB->buildComplete();
+    result = secondBuildDB->buildStarted(&error);
+    EXPECT_TRUE(result);
+    EXPECT_EQ(error, "");
+    secondBuildDB->buildComplete();
+
+    // Clean up database connections before unlinking
+    buildDB = nullptr;
+    secondBuildDB = nullptr;
+    otherBuildDB = nullptr;
+
+    ec = llvm::sys::fs::remove(dbPath.str());
+    EXPECT_EQ(bool(ec), false);
+    (void)llvm::sys::fs::remove(dbPath.str() + "-lock");
+  }
+}
+
+TEST(BuildDBTest, CloseDBConnectionAfterCloseCall) {
+  for (const auto& backend: getBackends()) {
+    SCOPED_TRACE(backend.name);
+
+    // Create a temporary file.
+    llvm::SmallString<256> dbPath;
+    auto ec = llvm::sys::fs::createTemporaryFile("build", "db", dbPath);
+    EXPECT_EQ(bool(ec), false);
+    const char* path = dbPath.c_str();
+    fprintf(stderr, "using db: %s\n", path);
+
+    std::string error;
+    std::unique_ptr<BuildDB> buildDB = backend.create(dbPath, &error);
+    EXPECT_TRUE(buildDB != nullptr);
+    EXPECT_EQ(error, "");
+
+    buildDB->buildStarted(&error);
+    EXPECT_EQ(error, "");
+
+    buildDB->buildComplete();
+
+    buildDB = nullptr;
+    ec = llvm::sys::fs::remove(dbPath.str());
+    EXPECT_EQ(bool(ec), false);
+    (void)llvm::sys::fs::remove(dbPath.str() + "-lock");
+  }
+}
@@ -17,10 +17,14 @@
 #include "llvm/ADT/StringMap.h"
 #include "llvm/Support/ErrorHandling.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
 
 #include "gtest/gtest.h"
 
+#include <atomic>
 #include <future>
+#include <mutex>
+#include <thread>
 #include <condition_variable>
 #include <unordered_map>
 #include <vector>
@@ -547,6 +551,136 @@ TEST(BuildEngineTest, deepDependencyScanningStack) {
   EXPECT_EQ(lastInputValue, intFromValue(engine.build("input-0")));
 }
 
+TEST(BuildEngineTest, parallelScanning) {
+  // Check that incremental builds behave identically when rule validation is
+  // performed on scan worker threads.
+  //
+  // Dependencies:
+  //   result: (mid-0, ..., mid-N)
+  //   mid-i: (leaf-i)
+  const int numLeaves = 200;
+  std::vector<int> leafValues(numLeaves, 1);
+  std::vector<std::string> builtKeys;
+  std::atomic<int> numValidations{0};
+
+  SimpleBuildEngineDelegate delegate;
+  core::BuildEngine engine(delegate);
+  engine.setScanConcurrency(4);
+  std::vector<KeyType> midKeys;
+  for (int i = 0; i != numLeaves; ++i) {
+    std::string leafName = "leaf-" + std::to_string(i);
+    std::string midName = "mid-" + std::to_string(i);
+    midKeys.push_back(midName);
+    engine.addRule({
+        leafName, {},
+        simpleAction({}, [&, i, leafName] (const std::vector<int>& inputs) {
+            builtKeys.push_back(leafName);
+            return leafValues[i]; }),
+        [&, i](core::BuildEngine&, const Rule& rule, const ValueType& value) {
+          ++numValidations;
+          return leafValues[i] == intFromValue(value);
+        } });
+    engine.addRule({
+        midName, {},
+        simpleAction({ leafName }, [&, midName] (const std::vector<int>& inputs) {
+            builtKeys.push_back(midName);
+            return inputs[0] * 2; }),
+        [&](core::BuildEngine&, const Rule& rule, const ValueType& value) {
+          ++numValidations;
+          return true;
+        } });
+  }
+  engine.addRule({
+      "result", {},
+      simpleAction(midKeys, [&] (const std::vector<int>& inputs) {
+          builtKeys.push_back("result");
+          int sum = 0;
+          for (auto value: inputs)
+            sum += value;
+          return sum; }) });
+
+  // Build the initial result.
+  EXPECT_EQ(numLeaves * 2, intFromValue(engine.build("result")));
+  EXPECT_EQ(size_t(numLeaves * 2 + 1), builtKeys.size());
+
+  // Perform a null build, which should validate every rule.
+  builtKeys.clear();
+  numValidations = 0;
+  EXPECT_EQ(numLeaves * 2, intFromValue(engine.build("result")));
+  EXPECT_EQ(0U, builtKeys.size());
+  EXPECT_EQ(numLeaves * 2, numValidations.load());
+
+  // Modify a few leaves, and check only their dependents are rebuilt.
+  leafValues[3] = 10;
+  leafValues[117] = 20;
+  builtKeys.clear();
+  EXPECT_EQ((numLeaves - 2 + 10 + 20) * 2,
+            intFromValue(engine.build("result")));
+  std::sort(builtKeys.begin(), builtKeys.end());
+  EXPECT_EQ(std::vector<std::string>({
+        "leaf-117", "leaf-3", "mid-117", "mid-3", "result" }), builtKeys);
+}
+
+TEST(BuildEngineTest, asyncValidation) {
+  // Check that rules can report their validity asynchronously, from another
+  // thread, both with and without parallel scanning.
+  for (unsigned scanThreads: { 0, 4 }) {
+    const int numInputs = 20;
+    std::vector<int> inputValues(numInputs, 1);
+    std::vector<std::string> builtKeys;
+    std::vector<std::thread> validators;
+    std::mutex validatorsMutex;
+
+    SimpleBuildEngineDelegate delegate;
+    core::BuildEngine engine(delegate);
+    engine.setScanConcurrency(scanThreads);
+    std::vector<KeyType> inputKeys;
+    for (int i = 0; i != numInputs; ++i) {
+      std::string name = "input-" + std::to_string(i);
+      inputKeys.push_back(name);
+      Rule rule{
+        name, {},
+        simpleAction({}, [&, i, name] (const std::vector<int>& inputs) {
+            builtKeys.push_back(name);
+            return inputValues[i]; }) };
+      rule.isResultValidAsync = [&, i](core::BuildEngine&, const Rule& rule,
+                                       const ValueType& value,
+                                       Rule::ValidationCompletionFn completion) {
+        bool isValid = inputValues[i] == intFromValue(value);
+        std::lock_guard<std::mutex> guard(validatorsMutex);
+        validators.emplace_back([=]() { completion(isValid); });
+      };
+      engine.addRule(std::move(rule));
+    }
+    engine.addRule({
+        "result", {},
+        simpleAction(inputKeys, [&] (const std::vector<int>& inputs) {
+            builtKeys.push_back("result");
+            int sum = 0;
+            for (auto value: inputs)
+              sum += value;
+            return sum; }) });
+
+    // Build the initial result.
+    EXPECT_EQ(numInputs, intFromValue(engine.build("result")));
+    EXPECT_EQ(size_t(numInputs + 1), builtKeys.size());
+
+    // Perform a null build.
+    builtKeys.clear();
+    EXPECT_EQ(numInputs, intFromValue(engine.build("result")));
+    EXPECT_EQ(0U, builtKeys.size());
+
+    // Modify an input, and check it is rebuilt.
+    inputValues[7] = 3;
+    builtKeys.clear();
+    EXPECT_EQ(numInputs + 2, intFromValue(engine.build("result")));
+    EXPECT_EQ(std::vector<std::string>({ "input-7", "result" }), builtKeys);
+
+    for (auto& validator: validators)
+      validator.join();
+  }
+}
+
 TEST(BuildEngineTest, discoveredDependencies) {
   // Check basic support for tasks to report discovered dependencies.
 
@@ -832,6 +966,91 @@ TEST(BuildEngineTest, CycleDuringScanningFromTop) {
   }
 }
 
+/// Check that many cycles can be resolved during a single build.
+TEST(BuildEngineTest, ResolveManyCycles) {
+  const int numCycles = 8;
+  int iteration = 0;
+  SimpleBuildEngineDelegate delegate;
+  core::BuildEngine engine(delegate);
+  std::vector<KeyType> topInputs;
+  for (int i = 0; i != numCycles; ++i) {
+    std::string b = "B" + std::to_string(i), c = "C" + std::to_string(i);
+    topInputs.push_back(b);
+    engine.addRule({
+        b, {}, simpleAction({ c }, [&](const std::vector<int>& inputs) {
+            return 2; }),
+        [&](BuildEngine&, const Rule&, const ValueType&) {
+          return true;
+        } });
+    engine.addRule({
+        c, {},
+        [&iteration, b](BuildEngine& engine) {
+          return engine.registerTask(
+              new SimpleTask(
+                  [&iteration, b]() -> std::vector<std::string> {
+                    if (iteration == 0)
+                      return { };
+                    return { b };
+                  },
+                  [&](const std::vector<int>& inputs) {
+                    return 2; }));
+        },
+        [&](BuildEngine&, const Rule&, const ValueType&) {
+          return false;
+        } });
+  }
+  engine.addRule({
+      "A", {}, simpleAction(topInputs, [&](const std::vector<int>& inputs) {
+          return int(inputs.size()); }) });
+
+  // Build the result.
+  EXPECT_EQ(numCycles, intFromValue(engine.build("A")));
+  EXPECT_EQ(std::vector<std::string>({}), delegate.cycle);
+
+  // Introduce the cycles, and rebuild allowing the engine to resolve them.
+  iteration = 1;
+  delegate.resolveCycle = true;
+  EXPECT_EQ(numCycles, intFromValue(engine.build("A")));
+  EXPECT_EQ(std::vector<std::string>({}), delegate.cycle);
+}
+
+TEST(BuildEngineTest, statistics) {
+  SimpleBuildEngineDelegate delegate;
+  core::BuildEngine engine(delegate);
+  engine.addRule({
+      "value-A", {}, simpleAction({}, [&] (const std::vector<int>& inputs) {
+          return 2; }) });
+  engine.addRule({
+      "value-B", {}, simpleAction({}, [&] (const std::vector<int>& inputs) {
+          return 3; }) });
+  engine.addRule({
+      "result", {}, simpleAction({"value-A", "value-B"},
+                                 [&] (const std::vector<int>& inputs) {
+          return inputs[0] * inputs[1]; }) });
+
+  EXPECT_EQ(6, intFromValue(engine.build("result")));
+  auto stats = engine.getStatistics();
+  EXPECT_EQ(3U, stats.numRulesScanned);
+  EXPECT_EQ(3U, stats.numTasksCreated);
+  EXPECT_EQ(2U, stats.numInputRequests);
+  EXPECT_EQ(0U, stats.numRulesUpToDate);
+  EXPECT_EQ(3U, stats.peakRules);
+  EXPECT_EQ(0U, stats.numRuleLookups);
+  EXPECT_EQ(2U, stats.maxInputRequests);
+
+  // Rebuild, everything should be up-to-date.
+  EXPECT_EQ(6, intFromValue(engine.build("result")));
+  stats = engine.getStatistics();
+  EXPECT_EQ(6U, stats.numRulesScanned);
+  EXPECT_EQ(3U, stats.numTasksCreated);
+  EXPECT_EQ(3U, stats.numRulesUpToDate);
+
+  std::string json;
+  llvm::raw_string_ostream os(json);
+  stats.writeJSON(os);
+  EXPECT_NE(std::string::npos, os.str().find("\"rules_up_to_date\": 3,"));
+}
+
 TEST(BuildEngineTest, basicIncrementalSignatureChange) {
   // Check a trivial build graph responds to incremental changes in rule
   // signatures appropriately.
@@ -979,4 +1198,226 @@ TEST(BuildEngineTest, concurrentProtection) {
   EXPECT_EQ(0U, delegate.errors.size());
 }
 
+TEST(BuildEngineTest, taskPriority) {
+  // Check that tasks are prioritized by their estimated critical path.
+  class PriorityRecordingTask : public SimpleTask {
+    std::string name;
+    std::unordered_map<std::string, uint64_t>& priorities;
+
+  public:
+    PriorityRecordingTask(std::string name, std::vector<KeyType> inputs,
+                          std::unordered_map<std::string, uint64_t>& priorities)
+        : SimpleTask([inputs]{ return inputs; },
+                     [](const std::vector<int>&) { return 1; }),
+          name(name), priorities(priorities) {}
+
+    virtual void inputsAvailable(core::BuildEngine& engine) override {
+      priorities[name] = engine.getTaskPriority(this);
+      if (name == "leaf")
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      SimpleTask::inputsAvailable(engine);
+    }
+  };
+
+  std::unordered_map<std::string, uint64_t> priorities;
+  SimpleBuildEngineDelegate delegate;
+  core::BuildEngine engine(delegate);
+  auto addRule = [&](std::string name, std::vector<KeyType> inputs) {
+    engine.addRule({
+        name, {}, [&priorities, name, inputs](BuildEngine& engine) {
+          return engine.registerTask(
+              new PriorityRecordingTask(name, inputs, priorities));
+        },
+        [](BuildEngine&, const Rule&, const ValueType&) { return false; } });
+  };
+  addRule("top", {"mid", "side"});
+  addRule("mid", {"leaf"});
+  addRule("side", {});
+  addRule("leaf", {});
+
+  // Without any history, the priority is the depth in the requested graph.
+  EXPECT_EQ(1, intFromValue(engine.build("top")));
+  EXPECT_EQ(4U, priorities.size());
+  EXPECT_EQ(1U, priorities["top"]);
+  EXPECT_EQ(2U, priorities["mid"]);
+  EXPECT_EQ(2U, priorities["side"]);
+  EXPECT_EQ(3U, priorities["leaf"]);
+
+  // On a rebuild, the priority accounts for the recorded durations.
+  priorities.clear();
+  EXPECT_EQ(1, intFromValue(engine.build("top")));
+  EXPECT_EQ(4U, priorities.size());
+  EXPECT_GE(priorities["leaf"], 20000U);
+  EXPECT_GT(priorities["leaf"], priorities["mid"]);
+  EXPECT_GT(priorities["mid"], priorities["top"]);
+}
+
+TEST(BuildEngineTest, taskPeakRSS) {
+  // Check that the largest reported peak RSS is recorded, and provided as the
+  // estimate on subsequent builds.
+  class PeakRSSTask : public SimpleTask {
+    std::vector<uint64_t> reports;
+    std::vector<uint64_t>& estimates;
+
+  public:
+    PeakRSSTask(std::vector<uint64_t> reports,
+                std::vector<uint64_t>& estimates)
+        : SimpleTask([]{ return std::vector<KeyType>{}; },
+                     [](const std::vector<int>&) { return 1; }),
+          reports(reports), estimates(estimates) {}
+
+    virtual void inputsAvailable(core::BuildEngine& engine) override {
+      estimates.push_back(engine.getTaskEstimatedPeakRSS(this));
+      for (auto peakRSS: reports)
+        engine.taskReportedPeakRSS(this, peakRSS);
+      SimpleTask::inputsAvailable(engine);
+    }
+  };
+
+  std::vector<uint64_t> reports{ 100, 200, 150 };
+  std::vector<uint64_t> estimates;
+  SimpleBuildEngineDelegate delegate;
+  core::BuildEngine engine(delegate);
+  engine.addRule({
+      "result", {}, [&](BuildEngine& engine) {
+        return engine.registerTask(new PeakRSSTask(reports, estimates));
+      },
+      [](BuildEngine&, const Rule&, const ValueType&) { return false; } });
+
+  // Without any history, there is no estimate.
+  EXPECT_EQ(1, intFromValue(engine.build("result")));
+  EXPECT_EQ(std::vector<uint64_t>{ 0 }, estimates);
+
+  // On a rebuild, the estimate is the largest reported value. If the task
+  // reports nothing, the estimate is preserved.
+  reports.clear();
+  EXPECT_EQ(1, intFromValue(engine.build("result")));
+  EXPECT_EQ(1, intFromValue(engine.build("result")));
+  EXPECT_EQ((std::vector<uint64_t>{ 0, 200, 200 }), estimates);
+}
+
+// Task which requests its inputs from another thread, after it has started
+// computing, and waits for them to be provided.
+class DynamicInputTask : public Task {
+  std::vector<KeyType> inputs;
+  std::function<void()> onComputed;
+  std::thread thread;
+
+  std::mutex mutex;
+  std::condition_variable condition;
+  std::vector<int> inputValues;
+  unsigned numProvided = 0;
+  bool cancelled = false;
+
+public:
+  DynamicInputTask(std::vector<KeyType> inputs, std::function<void()> onComputed)
+      : inputs(inputs), onComputed(onComputed), inputValues(inputs.size()) {}
+
+  ~DynamicInputTask() {
+    if (thread.joinable())
+      thread.join();
+  }
+
+  virtual void start(BuildEngine&) override {}
+
+  virtual void provideValue(BuildEngine&, uintptr_t inputID,
+                            const ValueType& value) override {
+    std::lock_guard<std::mutex> lock(mutex);
+    inputValues[inputID] = intFromValue(value);
+    ++numProvided;
+    condition.notify_all();
+  }
+
+  virtual void inputRequestsCancelled(BuildEngine&) override {
+    std::lock_guard<std::mutex> lock(mutex);
+    cancelled = true;
+    condition.notify_all();
+  }
+
+  virtual void inputsAvailable(BuildEngine& engine) override {
+    thread = std::thread([this, &engine] {
+      for (unsigned i = 0, e = inputs.size(); i != e; ++i) {
+        engine.taskNeedsInput(this, inputs[i], i);
+        engine.taskDiscoveredDependency(this, inputs[i] + "-discovered");
+      }
+
+      int sum = 0;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        condition.wait(lock, [&] {
+          return cancelled || numProvided == inputs.size(); });
+        for (int value: inputValues)
+          sum += value;
+      }
+      onComputed();
+      engine.taskIsComplete(this, intToValue(sum));
+    });
+  }
+};
+
+TEST(BuildEngineTest, dynamicInputs) {
+  std::vector<std::string> builtKeys;
+  std::mutex builtKeysMutex;
+  int valueA = 2;
+  SimpleBuildEngineDelegate delegate;
+  core::BuildEngine engine(delegate);
+  engine.addRule({
+      "value-A", {}, simpleAction({}, [&] (const std::vector<int>& inputs) {
+          std::lock_guard<std::mutex> lock(builtKeysMutex);
+          builtKeys.push_back("value-A");
+          return valueA; }),
+      [&](BuildEngine&, const Rule&, const ValueType& value) {
+        return valueA == intFromValue(value);
+      } });
+  engine.addRule({
+      "value-B", {}, simpleAction({}, [&] (const std::vector<int>& inputs) {
+          std::lock_guard<std::mutex> lock(builtKeysMutex);
+          builtKeys.push_back("value-B");
+          return 3; }) });
+  for (auto key: { "value-A-discovered", "value-B-discovered" }) {
+    engine.addRule({
+        key, {}, simpleAction({}, [&] (const std::vector<int>& inputs) {
+            return 0; }) });
+  }
+  engine.addRule({
+      "result", {}, [&](BuildEngine& engine) {
+        return engine.registerTask(new DynamicInputTask(
+            { "value-A", "value-B" }, [&] {
+              std::lock_guard<std::mutex> lock(builtKeysMutex);
+              builtKeys.push_back("result");
+            }));
+      } });
+
+  // Build the result, the dynamic inputs should be provided.
+  EXPECT_EQ(2 + 3, intFromValue(engine.build("result")));
+  EXPECT_EQ(3U, builtKeys.size());
+  EXPECT_EQ("result", builtKeys.back());
+
+  // Check that the dynamic inputs were recorded as dependencies.
+  builtKeys.clear();
+  valueA = 5;
+  EXPECT_EQ(5 + 3, intFromValue(engine.build("result")));
+  EXPECT_EQ(std::vector<std::string>({ "value-A", "result" }), builtKeys);
+  EXPECT_EQ(0U, delegate.errors.size());
+}
+
+TEST(BuildEngineTest, dynamicInputCycle) {
+  SimpleBuildEngineDelegate delegate;
+  core::BuildEngine engine(delegate);
+  engine.addRule({
+      "A", {}, [&](BuildEngine& engine) {
+        return engine.registerTask(new DynamicInputTask({ "B" }, []{}));
+      } });
+  engine.addRule({
+      "B", {},
+      simpleAction({"A"}, [&](const std::vector<int>& inputs) {
+          return 2; }) });
+
+  // The cycle through the dynamic input should be detected, and the waiting
+  // task released.
+  auto result = engine.build("A");
+  EXPECT_EQ(ValueType{}, result);
+  EXPECT_EQ(std::vector<std::string>({ "A", "B", "A" }), delegate.cycle);
+}
+
 }
@@ -296,6 +296,7 @@ TEST(DepsBuildEngineTest, KeysWithNull) {
 
   ec = llvm::sys::fs::remove(dbPath.str());
   EXPECT_EQ(bool(ec), false);
+  (void)llvm::sys::fs::remove(dbPath.str() + "-lock");
 }
 
 }
@@ -13,118 +13,806 @@
 #include "llbuild/Core/BuildDB.h"
 
 #include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/Support/FileSystem.h"
 
 #include "gtest/gtest.h"
 
+#include <mutex>
+#include <thread>
+
 #include <sqlite3.h>
 
 using namespace llbuild;
 using namespace llbuild::core;
 
-TEST(SQLiteBuildDBTest, ErrorHandling) {
-    // Create a temporary file.
-    llvm::SmallString<256> dbPath;
-    auto ec = llvm::sys::fs::createTemporaryFile("build", "db", dbPath);
-    EXPECT_EQ(bool(ec), false);
-    const char* path = dbPath.c_str();
-    fprintf(stderr, "using db: %s\n", path);
+namespace {
+class SimpleBuildDBDelegate : public BuildDBDelegate {
+  std::mutex keyTableMutex;
+  llvm::StringMap<bool> keyTable;
 
-    std::string error;
-    std::unique_ptr<BuildDB> buildDB = createSQLiteBuildDB(dbPath, 1, /* recreateUnmatchedVersion = */ true, &error);
-    EXPECT_TRUE(buildDB != nullptr);
-    EXPECT_EQ(error, "");
+public:
+  virtual const KeyID getKeyID(const KeyType& key) override {
+    std::lock_guard<std::mutex> guard(keyTableMutex);
+    auto it = keyTable.insert(std::make_pair(key, false)).first;
+    return KeyID(it->getKey().data());
+  }
 
-    sqlite3 *db = nullptr;
-    sqlite3_open(path, &db);
-    sqlite3_exec(db, "PRAGMA locking_mode = EXCLUSIVE; BEGIN EXCLUSIVE;", nullptr, nullptr, nullptr);
+  virtual KeyType getKeyForID(const KeyID key) override {
+    return llvm::StringMapEntry<bool>::GetStringMapEntryFromKeyData(
+      (const char*)(uintptr_t)key).getKey();
+  }
+};
+}
 
-    buildDB = createSQLiteBuildDB(dbPath, 1, /* recreateUnmatchedVersion = */ true, &error);
-    EXPECT_FALSE(buildDB == nullptr);
+TEST(SQLiteBuildDBTest, LookupWithoutValue) {
+  // Create a temporary file.
+  llvm::SmallString<256> dbPath;
+  auto ec = llvm::sys::fs::createTemporaryFile("build", "db", dbPath);
+  EXPECT_EQ(bool(ec), false);
 
-    // The database is opened lazily, thus run an operation that will cause it
-    // to be opened and verify that it fails as expected.
-    bool result = true;
-    buildDB->getCurrentEpoch(&result, &error);
-    EXPECT_FALSE(result);
+  SimpleBuildDBDelegate delegate;
+  std::string error;
+  std::unique_ptr<BuildDB> buildDB = createSQLiteBuildDB(dbPath, 1, /* recreateUnmatchedVersion = */ true, &error);
+  EXPECT_TRUE(buildDB != nullptr);
+  buildDB->attachDelegate(&delegate);
 
-    std::stringstream out;
-    out << "error: accessing build database \"" << path << "\": database is locked Possibly there are two concurrent builds running in the same filesystem location.";
-    EXPECT_EQ(error, out.str());
+  // Store a result.
+  Rule rule{"output"};
+  KeyID keyID = delegate.getKeyID(rule.key);
+  Result result;
+  result.value = {1, 2, 3};
+  result.builtAt = 1;
+  result.computedAt = 1;
+  result.peakRSS = 64 * 1024 * 1024;
+  result.dependencies.push_back(delegate.getKeyID("input"), false);
+  EXPECT_TRUE(buildDB->buildStarted(&error));
+  EXPECT_TRUE(buildDB->setRuleResult(keyID, rule, result, &error));
+  buildDB->buildComplete();
+  EXPECT_EQ(error, "");
 
-    // Clean up database connections before unlinking
-    sqlite3_exec(db, "END;", nullptr, nullptr, nullptr);
-    sqlite3_close(db);
-    buildDB = nullptr;
+  // Reopen the database, and check the result can be retrieved without its
+  // value, then with it.
+  buildDB = createSQLiteBuildDB(dbPath, 1, /* recreateUnmatchedVersion = */ true, &error);
+  buildDB->attachDelegate(&delegate);
+  Result metadata;
+  bool valueLoaded = true;
+  EXPECT_TRUE(buildDB->lookupRuleResultWithoutValue(
+                  keyID, rule.key, &metadata, &valueLoaded, &error));
+  EXPECT_EQ(error, "");
+  EXPECT_FALSE(valueLoaded);
+  EXPECT_TRUE(metadata.value.empty());
+  EXPECT_EQ(1U, metadata.builtAt);
+  EXPECT_EQ(result.peakRSS, metadata.peakRSS);
+  EXPECT_EQ(1U, metadata.dependencies.size());
+  EXPECT_EQ(delegate.getKeyID("input"), metadata.dependencies[0].keyID);
 
-    ec = llvm::sys::fs::remove(dbPath.str());
-    EXPECT_EQ(bool(ec), false);
+  ValueType value;
+  EXPECT_TRUE(buildDB->lookupRuleResultValue(keyID, rule.key, &value, &error));
+  EXPECT_EQ(error, "");
+  EXPECT_EQ(result.value, value);
+
+  // Check that the value can also be retrieved directly.
+  buildDB = createSQLiteBuildDB(dbPath, 1, /* recreateUnmatchedVersion = */ true, &error);
+  buildDB->attachDelegate(&delegate);
+  value.clear();
+  EXPECT_TRUE(buildDB->lookupRuleResultValue(keyID, rule.key, &value, &error));
+  EXPECT_EQ(result.value, value);
+  EXPECT_FALSE(buildDB->lookupRuleResultValue(
+                   delegate.getKeyID("missing"), "missing", &value, &error));
+  EXPECT_EQ(error, "");
+
+  buildDB = nullptr;
+  ec = llvm::sys::fs::remove(dbPath.str());
+  EXPECT_EQ(bool(ec), false);
+  (void)llvm::sys::fs::remove(dbPath.str() + "-lock");
 }
 
-TEST(SQLiteBuildDBTest, LockedWhileBuilding) {
+TEST(SQLiteBuildDBTest, IncrementalCommits) {
   // Create a temporary file.
   llvm::SmallString<256> dbPath;
   auto ec = llvm::sys::fs::createTemporaryFile("build", "db", dbPath);
   EXPECT_EQ(bool(ec), false);
-  const char* path = dbPath.c_str();
-  fprintf(stderr, "using db: %s\n", path);
 
+  SimpleBuildDBDelegate delegate;
   std::string error;
   std::unique_ptr<BuildDB> buildDB = createSQLiteBuildDB(dbPath, 1, /* recreateUnmatchedVersion = */ true, &error);
   EXPECT_TRUE(buildDB != nullptr);
+  buildDB->attachDelegate(&delegate);
+
+  // Store enough results that some must be committed while the build is still
+  // running.
+  const int numResults = 2500;
+  EXPECT_TRUE(buildDB->buildStarted(&error));
+  EXPECT_TRUE(buildDB->setCurrentIteration(2, &error));
+  for (int i = 0; i != numResults; ++i) {
+    Rule rule{"output-" + std::to_string(i)};
+    Result result;
+    result.value = {uint8_t(i)};
+    result.builtAt = 2;
+    result.computedAt = 2;
+    EXPECT_TRUE(buildDB->setRuleResult(delegate.getKeyID(rule.key), rule,
+                                       result, &error));
+  }
+  EXPECT_EQ(error, "");
+
+  // Check that a reader can see the committed results mid-build.
+  std::unique_ptr<BuildDB> readerDB = createSQLiteBuildDB(dbPath, 1, /* recreateUnmatchedVersion = */ true, &error);
+  readerDB->attachDelegate(&delegate);
+  bool success = false;
+  EXPECT_EQ(2U, readerDB->getCurrentEpoch(&success, &error));
+  EXPECT_TRUE(success);
+  ValueType value;
+  EXPECT_TRUE(readerDB->lookupRuleResultValue(
+                  delegate.getKeyID("output-0"), "output-0", &value, &error));
+  EXPECT_EQ(ValueType{0}, value);
   EXPECT_EQ(error, "");
 
-  std::unique_ptr<BuildDB> secondBuildDB = createSQLiteBuildDB(dbPath, 1, /* recreateUnmatchedVersion = */ true, &error);
+  // Check that the committed batches did not let another build, or garbage
+  // collection, start meanwhile.
+  std::string lockedError = ("error: accessing build database \"" +
+                             dbPath.str().str() + "\": database is locked "
+                             "Possibly there are two concurrent builds running "
+                             "in the same filesystem location.");
+  EXPECT_FALSE(readerDB->buildStarted(&error));
+  EXPECT_EQ(lockedError, error);
+  error.clear();
+  BuildDBGarbageCollectionStats stats;
+  EXPECT_FALSE(readerDB->collectGarbage(0, &stats, &error));
+  EXPECT_EQ(lockedError, error);
+  error.clear();
+  readerDB = nullptr;
+
+  // Drop the database without completing the build, as if the build was
+  // interrupted, and check that only the uncommitted results were lost.
+  buildDB = nullptr;
+  buildDB = createSQLiteBuildDB(dbPath, 1, /* recreateUnmatchedVersion = */ true, &error);
+  buildDB->attachDelegate(&delegate);
+  std::vector<KeyType> keys;
+  std::vector<Result> results;
+  EXPECT_TRUE(buildDB->getKeysWithResult(keys, results, &error));
+  EXPECT_EQ(error, "");
+  EXPECT_LT(0U, results.size());
+  EXPECT_GT(size_t(numResults), results.size());
+
+  buildDB = nullptr;
+  ec = llvm::sys::fs::remove(dbPath.str());
+  EXPECT_EQ(bool(ec), false);
+  (void)llvm::sys::fs::remove(dbPath.str() + "-lock");
+}
+
+TEST(SQLiteBuildDBTest, WriteBehind) {
+  // Create a temporary file.
+  llvm::SmallString<256> dbPath;
+  auto ec = llvm::sys::fs::createTemporaryFile("build", "db", dbPath);
+  EXPECT_EQ(bool(ec), false);
+
+  SimpleBuildDBDelegate delegate;
+  std::string error;
+  std::unique_ptr<BuildDB> buildDB = createSQLiteBuildDB(dbPath, 1, /* recreateUnmatchedVersion = */ true, &error, /* writeBehind = */ true);
   EXPECT_TRUE(buildDB != nullptr);
+  buildDB->attachDelegate(&delegate);
+
+  const int numResults = 100;
+  EXPECT_TRUE(buildDB->buildStarted(&error));
+  for (int i = 0; i != numResults; ++i) {
+    Rule rule{"output-" + std::to_string(i)};
+    Result result;
+    result.value = {uint8_t(i)};
+    result.builtAt = 1;
+    result.computedAt = 1;
+    result.dependencies.push_back(delegate.getKeyID("input"), false);
+    EXPECT_TRUE(buildDB->setRuleResult(delegate.getKeyID(rule.key), rule,
+                                       result, &error));
+  }
+  EXPECT_EQ(error, "");
+
+  // Check that results are visible to lookups, even if not yet written.
+  Result result;
+  EXPECT_TRUE(buildDB->lookupRuleResult(delegate.getKeyID("output-99"),
+                                        "output-99", &result, &error));
+  EXPECT_EQ(error, "");
+  EXPECT_EQ(ValueType{99}, result.value);
+  EXPECT_EQ(1U, result.dependencies.size());
+  buildDB->buildComplete();
+
+  // Check that all of the results were written.
+  buildDB = createSQLiteBuildDB(dbPath, 1, /* recreateUnmatchedVersion = */ true, &error);
+  buildDB->attachDelegate(&delegate);
+  std::vector<KeyType> keys;
+  std::vector<Result> results;
+  EXPECT_TRUE(buildDB->getKeysWithResult(keys, results, &error));
+  EXPECT_EQ(error, "");
+  EXPECT_EQ(size_t(numResults), results.size());
+
+  buildDB = nullptr;
+  ec = llvm::sys::fs::remove(dbPath.str());
+  EXPECT_EQ(bool(ec), false);
+  (void)llvm::sys::fs::remove(dbPath.str() + "-lock");
+}
+
+TEST(SQLiteBuildDBTest, BulkKeyMapping) {
+  // Create a temporary file.
+  llvm::SmallString<256> dbPath;
+  auto ec = llvm::sys::fs::createTemporaryFile("build", "db", dbPath);
+  EXPECT_EQ(bool(ec), false);
+
+  SimpleBuildDBDelegate delegate;
+  std::string error;
+
+  // Store results with enough new dependency keys to need several batches,
+  // over two builds so that the second one maps existing and new keys.
+  for (int iteration = 1; iteration <= 2; ++iteration) {
+    std::unique_ptr<BuildDB> buildDB = createSQLiteBuildDB(dbPath, 1, /* recreateUnmatchedVersion = */ true, &error);
+    buildDB->attachDelegate(&delegate);
+    EXPECT_TRUE(buildDB->buildStarted(&error));
+    Rule rule{"output-" + std::to_string(iteration)};
+    Result result;
+    result.builtAt = iteration;
+    for (int i = 0; i != 150 * iteration; ++i) {
+      result.dependencies.push_back(
+          delegate.getKeyID("input-" + std::to_string(i)), i % 2);
+    }
+    EXPECT_TRUE(buildDB->setRuleResult(delegate.getKeyID(rule.key), rule,
+                                       result, &error));
+    buildDB->buildComplete();
+    EXPECT_EQ(error, "");
+  }
+
+  // Check the dependencies are mapped back correctly.
+  std::unique_ptr<BuildDB> buildDB = createSQLiteBuildDB(dbPath, 1, /* recreateUnmatchedVersion = */ true, &error);
+  buildDB->attachDelegate(&delegate);
+  Result result;
+  EXPECT_TRUE(buildDB->lookupRuleResult(delegate.getKeyID("output-2"),
+                                        "output-2", &result, &error));
+  EXPECT_EQ(error, "");
+  EXPECT_EQ(300U, result.dependencies.size());
+  for (int i = 0; i != 300; ++i) {
+    EXPECT_EQ(delegate.getKeyID("input-" + std::to_string(i)),
+              result.dependencies[i].keyID);
+    EXPECT_EQ(bool(i % 2), result.dependencies[i].flag);
+  }
+  std::vector<KeyType> keys;
+  EXPECT_TRUE(buildDB->getKeys(keys, &error));
+  EXPECT_EQ(302U, keys.size());
+
+  buildDB = nullptr;
+  ec = llvm::sys::fs::remove(dbPath.str());
+  EXPECT_EQ(bool(ec), false);
+  (void)llvm::sys::fs::remove(dbPath.str() + "-lock");
+}
+
+TEST(SQLiteBuildDBTest, PreloadResults) {
+  // Create a temporary file.
+  llvm::SmallString<256> dbPath;
+  auto ec = llvm::sys::fs::createTemporaryFile("build", "db", dbPath);
+  EXPECT_EQ(bool(ec), false);
+
+  SimpleBuildDBDelegate delegate;
+  std::string error;
+  std::unique_ptr<BuildDB> buildDB = createSQLiteBuildDB(dbPath, 1, /* recreateUnmatchedVersion = */ true, &error);
+  buildDB->attachDelegate(&delegate);
+  EXPECT_TRUE(buildDB->buildStarted(&error));
+  for (int i = 0; i != 10; ++i) {
+    Rule rule{"output-" + std::to_string(i)};
+    Result result;
+    result.value = {uint8_t(i)};
+    result.builtAt = 1;
+    result.peakRSS = i;
+    result.dependencies.push_back(delegate.getKeyID("input"), true);
+    EXPECT_TRUE(buildDB->setRuleResult(delegate.getKeyID(rule.key), rule,
+                                       result, &error));
+  }
+  buildDB->buildComplete();
+  EXPECT_EQ(error, "");
+
+  // Preload the results, and check they are returned along with their values.
+  buildDB = createSQLiteBuildDB(dbPath, 1, /* recreateUnmatchedVersion = */ true, &error);
+  buildDB->attachDelegate(&delegate);
+  EXPECT_TRUE(buildDB->preloadResults(&error));
+  EXPECT_EQ(error, "");
+  Result result;
+  bool valueLoaded = false;
+  EXPECT_TRUE(buildDB->lookupRuleResultWithoutValue(
+                  delegate.getKeyID("output-3"), "output-3", &result,
+                  &valueLoaded, &error));
+  EXPECT_TRUE(valueLoaded);
+  EXPECT_EQ(ValueType{3}, result.value);
+  EXPECT_EQ(1U, result.builtAt);
+  EXPECT_EQ(3U, result.peakRSS);
+  EXPECT_EQ(1U, result.dependencies.size());
+  EXPECT_EQ(delegate.getKeyID("input"), result.dependencies[0].keyID);
+  EXPECT_TRUE(result.dependencies[0].flag);
+
+  // Check that a later write supersedes the preloaded result, and that keys
+  // without results are not found.
+  EXPECT_TRUE(buildDB->buildStarted(&error));
+  Rule rule{"output-4"};
+  Result newResult;
+  newResult.value = {42};
+  newResult.builtAt = 2;
+  EXPECT_TRUE(buildDB->setRuleResult(delegate.getKeyID(rule.key), rule,
+                                     newResult, &error));
+  result = Result{};
+  EXPECT_TRUE(buildDB->lookupRuleResultWithoutValue(
+                  delegate.getKeyID("output-4"), "output-4", &result,
+                  &valueLoaded, &error));
+  EXPECT_EQ(2U, result.builtAt);
+  EXPECT_EQ(0U, result.dependencies.size());
+  result = Result{};
+  EXPECT_FALSE(buildDB->lookupRuleResultWithoutValue(
+                   delegate.getKeyID("input"), "input", &result,
+                   &valueLoaded, &error));
+  EXPECT_FALSE(buildDB->lookupRuleResultWithoutValue(
+                   delegate.getKeyID("missing"), "missing", &result,
+                   &valueLoaded, &error));
+  buildDB->buildComplete();
+  EXPECT_EQ(error, "");
+
+  buildDB = nullptr;
+  ec = llvm::sys::fs::remove(dbPath.str());
+  EXPECT_EQ(bool(ec), false);
+  (void)llvm::sys::fs::remove(dbPath.str() + "-lock");
+}
+
+TEST(SQLiteBuildDBTest, CompressedResults) {
+  // Create a temporary file.
+  llvm::SmallString<256> dbPath;
+  auto ec = llvm::sys::fs::createTemporaryFile("build", "db", dbPath);
+  EXPECT_EQ(bool(ec), false);
+
+  SimpleBuildDBDelegate delegate;
+  std::string error;
+  std::unique_ptr<BuildDB> buildDB = createSQLiteBuildDB(dbPath, 1, /* recreateUnmatchedVersion = */ true, &error,
+                                                         /* writeBehind = */ false,
+                                                         /* compress = */ true);
+  buildDB->attachDelegate(&delegate);
+
+  // Store a result with a large, repetitive value and many (repeated)
+  // dependencies, and a small one.
+  Rule rule{"output"};
+  Result result;
+  for (int i = 0; i != 100; ++i) {
+    std::string path = "/some/long/directory/path/file-" + std::to_string(i);
+    result.value.insert(result.value.end(), path.begin(), path.end());
+    result.value.push_back(0);
+  }
+  for (int i = 0; i != 1000; ++i) {
+    result.dependencies.push_back(
+        delegate.getKeyID("input-" + std::to_string(i % 10)), i % 2 == 0);
+  }
+  result.builtAt = 1;
+  Rule smallRule{"small"};
+  Result smallResult;
+  smallResult.value = {1, 2, 3};
+  smallResult.builtAt = 1;
+  EXPECT_TRUE(buildDB->buildStarted(&error));
+  EXPECT_TRUE(buildDB->setRuleResult(delegate.getKeyID(rule.key), rule,
+                                     result, &error));
+  EXPECT_TRUE(buildDB->setRuleResult(delegate.getKeyID(smallRule.key),
+                                     smallRule, smallResult, &error));
+  buildDB->buildComplete();
   EXPECT_EQ(error, "");
+  buildDB = nullptr;
+
+  // Check that only the large result was stored compressed.
+  sqlite3 *db = nullptr;
+  sqlite3_open(dbPath.c_str(), &db);
+  sqlite3_stmt* stmt = nullptr;
+  sqlite3_prepare_v2(db, ("SELECT key, flags, length(value) FROM rule_results "
+                          "JOIN key_names ON key_id == id ORDER BY key;"),
+                     -1, &stmt, nullptr);
+  EXPECT_EQ(SQLITE_ROW, sqlite3_step(stmt));
+  EXPECT_EQ(std::string("output"), (const char*)sqlite3_column_text(stmt, 0));
+  EXPECT_EQ(3, sqlite3_column_int(stmt, 1));
+  EXPECT_GT(int(result.value.size()) / 2, sqlite3_column_int(stmt, 2));
+  EXPECT_EQ(SQLITE_ROW, sqlite3_step(stmt));
+  EXPECT_EQ(std::string("small"), (const char*)sqlite3_column_text(stmt, 0));
+  EXPECT_EQ(0, sqlite3_column_int(stmt, 1));
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
 
-  bool result = buildDB->buildStarted(&error);
-  EXPECT_TRUE(result);
+  // Check the result is read back transparently by each kind of lookup.
+  auto checkResult = [&](const Result& lookup, bool includeValue) {
+    if (includeValue) {
+      EXPECT_EQ(result.value, lookup.value);
+    }
+    EXPECT_EQ(result.dependencies.size(), lookup.dependencies.size());
+    for (size_t i = 0; i != lookup.dependencies.size(); ++i) {
+      EXPECT_EQ(result.dependencies[i].keyID, lookup.dependencies[i].keyID);
+      EXPECT_EQ(result.dependencies[i].flag, lookup.dependencies[i].flag);
+    }
+  };
+  buildDB = createSQLiteBuildDB(dbPath, 1, /* recreateUnmatchedVersion = */ true, &error);
+  buildDB->attachDelegate(&delegate);
+  Result lookup;
+  EXPECT_TRUE(buildDB->lookupRuleResult(delegate.getKeyID(rule.key), rule.key,
+                                        &lookup, &error));
+  checkResult(lookup, /*includeValue=*/true);
+  lookup = Result{};
+  bool valueLoaded = true;
+  EXPECT_TRUE(buildDB->lookupRuleResultWithoutValue(
+                  delegate.getKeyID(rule.key), rule.key, &lookup,
+                  &valueLoaded, &error));
+  checkResult(lookup, /*includeValue=*/false);
+  ValueType value;
+  EXPECT_TRUE(buildDB->lookupRuleResultValue(delegate.getKeyID(rule.key),
+                                             rule.key, &value, &error));
+  EXPECT_EQ(result.value, value);
+  std::vector<KeyType> keys;
+  std::vector<Result> results;
+  EXPECT_TRUE(buildDB->getKeysWithResult(keys, results, &error));
+  EXPECT_EQ(2U, results.size());
+  for (size_t i = 0; i != keys.size(); ++i) {
+    if (keys[i] == rule.key)
+      checkResult(results[i], /*includeValue=*/true);
+    else
+      EXPECT_EQ(smallResult.value, results[i].value);
+  }
   EXPECT_EQ(error, "");
 
-  // Tests that we cannot start a second build with an existing connection
-  result = secondBuildDB->buildStarted(&error);
-  EXPECT_FALSE(result);
-  std::stringstream out;
-  out << "error: accessing build database \"" << path << "\": database is locked Possibly there are two concurrent builds running in the same filesystem location.";
-  EXPECT_EQ(error, out.str());
+  buildDB = createSQLiteBuildDB(dbPath, 1, /* recreateUnmatchedVersion = */ true, &error);
+  buildDB->attachDelegate(&delegate);
+  EXPECT_TRUE(buildDB->preloadResults(&error));
+  lookup = Result{};
+  EXPECT_TRUE(buildDB->lookupRuleResult(delegate.getKeyID(rule.key), rule.key,
+                                        &lookup, &error));
+  checkResult(lookup, /*includeValue=*/true);
+  EXPECT_EQ(error, "");
 
-  // Tests that we cannot create new connections while a build is running
-  std::unique_ptr<BuildDB> otherBuildDB = createSQLiteBuildDB(dbPath, 1, /* recreateUnmatchedVersion = */ true, &error);
-  EXPECT_FALSE(otherBuildDB == nullptr);
+  // Check that compression is disabled by default.
+  buildDB = createSQLiteBuildDB(dbPath, 1, /* recreateUnmatchedVersion = */ true, &error);
+  buildDB->attachDelegate(&delegate);
+  EXPECT_TRUE(buildDB->buildStarted(&error));
+  EXPECT_TRUE(buildDB->setRuleResult(delegate.getKeyID(rule.key), rule,
+                                     result, &error));
+  buildDB->buildComplete();
+  EXPECT_EQ(error, "");
+  buildDB = nullptr;
+  sqlite3_open(dbPath.c_str(), &db);
+  sqlite3_prepare_v2(db, ("SELECT flags, length(value) FROM rule_results "
+                          "JOIN key_names ON key_id == id WHERE key == 'output';"),
+                     -1, &stmt, nullptr);
+  EXPECT_EQ(SQLITE_ROW, sqlite3_step(stmt));
+  EXPECT_EQ(0, sqlite3_column_int(stmt, 0));
+  EXPECT_EQ(int(result.value.size()), sqlite3_column_int(stmt, 1));
+  sqlite3_finalize(stmt);
+
+  // Check that a compressed value claiming an implausible size is reported as
+  // malformed, rather than allocated.
+  sqlite3_exec(db, ("UPDATE rule_results SET value = X'FFFFFFFF00', flags = 1 "
+                    "WHERE key_id == (SELECT id FROM key_names "
+                    "WHERE key == 'output');"),
+               nullptr, nullptr, nullptr);
+  sqlite3_close(db);
+  buildDB = createSQLiteBuildDB(dbPath, 1, /* recreateUnmatchedVersion = */ true, &error);
+  buildDB->attachDelegate(&delegate);
+  lookup = Result{};
+  EXPECT_FALSE(buildDB->lookupRuleResult(delegate.getKeyID(rule.key), rule.key,
+                                         &lookup, &error));
+  EXPECT_NE(error, "");
+
+  buildDB = nullptr;
+  ec = llvm::sys::fs::remove(dbPath.str());
+  EXPECT_EQ(bool(ec), false);
+  (void)llvm::sys::fs::remove(dbPath.str() + "-lock");
+}
 
-  // The database is opened lazily, thus run an operation that will cause it
-  // to be opened and verify that it fails as expected.
-  bool success = true;
-  otherBuildDB->getCurrentEpoch(&success, &error);
-  EXPECT_FALSE(success);
-  EXPECT_EQ(error, out.str());
+TEST(SQLiteBuildDBTest, MalformedDependencies) {
+  // Create a temporary file.
+  llvm::SmallString<256> dbPath;
+  auto ec = llvm::sys::fs::createTemporaryFile("build", "db", dbPath);
+  EXPECT_EQ(bool(ec), false);
 
-  // Clean up database connections before unlinking
+  SimpleBuildDBDelegate delegate;
+  std::string error;
+  std::unique_ptr<BuildDB> buildDB = createSQLiteBuildDB(dbPath, 1, /* recreateUnmatchedVersion = */ true, &error);
+  buildDB->attachDelegate(&delegate);
+  Rule rule{"output"};
+  Result result;
+  result.builtAt = 1;
+  result.dependencies.push_back(delegate.getKeyID("input"), false);
+  EXPECT_TRUE(buildDB->buildStarted(&error));
+  EXPECT_TRUE(buildDB->setRuleResult(delegate.getKeyID(rule.key), rule,
+                                     result, &error));
   buildDB->buildComplete();
+  EXPECT_EQ(error, "");
   buildDB = nullptr;
-  secondBuildDB = nullptr;
-  otherBuildDB = nullptr;
+
+  // Check that dependencies which end in the middle of an integer, or contain
+  // one which is too long, are reported as malformed.
+  for (const char* dependencies: { "X'80'", "X'0280'",
+                                   "X'FFFFFFFFFFFFFFFFFFFF01'" }) {
+    sqlite3 *db = nullptr;
+    sqlite3_open(dbPath.c_str(), &db);
+    std::string sql = (std::string("UPDATE rule_results SET dependencies = ") +
+                       dependencies + ", flags = 0;");
+    EXPECT_EQ(SQLITE_OK, sqlite3_exec(db, sql.c_str(), nullptr, nullptr,
+                                      nullptr));
+    sqlite3_close(db);
+
+    buildDB = createSQLiteBuildDB(dbPath, 1, /* recreateUnmatchedVersion = */ true, &error);
+    buildDB->attachDelegate(&delegate);
+    Result lookup;
+    error.clear();
+    EXPECT_FALSE(buildDB->lookupRuleResult(delegate.getKeyID(rule.key),
+                                           rule.key, &lookup, &error));
+    EXPECT_EQ(0U, error.find("unexpected contents for database result"));
+    buildDB = nullptr;
+  }
 
   ec = llvm::sys::fs::remove(dbPath.str());
   EXPECT_EQ(bool(ec), false);
+  (void)llvm::sys::fs::remove(dbPath.str() + "-lock");
 }
 
-TEST(SQLiteBuildDBTest, CloseDBConnectionAfterCloseCall) {
+TEST(SQLiteBuildDBTest, CollectGarbage) {
   // Create a temporary file.
   llvm::SmallString<256> dbPath;
   auto ec = llvm::sys::fs::createTemporaryFile("build", "db", dbPath);
   EXPECT_EQ(bool(ec), false);
-  const char* path = dbPath.c_str();
-  fprintf(stderr, "using db: %s\n", path);
-  
+
+  SimpleBuildDBDelegate delegate;
   std::string error;
   std::unique_ptr<BuildDB> buildDB = createSQLiteBuildDB(dbPath, 1, /* recreateUnmatchedVersion = */ true, &error);
-  EXPECT_TRUE(buildDB != nullptr);
+  buildDB->attachDelegate(&delegate);
+
+  auto setResult = [&](const KeyType& key, uint64_t builtAt,
+                       std::vector<KeyType> dependencies) {
+    Rule rule{key};
+    Result result;
+    result.value = {1};
+    result.builtAt = builtAt;
+    result.computedAt = builtAt;
+    for (const auto& dependency: dependencies)
+      result.dependencies.push_back(delegate.getKeyID(dependency), false);
+    EXPECT_TRUE(buildDB->setRuleResult(delegate.getKeyID(key), rule, result,
+                                       &error));
+  };
+
+  // Build "root1" (which depends on "a" and in turn "b"), and an unrelated
+  // "old" result at iteration 1, then "root2" (which depends on "a") at
+  // iteration 3.
+  EXPECT_TRUE(buildDB->buildStarted(&error));
+  EXPECT_TRUE(buildDB->setCurrentIteration(1, &error));
+  EXPECT_TRUE(buildDB->setBuildRoot(delegate.getKeyID("root1"), "root1",
+                                    &error));
+  setResult("root1", 1, {"a"});
+  setResult("a", 1, {"b"});
+  setResult("b", 1, {});
+  setResult("old", 1, {"old-input"});
+  buildDB->buildComplete();
+  EXPECT_TRUE(buildDB->buildStarted(&error));
+  EXPECT_TRUE(buildDB->setCurrentIteration(3, &error));
+  EXPECT_TRUE(buildDB->setBuildRoot(delegate.getKeyID("root2"), "root2",
+                                    &error));
+  setResult("root2", 3, {"a"});
+  buildDB->buildComplete();
+  EXPECT_EQ(error, "");
+
+  // Nothing is old enough to be collected yet.
+  BuildDBGarbageCollectionStats stats;
+  EXPECT_TRUE(buildDB->collectGarbage(2, &stats, &error));
+  EXPECT_EQ(0U, stats.numResultsRemoved);
+  EXPECT_EQ(0U, stats.numKeysRemoved);
+
+  // Otherwise, only the results still reachable from "root2" are kept.
+  EXPECT_TRUE(buildDB->collectGarbage(1, &stats, &error));
   EXPECT_EQ(error, "");
-  
-  buildDB->buildStarted(&error);
+  EXPECT_EQ(2U, stats.numResultsRemoved);
+  EXPECT_EQ(3U, stats.numKeysRemoved);
+  std::vector<KeyType> keys;
+  EXPECT_TRUE(buildDB->getKeys(keys, &error));
+  std::sort(keys.begin(), keys.end());
+  EXPECT_EQ(std::vector<KeyType>({ "a", "b", "root2" }), keys);
+  Result result;
+  EXPECT_TRUE(buildDB->lookupRuleResult(delegate.getKeyID("a"), "a", &result,
+                                        &error));
+  EXPECT_EQ(1U, result.dependencies.size());
+  EXPECT_EQ(delegate.getKeyID("b"), result.dependencies[0].keyID);
+  result = Result{};
+  EXPECT_FALSE(buildDB->lookupRuleResult(delegate.getKeyID("old"), "old",
+                                         &result, &error));
   EXPECT_EQ(error, "");
-  
+
+  // Check the database is still usable, and the removed key can be recreated.
+  EXPECT_TRUE(buildDB->buildStarted(&error));
+  EXPECT_TRUE(buildDB->setCurrentIteration(4, &error));
+  setResult("old", 4, {"b"});
   buildDB->buildComplete();
+  result = Result{};
+  EXPECT_TRUE(buildDB->lookupRuleResult(delegate.getKeyID("old"), "old",
+                                        &result, &error));
+  EXPECT_EQ(4U, result.builtAt);
+  EXPECT_EQ(1U, result.dependencies.size());
+  EXPECT_EQ(delegate.getKeyID("b"), result.dependencies[0].keyID);
+  EXPECT_EQ(error, "");
+
+  buildDB = nullptr;
+  ec = llvm::sys::fs::remove(dbPath.str());
+  EXPECT_EQ(bool(ec), false);
+  (void)llvm::sys::fs::remove(dbPath.str() + "-lock");
+}
+
+TEST(SQLiteBuildDBTest, ReverseDependencies) {
+  // Create a temporary file.
+  llvm::SmallString<256> dbPath;
+  auto ec = llvm::sys::fs::createTemporaryFile("build", "db", dbPath);
+  EXPECT_EQ(bool(ec), false);
+
+  SimpleBuildDBDelegate delegate;
+  std::string error;
+  std::unique_ptr<BuildDB> buildDB;
+  auto openDB = [&]() {
+    buildDB = createSQLiteBuildDB(dbPath, 1,
+                                  /* recreateUnmatchedVersion = */ true,
+                                  &error);
+    buildDB->attachDelegate(&delegate);
+  };
+  openDB();
+
+  auto setResult = [&](const KeyType& key, uint64_t builtAt,
+                       std::vector<KeyType> dependencies) {
+    Rule rule{key};
+    Result result;
+    result.builtAt = builtAt;
+    for (const auto& dependency: dependencies)
+      result.dependencies.push_back(delegate.getKeyID(dependency), false);
+    EXPECT_TRUE(buildDB->setRuleResult(delegate.getKeyID(key), rule, result,
+                                       &error));
+  };
+  auto getDependents = [&](const KeyType& key) {
+    std::vector<KeyType> keys;
+    EXPECT_TRUE(buildDB->getReverseDependencies(key, keys, &error));
+    std::sort(keys.begin(), keys.end());
+    return keys;
+  };
+
+  EXPECT_TRUE(buildDB->buildStarted(&error));
+  EXPECT_TRUE(buildDB->setCurrentIteration(1, &error));
+  setResult("a", 1, {"b", "c", "b"});
+  setResult("d", 1, {"b"});
+  buildDB->buildComplete();
+  buildDB = nullptr;
+
+  // Check that the index is not maintained until it is first queried.
+  {
+    sqlite3 *db = nullptr;
+    sqlite3_open(dbPath.c_str(), &db);
+    sqlite3_stmt* stmt = nullptr;
+    sqlite3_prepare_v2(db, "SELECT COUNT(*) FROM reverse_dependencies;",
+                       -1, &stmt, nullptr);
+    EXPECT_EQ(SQLITE_ROW, sqlite3_step(stmt));
+    EXPECT_EQ(0, sqlite3_column_int(stmt, 0));
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+  }
+
+  openDB();
+  EXPECT_EQ(std::vector<KeyType>({ "a", "d" }), getDependents("b"));
+  EXPECT_EQ(std::vector<KeyType>({ "a" }), getDependents("c"));
+  EXPECT_EQ(std::vector<KeyType>(), getDependents("a"));
+  EXPECT_EQ(std::vector<KeyType>(), getDependents("unknown"));
+
+  // Check that the edges are replaced when a result changes.
+  EXPECT_TRUE(buildDB->buildStarted(&error));
+  EXPECT_TRUE(buildDB->setCurrentIteration(2, &error));
+  setResult("a", 2, {"c"});
+  buildDB->buildComplete();
+  EXPECT_EQ(std::vector<KeyType>({ "d" }), getDependents("b"));
+  EXPECT_EQ(std::vector<KeyType>({ "a" }), getDependents("c"));
+
+  // Check that the edges are removed along with collected results.
+  BuildDBGarbageCollectionStats stats;
+  EXPECT_TRUE(buildDB->collectGarbage(0, &stats, &error));
+  EXPECT_EQ(1U, stats.numResultsRemoved);
+  EXPECT_EQ(std::vector<KeyType>(), getDependents("b"));
+
+  // Check that the index is maintained by later builds, and is not rebuilt
+  // when the database is reopened (which would drop the extra edge).
+  buildDB = nullptr;
+  {
+    sqlite3 *db = nullptr;
+    sqlite3_open(dbPath.c_str(), &db);
+    EXPECT_EQ(SQLITE_OK, sqlite3_exec(
+                  db, ("INSERT INTO reverse_dependencies "
+                       "SELECT a.id, c.id FROM key_names AS a, key_names AS c "
+                       "WHERE a.key == 'c' AND c.key == 'c';"),
+                  nullptr, nullptr, nullptr));
+    sqlite3_close(db);
+  }
+  openDB();
+  EXPECT_TRUE(buildDB->buildStarted(&error));
+  EXPECT_TRUE(buildDB->setCurrentIteration(3, &error));
+  setResult("e", 3, {"c"});
+  buildDB->buildComplete();
+  buildDB = nullptr;
+  openDB();
+  EXPECT_EQ(std::vector<KeyType>({ "a", "c", "e" }), getDependents("c"));
+  EXPECT_EQ(error, "");
+
+  buildDB = nullptr;
+  ec = llvm::sys::fs::remove(dbPath.str());
+  EXPECT_EQ(bool(ec), false);
+  (void)llvm::sys::fs::remove(dbPath.str() + "-lock");
+}
+
+TEST(SQLiteBuildDBTest, ConcurrentLookups) {
+  for (bool writeBehind: { false, true }) {
+    // Create a temporary file.
+    llvm::SmallString<256> dbPath;
+    auto ec = llvm::sys::fs::createTemporaryFile("build", "db", dbPath);
+    EXPECT_EQ(bool(ec), false);
+
+    SimpleBuildDBDelegate delegate;
+    std::string error;
+    std::unique_ptr<BuildDB> buildDB = createSQLiteBuildDB(dbPath, 1, /* recreateUnmatchedVersion = */ true, &error, writeBehind);
+    buildDB->attachDelegate(&delegate);
+
+    const int numResults = 200;
+    auto setResult = [&](int i, uint8_t value) {
+      Rule rule{"output-" + std::to_string(i)};
+      Result result;
+      result.value = {uint8_t(i), value};
+      result.builtAt = value;
+      result.dependencies.push_back(
+          delegate.getKeyID("input-" + std::to_string(i)), false);
+      EXPECT_TRUE(buildDB->setRuleResult(delegate.getKeyID(rule.key), rule,
+                                         result, &error));
+    };
+    auto checkResult = [&](int i, uint8_t value) {
+      KeyType key = "output-" + std::to_string(i);
+      std::string error;
+      Result result;
+      EXPECT_TRUE(buildDB->lookupRuleResult(delegate.getKeyID(key), key,
+                                            &result, &error));
+      EXPECT_EQ(error, "");
+      EXPECT_EQ(ValueType({ uint8_t(i), value }), result.value);
+      EXPECT_EQ(1U, result.dependencies.size());
+      if (result.dependencies.size() == 1) {
+        EXPECT_EQ(delegate.getKeyID("input-" + std::to_string(i)),
+                  result.dependencies[0].keyID);
+      }
+      ValueType valueOnly;
+      EXPECT_TRUE(buildDB->lookupRuleResultValue(delegate.getKeyID(key), key,
+                                                 &valueOnly, &error));
+      EXPECT_EQ(result.value, valueOnly);
+    };
+
+    EXPECT_TRUE(buildDB->buildStarted(&error));
+    for (int i = 0; i != numResults; ++i)
+      setResult(i, 1);
+    buildDB->buildComplete();
+    EXPECT_EQ(error, "");
+
+    // Look up the results from several threads, while the even results are
+    // rewritten by a running build.
+    EXPECT_TRUE(buildDB->buildStarted(&error));
+    std::vector<std::thread> threads;
+    for (int t = 0; t != 4; ++t) {
+      threads.emplace_back([&, t] {
+          for (int i = 1 + 2 * t; i < numResults; i += 8)
+            checkResult(i, 1);
+        });
+    }
+    for (int i = 0; i < numResults; i += 2)
+      setResult(i, 2);
+    for (auto& thread: threads)
+      thread.join();
+
+    // Check that the rewritten results are visible before they are committed.
+    for (int i = 0; i != numResults; ++i)
+      checkResult(i, i % 2 == 0 ? 2 : 1);
+    buildDB->buildComplete();
+    EXPECT_EQ(error, "");
+
+    // Check that the lookups also work outside of a build.
+    for (int i = 0; i != numResults; ++i)
+      checkResult(i, i % 2 == 0 ? 2 : 1);
+
+    buildDB = nullptr;
+    ec = llvm::sys::fs::remove(dbPath.str());
+    EXPECT_EQ(bool(ec), false);
+    (void)llvm::sys::fs::remove(dbPath.str() + "-lock");
+  }
 }